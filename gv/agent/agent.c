@@ -3,8 +3,10 @@
 
 #include "agent.h"
 
+#include <aqua/gv_ipc.h>
 #include <aqua/gv_proto.h>
 #include <aqua/kos.h>
+#include <aqua/trace.h>
 #include <aqua/vdriver_loader.h>
 
 #include <stdio.h>
@@ -15,8 +17,51 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
 #include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Maximum number of calls we pass on to the KOS before flushing, even if more are waiting on the socket.
+ */
+#define BATCH_MAX 32
+
+/**
+ * Most argument bytes we hold for a single connection at once, across all of its outstanding calls.
+ *
+ * Calls announce the size of their arguments up front, so this is what stops whatever is on the other end of the socket from getting us to allocate arbitrary amounts of memory.
+ */
+#define ARG_BYTES_MAX ((size_t) 256 << 20)
+
+/**
+ * A call we've passed on to the KOS but which hasn't returned yet.
+ *
+ * Calls may return in any order, so everything we need to know to send their return back is kept here rather than in the agent itself.
+ */
+typedef struct {
+	kos_cookie_t cookie;
+	uint64_t req_id;
+	uint32_t fn_id;
+
+	gv_compression_t ret_compression;
+	int ret_level;
+
+	/**
+	 * The arguments, and the buffer buffer arguments point into, which need to stay around until the call is done.
+	 */
+	void* arg_buf;
+	kos_val_t* args;
+
+	/**
+	 * How many bytes this call counts for against {@link ARG_BYTES_MAX}.
+	 */
+	size_t arg_size;
+} req_t;
 
 struct gv_agent_t {
 	umber_class_t const* cls;
@@ -24,50 +69,178 @@ struct gv_agent_t {
 	int sock;
 	uint64_t hid;
 	uint64_t vid;
-	bool vdev_found;
 	vdriver_t* vdriver;
 
+	/**
+	 * All the VDEVs of the spec we were created for.
+	 */
+	size_t vdev_count;
+	kos_vdev_descr_t* vdevs;
+
 	kos_cookie_t conn_cookie;
+	bool connected;
 	uint64_t conn_id;
 
-	uint32_t last_fn_id;
+	size_t req_count;
+	req_t* reqs;
+	size_t arg_bytes; // Held for outstanding calls and calls being received (see ARG_BYTES_MAX).
+
 	uint32_t fn_count;
 	kos_fn_t const* fns;
+	gv_fn_layout_t* layouts;
+
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+	ZSTD_DDict* ddict;
+	uint32_t dict_id;
 };
 
-static void notif_cb(kos_notif_t const* notif, void* data) {
-	gv_agent_t* const a = data;
+static umber_class_t const* cls = NULL;
 
-	void* packet_data = malloc(sizeof(gv_packet_t));
-	assert(packet_data != NULL);
+static __attribute__((constructor)) void init(void) {
+	cls = umber_class_new("gv.agent.notif", UMBER_LVL_WARN, "GrapeVine KOS agent notification dispatch.");
+}
 
-	gv_packet_t* packet = packet_data;
-	size_t size = 0; // If size == 0, there is no packet to send.
+/**
+ * All the agents in a process share a single KOS, which isn't thread-safe, so this must be held whenever it's used.
+ * Notifications are delivered from within KOS calls and may be for any agent in the process, so this also protects the list of agents, their pending calls, and whatever is sent over their sockets from notifications.
+ */
+static pthread_mutex_t kos_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool kos_ready = false;
+
+static size_t agent_count = 0;
+static gv_agent_t** agents = NULL;
+
+/**
+ * The agent VDEVs which are being attached (i.e. by kos_req_vdev()) are for.
+ */
+static gv_agent_t* attaching = NULL;
+
+static req_t* find_req(gv_agent_t* a, kos_cookie_t cookie) {
+	for (size_t i = 0; i < a->req_count; i++) {
+		if (a->reqs[i].cookie == cookie) {
+			return &a->reqs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void free_req(gv_agent_t* a, req_t* req) {
+	free(req->arg_buf);
+	free(req->args);
+
+	a->arg_bytes -= req->arg_size;
+
+	*req = a->reqs[--a->req_count];
+}
+
+static void send_call_fail(gv_agent_t* a, uint64_t req_id) {
+	gv_packet_t const packet = {
+		.header = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_KOS_CALL_FAIL,
+			.len = sizeof packet.kos_call_fail,
+		},
+		.kos_call_fail.req_id = req_id,
+	};
+
+	size_t const size = sizeof packet.header + sizeof packet.kos_call_fail;
+
+	if (gv_send(a->sock, &packet, size, 0) != (ssize_t) size) {
+		LOG_E(a->cls, "Failed to send %s packet.", gv_packet_type_strs[packet.header.type]);
+	}
+}
 
+/**
+ * Find the agent a notification is for.
+ *
+ * @param notif The notification.
+ * @param req_ref Where to put the call the notification is for, if it's a call notification.
+ * @return The agent, or NULL if the notification isn't for any agent.
+ */
+static gv_agent_t* notif_agent(kos_notif_t const* notif, req_t** req_ref) {
 	switch (notif->kind) {
 	case KOS_NOTIF_ATTACH:
-		// TODO I'm not sure these VIDs can just be sent like this. I think this depends a lot on the order of VDRIVERs loaded by gvd. Not sure what an elegant solution is here. Perhaps we mask out the slice?
+		return attaching;
+	case KOS_NOTIF_DETACH:
+		for (size_t i = 0; i < agent_count; i++) {
+			gv_agent_t* const a = agents[i];
 
-		if (notif->attach.vdev.vdev_id != a->vid) {
-			break;
+			if (a->sock >= 0 && a->hid == notif->detach.host_id && a->vid == notif->detach.vdev_id) {
+				return a;
+			}
 		}
 
-		LOG_I(a->cls, "Found our VDEV: %s.", notif->attach.vdev.human);
+		break;
+	case KOS_NOTIF_CONN_FAIL:
+	case KOS_NOTIF_CONN:
+		for (size_t i = 0; i < agent_count; i++) {
+			gv_agent_t* const a = agents[i];
 
-		a->vdriver = vdriver_loader_find_loaded_by_vid(a->vid);
+			if (a->sock >= 0 && a->conn_cookie == notif->cookie) {
+				return a;
+			}
+		}
 
-		if (a->vdriver == NULL) {
-			LOG_E(a->cls, "Could not find associated loaded VDRIVER.");
-			break;
+		break;
+	case KOS_NOTIF_CALL_FAIL:
+	case KOS_NOTIF_CALL_RET:
+		for (size_t i = 0; i < agent_count; i++) {
+			if ((*req_ref = find_req(agents[i], notif->cookie)) != NULL) {
+				return agents[i];
+			}
+		}
+
+		break;
+	case KOS_NOTIF_INTERRUPT:
+		break;
+	}
+
+	return NULL;
+}
+
+static void notif_cb(kos_notif_t const* notif, void* data) {
+	(void) data;
+
+	req_t* req = NULL;
+	gv_agent_t* const a = notif_agent(notif, &req);
+
+	if (a == NULL) {
+		if (notif->kind == KOS_NOTIF_CALL_RET) {
+			LOG_W(cls, "Got call return notification from KOS for a call we didn't make (cookie=0x%" PRIx64 ").", notif->cookie);
 		}
 
-		a->hid = notif->attach.vdev.host_id;
-		a->vdev_found = true;
+		return;
+	}
+
+	void* packet_data = malloc(sizeof(gv_packet_t));
+	assert(packet_data != NULL);
+
+	gv_packet_t* packet = packet_data;
+	size_t size = 0; // If size == 0, there is no packet to send.
+
+	packet->header.vers = GV_PROTO_VERS;
+
+	req_t* done_req = NULL;
+
+	switch (notif->kind) {
+	case KOS_NOTIF_ATTACH:
+		// Keep track of all the VDEVs of our spec, as we might not know which one we'll be asked for yet (see gv_agent_create_idle()).
+
+		a->vdevs = realloc(a->vdevs, (a->vdev_count + 1) * sizeof *a->vdevs);
+		assert(a->vdevs != NULL);
+		a->vdevs[a->vdev_count++] = notif->attach.vdev;
 
 		break;
 	case KOS_NOTIF_DETACH:
 	case KOS_NOTIF_CONN_FAIL:
+		if (a->sock < 0) {
+			break; // Not serving a connection yet, so there's nobody to tell.
+		}
+
 		packet->header.type = GV_PACKET_TYPE_CONN_VDEV_FAIL;
+		packet->header.len = 0;
 		size = sizeof packet->header;
 
 		break;
@@ -76,6 +249,7 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 			break;
 		}
 
+		a->connected = true;
 		a->conn_id = notif->conn_id;
 
 		// Keep track of functions for future calls.
@@ -84,6 +258,13 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 		a->fn_count = notif->conn.fn_count;
 		a->fns = notif->conn.fns;
 
+		a->layouts = malloc(a->fn_count * sizeof *a->layouts);
+		assert(a->fn_count == 0 || a->layouts != NULL);
+
+		for (size_t i = 0; i < a->fn_count; i++) {
+			gv_fn_layout_init(&a->layouts[i], &a->fns[i]);
+		}
+
 		// Prepare packet.
 
 		packet->header.type = GV_PACKET_TYPE_CONN_VDEV_RES;
@@ -93,6 +274,7 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 		conn_vdev_res->conn_id = notif->conn_id;
 		conn_vdev_res->const_count = notif->conn.const_count;
 		conn_vdev_res->fn_count = notif->conn.fn_count;
+		conn_vdev_res->dict_id = a->dict_id;
 
 		// Serialize consts.
 
@@ -129,60 +311,137 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 			size += gv_serialize_fn((void*) packet + size, &notif->conn.fns[i]);
 		}
 
+		packet->header.len = size - sizeof packet->header;
 		conn_vdev_res = &packet->conn_vdev_res;
 		conn_vdev_res->size = size - sizeof packet->header;
 
 		break;
 	case KOS_NOTIF_CALL_FAIL:
-		// TODO
+		LOG_W(a->cls, "Call failed (req_id=%" PRIu64 ").", req->req_id);
+
+		send_call_fail(a, req->req_id);
+		free_req(a, req);
+
 		break;
 	case KOS_NOTIF_CALL_RET:
-		LOG_V(a->cls, "Got call return notification from KOS.");
+		LOG_V(a->cls, "Got call return notification from KOS (req_id=%" PRIu64 ").", req->req_id);
 		packet->header.type = GV_PACKET_TYPE_KOS_CALL_RET;
 
-		kos_type_t const ret_type = a->fns[a->last_fn_id].ret_type;
+		kos_type_t const ret_type = a->fns[req->fn_id].ret_type;
 		kos_val_t const* const ret = &notif->call_ret.ret;
 
 		size_t const val_size = gv_serialize_val_size(ret_type, ret);
+		size_t const proto_header_size = sizeof packet->header + sizeof packet->kos_call_ret;
+
+		packet->header.len = sizeof packet->kos_call_ret + val_size;
+		packet->kos_call_ret.req_id = req->req_id;
+		packet->kos_call_ret.compression = GV_COMPRESSION_NONE;
 		packet->kos_call_ret.size = val_size;
 
-		size_t const proto_header_size = sizeof packet->header + sizeof packet->kos_call_ret;
-		size = proto_header_size + val_size;
+		int const ret_level = req->ret_level;
+		bool const want_compression = req->ret_compression == GV_COMPRESSION_ZSTD;
+
+		// The return value may still point into the call's arguments, so only let go of them once it's been sent.
+
+		done_req = req;
+
+		// Only buffers can be large enough to be worth compressing, and only if the KOS asked for it and they look compressible.
 
-		packet = realloc(packet, size);
+		bool const is_buf = ret_type == KOS_TYPE_BUF;
+
+		bool const compress =
+			is_buf &&
+			want_compression &&
+			val_size >= GV_COMPRESSION_THRESHOLD &&
+			gv_entropy_estimate(ret->buf.ptr, ret->buf.size) < GV_ENTROPY_THRESHOLD;
+
+		if (is_buf && !compress) {
+			// Send the buffer straight from where the VDRIVER put it rather than copying it into the packet first.
+
+			packet = realloc(packet, proto_header_size + sizeof ret->buf.size);
+			assert(packet != NULL);
+
+			memcpy((void*) packet + proto_header_size, &ret->buf.size, sizeof ret->buf.size);
+
+			struct iovec const iov[] = {
+				{packet, proto_header_size + sizeof ret->buf.size},
+				{(void*) ret->buf.ptr, ret->buf.size},
+			};
+
+			TRACE_FLOW(TRACE_AGENT_RET, req->req_id, req->req_id, val_size, val_size);
+
+			if (gv_sendv(a->sock, iov, sizeof iov / sizeof *iov, 0) != (ssize_t) (proto_header_size + val_size)) {
+				LOG_E(a->cls, "Failed to send %s packet.", gv_packet_type_strs[packet->header.type]);
+			}
+
+			break; // Leave size at 0, as we've already sent the packet.
+		}
+
+		packet = realloc(packet, proto_header_size + val_size);
 		assert(packet != NULL);
 
-		assert(gv_serialize_val((void*) packet + proto_header_size, ret_type, ret) == val_size);
+		void* const val_buf = (void*) packet + proto_header_size;
+		assert(gv_serialize_val(val_buf, ret_type, ret) == val_size);
+
+		if (compress) {
+			size_t const bound = ZSTD_compressBound(val_size);
+			void* const compressed = malloc(proto_header_size + bound);
+			assert(compressed != NULL);
+
+			size_t const compressed_size = ZSTD_compressCCtx(a->cctx, compressed + proto_header_size, bound, val_buf, val_size, ret_level);
+
+			// Only use the compressed version if it's actually smaller.
+
+			if (!ZSTD_isError(compressed_size) && compressed_size < val_size) {
+				memcpy(compressed, packet, proto_header_size);
+				free(packet);
+				packet = compressed;
+
+				packet->header.len = sizeof packet->kos_call_ret + compressed_size;
+				packet->kos_call_ret.compression = GV_COMPRESSION_ZSTD;
+				packet->kos_call_ret.size = compressed_size;
+
+				LOG_V(a->cls, "Compressed return value from %zu bytes to %zu at level %d.", val_size, compressed_size, ret_level);
+			}
+
+			else {
+				free(compressed);
+			}
+		}
+
+		size = proto_header_size + packet->kos_call_ret.size;
+		TRACE_FLOW(TRACE_AGENT_RET, req->req_id, req->req_id, val_size, packet->kos_call_ret.size);
 
 		break;
 	case KOS_NOTIF_INTERRUPT:
 		break;
 	}
 
-	if (size != 0 && send(a->sock, packet, size, 0) != (ssize_t) size) {
+	if (size != 0 && gv_send(a->sock, packet, size, 0) != (ssize_t) size) {
 		LOG_E(a->cls, "Failed to send %s packet.", gv_packet_type_strs[packet->header.type]);
 	}
 
 	free(packet);
-}
-
-static void call(gv_agent_t* a, gv_kos_call_t* call) {
-	LOG_V(a->cls, "Calling KOS function (fn_id=%u).", call->fn_id);
-
-	// Receive compressed argument data.
 
-	void* const compressed_arg_buf = malloc(call->size);
-	assert(compressed_arg_buf != NULL);
+	if (done_req != NULL) {
+		free_req(a, done_req);
+	}
+}
 
+/**
+ * Receive exactly `size` bytes from the KOS.
+ *
+ * @return 0 on success, or a negative value if the connection was closed or broke.
+ */
+static int recv_all(gv_agent_t* a, void* buf, size_t size) {
 	size_t total = 0;
 
-	while (total < call->size) {
-		ssize_t const r = recv(a->sock, (char*) compressed_arg_buf + total, call->size - total, 0);
+	while (total < size) {
+		ssize_t const r = gv_recv(a->sock, (char*) buf + total, size - total, 0);
 
 		if (r == 0) {
-			LOG_E(a->cls, "recv: Connection closed (received %zu/%zu bytes).", total, call->size);
-			free(compressed_arg_buf);
-			goto fail;
+			LOG_E(a->cls, "recv: Connection closed (received %zu/%zu bytes).", total, size);
+			return -1;
 		}
 
 		if (r < 0) {
@@ -191,127 +450,463 @@ static void call(gv_agent_t* a, gv_kos_call_t* call) {
 			}
 
 			LOG_E(a->cls, "recv: %s", strerror(errno));
-			free(compressed_arg_buf);
-			goto fail;
+			return -1;
 		}
 
 		total += (size_t) r;
 	}
 
-	if (call->fn_id >= a->fn_count) { // Do this after so we do clear the recv buffer.
-		LOG_E(a->cls, "Function ID %zu doesn't exist (%zu functions total).", call->fn_id, a->fn_count);
+	return 0;
+}
+
+/**
+ * Count argument bytes against the connection's {@link ARG_BYTES_MAX}, unless that would take it over.
+ *
+ * @param a The agent.
+ * @param size Number of bytes.
+ * @return Whether the bytes could be counted.
+ */
+static bool reserve_arg_bytes(gv_agent_t* a, size_t size) {
+	pthread_mutex_lock(&kos_lock);
+	bool const fits = size <= ARG_BYTES_MAX - a->arg_bytes;
+
+	if (fits) {
+		a->arg_bytes += size;
+	}
+
+	pthread_mutex_unlock(&kos_lock);
+	return fits;
+}
+
+static void release_arg_bytes(gv_agent_t* a, size_t size) {
+	pthread_mutex_lock(&kos_lock);
+	a->arg_bytes -= size;
+	pthread_mutex_unlock(&kos_lock);
+}
+
+/**
+ * Receive and throw away a chunked payload (see {@link GV_COMPRESSION_ZSTD_CHUNKED}), so that we can get to the next packet after refusing a call.
+ *
+ * @return 0 on success, or a negative value if the connection was closed or broke, or the payload is malformed.
+ */
+static int discard_chunked(gv_agent_t* a) {
+	for (;;) {
+		gv_chunk_t hdr;
+
+		if (recv_all(a, &hdr, sizeof hdr) < 0) {
+			return -1;
+		}
+
+		if (hdr.size == 0) {
+			return 0;
+		}
+
+		if (hdr.size > GV_CHUNK_SIZE) {
+			LOG_E(a->cls, "Argument chunk is too large (%" PRIu32 " bytes, maximum is %d).", hdr.size, GV_CHUNK_SIZE);
+			return -1;
+		}
+
+		if (gv_recv_discard(a->sock, hdr.size) < 0) {
+			return -1;
+		}
+	}
+}
+
+/**
+ * Receive and decompress a chunked payload (see {@link GV_COMPRESSION_ZSTD_CHUNKED}).
+ *
+ * Each chunk is decompressed as soon as it's received, so that this overlaps with the KOS compressing and sending the next ones, and so we only ever need to hold one of them.
+ *
+ * @param a The agent.
+ * @param size Uncompressed size of the payload.
+ * @return The uncompressed payload, or `NULL` if something went wrong.
+ */
+static void* recv_chunked(gv_agent_t* a, size_t size) {
+	void* const buf = malloc(size);
+	void* const chunk = malloc(GV_CHUNK_SIZE);
+
+	if ((size > 0 && buf == NULL) || chunk == NULL) {
+		LOG_E(a->cls, "Failed to allocate buffer for chunked payload (%zu bytes).", size);
+
+		free(chunk);
+		free(buf);
+
+		discard_chunked(a);
+		return NULL;
+	}
+
+	ZSTD_DCtx_reset(a->dctx, ZSTD_reset_session_only);
+	ZSTD_outBuffer out = {buf, size, 0};
+
+	for (;;) {
+		gv_chunk_t hdr;
+
+		if (recv_all(a, &hdr, sizeof hdr) < 0) {
+			goto err;
+		}
+
+		if (hdr.size == 0) {
+			break;
+		}
+
+		if (hdr.size > GV_CHUNK_SIZE) {
+			LOG_E(a->cls, "Argument chunk is too large (%" PRIu32 " bytes, maximum is %d).", hdr.size, GV_CHUNK_SIZE);
+			goto err;
+		}
+
+		if (recv_all(a, chunk, hdr.size) < 0) {
+			goto err;
+		}
+
+		ZSTD_inBuffer in = {chunk, hdr.size, 0};
+
+		while (in.pos < in.size) {
+			size_t const prev_in = in.pos;
+			size_t const prev_out = out.pos;
+			size_t const r = ZSTD_decompressStream(a->dctx, &out, &in);
+
+			if (ZSTD_isError(r)) {
+				LOG_E(a->cls, "Something went wrong during ZSTD decompression: %s", ZSTD_getErrorName(r));
+				goto err;
+			}
+
+			if (in.pos == prev_in && out.pos == prev_out) {
+				LOG_E(a->cls, "Chunked payload is larger than announced (%zu bytes).", size);
+				goto err;
+			}
+		}
+	}
+
+	if (out.pos != size) {
+		LOG_E(a->cls, "Chunked payload is smaller than announced (%zu/%zu bytes).", out.pos, size);
+		goto err;
+	}
+
+	free(chunk);
+	return buf;
+
+err:
+
+	free(chunk);
+	free(buf);
+
+	return NULL;
+}
+
+static void call(gv_agent_t* a, gv_kos_call_t* call) {
+	LOG_V(a->cls, "Calling KOS function (fn_id=%u, req_id=%" PRIu64 ").", call->fn_id, call->req_id);
+	TRACE_FLOW(TRACE_AGENT_CALL_BEGIN, call->req_id, call->req_id, call->fn_id, call->size);
+
+	void* arg_buf;
+	size_t uncompressed_size = call->size;
+	size_t reserved = 0; // What we're currently counting for against ARG_BYTES_MAX.
+
+	// Refuse calls which would have us hold too much for this connection before allocating anything for them.
+	// Their arguments still need to be received and thrown away to get to the next packet.
+
+	if (!reserve_arg_bytes(a, call->size)) {
+		LOG_E(a->cls, "Arguments are too large (%" PRIu32 " bytes, at most %zu may be held per connection).", call->size, ARG_BYTES_MAX);
+
+		if (call->compression == GV_COMPRESSION_ZSTD_CHUNKED) {
+			discard_chunked(a);
+		}
+
+		else {
+			gv_recv_discard(a->sock, call->size);
+		}
+
+		goto fail;
+	}
+
+	reserved = call->size;
+
+	if (call->compression == GV_COMPRESSION_ZSTD_CHUNKED) {
+		if ((arg_buf = recv_chunked(a, call->size)) == NULL) {
+			goto fail;
+		}
+
+		goto received;
+	}
+
+	// Receive compressed argument data.
+
+	void* const compressed_arg_buf = malloc(call->size);
+
+	if (compressed_arg_buf == NULL) {
+		LOG_E(a->cls, "Failed to allocate argument buffer (%" PRIu32 " bytes).", call->size);
+		gv_recv_discard(a->sock, call->size);
+		goto fail;
+	}
+
+	if (recv_all(a, compressed_arg_buf, call->size) < 0) {
 		free(compressed_arg_buf);
 		goto fail;
 	}
 
 	// Decompress argument buffer.
-	// TODO Support uncompressed argument buffers too.
 
-	unsigned long long const uncompressed_size = ZSTD_getFrameContentSize(compressed_arg_buf, call->size);
+	arg_buf = compressed_arg_buf;
+
+	if (call->compression == GV_COMPRESSION_ZSTD) {
+		unsigned long long const content_size = ZSTD_getFrameContentSize(compressed_arg_buf, call->size);
+
+		if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+			LOG_E(a->cls, "Argument buffer was not compressed by ZSTD.");
+			free(compressed_arg_buf);
+			goto fail;
+		}
+
+		if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+			LOG_E(a->cls, "Uncompressed size of argument buffer is unknown.");
+			free(compressed_arg_buf);
+			goto fail;
+		}
+
+		if (content_size > ARG_BYTES_MAX || !reserve_arg_bytes(a, content_size)) {
+			LOG_E(a->cls, "Uncompressed arguments are too large (%llu bytes, at most %zu may be held per connection).", content_size, ARG_BYTES_MAX);
+			free(compressed_arg_buf);
+			goto fail;
+		}
+
+		uncompressed_size = content_size;
+		reserved += uncompressed_size;
+		arg_buf = malloc(uncompressed_size);
+
+		if (arg_buf == NULL) {
+			LOG_E(a->cls, "Failed to allocate uncompressed argument buffer (%zu bytes).", uncompressed_size);
+			free(compressed_arg_buf);
+			goto fail;
+		}
+
+		if (call->dict_id != 0 && call->dict_id != a->dict_id) {
+			LOG_E(a->cls, "Argument buffer was compressed with a dictionary we don't have (id=%" PRIu32 ").", call->dict_id);
+			free(compressed_arg_buf);
+			free(arg_buf);
+			goto fail;
+		}
+
+		size_t const zstd_size = call->dict_id != 0 ?
+			ZSTD_decompress_usingDDict(a->dctx, arg_buf, uncompressed_size, compressed_arg_buf, call->size, a->ddict) :
+			ZSTD_decompressDCtx(a->dctx, arg_buf, uncompressed_size, compressed_arg_buf, call->size);
 
-	if (uncompressed_size == ZSTD_CONTENTSIZE_ERROR) {
-		LOG_E(a->cls, "Argument buffer was not compressed by ZSTD.");
 		free(compressed_arg_buf);
-		goto fail;
+
+		release_arg_bytes(a, call->size);
+		reserved -= call->size;
+
+		if (ZSTD_isError(zstd_size) || zstd_size != uncompressed_size) {
+			LOG_E(a->cls, "Something went wrong during ZSTD decompression!");
+			free(arg_buf);
+			goto fail;
+		}
 	}
 
-	if (uncompressed_size == ZSTD_CONTENTSIZE_UNKNOWN) {
-		LOG_E(a->cls, "Uncompressed size of argument buffer is unknown.");
+	else if (call->compression != GV_COMPRESSION_NONE) {
+		LOG_E(a->cls, "Unknown compression method %d.", call->compression);
 		free(compressed_arg_buf);
 		goto fail;
 	}
 
-	void* const arg_buf = malloc(uncompressed_size);
-	assert(arg_buf != NULL);
+received:
 
-	size_t const zstd_size = ZSTD_decompress(arg_buf, uncompressed_size, compressed_arg_buf, call->size);
-	free(compressed_arg_buf);
+	// Do this after receiving the arguments so we do clear the recv buffer.
 
-	if (ZSTD_isError(zstd_size) || zstd_size != uncompressed_size) {
-		LOG_W(a->cls, "Something went wrong during ZSTD decompression!");
-		// TODO how do we fail??
+	if (call->fn_id >= a->fn_count) {
+		LOG_E(a->cls, "Function ID %" PRIu32 " doesn't exist (%" PRIu32 " functions total).", call->fn_id, a->fn_count);
+		free(arg_buf);
+		goto fail;
 	}
 
 	// Deserialize argument buffer.
+	// Buffer arguments point straight into the argument buffer rather than being copied out of it, as they may be very large.
 
 	size_t const arg_count = a->fns[call->fn_id].param_count;
 	kos_val_t* const args = malloc(arg_count * sizeof *args);
 	assert(args != NULL);
-	kos_param_t const* const params = a->fns[call->fn_id].params;
 
-	size_t size = 0;
+	ssize_t const size = gv_deserialize_args(arg_buf, uncompressed_size, &a->layouts[call->fn_id], call->encoding, true, args);
 
-	for (size_t i = 0; i < arg_count; i++) {
-		size += gv_deserialize_val(arg_buf + size, params[i].type, &args[i]);
+	if (size < 0) {
+		LOG_E(a->cls, "Argument buffer is malformed.");
+		free(arg_buf);
+		free(args);
+		goto fail;
 	}
 
-	free(arg_buf);
-
-	if (size != uncompressed_size) {
-		LOG_E(a->cls, "Deserialized size (%zu) is not the same as reported uncompressed size (%zu).", size, uncompressed_size);
+	if ((size_t) size != uncompressed_size) {
+		LOG_E(a->cls, "Deserialized size (%zd) is not the same as reported uncompressed size (%zu).", size, uncompressed_size);
+		free(arg_buf);
 		free(args);
 		goto fail;
 	}
 
-	a->last_fn_id = call->fn_id;
-	kos_vdev_call(call->conn_id, call->fn_id, args);
-	kos_flush(true);
+	// The call is only actually made on the next flush (see gv_agent_loop), and may return at any point after that.
 
-	for (size_t i = 0; i < arg_count; i++) {
-		kos_val_free(params[i].type, &args[i]);
-	}
+	pthread_mutex_lock(&kos_lock);
+
+	a->reqs = realloc(a->reqs, (a->req_count + 1) * sizeof *a->reqs);
+	assert(a->reqs != NULL);
 
-	free(args);
+	a->reqs[a->req_count++] = (req_t) {
+		.cookie = kos_vdev_call(call->conn_id, call->fn_id, args),
+		.req_id = call->req_id,
+		.fn_id = call->fn_id,
+		.ret_compression = call->ret_compression,
+		.ret_level = call->ret_level,
+		.arg_buf = arg_buf,
+		.args = args,
+		.arg_size = reserved,
+	};
 
+	pthread_mutex_unlock(&kos_lock);
+
+	TRACE_FLOW(TRACE_AGENT_CALL_END, call->req_id, call->req_id, 0, 0);
 	return;
 
 fail:
 
-	LOG_F(a->cls, "TODO");
+	// Returns of our other calls may be being sent from another thread at the same time.
+
+	pthread_mutex_lock(&kos_lock);
+	a->arg_bytes -= reserved;
+	send_call_fail(a, call->req_id);
+	pthread_mutex_unlock(&kos_lock);
 }
 
-gv_agent_t* gv_agent_create(int sock, char const* spec, uint64_t vdev_id) {
+gv_agent_t* gv_agent_create_idle(char const* spec) {
 	gv_agent_t* const a = calloc(1, sizeof *a);
 	assert(a != NULL);
 
 	a->cls = umber_class_new("gv.agent", UMBER_LVL_WARN, "GrapeVine KOS agent (library).");
-	a->sock = sock;
-	a->vid = vdev_id;
-	a->vdev_found = false;
+	a->sock = -1;
+	a->vid = -1ull;
 
-	LOG_V(a->cls, "Initiate connection with KOS.");
-	kos_descr_v4_t descr;
+	a->cctx = ZSTD_createCCtx();
+	assert(a->cctx != NULL);
 
-	if (kos_hello(KOS_API_V4, KOS_API_V4, &descr) != KOS_API_V4) {
-		LOG_F(a->cls, "Could not initiate connection with KOS.");
-		gv_agent_destroy(a);
-		return NULL;
+	a->dctx = ZSTD_createDCtx();
+	assert(a->dctx != NULL);
+
+	// Load the dictionary for this spec if we have one, so the KOS can compress small calls efficiently.
+
+	size_t dict_size;
+	void* const dict = gv_dict_load(spec, &dict_size);
+
+	if (dict != NULL) {
+		a->ddict = ZSTD_createDDict(dict, dict_size);
+		a->dict_id = ZSTD_getDictID_fromDict(dict, dict_size);
+		free(dict);
+
+		if (a->ddict == NULL) {
+			a->dict_id = 0;
+		}
+
+		LOG_V(a->cls, "Loaded dictionary for %s (id=%" PRIu32 ").", spec, a->dict_id);
 	}
 
-	LOG_V(a->cls, "Subscribe to KOS notifications.");
-	kos_sub_to_notif(notif_cb, a);
+	pthread_mutex_lock(&kos_lock);
+
+	// All agents in a process share the same KOS, and thus the same VDRIVERs, so only the first one needs to initiate the connection with it.
+
+	if (!kos_ready) {
+		LOG_V(a->cls, "Initiate connection with KOS.");
+		kos_descr_v4_t descr;
+
+		if (kos_hello(KOS_API_V4, KOS_API_V4, &descr) != KOS_API_V4) {
+			LOG_F(a->cls, "Could not initiate connection with KOS.");
+			pthread_mutex_unlock(&kos_lock);
+			gv_agent_destroy(a);
+			return NULL;
+		}
+
+		LOG_V(a->cls, "Subscribe to KOS notifications.");
+		kos_sub_to_notif(notif_cb, NULL);
+
+		kos_ready = true;
+	}
+
+	agents = realloc(agents, (agent_count + 1) * sizeof *agents);
+	assert(agents != NULL);
+	agents[agent_count++] = a;
 
 	LOG_V(a->cls, "Request %s.", spec);
+
+	attaching = a;
 	kos_req_vdev(spec); // TODO Maybe there should be a way to just request local?
+	attaching = NULL;
 
 	// TODO We don't need a flush call with the current implementation, but should we require one? I'm guessing yes, but this should be defined in the spec.
 
-	if (!a->vdev_found) {
-		LOG_E(a->cls, "Couldn't find VDEV with ID %" PRIu64 ".", a->vid);
+	// The VDRIVER is only actually loaded once one of its VDEVs is looked up, and this is the expensive part, so get it out of the way now.
+	// All the VDEVs of a spec share a VDRIVER, so looking up the first one is enough.
+
+	if (a->vdev_count > 0) {
+		vdriver_loader_find_loaded_by_vid(a->vdevs[0].vdev_id);
+	}
+
+	pthread_mutex_unlock(&kos_lock);
+	return a;
+}
+
+int gv_agent_bind(gv_agent_t* a, int sock, uint64_t vdev_id) {
+	assert(a->sock < 0);
+
+	a->sock = sock;
+	a->vid = vdev_id;
+
+	// TODO I'm not sure these VIDs can just be sent like this. I think this depends a lot on the order of VDRIVERs loaded by gvd. Not sure what an elegant solution is here. Perhaps we mask out the slice?
+
+	kos_vdev_descr_t const* vdev = NULL;
+
+	for (size_t i = 0; i < a->vdev_count; i++) {
+		if (a->vdevs[i].vdev_id == vdev_id) {
+			vdev = &a->vdevs[i];
+			break;
+		}
+	}
+
+	if (vdev == NULL) {
+		LOG_E(a->cls, "Couldn't find VDEV with ID %" PRIu64 ".", vdev_id);
 
 		// TODO Here, if we didn't find the VDEV we were looking for, we should send a CONN_FAIL.
 
-		gv_agent_destroy(a);
-		return NULL;
+		return -1;
 	}
 
-	assert(a->vdriver != NULL); // If a->vdev_found, then a->vdriver != NULL.
+	LOG_I(a->cls, "Found our VDEV: %s.", vdev->human);
+
+	pthread_mutex_lock(&kos_lock);
+	a->vdriver = vdriver_loader_find_loaded_by_vid(vdev_id);
+
+	if (a->vdriver == NULL) {
+		LOG_E(a->cls, "Could not find associated loaded VDRIVER.");
+		pthread_mutex_unlock(&kos_lock);
+		return -1;
+	}
+
+	a->hid = vdev->host_id;
 
 	LOG_V(a->cls, "Establish connection to VDEV.");
 
 	a->conn_cookie = kos_vdev_conn(a->hid, a->vid);
 	kos_flush(true);
 
+	pthread_mutex_unlock(&kos_lock);
+	return 0;
+}
+
+gv_agent_t* gv_agent_create(int sock, char const* spec, uint64_t vdev_id) {
+	gv_agent_t* const a = gv_agent_create_idle(spec);
+
+	if (a == NULL) {
+		return NULL;
+	}
+
+	if (gv_agent_bind(a, sock, vdev_id) < 0) {
+		gv_agent_destroy(a);
+		return NULL;
+	}
+
 	return a;
 }
 
@@ -325,8 +920,14 @@ void gv_agent_loop(gv_agent_t* a) {
 
 	gv_packet_t buf;
 	int len;
+	size_t batched = 0;
+
+	while ((len = gv_recv(a->sock, &buf.header, sizeof buf.header, MSG_WAITALL)) > 0) {
+		if (!gv_packet_header_valid(&buf.header)) {
+			LOG_E(a->cls, "Got packet with unsupported protocol version %d or type %d.", buf.header.vers, buf.header.type);
+			break;
+		}
 
-	while ((len = recv(a->sock, &buf.header, sizeof buf.header, MSG_WAITALL)) > 0) {
 		LOG_V(a->cls, "Got %s packet.", gv_packet_type_strs[buf.header.type]);
 
 		switch (buf.header.type) {
@@ -341,24 +942,173 @@ void gv_agent_loop(gv_agent_t* a) {
 		case GV_PACKET_TYPE_LEN:
 		default:
 			LOG_E(a->cls, "Unexpected packet. This should not happen!");
-			break;
+
+			if (gv_recv_discard(a->sock, buf.header.len) < 0) {
+				return;
+			}
+
+			continue;
 		case GV_PACKET_TYPE_KOS_CALL:
-			if (recv(a->sock, &buf.kos_call, sizeof buf.kos_call, MSG_WAITALL) != sizeof buf.kos_call) {
-				LOG_E(a->cls, "recv failed.");
-				break;
+			if (buf.header.len < sizeof buf.kos_call || recv_all(a, &buf.kos_call, sizeof buf.kos_call) < 0) {
+				LOG_E(a->cls, "Failed to receive %s packet.", gv_packet_type_strs[buf.header.type]);
+				return;
+			}
+
+			if (buf.kos_call.compression != GV_COMPRESSION_ZSTD_CHUNKED && buf.header.len != sizeof buf.kos_call + buf.kos_call.size) {
+				LOG_E(a->cls, "%s packet length (%" PRIu32 ") doesn't match its argument size (%" PRIu32 ").", gv_packet_type_strs[buf.header.type], buf.header.len, buf.kos_call.size);
+				return;
 			}
 
 			call(a, &buf.kos_call);
+			batched++;
+
 			break;
 		}
+
+		// Pass all the calls which are already waiting on to the KOS before flushing, so that independent ones can be executed concurrently.
+		// Their returns are sent back as they complete, in whatever order that is.
+
+		struct pollfd pfd = {
+			.fd = a->sock,
+			.events = POLLIN,
+		};
+
+		if (batched >= BATCH_MAX || poll(&pfd, 1, 0) <= 0) {
+			pthread_mutex_lock(&kos_lock);
+			kos_flush(true);
+			pthread_mutex_unlock(&kos_lock);
+
+			batched = 0;
+		}
 	}
 }
 
 void gv_agent_destroy(gv_agent_t* a) {
 	// TODO Should we also be responsible for closing the socket?
 
-	kos_vdev_disconn(a->conn_id);
+	pthread_mutex_lock(&kos_lock);
+
+	// Other agents in the process are still using the KOS, so make sure we don't disconnect them.
+
+	if (a->connected) {
+		kos_vdev_disconn(a->conn_id);
+	}
+
+	for (size_t i = 0; i < agent_count; i++) {
+		if (agents[i] == a) {
+			agents[i] = agents[--agent_count];
+			break;
+		}
+	}
 
+	while (a->req_count > 0) {
+		free_req(a, &a->reqs[0]);
+	}
+
+	pthread_mutex_unlock(&kos_lock);
+
+	free(a->reqs);
+	free(a->vdevs);
+
+	for (size_t i = 0; a->layouts != NULL && i < a->fn_count; i++) {
+		gv_fn_layout_destroy(&a->layouts[i]);
+	}
+
+	free(a->layouts);
+	ZSTD_freeCCtx(a->cctx);
+	ZSTD_freeDCtx(a->dctx);
+	ZSTD_freeDDict(a->ddict);
 	free((void*) a->cls);
 	free(a);
 }
+
+int gv_agent_register(char const* spec) {
+	gv_ctl_t msg = {
+		.type = GV_CTL_TYPE_REGISTER,
+	};
+
+	if (strlen(spec) >= sizeof msg.reg.spec) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(msg.reg.spec, spec);
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	strncpy(addr.sun_path, gv_get_ctl_path(), sizeof addr.sun_path - 1);
+	int const ctl = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (ctl < 0) {
+		return -1;
+	}
+
+	if (connect(ctl, (struct sockaddr*) &addr, sizeof addr) < 0) {
+		goto err;
+	}
+
+	if (send(ctl, &msg, sizeof msg, 0) != sizeof msg) {
+		goto err;
+	}
+
+	ssize_t r;
+	while ((r = recv(ctl, &msg, sizeof msg, MSG_WAITALL)) < 0 && errno == EINTR);
+
+	if (r != sizeof msg || msg.type != GV_CTL_TYPE_RES) {
+		errno = ECONNRESET;
+		goto err;
+	}
+
+	if (msg.res.err != 0) {
+		errno = msg.res.err;
+		goto err;
+	}
+
+	return ctl;
+
+err:;
+
+	int const err = errno;
+	close(ctl);
+	errno = err;
+
+	return -1;
+}
+
+int gv_agent_accept(int ctl, uint64_t* vdev_id_ref) {
+	gv_ctl_t ctl_msg;
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+
+	struct iovec iov = {
+		.iov_base = &ctl_msg,
+		.iov_len = sizeof ctl_msg,
+	};
+
+	struct msghdr msg = {
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	ssize_t r;
+	while ((r = recvmsg(ctl, &msg, MSG_WAITALL)) < 0 && errno == EINTR);
+
+	if (r != sizeof ctl_msg || ctl_msg.type != GV_CTL_TYPE_CONN) {
+		return -1;
+	}
+
+	struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+
+	int sock;
+	memcpy(&sock, CMSG_DATA(cmsg), sizeof sock);
+	*vdev_id_ref = ctl_msg.conn.vdev_id;
+
+	return sock;
+}
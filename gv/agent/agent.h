@@ -6,7 +6,10 @@
  *
  * This is used by the CLI, of which a process is spawned by the GrapeVine daemon when a new connection is made to it.
  * It is a standalone library to allow other processes to become GrapeVine KOS agents themselves (e.g. if a VDRIVER must be loaded by a specific process in order to work).
- * These other processes must handle the connection themselves however, which usually involves receiving one already established by gvd through a UDS.
+ * These other processes must handle the connection themselves however, which usually involves claiming the spec from gvd with {@link gv_agent_register} and receiving connections already established by gvd with {@link gv_agent_accept}.
+ *
+ * Any number of agents may be used at once from different threads of the same process, in which case they share a single KOS and thus a single instance of each VDRIVER.
+ * This is how the CLI serves all the connections of a KOS session from one process.
  */
 
 #pragma once
@@ -15,6 +18,21 @@
 
 #include <stdint.h>
 
+/**
+ * Maximum length of the spec in {@link gv_agent_handoff_t}, including the null terminator.
+ */
+#define GV_AGENT_SPEC_MAX 64
+
+/**
+ * What gvd sends to KOS agents started with `-p` over their UDS to hand them a connection.
+ *
+ * The connection's socket itself is sent along with this as `SCM_RIGHTS`.
+ */
+typedef struct {
+	uint64_t vdev_id;
+	char spec[GV_AGENT_SPEC_MAX];
+} gv_agent_handoff_t;
+
 /**
  * GrapeVine KOS agent handle.
  */
@@ -32,6 +50,28 @@ typedef struct gv_agent_t gv_agent_t;
  */
 gv_agent_t* gv_agent_create(int sock, char const* spec, uint64_t vdev_id);
 
+/**
+ * Create a GrapeVine KOS agent without a connection yet.
+ *
+ * This does everything which doesn't depend on the connection ahead of time (connecting to the KOS, finding the VDEVs of the spec, and loading their VDRIVER), which is most of the work of {@link gv_agent_create}.
+ * It is what lets gvd keep idle agents around, ready to take on connections as soon as they come in.
+ * Call {@link gv_agent_bind} once a connection has been established.
+ *
+ * @param spec The spec of the VDRIVER to look for VDEVs in.
+ * @return The GrapeVine KOS agent handle.
+ */
+gv_agent_t* gv_agent_create_idle(char const* spec);
+
+/**
+ * Give an agent created with {@link gv_agent_create_idle} the connection it should serve.
+ *
+ * @param agent The agent.
+ * @param sock Socket connection has been established on.
+ * @param vdev_id The VDEV ID of the VDEV we should send commands to, which must be of the spec the agent was created for.
+ * @return 0 on success, or a negative value if the VDEV couldn't be found or connected to. The agent should then be destroyed.
+ */
+int gv_agent_bind(gv_agent_t* agent, int sock, uint64_t vdev_id);
+
 /**
  * Get loaded VDRIVER for the VDEV we created the agent for.
  *
@@ -55,3 +95,25 @@ void gv_agent_loop(gv_agent_t* agent);
  * @param agent The agent to destroy.
  */
 void gv_agent_destroy(gv_agent_t* agent);
+
+/**
+ * Claim a spec from the GrapeVine daemon over its control socket.
+ *
+ * Connections to VDEVs of this spec are then handed to us rather than to a KOS agent process spawned by gvd, for as long as the returned socket stays open.
+ * These are received with {@link gv_agent_accept}.
+ *
+ * @param spec The spec to claim.
+ * @return The control socket, or -1 on failure (with `errno` set, e.g. to `EEXIST` if another process already claimed the spec).
+ */
+int gv_agent_register(char const* spec);
+
+/**
+ * Wait for the GrapeVine daemon to hand us a connection to a VDEV of a spec we claimed with {@link gv_agent_register}.
+ *
+ * The connection can then be served by an agent created with {@link gv_agent_create}.
+ *
+ * @param ctl The control socket returned by {@link gv_agent_register}.
+ * @param vdev_id_ref Where to put the VDEV ID the connection is for.
+ * @return The connection's socket, or -1 if the control socket was closed or something went wrong.
+ */
+int gv_agent_accept(int ctl, uint64_t* vdev_id_ref);
@@ -8,21 +8,190 @@
 
 #include <umber.h>
 
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
+
 static umber_class_t const* cls;
 
+/**
+ * Number of connections we're serving when started with -p, and our UDS to gvd.
+ */
+static pthread_mutex_t serving_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serving_cond = PTHREAD_COND_INITIALIZER;
+static size_t serving = 0;
+static int uds = -1;
+
+typedef struct {
+	gv_agent_t* agent;
+	int sock;
+} serve_t;
+
+/**
+ * Wait for gvd to hand us a connection.
+ *
+ * @param sock_ref Where to put the connection's socket.
+ * @param handoff Where to put what the connection is for.
+ * @return 0 on success, or a negative value if gvd went away or we stopped taking on connections.
+ */
+static int recv_handoff(int* sock_ref, gv_agent_handoff_t* handoff) {
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+
+	struct iovec iov = {
+		.iov_base = handoff,
+		.iov_len = sizeof *handoff,
+	};
+
+	struct msghdr msg = {
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	ssize_t r;
+
+	while ((r = recvmsg(uds, &msg, MSG_WAITALL)) < 0 && errno == EINTR);
+
+	if (r != sizeof *handoff) {
+		return -1;
+	}
+
+	struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		LOG_F(cls, "Expected a socket from gvd.");
+		return -1;
+	}
+
+	memcpy(sock_ref, CMSG_DATA(cmsg), sizeof *sock_ref);
+	handoff->spec[sizeof handoff->spec - 1] = '\0';
+
+	return 0;
+}
+
+static void* serve_thread(void* arg) {
+	serve_t* const serve = arg;
+
+	gv_agent_loop(serve->agent);
+	gv_agent_destroy(serve->agent);
+	close(serve->sock);
+	free(serve);
+
+	pthread_mutex_lock(&serving_lock);
+
+	if (--serving == 0) {
+		// That was our last connection, so stop taking on new ones and exit once we're done with whatever gvd already sent our way.
+		// gvd notices and starts a new agent for the session if it needs one.
+
+		shutdown(uds, SHUT_RDWR);
+		pthread_cond_signal(&serving_cond);
+	}
+
+	pthread_mutex_unlock(&serving_lock);
+	return NULL;
+}
+
+/**
+ * Serve connections handed to us by gvd over a UDS, each from its own thread.
+ *
+ * These may be for any number of VDEVs, but they all share our KOS and its VDRIVERs.
+ *
+ * @param spec Spec to get an agent ready for ahead of time, or NULL.
+ * @return The exit status.
+ */
+static int serve_handoffs(char const* spec) {
+	gv_agent_t* idle = NULL;
+
+	if (spec != NULL && (idle = gv_agent_create_idle(spec)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	// Let gvd know we're ready.
+
+	if (send(uds, &(char) {0}, 1, 0) != 1) {
+		LOG_V(cls, "gvd went away before handing us a connection.");
+		goto done;
+	}
+
+	int sock;
+	gv_agent_handoff_t handoff;
+
+	while (recv_handoff(&sock, &handoff) == 0) {
+		gv_agent_t* agent;
+
+		if (idle != NULL && strcmp(handoff.spec, spec) == 0) {
+			agent = idle;
+			idle = NULL;
+		}
+
+		else if ((agent = gv_agent_create_idle(handoff.spec)) == NULL) {
+			close(sock);
+			continue;
+		}
+
+		if (gv_agent_bind(agent, sock, handoff.vdev_id) < 0) {
+			gv_agent_destroy(agent);
+			close(sock);
+			continue;
+		}
+
+		serve_t* const serve = malloc(sizeof *serve);
+		assert(serve != NULL);
+
+		serve->agent = agent;
+		serve->sock = sock;
+
+		pthread_mutex_lock(&serving_lock);
+		serving++;
+		pthread_mutex_unlock(&serving_lock);
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, serve_thread, serve);
+		pthread_detach(thread);
+	}
+
+	// gvd won't be sending us anything else, so just wait for the connections we're serving to be done.
+
+	pthread_mutex_lock(&serving_lock);
+
+	while (serving > 0) {
+		pthread_cond_wait(&serving_cond, &serving_lock);
+	}
+
+	pthread_mutex_unlock(&serving_lock);
+
+done:
+
+	if (idle != NULL) {
+		gv_agent_destroy(idle);
+	}
+
+	close(uds);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[]) {
 	cls = umber_class_new("gv.agent", UMBER_LVL_WARN, "GrapeVine KOS agent (CLI).");
 
 	int sock = 3; // Set by gvd when spawning us.
 	uint64_t vid = -1ull;
 	char const* spec = NULL;
+	bool pooled = false;
 
 	int c;
 
-	while ((c = getopt(argc, argv, "s:v:")) != -1) {
+	while ((c = getopt(argc, argv, "ps:v:")) != -1) {
 		switch (c) {
+		case 'p':
+			pooled = true;
+			break;
 		case 's':
 			spec = optarg;
 			break;
@@ -43,6 +212,19 @@ int main(int argc, char* argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	// With -p, fd 3 is instead a UDS connected to gvd, which hands us connections as they come in.
+	// The spec is optional then, and only lets us get ready for connections to it ahead of time.
+
+	if (pooled && vid != -1ull) {
+		LOG_F(cls, "Agents started with -p are only told VIDs along with connections, so -v is not allowed with -p.");
+		return EXIT_FAILURE;
+	}
+
+	if (pooled) {
+		uds = sock;
+		return serve_handoffs(spec);
+	}
+
 	if (spec == NULL) {
 		LOG_F(cls, "Expected spec argument (-s).");
 		return EXIT_FAILURE;
@@ -2,23 +2,36 @@
 // Copyright (c) 2024-2025 Aymeric Wibo
 
 #include "conn.h"
+#include "ctl.h"
+#include "loop.h"
+#include "pool.h"
+#include "session.h"
 #include "query.h"
 
 #include <aqua/gv_proto.h>
+#include <aqua/trace.h>
 #include <aqua/vdriver_loader.h>
 
 #include <umber.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/un.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <sys/wait.h>
+
+/**
+ * Maximum number of events handled per iteration of the event loop.
+ */
+#define CONN_LOOP_BATCH 256
 
 static umber_class_t const* cls = NULL;
 
@@ -26,35 +39,12 @@ static __attribute__((constructor)) void init(void) {
 	cls = umber_class_new("aqua.gv.conn", UMBER_LVL_INFO, "GrapeVine daemon connection handling.");
 }
 
-static void send_sock_to_proc(vdriver_t* vdriver, conn_t* conn, uint64_t vdev_id) {
-	LOG_V(cls, "Passing connection to another process through a UDS (spec=%s).", vdriver->spec);
-
-	// Create and connect to UDS.
-
-	int const uds = socket(AF_UNIX, SOCK_STREAM, 0);
-
-	if (uds < 0) {
-		LOG_E(cls, "socket(AF_UNIX): %s", strerror(errno));
-		return;
-	}
-
-	struct sockaddr_un addr = {0};
-	addr.sun_family = AF_UNIX;
-	addr.sun_path[0] = '\0'; // Abstract UDS.
-	strncpy(addr.sun_path + 1, vdriver->spec, sizeof addr.sun_path - 1);
-
-	if (connect(uds, (struct sockaddr*) &addr, sizeof addr) < 0) {
-		LOG_E(cls, "connect: %s", strerror(errno));
-		goto err_connect;
-	}
-
-	// Send over VDEV connection's socket.
-
+int send_sock(int uds, int sock, void const* data, size_t size) {
 	char control[CMSG_SPACE(sizeof(int))] = {0};
 
 	struct iovec iov = {
-		.iov_base = &vdev_id,
-		.iov_len = sizeof vdev_id
+		.iov_base = (void*) data,
+		.iov_len = size,
 	};
 
 	struct msghdr msg = {
@@ -69,30 +59,26 @@ static void send_sock_to_proc(vdriver_t* vdriver, conn_t* conn, uint64_t vdev_id
 	cmsg->cmsg_type = SCM_RIGHTS;
 	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
 
-	memcpy(CMSG_DATA(cmsg), &conn->sock, sizeof conn->sock);
+	memcpy(CMSG_DATA(cmsg), &sock, sizeof sock);
 
 	if (sendmsg(uds, &msg, 0) < 0) {
-		LOG_E(cls, "sendmsg: %s", strerror(errno));
-		goto err_sendmsg;
+		return -1;
 	}
 
-err_sendmsg:
-err_connect:
-
-	close(uds);
+	return 0;
 }
 
-static void spawn_kos_agent(vdriver_t* vdriver, conn_t* conn, uint64_t vdev_id) {
+static void spawn_kos_agent(char const* spec, conn_t* conn, uint64_t vdev_id) {
 	// Spawn KOS agent process.
 	// TODO Note that if you're stuck on an issue here, it might be that gv-agent failed to start; it will fail silently if so!
 
-	LOG_V(cls, "Spawning KOS agent process (spec=%s).", vdriver->spec);
+	LOG_V(cls, "Spawning KOS agent process (spec=%s).", spec);
 
 	char vid_str[16];
 	snprintf(vid_str, sizeof vid_str, "%" PRIu64, vdev_id);
 
 	char* const path = "gv-agent";
-	char* const argv[] = {path, "-s", vdriver->spec, "-v", vid_str, NULL};
+	char* const argv[] = {path, "-s", (char*) spec, "-v", vid_str, NULL};
 
 	posix_spawn_file_actions_t actions;
 	posix_spawn_file_actions_init(&actions);
@@ -111,125 +97,519 @@ static void spawn_kos_agent(vdriver_t* vdriver, conn_t* conn, uint64_t vdev_id)
 	// TODO We should keep track of all our KOS agents so that we can ask them to terminate all connections when we go down.
 }
 
-static void conn_vdev(conn_t* conn, uint64_t vdev_id) {
+static void conn_vdev(conn_t* conn, uint64_t vdev_id, uint64_t session_id) {
 	// TODO If this fails, we are responsible for sending a CONN_FAIL (or whatever).
 
 	LOG_V(cls, "Looking for VDRIVER associated to VID %" PRIu64 ".", vdev_id);
+	TRACE(TRACE_GVD_CONN_VDEV, session_id, vdev_id, 0);
+
+	// We only need the spec here, so there's no need to actually load the VDRIVER; the KOS agent will do that.
 
-	vdriver_t* const vdriver = vdriver_loader_find_loaded_by_vid(vdev_id);
+	char const* const spec = vdriver_loader_get_spec_by_vid(vdev_id);
 
-	if (vdriver == NULL) {
+	if (spec == NULL) {
 		LOG_E(cls, "Could not find associated VDRIVER.");
-		goto done;
+		return;
 	}
 
-	if (strcmp(vdriver->spec, "aquabsd.black.vr") == 0) { // TODO Hardcoding this for the time being.
-		send_sock_to_proc(vdriver, conn, vdev_id);
+	// Whoever we hand the socket off to expects it to be blocking, and the flag is shared with them.
+
+	fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) & ~O_NONBLOCK);
+
+	// If a local process has claimed the spec, it handles all connections to its VDEVs itself.
+	// Otherwise, connections from the same session all go to the same KOS agent, or we use a pooled KOS agent if one is ready, or spawn one just for this connection.
+
+	if (ctl_handoff(conn->state, spec, conn->sock, vdev_id) == 0) {
+		return;
 	}
 
-	else {
-		spawn_kos_agent(vdriver, conn, vdev_id);
+	if (session_id != 0) {
+		if (session_handoff(conn->state, conn->addr.sin_addr.s_addr, session_id, spec, conn->sock, vdev_id) < 0) {
+			LOG_E(cls, "Could not find or start a KOS agent for session %" PRIx64 ".", session_id);
+		}
 	}
 
-done:
+	else if (pool_handoff(conn->state, spec, conn->sock, vdev_id) < 0) {
+		spawn_kos_agent(spec, conn, vdev_id);
+	}
+}
+
+static void conn_close(conn_t* conn) {
+	state_t* const state = conn->state;
 
+	if (conn->kind == CONN_KIND_CTL) {
+		ctl_closed(conn);
+	}
+
+	loop_del(state->loop, conn->sock);
 	close(conn->sock);
+	free(conn->tx);
+
+	// There may still be events for this connection in the batch we're handling, so only free it once we're done with that.
+
+	conn->sock = -1;
+	conn->tx = NULL;
+	conn->next_dead = state->dead_conns;
+	state->dead_conns = conn;
+
+	state->conn_count--;
+}
+
+static int conn_flush(conn_t* conn) {
+	while (conn->tx_sent < conn->tx_size) {
+		ssize_t const r = gv_send(conn->sock, conn->tx + conn->tx_sent, conn->tx_size - conn->tx_sent, 0);
+
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (conn->tx_blocked) {
+				return 0;
+			}
+
+			conn->tx_blocked = true;
+			return loop_watch_write(conn->state->loop, conn->sock, conn, true);
+		}
+
+		if (r < 0) {
+			LOG_E(cls, "send: %s", strerror(errno));
+			return -1;
+		}
+
+		conn->tx_sent += r;
+	}
+
+	free(conn->tx);
+
+	conn->tx = NULL;
+	conn->tx_size = 0;
+	conn->tx_sent = 0;
+
+	if (!conn->tx_blocked) {
+		return 0;
+	}
+
+	conn->tx_blocked = false;
+	return loop_watch_write(conn->state->loop, conn->sock, conn, false);
 }
 
-void* conn_thread(void* arg) {
-	conn_t* const conn = arg;
+int conn_send(conn_t* conn, void* buf, size_t size) {
+	// Nothing we send is large, so if something is already waiting to be sent, just append to it.
 
-	gv_packet_t buf;
-	int len;
+	conn->tx = realloc(conn->tx, conn->tx_size + size);
+	assert(conn->tx != NULL);
 
-	// The recvs for packets we don't expect to receive are just a best attempt at clearing the buffer until the next packet.
-	// Doesn't really matter if they fail, this is a bad condition to be in anyway and we did our best to recover.
+	memcpy(conn->tx + conn->tx_size, buf, size);
+	conn->tx_size += size;
+	free(buf);
 
-	while ((len = recv(conn->sock, &buf.header, sizeof buf.header, MSG_WAITALL)) > 0) {
-		// TODO We should check that we can even do gv_packet_type_strs[buf.header.type]... Maybe even just have an inline function to do this for us with the table hidden inside so we don't access this directly.
-		// TODO Should we really be goto stop;'ing everywhere?
+	return conn_flush(conn);
+}
+
+/**
+ * Check the header of a packet we've just received, and work out how much of the packet is left to receive.
+ *
+ * @return 0 on success, or a negative value if we can't trust anything else on the connection.
+ */
+static int conn_header(conn_t* conn) {
+	gv_packet_header_t const* const header = &conn->rx.header;
 
-		LOG_V(
+	if (!gv_packet_header_valid(header)) {
+		LOG_E(
 			cls,
-			"Got %s packet from %s:0x%x.",
-			gv_packet_type_strs[buf.header.type],
+			"Got packet with unsupported protocol version %d or type %d from %s:0x%x.",
+			header->vers,
+			header->type,
 			inet_ntoa(conn->addr.sin_addr),
 			ntohs(conn->addr.sin_port)
 		);
 
-		switch (buf.header.type) {
-		case GV_PACKET_TYPE_ELP:
-			recv(conn->sock, &buf.elp, sizeof buf.elp, MSG_WAITALL);
+		return -1;
+	}
 
-			LOG_E(
-				cls,
-				"Received ELP from %s:0x%x (host %" PRIx64 ") on TCP. This should not happen!",
-				inet_ntoa(conn->addr.sin_addr),
-				ntohs(conn->addr.sin_port),
-				buf.elp.host_id
-			);
-			break;
-		case GV_PACKET_TYPE_QUERY:
-			if (query_res(conn) < 0) {
-				goto stop;
+	LOG_V(
+		cls,
+		"Got %s packet from %s:0x%x.",
+		gv_packet_type_str(header->type),
+		inet_ntoa(conn->addr.sin_addr),
+		ntohs(conn->addr.sin_port)
+	);
+
+	switch (header->type) {
+	case GV_PACKET_TYPE_QUERY:
+		// Empty QUERY packets (e.g. from aqua-gvd-bench) just get all our VDEVs back.
+
+		if (header->len == 0) {
+			return 0;
+		}
+
+		if (header->len == sizeof conn->rx.query) {
+			conn->rx_want += header->len;
+			return 0;
+		}
+
+		break;
+	case GV_PACKET_TYPE_CONN_VDEV:
+		if (header->len == sizeof conn->rx.conn_vdev) {
+			conn->rx_want += header->len;
+			return 0;
+		}
+
+		break;
+	case GV_PACKET_TYPE_ELP:
+		LOG_E(
+			cls,
+			"Received ELP from %s:0x%x on TCP. This should not happen!",
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port)
+		);
+		break;
+	case GV_PACKET_TYPE_QUERY_RES:
+		LOG_E(
+			cls,
+			"Received QUERY_RES from %s:0x%x. This should not happen, as this connection isn't ever used to send out QUERY packets!",
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port)
+		);
+		break;
+	case GV_PACKET_TYPE_CONN_VDEV_RES:
+	case GV_PACKET_TYPE_CONN_VDEV_FAIL:
+		LOG_E(
+			cls,
+			"Received %s from %s:0x%x. This should not happen, as this connection isn't ever used to send out CONN_VDEV packets!",
+			gv_packet_type_str(header->type),
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port)
+		);
+		break;
+	case GV_PACKET_TYPE_KOS_CALL:
+	case GV_PACKET_TYPE_KOS_CALL_FAIL:
+	case GV_PACKET_TYPE_KOS_CALL_RET:
+		LOG_E(
+			cls,
+			"Received %s from %s:0x%x. This should not happen, as this connection should have already been passed on to a KOS agent!",
+			gv_packet_type_str(header->type),
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port)
+		);
+		break;
+	case GV_PACKET_TYPE_LEN:
+		assert(false);
+	}
+
+	// Skip over packets we don't expect (or whose length is wrong), so that we don't lose track of where the next one starts.
+
+	conn->rx_discard = header->len;
+	return 0;
+}
+
+/**
+ * Handle a packet we've received in full.
+ *
+ * @return 0 if the connection is to stay open, or a negative value if it is to be closed.
+ */
+static int conn_packet(conn_t* conn) {
+	switch (conn->rx.header.type) {
+	case GV_PACKET_TYPE_QUERY:
+		return query_res(conn);
+	case GV_PACKET_TYPE_CONN_VDEV:
+		conn_vdev(conn, conn->rx.conn_vdev.vdev_id, conn->rx.conn_vdev.session_id);
+		return -1; // Either we handed the connection off, or we couldn't; either way, we're done with it.
+	default:
+		assert(false);
+	}
+
+	return -1;
+}
+
+/**
+ * Receive whatever is available on a connection, handling packets as they complete.
+ *
+ * @return 0 if the connection is to stay open, or a negative value if it is to be closed.
+ */
+static int conn_readable(conn_t* conn) {
+	for (;;) {
+		ssize_t r;
+
+		if (conn->rx_discard > 0) {
+			char scratch[4096];
+			r = gv_recv(conn->sock, scratch, conn->rx_discard < sizeof scratch ? conn->rx_discard : sizeof scratch, 0);
+		}
+
+		else {
+			r = gv_recv(conn->sock, (uint8_t*) &conn->rx + conn->rx_got, conn->rx_want - conn->rx_got, 0);
+		}
+
+		if (r == 0) {
+			return -1;
+		}
+
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (r < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		if (conn->rx_discard > 0) {
+			conn->rx_discard -= r;
+			continue;
+		}
+
+		conn->rx_got += r;
+
+		if (conn->rx_got == sizeof conn->rx.header) {
+			if (conn_header(conn) < 0) {
+				return -1;
 			}
 
-			break;
-		case GV_PACKET_TYPE_QUERY_RES:
-			recv(conn->sock, &buf.query_res, sizeof buf.query_res, MSG_WAITALL);
+			if (conn->rx_discard > 0) {
+				conn->rx_got = 0;
+				continue;
+			}
+		}
 
-			LOG_E(
-				cls,
-				"Received QUERY_RES from %s:0x%x. This should not happen, as this connection isn't ever used to send out QUERY packets!",
-				inet_ntoa(conn->addr.sin_addr),
-				ntohs(conn->addr.sin_port)
-			);
-			break;
-		case GV_PACKET_TYPE_CONN_VDEV:
-			if (recv(conn->sock, &buf.conn_vdev, sizeof buf.conn_vdev, MSG_WAITALL) != sizeof buf.conn_vdev) {
-				LOG_E(cls, "recv failed.");
-				goto stop;
+		if (conn->rx_got < conn->rx_want) {
+			continue;
+		}
+
+		conn->rx_got = 0;
+		conn->rx_want = sizeof conn->rx.header;
+
+		if (conn_packet(conn) < 0) {
+			return -1;
+		}
+	}
+}
+
+static void conn_accept(conn_t const* listener) {
+	state_t* const state = listener->state;
+	bool const ctl = listener->kind == CONN_KIND_CTL_LISTENER;
+
+	// Accept everything waiting in the backlog at once.
+
+	for (;;) {
+		conn_t* const conn = calloc(1, sizeof *conn);
+		assert(conn != NULL);
+
+		conn->state = state;
+		conn->kind = ctl ? CONN_KIND_CTL : CONN_KIND_GV;
+		conn->addr_len = sizeof conn->addr;
+
+		if (ctl) {
+			conn->sock = accept(listener->sock, NULL, NULL);
+		}
+
+		else {
+			conn->sock = accept(listener->sock, (struct sockaddr*) &conn->addr, &conn->addr_len);
+		}
+
+		if (conn->sock < 0) {
+			int const err = errno;
+			free(conn);
+
+			if (err == EINTR || err == ECONNABORTED) {
+				continue;
 			}
 
-			conn_vdev(conn, buf.conn_vdev.vdev_id);
-			break;
-		case GV_PACKET_TYPE_CONN_VDEV_RES:
-			recv(conn->sock, &buf.conn_vdev_res, sizeof buf.conn_vdev_res, MSG_WAITALL);
-			__attribute__((fallthrough));
-		case GV_PACKET_TYPE_CONN_VDEV_FAIL:
-			LOG_E(
-				cls,
-				"Received %s from %s:0x%x (host %" PRIx64 "). This should not happen, as this connection isn't ever used to send out CONN_VDEV packets!",
-				gv_packet_type_strs[buf.header.type],
-				inet_ntoa(conn->addr.sin_addr),
-				ntohs(conn->addr.sin_port),
-				buf.elp.host_id
-			);
-			break;
-		case GV_PACKET_TYPE_KOS_CALL:
-			// TODO Read remaining bytes of packet.
-		case GV_PACKET_TYPE_KOS_CALL_FAIL:
-			// TODO Read remaining bytes of packet.
-		case GV_PACKET_TYPE_KOS_CALL_RET:
-			// TODO Read remaining bytes of packet.
-			LOG_E(
-				cls,
-				"Received %s from %s:0x%x (host %" PRIx64 "). This should not happen, as this connection should have already been passed on to a KOS agent!",
-				gv_packet_type_strs[buf.header.type],
+			if (err != EAGAIN && err != EWOULDBLOCK) {
+				LOG_E(state->listener_cls, "accept: %s", strerror(err));
+			}
+
+			return;
+		}
+
+		if (ctl) {
+			LOG_V(state->listener_cls, "Accepted control connection.");
+			conn->rx_want = sizeof conn->ctl_rx;
+		}
+
+		else {
+			TRACE(TRACE_GVD_ACCEPT, sockaddr_to_mac((struct sockaddr*) &conn->addr), 0, 0);
+
+			LOG_I(
+				state->listener_cls,
+				"Accepted connection from %s:0x%x (host %" PRIx64 ").",
 				inet_ntoa(conn->addr.sin_addr),
 				ntohs(conn->addr.sin_port),
-				buf.elp.host_id
+				sockaddr_to_mac((struct sockaddr*) &conn->addr)
 			);
-			break;
-		case GV_PACKET_TYPE_LEN:
-			assert(false);
+
+			conn->rx_want = sizeof conn->rx.header;
+		}
+
+		// Connections must not leak into the KOS agents we spawn, or closing them wouldn't actually close them.
+		// This isn't a problem for the one we spawn a KOS agent for, as dup2() clears the flag.
+
+		fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) | O_NONBLOCK);
+		fcntl(conn->sock, F_SETFD, FD_CLOEXEC);
+
+		if (loop_add(state->loop, conn->sock, conn) < 0) {
+			LOG_E(state->listener_cls, "Failed to add connection to event loop: %s", strerror(errno));
+			close(conn->sock);
+			free(conn);
+			continue;
 		}
+
+		state->conn_count++;
 	}
+}
 
-stop:
+// Signals are only handled once the event loop gets round to it (see conn_loop).
 
-	close(conn->sock);
-	conn->slot_used = false;
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t child_exited = 0;
+static int signal_wake = -1;
+
+static void on_signal(int sig) {
+	int const saved_errno = errno;
+
+	if (sig == SIGUSR1) {
+		dump_requested = 1;
+	}
+
+	else if (sig == SIGCHLD) {
+		child_exited = 1;
+	}
+
+	else {
+		stop_requested = 1;
+	}
+
+	// Wake the event loop up through the control socket's wake pipe, which it empties without needing there to be any events queued.
+
+	while (write(signal_wake, "", 1) < 0 && errno == EINTR);
+	errno = saved_errno;
+}
+
+int conn_loop(state_t* state) {
+	state->conn_count = 0;
+	state->dead_conns = NULL;
+	state->loop = loop_create();
+
+	if (state->loop < 0) {
+		LOG_F(state->listener_cls, "Failed to create event loop: %s", strerror(errno));
+		return -1;
+	}
+
+	// The listening sockets (and the wake pipe) get connections of their own, so that events on them can be told apart from those on the connections they accept.
+
+	conn_t listeners[] = {
+		{
+			.state = state,
+			.kind = CONN_KIND_GV_LISTENER,
+			.sock = state->sock,
+		},
+		{
+			.state = state,
+			.kind = CONN_KIND_CTL_LISTENER,
+			.sock = state->ctl_sock,
+		},
+		{
+			.state = state,
+			.kind = CONN_KIND_CTL_WAKE,
+			.sock = state->ctl_wake[0],
+		},
+	};
+
+	for (size_t i = 0; i < sizeof listeners / sizeof *listeners; i++) {
+		if (loop_add(state->loop, listeners[i].sock, &listeners[i]) < 0) {
+			LOG_F(state->listener_cls, "Failed to add listening socket or wake pipe to event loop: %s", strerror(errno));
+			goto done;
+		}
+	}
+
+	// SIGUSR1 dumps the trace (see trace_dump), as we otherwise only write it when exiting, and SIGTERM and SIGINT stop gvd gracefully, which then dumps it too.
+
+	signal_wake = state->ctl_wake[1];
+
+	struct sigaction const sa = {
+		.sa_handler = on_signal,
+	};
+
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	// KOS agents we spawn (per-connection, pooled, or for sessions) are reaped here once they exit, rather than left behind as zombies.
+
+	sigaction(SIGCHLD, &sa, NULL);
+
+	int rv = -1;
+	loop_ev_t evs[CONN_LOOP_BATCH];
+
+	while (!stop_requested) {
+		if (dump_requested) {
+			dump_requested = 0;
+			LOG_I(state->listener_cls, "Dumping trace.");
+			trace_dump();
+		}
+
+		if (child_exited) {
+			child_exited = 0;
+			while (waitpid(-1, NULL, WNOHANG) > 0);
+		}
+
+		int const n = loop_wait(state->loop, evs, sizeof evs / sizeof *evs);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0) {
+			LOG_F(state->listener_cls, "Failed to wait for events: %s", strerror(errno));
+			goto done;
+		}
+
+		for (int i = 0; i < n; i++) {
+			loop_ev_t const* const ev = &evs[i];
+			conn_t* const conn = ev->data;
+
+			if (conn->kind == CONN_KIND_GV_LISTENER || conn->kind == CONN_KIND_CTL_LISTENER) {
+				conn_accept(conn);
+				continue;
+			}
+
+			if (conn->kind == CONN_KIND_CTL_WAKE) {
+				ctl_events(state);
+				continue;
+			}
+
+			if (conn->sock < 0) {
+				continue; // Already closed while handling this batch.
+			}
+
+			if (ev->writable && conn_flush(conn) < 0) {
+				conn_close(conn);
+				continue;
+			}
+
+			if (!ev->readable && !ev->hup) {
+				continue;
+			}
+
+			if ((conn->kind == CONN_KIND_CTL ? ctl_readable(conn) : conn_readable(conn)) < 0) {
+				conn_close(conn);
+			}
+		}
+
+		while (state->dead_conns != NULL) {
+			conn_t* const dead = state->dead_conns;
+			state->dead_conns = dead->next_dead;
+			free(dead);
+		}
+
+		LOG_V(state->listener_cls, "%zu connections open.", state->conn_count);
+	}
+
+	LOG_I(state->listener_cls, "Asked to stop.");
+	rv = 0;
+
+done:
 
-	return NULL;
+	close(state->loop);
+	return rv;
 }
@@ -1,25 +1,125 @@
 // This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
-// Copyright (c) 2024 Aymeric Wibo
+// Copyright (c) 2024-2025 Aymeric Wibo
 
 #pragma once
 
-#include <pthread.h>
+#include <aqua/gv_ipc.h>
+#include <aqua/gv_proto.h>
+
 #include <stdbool.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 typedef struct state_t state_t;
+typedef struct conn_t conn_t;
 
-typedef struct {
-	bool slot_used;
+/**
+ * What's on the other end of a connection.
+ */
+typedef enum {
+	/**
+	 * The TCP socket we listen for GrapeVine connections on.
+	 */
+	CONN_KIND_GV_LISTENER,
+	/**
+	 * A GrapeVine connection from another node.
+	 */
+	CONN_KIND_GV,
+	/**
+	 * The UDS we listen for control connections on.
+	 */
+	CONN_KIND_CTL_LISTENER,
+	/**
+	 * A control connection from a local process (see ctl.h).
+	 */
+	CONN_KIND_CTL,
+	/**
+	 * The pipe the event loop is woken up on when ATTACH and DETACH messages are queued for subscribers (see {@link ctl_vdevs_changed}).
+	 */
+	CONN_KIND_CTL_WAKE,
+} conn_kind_t;
 
+/**
+ * A connection gvd is handling, until it's closed or handed off to a KOS agent.
+ *
+ * All connections are handled by a single event loop (see {@link conn_loop}), so this holds everything needed to pick up where we left off whenever the socket becomes readable or writable again.
+ */
+struct conn_t {
 	state_t* state;
-	pthread_t thread;
+	conn_kind_t kind;
 
 	int sock;
 	struct sockaddr_in addr;
 	socklen_t addr_len;
-} conn_t;
 
-void* conn_thread(void* arg);
+	/**
+	 * The packet being received, how much of it has been received so far, and how much of it we want.
+	 *
+	 * We only ever receive as much as is left of the current packet, so that nothing following a CONN_VDEV packet is read before the socket is handed off.
+	 * Control connections receive control messages instead.
+	 */
+	union {
+		gv_packet_t rx;
+		gv_ctl_t ctl_rx;
+	};
+	size_t rx_got;
+	size_t rx_want;
+
+	/**
+	 * Number of bytes left to skip over of a packet we don't expect.
+	 */
+	size_t rx_discard;
+
+	/**
+	 * Data waiting to be sent, its size, and how much of it has been sent so far.
+	 */
+	uint8_t* tx;
+	size_t tx_size;
+	size_t tx_sent;
+
+	/**
+	 * Whether we're waiting for the socket to become writable to send the rest of the data.
+	 */
+	bool tx_blocked;
+
+	/**
+	 * Next closed connection to be freed, as there may still be events for it to skip over.
+	 */
+	conn_t* next_dead;
+};
+
+/**
+ * Accept and handle connections until asked to stop or something goes irrecoverably wrong.
+ *
+ * This also handles the signals gvd is sent: SIGTERM and SIGINT stop it, and SIGUSR1 dumps its trace (see {@link trace_dump}).
+ *
+ * @param state The gvd state, whose listening sockets (see {@link ctl_listen}) must be non-blocking and listening.
+ * @return 0 if asked to stop, or -1 if something went wrong.
+ */
+int conn_loop(state_t* state);
+
+/**
+ * Send data on a connection.
+ *
+ * Whatever can't be sent right away is sent when the socket becomes writable again.
+ *
+ * @param conn The connection.
+ * @param buf Data to send, which the connection takes ownership of.
+ * @param size Size of the data.
+ * @return 0 on success, or a negative value if the connection broke.
+ */
+int conn_send(conn_t* conn, void* buf, size_t size);
+
+/**
+ * Send a socket over a UDS, along with what it's for.
+ *
+ * This is how connections are handed off to processes which handle them themselves, and to KOS agents started with `-p`.
+ *
+ * @param uds The UDS to send over.
+ * @param sock The socket to send.
+ * @param data What the connection is for (e.g. its VDEV ID).
+ * @param size Size of the data.
+ * @return 0 on success, or -1 on error (with `errno` set).
+ */
+int send_sock(int uds, int sock, void const* data, size_t size);
@@ -0,0 +1,334 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Measure how many connections a running gvd can set up per second with many clients connecting at once.
+// Each client connects, sends a QUERY, waits for the full QUERY_RES, disconnects, and starts over, which is what every node discovering us over ELP does.
+
+#define _POSIX_C_SOURCE 200809L // For clock_gettime().
+
+#include <aqua/gv_proto.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_SECONDS 5
+
+typedef enum {
+	STAGE_CONNECTING,
+	STAGE_HEADER,
+	STAGE_BODY,
+} stage_t;
+
+typedef struct {
+	stage_t stage;
+	uint64_t start;
+
+	gv_packet_header_t header;
+	size_t got;
+	size_t left;
+} client_t;
+
+static struct sockaddr_in addr;
+
+static size_t lat_count = 0;
+static uint64_t* lats = NULL;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(void const* a, void const* b) {
+	uint64_t const x = *(uint64_t const*) a;
+	uint64_t const y = *(uint64_t const*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Start a new connection for a client.
+ *
+ * @return The socket, or -1 on error.
+ */
+static int client_connect(client_t* client) {
+	int const sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (sock < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	client->stage = STAGE_CONNECTING;
+	client->start = now();
+	client->got = 0;
+	client->left = 0;
+
+	if (connect(sock, (struct sockaddr*) &addr, sizeof addr) < 0 && errno != EINPROGRESS) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * Make progress on a client whose socket is ready.
+ *
+ * @return 1 if the connection is done, 0 if it isn't yet, or -1 if it failed.
+ */
+static int client_step(client_t* client, struct pollfd* pfd) {
+	if (client->stage == STAGE_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof err;
+
+		if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			return -1;
+		}
+
+		gv_packet_header_t const query = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_QUERY,
+			.len = 0,
+		};
+
+		if (send(pfd->fd, &query, sizeof query, 0) != sizeof query) {
+			return -1;
+		}
+
+		client->stage = STAGE_HEADER;
+		pfd->events = POLLIN;
+
+		return 0;
+	}
+
+	for (;;) {
+		ssize_t r;
+
+		if (client->stage == STAGE_HEADER) {
+			r = recv(pfd->fd, (uint8_t*) &client->header + client->got, sizeof client->header - client->got, 0);
+		}
+
+		else {
+			char scratch[4096];
+			r = recv(pfd->fd, scratch, client->left < sizeof scratch ? client->left : sizeof scratch, 0);
+		}
+
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			return 0;
+		}
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		if (client->stage == STAGE_BODY) {
+			client->left -= r;
+
+			if (client->left == 0) {
+				return 1;
+			}
+
+			continue;
+		}
+
+		client->got += r;
+
+		if (client->got < sizeof client->header) {
+			continue;
+		}
+
+		if (!gv_packet_header_valid(&client->header) || client->header.type != GV_PACKET_TYPE_QUERY_RES) {
+			fprintf(stderr, "Got something other than a QUERY_RES back.\n");
+			return -1;
+		}
+
+		client->stage = STAGE_BODY;
+		client->left = client->header.len;
+
+		if (client->left == 0) {
+			return 1;
+		}
+	}
+}
+
+static void usage(char const* progname) {
+	fprintf(stderr, "usage: %s [-c clients] [-t seconds] [address]\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	char const* const progname = argv[0];
+
+	size_t client_count = DEFAULT_CLIENTS;
+	double seconds = DEFAULT_SECONDS;
+
+	int c;
+
+	while ((c = getopt(argc, argv, "c:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			client_count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1 || client_count == 0 || seconds <= 0) {
+		usage(progname);
+	}
+
+	addr = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_port = htons(GV_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if (argc == 1 && inet_pton(AF_INET, argv[0], &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address '%s'.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Each client needs its own file descriptor, which is more than the default limit allows on most systems.
+
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < client_count + 16) {
+		rl.rlim_cur = client_count + 16 < rl.rlim_max ? client_count + 16 : rl.rlim_max;
+
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < client_count + 16) {
+			fprintf(stderr, "Can't raise file descriptor limit high enough for %zu clients.\n", client_count);
+			return EXIT_FAILURE;
+		}
+	}
+
+	client_t* const clients = calloc(client_count, sizeof *clients);
+	struct pollfd* const pfds = calloc(client_count, sizeof *pfds);
+
+	assert(clients != NULL);
+	assert(pfds != NULL);
+
+	size_t failures = 0;
+	size_t lat_cap = 0;
+
+	for (size_t i = 0; i < client_count; i++) {
+		pfds[i].fd = client_connect(&clients[i]);
+		pfds[i].events = POLLOUT;
+
+		if (pfds[i].fd < 0) {
+			fprintf(stderr, "Failed to start connection %zu.\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t const start = now();
+	uint64_t const end = start + seconds * 1e9;
+
+	while (now() < end) {
+		int const n = poll(pfds, client_count, 100);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0) {
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		for (size_t i = 0; i < client_count; i++) {
+			struct pollfd* const pfd = &pfds[i];
+			client_t* const client = &clients[i];
+
+			if (pfd->revents == 0) {
+				continue;
+			}
+
+			int const rv = client_step(client, pfd);
+
+			if (rv == 0) {
+				continue;
+			}
+
+			if (rv > 0) {
+				if (lat_count == lat_cap) {
+					lat_cap = lat_cap == 0 ? 4096 : lat_cap * 2;
+					lats = realloc(lats, lat_cap * sizeof *lats);
+					assert(lats != NULL);
+				}
+
+				lats[lat_count++] = now() - client->start;
+			}
+
+			else {
+				failures++;
+			}
+
+			close(pfd->fd);
+
+			pfd->fd = client_connect(client);
+			pfd->events = POLLOUT;
+
+			if (pfd->fd < 0) {
+				fprintf(stderr, "Failed to restart connection %zu.\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	double const elapsed = (now() - start) / 1e9;
+
+	for (size_t i = 0; i < client_count; i++) {
+		close(pfds[i].fd);
+	}
+
+	if (lat_count == 0) {
+		fprintf(stderr, "No connection completed (%zu failed). Is gvd running?\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	qsort(lats, lat_count, sizeof *lats, cmp_u64);
+
+	printf("%10s%14s%12s%12s%12s%10s\n", "CLIENTS", "CONNS/S", "P50 (US)", "P99 (US)", "MAX (US)", "FAILED");
+
+	printf(
+		"%10zu%14.0f%12.1f%12.1f%12.1f%10zu\n",
+		client_count,
+		lat_count / elapsed,
+		lats[lat_count / 2] / 1e3,
+		lats[lat_count * 99 / 100] / 1e3,
+		lats[lat_count - 1] / 1e3,
+		failures
+	);
+
+	free(lats);
+	free(pfds);
+	free(clients);
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,551 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "ctl.h"
+#include "gv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Maximum number of bytes of ATTACH and DETACH messages which may be waiting to be sent to a subscriber.
+ *
+ * Past this, the subscriber isn't keeping up and we'd rather drop it than keep buffering for it.
+ */
+#define CTL_TX_MAX (16 << 20)
+
+int ctl_listen(state_t* state) {
+	state->reg_count = 0;
+	state->regs = NULL;
+
+	state->sub_count = 0;
+	state->subs = NULL;
+	state->spec_count = 0;
+	state->specs = NULL;
+
+	state->ctl_event_count = 0;
+	state->ctl_events = NULL;
+
+	// ATTACH and DETACH messages are queued from the ELP and query threads, which wake the event loop up through this pipe to send them.
+	// Neither end may block: the event loop mustn't, and if the pipe is full, the event loop is already going to wake up anyway.
+
+	if (pipe(state->ctl_wake) < 0) {
+		LOG_E(state->ctl_cls, "pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < 2; i++) {
+		fcntl(state->ctl_wake[i], F_SETFL, fcntl(state->ctl_wake[i], F_GETFL) | O_NONBLOCK);
+		fcntl(state->ctl_wake[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	pthread_mutex_init(&state->ctl_events_mutex, NULL);
+
+	char const* const path = gv_get_ctl_path();
+	LOG_V(state->ctl_cls, "Creating control socket at %s.", path);
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		LOG_E(state->ctl_cls, "Control socket path %s is too long.", path);
+		goto err_path;
+	}
+
+	strcpy(addr.sun_path, path);
+	state->ctl_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (state->ctl_sock < 0) {
+		LOG_E(state->ctl_cls, "socket(AF_UNIX): %s", strerror(errno));
+		goto err_path;
+	}
+
+	// We hold the lock file, so whatever is at this path was left behind by a previous instance.
+
+	unlink(path);
+
+	if (bind(state->ctl_sock, (struct sockaddr*) &addr, sizeof addr) < 0) {
+		LOG_E(state->ctl_cls, "bind(\"%s\"): %s", path, strerror(errno));
+		goto err;
+	}
+
+	fcntl(state->ctl_sock, F_SETFL, fcntl(state->ctl_sock, F_GETFL) | O_NONBLOCK);
+	fcntl(state->ctl_sock, F_SETFD, FD_CLOEXEC);
+
+	if (listen(state->ctl_sock, SOMAXCONN) < 0) {
+		LOG_E(state->ctl_cls, "listen: %s", strerror(errno));
+		goto err_listen;
+	}
+
+	return 0;
+
+err_listen:
+
+	unlink(path);
+
+err:
+
+	close(state->ctl_sock);
+	state->ctl_sock = -1;
+
+err_path:
+
+	pthread_mutex_destroy(&state->ctl_events_mutex);
+
+	close(state->ctl_wake[0]);
+	close(state->ctl_wake[1]);
+
+	return -1;
+}
+
+static reg_t* find_reg(state_t* state, char const* spec) {
+	for (size_t i = 0; i < state->reg_count; i++) {
+		if (strcmp(state->regs[i].spec, spec) == 0) {
+			return &state->regs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int reg(conn_t* conn) {
+	state_t* const state = conn->state;
+	char const* const spec = conn->ctl_rx.reg.spec;
+
+	gv_ctl_t* const res = calloc(1, sizeof *res);
+	assert(res != NULL);
+
+	res->type = GV_CTL_TYPE_RES;
+
+	if (memchr(spec, '\0', sizeof conn->ctl_rx.reg.spec) == NULL || *spec == '\0') {
+		LOG_W(state->ctl_cls, "Got REGISTER with an invalid spec.");
+		res->res.err = EINVAL;
+	}
+
+	else if (find_reg(state, spec) != NULL) {
+		LOG_W(state->ctl_cls, "Can't register %s, as it's already been claimed by someone else.", spec);
+		res->res.err = EEXIST;
+	}
+
+	else {
+		state->regs = realloc(state->regs, (state->reg_count + 1) * sizeof *state->regs);
+		assert(state->regs != NULL);
+
+		reg_t* const r = &state->regs[state->reg_count++];
+
+		strcpy(r->spec, spec);
+		r->conn = conn;
+
+		LOG_I(state->ctl_cls, "Connections to %s VDEVs are now handed to a local process.", spec);
+	}
+
+	return conn_send(conn, res, sizeof *res);
+}
+
+static bool spec_matches(char const* sub_spec, char const* spec) {
+	return *sub_spec == '\0' || strcmp(sub_spec, spec) == 0;
+}
+
+static spec_ent_t* find_spec(state_t* state, char const* spec) {
+	for (size_t i = 0; i < state->spec_count; i++) {
+		if (strcmp(state->specs[i].spec, spec) == 0) {
+			return &state->specs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int sub(conn_t* conn) {
+	state_t* const state = conn->state;
+	char const* const spec = conn->ctl_rx.sub.spec;
+
+	if (memchr(spec, '\0', sizeof conn->ctl_rx.sub.spec) == NULL) {
+		LOG_W(state->ctl_cls, "Got SUBSCRIBE with an invalid spec.");
+
+		gv_ctl_t* const res = calloc(1, sizeof *res);
+		assert(res != NULL);
+
+		res->type = GV_CTL_TYPE_RES;
+		res->res.err = EINVAL;
+
+		return conn_send(conn, res, sizeof *res);
+	}
+
+	bool subbed = false;
+
+	for (size_t i = 0; i < state->sub_count; i++) {
+		if (state->subs[i].conn == conn && strcmp(state->subs[i].spec, spec) == 0) {
+			subbed = true;
+			break;
+		}
+	}
+
+	if (!subbed) {
+		state->subs = realloc(state->subs, (state->sub_count + 1) * sizeof *state->subs);
+		assert(state->subs != NULL);
+
+		sub_t* const s = &state->subs[state->sub_count++];
+
+		strcpy(s->spec, spec);
+		s->conn = conn;
+
+		LOG_V(state->ctl_cls, "Local process subscribed to %s VDEVs.", *spec == '\0' ? "all" : spec);
+	}
+
+	// Send the VDEVs we know about for the spec from the spec index, followed by the reply, all at once.
+
+	size_t count = 0;
+
+	for (size_t i = 0; i < state->spec_count; i++) {
+		if (spec_matches(spec, state->specs[i].spec)) {
+			count += state->specs[i].vdev_count;
+		}
+	}
+
+	gv_ctl_t* const msgs = calloc(count + 1, sizeof *msgs);
+	assert(msgs != NULL);
+
+	gv_ctl_t* msg = msgs;
+
+	for (size_t i = 0; i < state->spec_count; i++) {
+		spec_ent_t const* const ent = &state->specs[i];
+
+		if (!spec_matches(spec, ent->spec)) {
+			continue;
+		}
+
+		for (size_t j = 0; j < ent->vdev_count; j++, msg++) {
+			msg->type = GV_CTL_TYPE_ATTACH;
+			msg->attach.vdev = ent->vdevs[j];
+		}
+	}
+
+	msg->type = GV_CTL_TYPE_RES;
+	msg->res.err = 0;
+
+	return conn_send(conn, msgs, (count + 1) * sizeof *msgs);
+}
+
+int ctl_readable(conn_t* conn) {
+	for (;;) {
+		ssize_t const r = recv(conn->sock, (uint8_t*) &conn->ctl_rx + conn->rx_got, conn->rx_want - conn->rx_got, 0);
+
+		if (r == 0) {
+			return -1;
+		}
+
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (r < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		conn->rx_got += r;
+
+		if (conn->rx_got < conn->rx_want) {
+			continue;
+		}
+
+		conn->rx_got = 0;
+
+		switch (conn->ctl_rx.type) {
+		case GV_CTL_TYPE_REGISTER:
+			if (reg(conn) < 0) {
+				return -1;
+			}
+
+			break;
+		case GV_CTL_TYPE_SUBSCRIBE:
+			if (sub(conn) < 0) {
+				return -1;
+			}
+
+			break;
+		default:
+			LOG_E(conn->state->ctl_cls, "Got unexpected control message type %d.", conn->ctl_rx.type);
+			return -1;
+		}
+	}
+}
+
+void ctl_closed(conn_t* conn) {
+	state_t* const state = conn->state;
+
+	for (size_t i = 0; i < state->reg_count;) {
+		reg_t* const r = &state->regs[i];
+
+		if (r->conn != conn) {
+			i++;
+			continue;
+		}
+
+		LOG_I(state->ctl_cls, "Local process handling %s VDEVs went away.", r->spec);
+		*r = state->regs[--state->reg_count];
+	}
+
+	for (size_t i = 0; i < state->sub_count;) {
+		if (state->subs[i].conn != conn) {
+			i++;
+			continue;
+		}
+
+		state->subs[i] = state->subs[--state->sub_count];
+	}
+}
+
+int ctl_handoff(state_t* state, char const* spec, int sock, uint64_t vdev_id) {
+	reg_t const* const r = find_reg(state, spec);
+
+	if (r == NULL) {
+		return -1;
+	}
+
+	// A reply still waiting to be sent would end up interleaved with this message.
+	// The control socket is also non-blocking, so if the process isn't keeping up, we'd rather not wait for it.
+
+	if (r->conn->tx_size > 0) {
+		LOG_W(state->ctl_cls, "Local process handling %s VDEVs isn't keeping up.", spec);
+		return -1;
+	}
+
+	gv_ctl_t msg = {
+		.type = GV_CTL_TYPE_CONN,
+		.conn.vdev_id = vdev_id,
+	};
+
+	strncpy(msg.conn.spec, spec, sizeof msg.conn.spec - 1);
+
+	if (send_sock(r->conn->sock, sock, &msg, sizeof msg) < 0) {
+		LOG_W(state->ctl_cls, "Failed to hand connection off to local process handling %s VDEVs: %s", spec, strerror(errno));
+		return -1;
+	}
+
+	LOG_V(state->ctl_cls, "Handed connection to VID %" PRIu64 " off to local process handling %s VDEVs.", vdev_id, spec);
+	return 0;
+}
+
+static kos_vdev_descr_t const* find_vdev(gv_node_ent_t const* ent, uint64_t vdev_id) {
+	if (ent == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < ent->vdev_count; i++) {
+		if (ent->vdevs[i].vdev_id == vdev_id) {
+			return &ent->vdevs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void queue_event(state_t* state, gv_ctl_t const* ev) {
+	state->ctl_events = realloc(state->ctl_events, (state->ctl_event_count + 1) * sizeof *state->ctl_events);
+	assert(state->ctl_events != NULL);
+
+	state->ctl_events[state->ctl_event_count++] = *ev;
+}
+
+void ctl_vdevs_changed(state_t* state, gv_node_ent_t const* old_ent, gv_node_ent_t const* new_ent) {
+	pthread_mutex_lock(&state->ctl_events_mutex);
+	size_t const prev_count = state->ctl_event_count;
+
+	// VDEVs which have changed are detached and then attached again, so that subscribers never need to handle the same VDEV being attached twice.
+
+	for (size_t i = 0; old_ent != NULL && i < old_ent->vdev_count; i++) {
+		kos_vdev_descr_t const* const vdev = &old_ent->vdevs[i];
+		kos_vdev_descr_t const* const new_vdev = find_vdev(new_ent, vdev->vdev_id);
+
+		if (new_vdev != NULL && memcmp(new_vdev, vdev, sizeof *vdev) == 0) {
+			continue;
+		}
+
+		gv_ctl_t ev = {
+			.type = GV_CTL_TYPE_DETACH,
+			.detach.host_id = old_ent->host_id,
+			.detach.vdev_id = vdev->vdev_id,
+		};
+
+		strncpy(ev.detach.spec, (char const*) vdev->spec, sizeof ev.detach.spec - 1);
+		queue_event(state, &ev);
+	}
+
+	for (size_t i = 0; new_ent != NULL && i < new_ent->vdev_count; i++) {
+		kos_vdev_descr_t const* const vdev = &new_ent->vdevs[i];
+		kos_vdev_descr_t const* const old_vdev = find_vdev(old_ent, vdev->vdev_id);
+
+		if (old_vdev != NULL && memcmp(old_vdev, vdev, sizeof *vdev) == 0) {
+			continue;
+		}
+
+		gv_ctl_t ev = {
+			.type = GV_CTL_TYPE_ATTACH,
+			.attach.vdev = *vdev,
+		};
+
+		ev.attach.vdev.host_id = new_ent->host_id;
+		ev.attach.vdev.kind = KOS_VDEV_KIND_GV;
+		ev.attach.vdev.spec[sizeof ev.attach.vdev.spec - 1] = '\0';
+
+		queue_event(state, &ev);
+	}
+
+	bool const wake = prev_count == 0 && state->ctl_event_count > 0;
+	pthread_mutex_unlock(&state->ctl_events_mutex);
+
+	// The event loop takes all queued events at once, so it only needs waking up when the first one is queued.
+
+	if (wake) {
+		while (write(state->ctl_wake[1], "", 1) < 0 && errno == EINTR);
+	}
+}
+
+/**
+ * Apply an ATTACH or DETACH message to the spec index.
+ */
+static void index_event(state_t* state, char const* spec, gv_ctl_t const* ev) {
+	spec_ent_t* ent = find_spec(state, spec);
+
+	if (ev->type == GV_CTL_TYPE_ATTACH) {
+		if (ent == NULL) {
+			state->specs = realloc(state->specs, (state->spec_count + 1) * sizeof *state->specs);
+			assert(state->specs != NULL);
+
+			ent = &state->specs[state->spec_count++];
+
+			strcpy(ent->spec, spec);
+			ent->vdev_count = 0;
+			ent->vdevs = NULL;
+		}
+
+		ent->vdevs = realloc(ent->vdevs, (ent->vdev_count + 1) * sizeof *ent->vdevs);
+		assert(ent->vdevs != NULL);
+		ent->vdevs[ent->vdev_count++] = ev->attach.vdev;
+
+		return;
+	}
+
+	if (ent == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < ent->vdev_count; i++) {
+		kos_vdev_descr_t const* const vdev = &ent->vdevs[i];
+
+		if (vdev->host_id == ev->detach.host_id && vdev->vdev_id == ev->detach.vdev_id) {
+			ent->vdevs[i] = ent->vdevs[--ent->vdev_count];
+			break;
+		}
+	}
+
+	if (ent->vdev_count == 0) {
+		free(ent->vdevs);
+		*ent = state->specs[--state->spec_count];
+	}
+}
+
+/**
+ * Send an ATTACH or DETACH message to a subscriber.
+ *
+ * Subscribers which aren't keeping up are dropped: their connection is shut down, and closed by the event loop once it notices.
+ */
+static void push(state_t* state, conn_t* conn, gv_ctl_t const* ev) {
+	if (conn->tx_size - conn->tx_sent > CTL_TX_MAX) {
+		return; // Already being dropped.
+	}
+
+	gv_ctl_t* const msg = malloc(sizeof *msg);
+	assert(msg != NULL);
+	*msg = *ev;
+
+	if (conn_send(conn, msg, sizeof *msg) < 0) {
+		shutdown(conn->sock, SHUT_RDWR);
+		return;
+	}
+
+	if (conn->tx_size - conn->tx_sent > CTL_TX_MAX) {
+		LOG_W(state->ctl_cls, "Dropping subscriber which isn't keeping up.");
+		shutdown(conn->sock, SHUT_RDWR);
+	}
+}
+
+/**
+ * Check if a message for a spec was already sent to the connection of a subscription because of one of the subscriptions before it, as a process may subscribe to both a spec and all specs.
+ */
+static bool sent_before(state_t* state, size_t sub_i, char const* spec) {
+	for (size_t i = 0; i < sub_i; i++) {
+		if (state->subs[i].conn == state->subs[sub_i].conn && spec_matches(state->subs[i].spec, spec)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ctl_events(state_t* state) {
+	// Empty the wake pipe before taking the queued events, so that we can't miss a wakeup for events queued in between.
+
+	char buf[64];
+	while (read(state->ctl_wake[0], buf, sizeof buf) > 0);
+
+	pthread_mutex_lock(&state->ctl_events_mutex);
+
+	size_t const count = state->ctl_event_count;
+	gv_ctl_t* const evs = state->ctl_events;
+
+	state->ctl_event_count = 0;
+	state->ctl_events = NULL;
+
+	pthread_mutex_unlock(&state->ctl_events_mutex);
+
+	for (size_t i = 0; i < count; i++) {
+		gv_ctl_t const* const ev = &evs[i];
+		char const* const spec = ev->type == GV_CTL_TYPE_ATTACH ? (char const*) ev->attach.vdev.spec : ev->detach.spec;
+
+		index_event(state, spec, ev);
+
+		for (size_t j = 0; j < state->sub_count; j++) {
+			sub_t const* const s = &state->subs[j];
+
+			if (spec_matches(s->spec, spec) && !sent_before(state, j, spec)) {
+				push(state, s->conn, ev);
+			}
+		}
+	}
+
+	LOG_V(state->ctl_cls, "Sent %zu ATTACH and DETACH messages to %zu subscriptions.", count, state->sub_count);
+	free(evs);
+}
+
+void ctl_free(state_t* state) {
+	free(state->regs);
+	free(state->subs);
+
+	for (size_t i = 0; i < state->spec_count; i++) {
+		free(state->specs[i].vdevs);
+	}
+
+	free(state->specs);
+	free(state->ctl_events);
+
+	pthread_mutex_destroy(&state->ctl_events_mutex);
+
+	close(state->ctl_wake[0]);
+	close(state->ctl_wake[1]);
+
+	close(state->ctl_sock);
+	unlink(gv_get_ctl_path());
+}
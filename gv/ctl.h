@@ -0,0 +1,117 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// The control socket lets long-running local processes (e.g. a compositor, VR runtime, or audio server) claim specs from gvd at runtime.
+// Connections to VDEVs of these specs are then handed straight to them, rather than to a KOS agent.
+// It also lets local processes (e.g. KOSs) subscribe to specs, to be told as soon as VDEVs of them come and go on the GrapeVine.
+
+#pragma once
+
+#include "conn.h"
+
+#include <aqua/gv_ipc.h>
+
+#include <stdint.h>
+
+typedef struct state_t state_t;
+
+/**
+ * A spec claimed by a process over the control socket.
+ */
+typedef struct {
+	char spec[GV_CTL_SPEC_MAX];
+
+	/**
+	 * The control connection of the process which claimed the spec.
+	 */
+	conn_t* conn;
+} reg_t;
+
+/**
+ * A spec subscribed to by a process over the control socket.
+ */
+typedef struct {
+	/**
+	 * The spec, or an empty string for all specs.
+	 */
+	char spec[GV_CTL_SPEC_MAX];
+
+	/**
+	 * The control connection of the process which subscribed.
+	 */
+	conn_t* conn;
+} sub_t;
+
+/**
+ * The VDEVs of a spec on the GrapeVine, as last told to subscribers.
+ *
+ * This is the spec index, which is only ever touched from the event loop, so that what's sent to new subscribers is always consistent with the ATTACH and DETACH messages sent to existing ones.
+ */
+typedef struct {
+	char spec[GV_CTL_SPEC_MAX];
+	size_t vdev_count;
+	kos_vdev_descr_t* vdevs;
+} spec_ent_t;
+
+/**
+ * Create the control socket and start listening on it.
+ *
+ * This must be done before the ELP subsystem is started, as that may already report VDEVs (see {@link ctl_vdevs_changed}).
+ *
+ * @param state The gvd state.
+ * @return 0 on success, or a negative value on failure.
+ */
+int ctl_listen(state_t* state);
+
+/**
+ * Receive whatever is available on a control connection, handling messages as they complete.
+ *
+ * @param conn The control connection.
+ * @return 0 if the connection is to stay open, or a negative value if it is to be closed.
+ */
+int ctl_readable(conn_t* conn);
+
+/**
+ * Give back everything claimed over a control connection which is being closed.
+ *
+ * @param conn The control connection.
+ */
+void ctl_closed(conn_t* conn);
+
+/**
+ * Hand a connection off to the process which claimed its spec, if any.
+ *
+ * @param state The gvd state.
+ * @param spec The spec of the VDEV the connection is for.
+ * @param sock The connection's socket.
+ * @param vdev_id The VDEV ID the connection is for.
+ * @return 0 if the connection was handed off, or a negative value if nobody claimed the spec or the process which did couldn't take it.
+ */
+int ctl_handoff(state_t* state, char const* spec, int sock, uint64_t vdev_id);
+
+/**
+ * Queue ATTACH and DETACH messages for subscribers for the difference between the old and new VDEVs of a node.
+ *
+ * This may be called from any thread; the messages are sent from the event loop (see {@link ctl_events}).
+ *
+ * @param state The gvd state.
+ * @param old_ent The node's previous entry, or NULL if it's new.
+ * @param new_ent The node's new entry, or NULL if it's gone.
+ */
+void ctl_vdevs_changed(state_t* state, gv_node_ent_t const* old_ent, gv_node_ent_t const* new_ent);
+
+/**
+ * Update the spec index with the queued ATTACH and DETACH messages and send them to subscribers.
+ *
+ * This is called from the event loop whenever it's woken up by {@link ctl_vdevs_changed}.
+ *
+ * @param state The gvd state.
+ */
+void ctl_events(state_t* state);
+
+/**
+ * Close and remove the control socket.
+ *
+ * @param state The gvd state.
+ */
+void ctl_free(state_t* state);
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,27 +19,241 @@
 
 #include <arpa/inet.h>
 
-static void write_nodes(state_t* state) {
-	LOG_V(state->elp_cls, "Writing nodes to %s.", gv_get_nodes_path());
-	FILE* const f = fopen(gv_get_nodes_path(), "w");
+/**
+ * Magic number at the start of the node cache, which also changes whenever its layout does.
+ */
+#define NODE_CACHE_MAGIC 0x32434E47 // "GNC2".
+
+/**
+ * Header of the node cache.
+ *
+ * The node cache is where we keep the last nodes we knew about and their VDEVs across restarts, so that they can be made available again straight away rather than only once they've each been queried again.
+ * This is followed by as many node entries as there are in the nodes file, each preceded by a {@link node_cache_ent_t}.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+
+	/**
+	 * Size of VDEV descriptors, so that we don't load a cache written by a version of gvd with a different `kos_vdev_descr_t`.
+	 */
+	uint32_t vdev_descr_size;
+} node_cache_header_t;
+
+/**
+ * What precedes each node entry in the node cache.
+ *
+ * When we query the node again, this lets it only send us what changed since.
+ */
+typedef struct __attribute__((packed)) {
+	uint64_t unique;
+	uint64_t vdevs_vers;
+} node_cache_ent_t;
+
+/**
+ * Get the path to the node cache.
+ *
+ * This value can be set with the GV_NODE_CACHE_PATH environment variable.
+ */
+static char const* get_node_cache_path(void) {
+	char const* const env = getenv("GV_NODE_CACHE_PATH");
+
+	if (env == NULL) {
+		return "/tmp/gv.node_cache";
+	}
+
+	return env;
+}
+
+static void write_node_cache(state_t* state) {
+	char const* const path = get_node_cache_path();
+
+	// Write to a temporary file first, so that we never leave a half-written cache behind if we go down while writing it.
+
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+
+	FILE* const f = fopen(tmp_path, "w");
 
 	if (f == NULL) {
-		LOG_E(state->elp_cls, "fopen: %s", strerror(errno));
-		exit(EXIT_FAILURE); // XXX
+		LOG_W(state->elp_cls, "Couldn't write node cache: fopen(\"%s\"): %s", tmp_path, strerror(errno));
+		return;
 	}
 
-	for (size_t i = 0; i < state->node_count; i++) {
-		node_t* const node = &state->nodes[i];
+	node_cache_header_t const header = {
+		.magic = NODE_CACHE_MAGIC,
+		.vdev_descr_size = sizeof(kos_vdev_descr_t),
+	};
+
+	bool ok = fwrite(&header, sizeof header, 1, f) == 1;
+
+	for (size_t i = 0; ok && i < state->node_count; i++) {
+		node_t const* const node = &state->nodes[i];
 
 		if (!node->slot_used) {
 			continue;
 		}
 
-		fwrite(node->ent, node->ent_bytes, 1, f);
+		node_cache_ent_t const cache_ent = {
+			.unique = node->unique,
+			.vdevs_vers = node->vdevs_vers,
+		};
+
+		ok = fwrite(&cache_ent, sizeof cache_ent, 1, f) == 1 && fwrite(node->ent, node->ent_bytes, 1, f) == 1;
 	}
 
-	fclose(f);
-	LOG_V(state->elp_cls, "Wrote %zu nodes to %s.", state->node_count, gv_get_nodes_path());
+	if (fclose(f) != 0 || !ok) {
+		LOG_W(state->elp_cls, "Couldn't write node cache to %s.", tmp_path);
+		unlink(tmp_path);
+		return;
+	}
+
+	if (rename(tmp_path, path) < 0) {
+		LOG_W(state->elp_cls, "Couldn't write node cache: rename: %s", strerror(errno));
+		unlink(tmp_path);
+	}
+}
+
+static void write_nodes(state_t* state) {
+	node_publish(state);
+	write_node_cache(state);
+}
+
+/**
+ * Set a node's VDEVs, taking ownership of them, and tell subscribers about any which changed.
+ */
+static void set_node_vdevs(state_t* state, node_t* node, size_t vdev_count, kos_vdev_descr_t* vdevs) {
+	size_t const vdevs_bytes = vdev_count * sizeof *vdevs;
+	gv_node_ent_t* const old_ent = node->ent;
+
+	node->ent_bytes = sizeof(gv_node_ent_t) + vdevs_bytes;
+	node->ent = calloc(1, node->ent_bytes);
+	assert(node->ent != NULL);
+
+	node->ent->host_id = node->host;
+	node->ent->ip.v4 = node->addr.sin_addr.s_addr;
+	node->ent->vdev_count = vdev_count;
+	memcpy(node->ent->vdevs, vdevs, vdevs_bytes);
+	free(vdevs);
+
+	ctl_vdevs_changed(state, old_ent, node->ent);
+	free(old_ent);
+}
+
+/**
+ * Apply a delta we got from querying a node to the VDEVs we already know it has, taking ownership of the delta's VDEVs and removed VDEV IDs.
+ *
+ * @return The node's VDEVs as of the delta, the number of which is written to `vdev_count_ref`.
+ */
+static kos_vdev_descr_t* apply_delta(node_t const* node, queried_t* queried, size_t* vdev_count_ref) {
+	size_t const max = node->ent->vdev_count + queried->vdev_count;
+	kos_vdev_descr_t* const vdevs = malloc(max * sizeof *vdevs);
+	assert(max == 0 || vdevs != NULL);
+
+	// Keep the VDEVs which were neither removed nor changed, and then add those which were added or changed.
+
+	size_t count = 0;
+
+	for (size_t i = 0; i < node->ent->vdev_count; i++) {
+		kos_vdev_descr_t const* const vdev = &node->ent->vdevs[i];
+		bool keep = true;
+
+		for (size_t j = 0; keep && j < queried->removed_count; j++) {
+			keep = queried->removed[j] != vdev->vdev_id;
+		}
+
+		for (size_t j = 0; keep && j < queried->vdev_count; j++) {
+			keep = queried->vdevs[j].vdev_id != vdev->vdev_id;
+		}
+
+		if (keep) {
+			vdevs[count++] = *vdev;
+		}
+	}
+
+	memcpy(vdevs + count, queried->vdevs, queried->vdev_count * sizeof *vdevs);
+	count += queried->vdev_count;
+
+	free(queried->vdevs);
+	free(queried->removed);
+
+	*vdev_count_ref = count;
+	return vdevs;
+}
+
+int elp_queried(state_t* state, uint64_t host, struct sockaddr_in const* addr, queried_t* queried) {
+	pthread_mutex_lock(&state->nodes_mutex);
+
+	node_t* node = node_find(state, host);
+
+	// A delta is only any good if we still have the VDEVs it's from, which we might not anymore (e.g. if the node went away in the meantime).
+
+	if (queried->delta && (node == NULL || node->ent == NULL || node->unique != queried->since_unique || node->vdevs_vers != queried->since_vers)) {
+		LOG_W(state->elp_cls, "Got changes to the VDEVs of node with host ID 0x%" PRIx64 " from a version of them we don't know about anymore.", host);
+		pthread_mutex_unlock(&state->nodes_mutex);
+
+		free(queried->vdevs);
+		free(queried->removed);
+
+		return -1;
+	}
+
+	// If none of the node's VDEVs changed, there's nothing to tell KOSs about, but the node cache still has to know about the node's new VDEV set version.
+
+	bool const vdevs_changed = node == NULL || !queried->delta || queried->vdev_count > 0 || queried->removed_count > 0 || node->addr.sin_addr.s_addr != addr->sin_addr.s_addr;
+	bool const vers_changed = node == NULL || node->unique != queried->unique || node->vdevs_vers != queried->vdevs_vers;
+
+	char const* const verb = node == NULL ? "Found new" : node->cached ? "Revalidated cached" : "Updated";
+
+	if (node == NULL) {
+		LOG_V(state->elp_cls, "No matching node found, creating a new one.");
+		node = node_add(state, host);
+	}
+
+	else {
+		node_touch(state, node);
+	}
+
+	size_t vdev_count = queried->vdev_count;
+	kos_vdev_descr_t* vdevs = queried->vdevs;
+
+	if (queried->delta) {
+		LOG_V(state->elp_cls, "Got %zu added or changed and %zu removed VDEVs.", queried->vdev_count, queried->removed_count);
+		vdevs = apply_delta(node, queried, &vdev_count);
+	}
+
+	else {
+		free(queried->removed);
+	}
+
+	LOG_I(
+		state->elp_cls,
+		"%s node with host ID 0x%" PRIx64 " (at %s) with %zu VDEVs.",
+		verb,
+		host,
+		inet_ntoa(addr->sin_addr),
+		vdev_count
+	);
+
+	node->cached = false;
+	node->unique = queried->unique;
+	node->vdevs_vers = queried->vdevs_vers;
+	node->addr = *addr;
+
+	if (vdevs_changed) {
+		set_node_vdevs(state, node, vdev_count, vdevs);
+		write_nodes(state);
+	}
+
+	else {
+		free(vdevs);
+
+		if (vers_changed) {
+			write_node_cache(state);
+		}
+	}
+
+	pthread_mutex_unlock(&state->nodes_mutex);
+	return 0;
 }
 
 static void* elp_sender(void* arg) {
@@ -46,14 +261,17 @@ static void* elp_sender(void* arg) {
 
 	LOG_V(state->elp_cls, "Building ELP packet and address info.");
 
-	srand(time(NULL));
-
 	gv_packet_t const packet = {
-		.header.type = GV_PACKET_TYPE_ELP,
-		.elp.unique = rand(),
+		.header = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_ELP,
+			.len = sizeof(gv_elp_t),
+		},
+		.elp.unique = state->unique,
 		.elp.vers = GV_ELP_VERS,
 		.elp.host_id = state->host_id,
 		.elp.name = "TODO",
+		.elp.vdevs_vers = state->vdevs_vers,
 	};
 
 	size_t const packet_size = sizeof packet.header + sizeof packet.elp;
@@ -64,7 +282,10 @@ static void* elp_sender(void* arg) {
 		.sin_addr.s_addr = sockaddr_to_in_addr(state->found_ipv4->ifa_broadaddr),
 	};
 
-	for (;;) {
+	pthread_mutex_lock(&state->elp_mutex);
+
+	while (!state->elp_stop) {
+		pthread_mutex_unlock(&state->elp_mutex);
 		LOG_V(state->elp_cls, "Broadcasting ELP packet.");
 
 		if (sendto(state->elp_sock, &packet, packet_size, 0, (struct sockaddr*) &addr, sizeof addr) != sizeof packet) {
@@ -72,31 +293,31 @@ static void* elp_sender(void* arg) {
 			exit(EXIT_FAILURE); // XXX
 		}
 
-		LOG_V(state->elp_cls, "Decrementing TTL of all known nodes.");
+		LOG_V(state->elp_cls, "Expiring nodes whose TTL has run out.");
 		pthread_mutex_lock(&state->nodes_mutex);
 
-		for (size_t i = 0; i < state->node_count; i++) {
-			node_t* const node = &state->nodes[i];
-
-			if (!node->slot_used) {
-				continue;
-			}
-
-			node->ttl -= ELP_DELAY;
-
-			if (node->ttl <= 0) {
-				LOG_I(state->elp_cls, "Node with host ID 0x%" PRIx64 " is considered dead.", node->host);
-				node->slot_used = false;
-				write_nodes(state);
-			}
+		if (node_tick(state) > 0) {
+			write_nodes(state);
 		}
 
 		pthread_mutex_unlock(&state->nodes_mutex);
 
+		// Wait on the condition variable rather than sleeping, so that elp_free() can wake us up straight away.
+
 		LOG_V(state->elp_cls, "Waiting for %d seconds before sending the next ELP packet.", ELP_DELAY);
-		sleep(ELP_DELAY);
+
+		struct timespec const until = {
+			.tv_sec = time(NULL) + ELP_DELAY,
+		};
+
+		pthread_mutex_lock(&state->elp_mutex);
+
+		if (!state->elp_stop) {
+			pthread_cond_timedwait(&state->elp_cond, &state->elp_mutex, &until);
+		}
 	}
 
+	pthread_mutex_unlock(&state->elp_mutex);
 	return NULL;
 }
 
@@ -116,6 +337,16 @@ static void* elp_listener(void* arg) {
 		gv_packet_t buf;
 		ssize_t const len = recvfrom(state->elp_sock, &buf, sizeof buf, MSG_WAITALL, (struct sockaddr*) &recv_addr, &recv_addr_len);
 
+		// elp_free() shuts the socket down to unblock us when stopping, at which point recvfrom() returns 0 or fails.
+
+		pthread_mutex_lock(&state->elp_mutex);
+		bool const stop = state->elp_stop;
+		pthread_mutex_unlock(&state->elp_mutex);
+
+		if (stop) {
+			break;
+		}
+
 		if (len < 0) {
 			LOG_E(state->elp_cls, "recvfrom: %s", strerror(errno));
 			exit(EXIT_FAILURE); // XXX
@@ -125,6 +356,11 @@ static void* elp_listener(void* arg) {
 			continue;
 		}
 
+		if ((size_t) len < sizeof buf.header || buf.header.vers != GV_PROTO_VERS) {
+			LOG_W(state->elp_cls, "Received packet with unsupported protocol version. Ignoring.");
+			continue;
+		}
+
 		if (buf.header.type != GV_PACKET_TYPE_ELP) {
 			LOG_W(state->elp_cls, "Received unknown packet type %d of length %zu. Ignoring.", buf.header.type, len);
 			continue;
@@ -156,106 +392,103 @@ static void* elp_listener(void* arg) {
 			LOG_W(state->elp_cls, "Host ID of node is the same as ours (0x%" PRIx64 ")!", state->host_id);
 		}
 
-		pthread_mutex_lock(&state->nodes_mutex);
-		node_t* found = NULL;
-		bool unique_changed = false;
-
-		for (size_t i = 0; i < state->node_count; i++) {
-			node_t* const node = &state->nodes[i];
-
-			if (!node->slot_used) {
-				found = node;
-				continue;
-			}
-
-			if (node->host == buf.elp.host_id) {
-				node->ttl = NODE_TTL;
-
-				if (node->unique == buf.elp.unique) {
-					LOG_V(state->elp_cls, "Is existing node and unique has not changed.", node->host);
-					goto nodes_mutex_unlock;
-				}
+		// If we already know about this node, refresh its TTL.
+		// Unless its unique or VDEV set version has changed since (or we only know about it from the node cache), there's nothing else to do.
+		// Otherwise, have it queried in the background; we keep on serving what we know about it in the meantime.
 
-				unique_changed = true;
-				found = node;
+		pthread_mutex_lock(&state->nodes_mutex);
+		node_t* const node = node_find(state, buf.elp.host_id);
+		bool up_to_date = false;
 
-				break;
-			}
+		if (node != NULL) {
+			node_touch(state, node);
+			up_to_date = node->unique == buf.elp.unique && node->vdevs_vers == buf.elp.vdevs_vers && !node->cached;
 		}
 
-		// We know we're going to have to fill in the node data by this point.
-		// Before we do anything, query a list of VDEV's from the node.
-		// We can release the lock here as decrementing TTLs and changing the node list don't have to be done atomically.
-
-		LOG_V(state->elp_cls, "Querying VDEVs from node.");
-
 		pthread_mutex_unlock(&state->nodes_mutex);
 
-		size_t vdev_count;
-		kos_vdev_descr_t* vdevs;
-
-		if (query(state, recv_addr.sin_addr.s_addr, &vdev_count, &vdevs) < 0) {
-			LOG_E(state->elp_cls, "Failed to query VDEVs.");
-			goto nodes_mutex_unlock;
+		if (up_to_date) {
+			LOG_V(state->elp_cls, "Is existing node and neither unique nor VDEV set version have changed.");
+			continue;
 		}
 
-		pthread_mutex_lock(&state->nodes_mutex);
-
-		// If we didn't find an empty slot or a matching host ID, create a new node.
+		LOG_V(state->elp_cls, "Queuing node to be queried.");
+		query_enqueue(state, buf.elp.host_id, buf.elp.unique, buf.elp.vdevs_vers, &recv_addr);
+	}
 
-		if (found == NULL) {
-			LOG_V(state->elp_cls, "No matching node found, creating a new one.");
+	return NULL;
+}
 
-			state->nodes = realloc(state->nodes, ++state->node_count * sizeof *state->nodes);
-			assert(state->nodes != NULL);
-			found = &state->nodes[state->node_count - 1];
-		}
+/**
+ * Load the nodes we knew about last time we were running from the node cache.
+ *
+ * These are made available straight away, and are queried again the next time we get an ELP from them (for what changed since, if anything).
+ * Those we don't get an ELP from in time are considered dead as usual.
+ */
+static void load_node_cache(state_t* state) {
+	char const* const path = get_node_cache_path();
+	FILE* const f = fopen(path, "r");
 
-		// Fill in the node information.
+	if (f == NULL) {
+		LOG_V(state->elp_cls, "No node cache at %s: %s", path, strerror(errno));
+		return;
+	}
 
-		char const* const verb = unique_changed ? "Updated" : "Found new";
+	node_cache_header_t header;
 
-		LOG_I(
-			state->elp_cls,
-			"%s node with host ID 0x%" PRIx64 " (at %s) with %zu VDEVs.",
-			verb,
-			buf.elp.host_id,
-			inet_ntoa(recv_addr.sin_addr),
-			vdev_count
-		);
+	if (fread(&header, sizeof header, 1, f) != 1 || header.magic != NODE_CACHE_MAGIC || header.vdev_descr_size != sizeof(kos_vdev_descr_t)) {
+		LOG_W(state->elp_cls, "Ignoring node cache at %s, as it was written by an incompatible version of gvd.", path);
+		goto done;
+	}
 
-		found->slot_used = true;
-		found->unique = buf.elp.unique;
-		found->host = buf.elp.host_id;
-		found->addr = recv_addr;
-		found->ttl = NODE_TTL;
+	node_cache_ent_t cache_ent;
+	gv_node_ent_t ent;
 
-		// Create node entry for writing out to file (for IPC).
+	while (fread(&cache_ent, sizeof cache_ent, 1, f) == 1 && fread(&ent, sizeof ent, 1, f) == 1) {
+		kos_vdev_descr_t* const vdevs = malloc(ent.vdev_count * sizeof *vdevs);
+		assert(ent.vdev_count == 0 || vdevs != NULL);
 
-		size_t const vdevs_bytes = vdev_count * sizeof *vdevs;
-		found->ent_bytes = sizeof(gv_node_ent_t) + vdevs_bytes;
-		found->ent = calloc(1, found->ent_bytes);
-		assert(found->ent != NULL);
+		if (fread(vdevs, sizeof *vdevs, ent.vdev_count, f) != ent.vdev_count) {
+			LOG_W(state->elp_cls, "Node cache at %s is truncated.", path);
+			free(vdevs);
+			break;
+		}
 
-		found->ent->host_id = found->host;
-		found->ent->ip.v4 = found->addr.sin_addr.s_addr;
-		found->ent->vdev_count = vdev_count;
-		memcpy(found->ent->vdevs, vdevs, vdevs_bytes);
-		free(vdevs);
+		if (node_find(state, ent.host_id) != NULL) {
+			LOG_W(state->elp_cls, "Node with host ID 0x%" PRIx64 " is in the node cache more than once.", ent.host_id);
+			free(vdevs);
+			continue;
+		}
 
-		write_nodes(state);
+		node_t* const node = node_add(state, ent.host_id);
 
-nodes_mutex_unlock:
+		node->cached = true;
+		node->unique = cache_ent.unique;
+		node->vdevs_vers = cache_ent.vdevs_vers;
+		node->addr = (struct sockaddr_in) {
+			.sin_family = AF_INET,
+			.sin_port = htons(GV_PORT),
+			.sin_addr.s_addr = ent.ip.v4,
+		};
 
-		pthread_mutex_unlock(&state->nodes_mutex);
+		set_node_vdevs(state, node, ent.vdev_count, vdevs);
 	}
 
-	return NULL;
+	LOG_I(state->elp_cls, "Loaded %zu nodes from node cache at %s.", state->node_live_count, path);
+	write_nodes(state);
+
+done:
+
+	fclose(f);
 }
 
 int elp(state_t* state) {
-	state->nodes = NULL;
-	state->node_count = 0;
+	node_table_init(state);
+
+	if (node_segment_init(state) < 0) {
+		LOG_F(state->elp_cls, "Failed to create nodes segment.");
+		return -1;
+	}
 
 	state->elp_threads_started = false;
 
@@ -289,7 +522,22 @@ int elp(state_t* state) {
 	LOG_I(state->elp_cls, "ELP socket bound to port 0x%x.", GV_ELP_PORT);
 	LOG_V(state->elp_cls, "Starting ELP sender and listener threads.");
 
+	// Pick a new unique, so that other nodes know to query us again.
+
+	srand(time(NULL));
+	state->unique = rand();
+
 	pthread_mutex_init(&state->nodes_mutex, NULL);
+	load_node_cache(state);
+
+	if (query_start(state) < 0) {
+		LOG_F(state->elp_cls, "Failed to start query workers.");
+		return -1;
+	}
+
+	state->elp_stop = false;
+	pthread_mutex_init(&state->elp_mutex, NULL);
+	pthread_cond_init(&state->elp_cond, NULL);
 
 	pthread_create(&state->elp_sender_thread, NULL, elp_sender, state);
 	pthread_create(&state->elp_listener_thread, NULL, elp_listener, state);
@@ -305,22 +553,30 @@ void elp_free(state_t* state) {
 	LOG_V(state->elp_cls, "Stopping ELP subsystem.");
 
 	if (state->elp_threads_started) {
+		query_free(state);
+
+		pthread_mutex_lock(&state->elp_mutex);
+		state->elp_stop = true;
+		pthread_cond_broadcast(&state->elp_cond);
+		pthread_mutex_unlock(&state->elp_mutex);
+
+		// The listener is blocked in recvfrom(), and shutting the socket down is what gets it to return.
+		// On a UDP socket this fails with ENOTCONN on some systems while still waking the listener up, so don't bother checking.
+
+		shutdown(state->elp_sock, SHUT_RDWR);
+
 		pthread_join(state->elp_sender_thread, NULL);
 		pthread_join(state->elp_listener_thread, NULL);
+
+		pthread_cond_destroy(&state->elp_cond);
+		pthread_mutex_destroy(&state->elp_mutex);
 	}
 
 	if (state->elp_sock >= 0) {
 		close(state->elp_sock);
 	}
 
-	if (state->nodes != NULL) {
-		for (size_t i = 0; i < state->node_count; i++) {
-			free(state->nodes[i].ent);
-		}
-
-		free(state->nodes);
-	}
-
+	node_table_free(state);
 	pthread_mutex_destroy(&state->nodes_mutex);
 
 	LOG_V(state->elp_cls, "ELP subsystem stopped successfully.");
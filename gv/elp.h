@@ -4,6 +4,18 @@
 #pragma once
 
 #include "gv.h"
+#include "query.h"
 
 int elp(state_t* state);
 void elp_free(state_t* state);
+
+/**
+ * Update what we know about a node once it's been queried.
+ *
+ * @param state The gvd state.
+ * @param host The node's host ID.
+ * @param addr The node's address.
+ * @param queried What we got from querying the node, whose VDEVs and removed VDEV IDs this takes ownership of.
+ * @return 0 on success, or a negative value if this is a delta from VDEVs we don't know about anymore (in which case the node must be queried again).
+ */
+int elp_queried(state_t* state, uint64_t host, struct sockaddr_in const* addr, queried_t* queried);
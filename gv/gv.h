@@ -4,6 +4,10 @@
 #pragma once
 
 #include "conn.h"
+#include "ctl.h"
+#include "node.h"
+#include "pool.h"
+#include "session.h"
 
 #include <aqua/gv_ipc.h>
 #include <aqua/kos.h>
@@ -12,6 +16,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <ifaddrs.h>
 #include <netinet/in.h>
@@ -22,16 +27,31 @@
 
 _Static_assert(sizeof(in_addr_t) == sizeof(uint32_t), "in_addr_t is not 32 bits long.");
 
+/**
+ * A node which needs querying, either because it's new or because its `unique` or VDEV set version changed (see query.h).
+ */
 typedef struct {
-	bool slot_used;
-	uint64_t unique;
 	uint64_t host;
+	uint64_t unique;
+	uint64_t vdevs_vers;
 	struct sockaddr_in addr;
-	int32_t ttl; // In seconds.
 
-	size_t ent_bytes;
-	gv_node_ent_t* ent;
-} node_t;
+	/**
+	 * When we last got an ELP from the node, so that we can give up on nodes which have gone away.
+	 */
+	time_t last_seen;
+
+	/**
+	 * When to try querying the node next, and how many times we've tried so far.
+	 */
+	time_t next_attempt;
+	unsigned attempts;
+
+	/**
+	 * Whether a worker is querying the node right now.
+	 */
+	bool running;
+} query_job_t;
 
 typedef struct state_t state_t;
 
@@ -45,18 +65,62 @@ struct state_t {
 	int elp_sock;
 
 	bool elp_threads_started;
+	pthread_mutex_t elp_mutex;
+	pthread_cond_t elp_cond;
+	bool elp_stop;
 	pthread_t elp_sender_thread;
 	pthread_t elp_listener_thread;
 
 	kos_vdev_descr_t* vdevs;
 	size_t vdev_count;
 
+	uint64_t unique; // Sent in our ELPs, and picked again whenever we restart.
+	uint64_t vdevs_vers; // Version of our set of VDEVs (see gv_elp_t).
+
 	pthread_mutex_t nodes_mutex;
-	size_t node_count;
+	size_t node_count; // Including unused slots.
+	size_t node_live_count;
 	node_t* nodes;
-
-	size_t connection_count;
-	conn_t* connections;
+	size_t node_free;
+	unsigned node_bucket_bits;
+	size_t* node_buckets;
+	uint64_t node_now; // In ticks of ELP_DELAY seconds.
+	size_t node_wheel[NODE_WHEEL_LEVELS][NODE_WHEEL_SLOTS];
+
+	int node_segment_fd;
+	gv_nodes_t* node_segment;
+	size_t node_segment_size;
+
+	pthread_mutex_t query_mutex;
+	pthread_cond_t query_cond;
+	bool query_stop;
+	size_t query_job_count;
+	query_job_t* query_jobs;
+	size_t query_worker_count;
+	pthread_t* query_workers;
+
+	int loop;
+	size_t conn_count;
+	conn_t* dead_conns;
+
+	size_t pool_count;
+	pool_t* pools;
+
+	size_t session_count;
+	session_t* sessions;
+
+	int ctl_sock;
+	size_t reg_count;
+	reg_t* regs;
+	size_t sub_count;
+	sub_t* subs;
+	size_t spec_count;
+	spec_ent_t* specs;
+
+	pthread_mutex_t ctl_events_mutex;
+	size_t ctl_event_count;
+	gv_ctl_t* ctl_events;
+	int ctl_wake[2]; // Pipe the event loop is woken up on when there are events queued.
 
 	// Logging classes.
 
@@ -64,6 +128,9 @@ struct state_t {
 	umber_class_t const* listener_cls;
 	umber_class_t const* elp_cls;
 	umber_class_t const* query_cls;
+	umber_class_t const* pool_cls;
+	umber_class_t const* session_cls;
+	umber_class_t const* ctl_cls;
 };
 
 static inline in_addr_t sockaddr_to_in_addr(struct sockaddr* addr) {
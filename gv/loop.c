@@ -0,0 +1,113 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "loop.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#endif
+
+/**
+ * Maximum number of events we get from the kernel at once.
+ */
+#define LOOP_BATCH 256
+
+#if defined(__linux__)
+int loop_create(void) {
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+int loop_add(int loop, int fd, void* data) {
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = data,
+	};
+
+	return epoll_ctl(loop, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int loop_watch_write(int loop, int fd, void* data, bool write) {
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | (write ? EPOLLOUT : 0),
+		.data.ptr = data,
+	};
+
+	return epoll_ctl(loop, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void loop_del(int loop, int fd) {
+	epoll_ctl(loop, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int loop_wait(int loop, loop_ev_t* evs, size_t max) {
+	struct epoll_event kevs[LOOP_BATCH];
+	int const n = epoll_wait(loop, kevs, max < LOOP_BATCH ? max : LOOP_BATCH, -1);
+
+	for (int i = 0; i < n; i++) {
+		evs[i] = (loop_ev_t) {
+			.data = kevs[i].data.ptr,
+			.readable = kevs[i].events & EPOLLIN,
+			.writable = kevs[i].events & EPOLLOUT,
+			.hup = kevs[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR),
+		};
+	}
+
+	return n;
+}
+#else
+int loop_create(void) {
+	return kqueue();
+}
+
+int loop_add(int loop, int fd, void* data) {
+	struct kevent kev;
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+
+	return kevent(loop, &kev, 1, NULL, 0, NULL);
+}
+
+int loop_watch_write(int loop, int fd, void* data, bool write) {
+	struct kevent kev;
+	EV_SET(&kev, fd, EVFILT_WRITE, write ? EV_ADD : EV_DELETE, 0, 0, data);
+
+	return kevent(loop, &kev, 1, NULL, 0, NULL);
+}
+
+void loop_del(int loop, int fd) {
+	struct kevent kevs[2];
+
+	EV_SET(&kevs[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	EV_SET(&kevs[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+	// Deleting the write filter fails if it wasn't being watched, which is fine; kevent still applies the other change.
+
+	for (size_t i = 0; i < sizeof kevs / sizeof *kevs; i++) {
+		kevent(loop, &kevs[i], 1, NULL, 0, NULL);
+	}
+}
+
+int loop_wait(int loop, loop_ev_t* evs, size_t max) {
+	struct kevent kevs[LOOP_BATCH];
+	int const n = kevent(loop, NULL, 0, kevs, max < LOOP_BATCH ? max : LOOP_BATCH, NULL);
+
+	// Unlike epoll, kqueue reports reads and writes on the same file descriptor as separate events.
+
+	for (int i = 0; i < n; i++) {
+		evs[i] = (loop_ev_t) {
+			.data = kevs[i].udata,
+			.readable = kevs[i].filter == EVFILT_READ,
+			.writable = kevs[i].filter == EVFILT_WRITE,
+			.hup = kevs[i].flags & (EV_EOF | EV_ERROR),
+		};
+	}
+
+	return n;
+}
+#endif
@@ -0,0 +1,77 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Thin wrapper around epoll on Linux and kqueue elsewhere, which is all gvd needs to wait on many sockets at once from a single thread.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * An event on a file descriptor being watched by a loop.
+ */
+typedef struct {
+	/**
+	 * The data passed when the file descriptor was added to the loop.
+	 */
+	void* data;
+
+	bool readable;
+	bool writable;
+
+	/**
+	 * Whether the other end hung up or an error occurred.
+	 *
+	 * There may still be data to read.
+	 */
+	bool hup;
+} loop_ev_t;
+
+/**
+ * Create a loop.
+ *
+ * @return The loop's file descriptor, or -1 on error (with `errno` set).
+ */
+int loop_create(void);
+
+/**
+ * Start watching a file descriptor for readability.
+ *
+ * @param loop The loop.
+ * @param fd The file descriptor to watch.
+ * @param data Data returned in events for this file descriptor.
+ * @return 0 on success, or -1 on error (with `errno` set).
+ */
+int loop_add(int loop, int fd, void* data);
+
+/**
+ * Change whether a file descriptor is also watched for writability.
+ *
+ * @param loop The loop.
+ * @param fd The file descriptor, which must already be watched.
+ * @param data Data returned in events for this file descriptor.
+ * @param write Whether to watch for writability as well as readability.
+ * @return 0 on success, or -1 on error (with `errno` set).
+ */
+int loop_watch_write(int loop, int fd, void* data, bool write);
+
+/**
+ * Stop watching a file descriptor.
+ *
+ * This must be called before the file descriptor is closed, as epoll otherwise keeps watching the underlying socket for as long as any other process (such as a KOS agent we handed it off to) holds it.
+ *
+ * @param loop The loop.
+ * @param fd The file descriptor.
+ */
+void loop_del(int loop, int fd);
+
+/**
+ * Wait for events.
+ *
+ * @param loop The loop.
+ * @param evs Array to write events to.
+ * @param max Size of the array.
+ * @return Number of events written, or -1 on error (with `errno` set).
+ */
+int loop_wait(int loop, loop_ev_t* evs, size_t max);
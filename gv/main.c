@@ -3,8 +3,11 @@
 
 #include "aqua/kos.h"
 #include "conn.h"
+#include "ctl.h"
 #include "elp.h"
 #include "gv.h"
+#include "pool.h"
+#include "session.h"
 
 #include <aqua/gv_ipc.h>
 #include <aqua/gv_proto.h>
@@ -12,8 +15,9 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
-#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +30,18 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 
+/**
+ * Backlog of connections waiting to be accepted.
+ *
+ * This is large so that bursts of clients connecting at once aren't refused while the event loop is busy; the kernel clamps it to its own limit anyway (e.g. `somaxconn`).
+ */
+#define LISTEN_BACKLOG 4096
+
+/**
+ * Default number of KOS agents to keep ready for each spec passed with -w.
+ */
+#define DEFAULT_POOL_SIZE 2
+
 static void vdev_inventory_notif_cb(kos_notif_t const* notif, void* data) {
 	state_t* const state = data;
 
@@ -54,18 +70,41 @@ int main(int argc, char* argv[]) {
 	state.listener_cls = umber_class_new("aqua.gvd.listener", UMBER_LVL_VERBOSE, "GrapeVine daemon connection listener.");
 	state.elp_cls = umber_class_new("aqua.gvd.elp", UMBER_LVL_INFO, "GrapeVine daemon echolocation (ELP) subsystem.");
 	state.query_cls = umber_class_new("aqua.gvd.query", UMBER_LVL_INFO, "GrapeVine daemon query subsystem.");
+	state.pool_cls = umber_class_new("aqua.gvd.pool", UMBER_LVL_INFO, "GrapeVine daemon KOS agent pool.");
+	state.session_cls = umber_class_new("aqua.gvd.session", UMBER_LVL_INFO, "GrapeVine daemon KOS sessions.");
+	state.ctl_cls = umber_class_new("aqua.gvd.ctl", UMBER_LVL_INFO, "GrapeVine daemon control socket.");
+
+	// Connections (and pooled KOS agents) may go away while we're writing to them, which we'd rather just get an error for.
+
+	signal(SIGPIPE, SIG_IGN);
 
 	LOG_V(state.init_cls, "Parsing options.");
 
 	char* interface_name = NULL;
 
+	size_t pool_size = DEFAULT_POOL_SIZE;
+	size_t pool_spec_count = 0;
+	char const** pool_specs = NULL;
+
 	int c;
 
-	while ((c = getopt(argc, argv, "i:")) != -1) {
+	while ((c = getopt(argc, argv, "i:n:w:")) != -1) {
 		switch (c) {
 		case 'i':
 			LOG_V(state.init_cls, "Setting interface name to %s.", optarg);
 			interface_name = optarg;
+			break;
+		case 'n':
+			pool_size = strtoul(optarg, NULL, 0);
+			LOG_V(state.init_cls, "Setting KOS agent pool size to %zu.", pool_size);
+			break;
+		case 'w':
+			LOG_V(state.init_cls, "Keeping KOS agents ready for %s.", optarg);
+
+			pool_specs = realloc(pool_specs, (pool_spec_count + 1) * sizeof *pool_specs);
+			assert(pool_specs != NULL);
+			pool_specs[pool_spec_count++] = optarg;
+
 			break;
 		default:
 			LOG_F(state.init_cls, "Unknown option: %c", c);
@@ -199,6 +238,10 @@ int main(int argc, char* argv[]) {
 
 	LOG_I(state.init_cls, "Found and inventoried %zu VDEVs.", state.vdev_count);
 
+	// Our VDEVs don't change for as long as we're running, so this is the only version of them there'll be (see gv_elp_t).
+
+	state.vdevs_vers = 1;
+
 	LOG_V(state.init_cls, "Creating socket for TCP connections (binding to port 0x%x).", GV_PORT);
 
 	state.sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -221,6 +264,14 @@ int main(int argc, char* argv[]) {
 		goto err_bind;
 	}
 
+	// Local processes which handle connections to VDEVs of some spec themselves claim it over the control socket, and others subscribe to specs over it.
+	// The ELP subsystem may already report VDEVs to subscribers as soon as it starts, so this must be done first.
+
+	if (ctl_listen(&state) < 0) {
+		LOG_F(state.init_cls, "Failed to create control socket.");
+		goto err_ctl;
+	}
+
 	LOG_V(state.init_cls, "Start the echolocation (ELP) subsystem.");
 
 	if (elp(&state) < 0) {
@@ -230,89 +281,51 @@ int main(int argc, char* argv[]) {
 
 	LOG_V(state.init_cls, "Starting to listen for connections.");
 
-	if (listen(state.sock, 5) < 0) { // TODO What's a sane default for the backlog number? Should this be configurable?
+	// Accepting is done from the event loop, which must never block.
+
+	fcntl(state.sock, F_SETFL, fcntl(state.sock, F_GETFL) | O_NONBLOCK);
+	fcntl(state.sock, F_SETFD, FD_CLOEXEC);
+
+	if (listen(state.sock, LISTEN_BACKLOG) < 0) {
 		LOG_F(state.init_cls, "listen: %s", strerror(errno));
 		goto err_listen;
 	}
 
-	// Wait for connections.
-
-	LOG_I(state.init_cls, "GrapeVine daemon bound to port 0x%x and listening for connections.", GV_PORT);
-
-	state.connection_count = 0;
-	state.connections = NULL;
+	// Get KOS agents ready for the specs we expect connections for, so that connecting to their VDEVs doesn't have to wait for a KOS agent to start up from scratch.
 
-	for (;;) {
-		conn_t conn;
+	state.pool_count = 0;
+	state.pools = NULL;
 
-		LOG_V(state.listener_cls, "Waiting for new connection.");
+	state.session_count = 0;
+	state.sessions = NULL;
 
-		conn.state = &state;
-		conn.sock = accept(state.sock, (struct sockaddr*) &conn.addr, &conn.addr_len);
-
-		if (conn.sock < 0) {
-			LOG_F(state.listener_cls, "accept: %s", strerror(errno));
-			goto err_accept;
-		}
-
-		LOG_I(
-			state.listener_cls,
-			"Accepted connection from %s:0x%x (host %" PRIx64 ").",
-			inet_ntoa(conn.addr.sin_addr),
-			ntohs(conn.addr.sin_port),
-			sockaddr_to_mac((struct sockaddr*) &conn.addr)
-		);
-
-		LOG_V(state.listener_cls, "Finding/creating slot for connection.");
-
-		conn_t* slot = NULL;
-
-		for (size_t i = 0; i < state.connection_count; i++) {
-			slot = &state.connections[i];
-
-			if (!slot->slot_used) {
-				break;
-			}
-		}
-
-		if (slot == NULL) {
-			state.connections = realloc(state.connections, ++state.connection_count * sizeof *state.connections);
-			assert(state.connections != NULL);
-			slot = &state.connections[state.connection_count - 1];
-		}
+	for (size_t i = 0; i < pool_spec_count; i++) {
+		pool_create(&state, pool_specs[i], pool_size);
+	}
 
-		*slot = conn;
-		slot->slot_used = true;
+	// Handle all connections from a single event loop.
+	// This only ever returns if we're asked to stop or something went irrecoverably wrong.
 
-		LOG_V(state.listener_cls, "Starting connection thread.");
+	LOG_I(state.init_cls, "GrapeVine daemon bound to port 0x%x and listening for connections.", GV_PORT);
 
-		pthread_create(&slot->thread, NULL, conn_thread, slot);
+	if (conn_loop(&state) < 0) {
+		goto err_loop;
 	}
 
 	rv = EXIT_SUCCESS;
 	LOG_I(state.init_cls, "GrapeVine daemon is shutting down gracefully.");
 
-err_accept:
-
-	LOG_V(state.init_cls, "Joining all connection threads.");
-
-	if (state.connections != NULL) {
-		for (size_t i = 0; i < state.connection_count; i++) {
-			conn_t* const conn = &state.connections[i];
-
-			if (conn->slot_used) {
-				pthread_join(conn->thread, NULL);
-			}
-		}
-
-		free(state.connections);
-	}
+err_loop:
 
+	session_free(&state);
+	pool_free(&state);
 err_listen:
 err_elp:
 
 	elp_free(&state);
+	ctl_free(&state);
 
+err_ctl:
 err_bind:
 
 	close(state.sock);
@@ -337,6 +350,8 @@ err_getifaddrs:
 err_lock:
 err_getopt:
 
+	free(pool_specs);
+
 	LOG_V(state.init_cls, "GrapeVine daemon finished with status %d.", rv);
 
 	return rv;
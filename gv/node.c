@@ -0,0 +1,408 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#if defined(__linux__)
+# define _POSIX_C_SOURCE 200809L // For ftruncate() and pread().
+#endif
+
+#include "node.h"
+#include "gv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Number of bits of the hash used to pick a bucket when the table is first created.
+ */
+#define NODE_BUCKET_BITS_MIN 4
+
+/**
+ * Size of the nodes segment when it's first created, in bytes.
+ */
+#define NODE_SEGMENT_SIZE_MIN (64 * 1024)
+
+static size_t bucket_of(state_t const* state, uint64_t host) {
+	return gv_host_id_hash(host) >> (64 - state->node_bucket_bits);
+}
+
+static void link_bucket(state_t* state, size_t i) {
+	size_t* const head = &state->node_buckets[bucket_of(state, state->nodes[i].host)];
+
+	state->nodes[i].bucket_next = *head;
+	*head = i;
+}
+
+static void unlink_bucket(state_t* state, size_t i) {
+	size_t* link = &state->node_buckets[bucket_of(state, state->nodes[i].host)];
+
+	while (*link != i) {
+		assert(*link != NODE_NONE);
+		link = &state->nodes[*link].bucket_next;
+	}
+
+	*link = state->nodes[i].bucket_next;
+}
+
+/**
+ * Double the number of buckets, so that there's never more than one node per bucket on average.
+ */
+static void grow_buckets(state_t* state) {
+	state->node_bucket_bits++;
+
+	size_t const bucket_count = (size_t) 1 << state->node_bucket_bits;
+	state->node_buckets = realloc(state->node_buckets, bucket_count * sizeof *state->node_buckets);
+	assert(state->node_buckets != NULL);
+
+	for (size_t i = 0; i < bucket_count; i++) {
+		state->node_buckets[i] = NODE_NONE;
+	}
+
+	for (size_t i = 0; i < state->node_count; i++) {
+		if (state->nodes[i].slot_used) {
+			link_bucket(state, i);
+		}
+	}
+}
+
+static void link_timer(state_t* state, size_t i) {
+	node_t* const node = &state->nodes[i];
+
+	// Nodes expiring within this level-0 turn go straight into the slot for their tick.
+	// Those expiring later go into the level-1 slot for their turn, and are moved down to level 0 when that turn comes (see node_tick()).
+
+	assert(node->expires >= state->node_now);
+
+	if (node->expires - state->node_now >= (uint64_t) NODE_WHEEL_SLOTS * NODE_WHEEL_SLOTS) {
+		node->expires = state->node_now + (uint64_t) NODE_WHEEL_SLOTS * NODE_WHEEL_SLOTS - 1;
+	}
+
+	node->timer_level = (node->expires >> NODE_WHEEL_BITS) == (state->node_now >> NODE_WHEEL_BITS) ? 0 : 1;
+	node->timer_slot = (node->expires >> (node->timer_level * NODE_WHEEL_BITS)) & (NODE_WHEEL_SLOTS - 1);
+
+	size_t* const head = &state->node_wheel[node->timer_level][node->timer_slot];
+
+	node->timer_prev = NODE_NONE;
+	node->timer_next = *head;
+
+	if (*head != NODE_NONE) {
+		state->nodes[*head].timer_prev = i;
+	}
+
+	*head = i;
+}
+
+static void unlink_timer(state_t* state, size_t i) {
+	node_t* const node = &state->nodes[i];
+
+	if (node->timer_prev == NODE_NONE) {
+		state->node_wheel[node->timer_level][node->timer_slot] = node->timer_next;
+	}
+
+	else {
+		state->nodes[node->timer_prev].timer_next = node->timer_next;
+	}
+
+	if (node->timer_next != NODE_NONE) {
+		state->nodes[node->timer_next].timer_prev = node->timer_prev;
+	}
+}
+
+void node_table_init(state_t* state) {
+	state->nodes = NULL;
+	state->node_count = 0;
+	state->node_live_count = 0;
+	state->node_free = NODE_NONE;
+
+	state->node_bucket_bits = NODE_BUCKET_BITS_MIN - 1;
+	state->node_buckets = NULL;
+	grow_buckets(state);
+
+	state->node_now = 0;
+
+	state->node_segment_fd = -1;
+	state->node_segment = NULL;
+	state->node_segment_size = 0;
+
+	for (size_t level = 0; level < NODE_WHEEL_LEVELS; level++) {
+		for (size_t slot = 0; slot < NODE_WHEEL_SLOTS; slot++) {
+			state->node_wheel[level][slot] = NODE_NONE;
+		}
+	}
+}
+
+node_t* node_find(state_t* state, uint64_t host) {
+	for (size_t i = state->node_buckets[bucket_of(state, host)]; i != NODE_NONE; i = state->nodes[i].bucket_next) {
+		if (state->nodes[i].host == host) {
+			return &state->nodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+node_t* node_add(state_t* state, uint64_t host) {
+	assert(node_find(state, host) == NULL);
+
+	// Reuse the slot of a dead node if there is one.
+
+	size_t i = state->node_free;
+
+	if (i != NODE_NONE) {
+		state->node_free = state->nodes[i].bucket_next;
+	}
+
+	else {
+		state->nodes = realloc(state->nodes, (state->node_count + 1) * sizeof *state->nodes);
+		assert(state->nodes != NULL);
+		i = state->node_count++;
+	}
+
+	node_t* const node = &state->nodes[i];
+
+	node->slot_used = true;
+	node->host = host;
+	node->ent_bytes = 0;
+	node->ent = NULL;
+	node->cached = false;
+
+	if (++state->node_live_count > ((size_t) 1 << state->node_bucket_bits)) {
+		grow_buckets(state); // This links the new node too.
+	}
+
+	else {
+		link_bucket(state, i);
+	}
+
+	node->expires = state->node_now + NODE_TTL / ELP_DELAY;
+	link_timer(state, i);
+
+	return node;
+}
+
+void node_touch(state_t* state, node_t* node) {
+	size_t const i = node - state->nodes;
+
+	unlink_timer(state, i);
+	node->expires = state->node_now + NODE_TTL / ELP_DELAY;
+	link_timer(state, i);
+}
+
+void node_remove(state_t* state, node_t* node) {
+	size_t const i = node - state->nodes;
+
+	unlink_bucket(state, i);
+	unlink_timer(state, i);
+
+	ctl_vdevs_changed(state, node->ent, NULL);
+	free(node->ent);
+	node->ent = NULL;
+	node->slot_used = false;
+
+	node->bucket_next = state->node_free;
+	state->node_free = i;
+	state->node_live_count--;
+}
+
+size_t node_tick(state_t* state) {
+	state->node_now++;
+
+	size_t const slot = state->node_now & (NODE_WHEEL_SLOTS - 1);
+
+	// At the start of each level-0 turn, move the nodes expiring during it down from level 1.
+
+	if (slot == 0) {
+		size_t const upper_slot = (state->node_now >> NODE_WHEEL_BITS) & (NODE_WHEEL_SLOTS - 1);
+		size_t i = state->node_wheel[1][upper_slot];
+
+		state->node_wheel[1][upper_slot] = NODE_NONE;
+
+		while (i != NODE_NONE) {
+			size_t const next = state->nodes[i].timer_next;
+			link_timer(state, i);
+			i = next;
+		}
+	}
+
+	size_t removed = 0;
+
+	while (state->node_wheel[0][slot] != NODE_NONE) {
+		node_t* const node = &state->nodes[state->node_wheel[0][slot]];
+		assert(node->expires == state->node_now);
+
+		LOG_I(state->elp_cls, "Node with host ID 0x%" PRIx64 " is considered dead.", node->host);
+
+		node_remove(state, node);
+		removed++;
+	}
+
+	return removed;
+}
+
+/**
+ * Grow the nodes segment (and our mapping of it) to at least a given size.
+ */
+static int grow_segment(state_t* state, size_t size) {
+	if (ftruncate(state->node_segment_fd, size) < 0) {
+		LOG_E(state->elp_cls, "ftruncate: %s", strerror(errno));
+		return -1;
+	}
+
+	void* const map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, state->node_segment_fd, 0);
+
+	if (map == MAP_FAILED) {
+		LOG_E(state->elp_cls, "mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	if (state->node_segment != NULL) {
+		munmap(state->node_segment, state->node_segment_size);
+	}
+
+	state->node_segment = map;
+	state->node_segment_size = size;
+
+	atomic_store_explicit(&state->node_segment->size, size, memory_order_release);
+	return 0;
+}
+
+int node_segment_init(state_t* state) {
+	char const* const path = gv_get_nodes_path();
+	LOG_V(state->elp_cls, "Mapping nodes segment at %s.", path);
+
+	state->node_segment_fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (state->node_segment_fd < 0) {
+		LOG_E(state->elp_cls, "open(\"%s\"): %s", path, strerror(errno));
+		return -1;
+	}
+
+	fcntl(state->node_segment_fd, F_SETFD, FD_CLOEXEC);
+
+	// Reuse the segment a previous instance left behind if we can, as KOSs may still have it mapped and would otherwise never see what we publish.
+	// We never shrink it, as that would pull the rug out from under these mappings.
+
+	struct stat st;
+
+	if (fstat(state->node_segment_fd, &st) < 0) {
+		LOG_E(state->elp_cls, "fstat: %s", strerror(errno));
+		goto err;
+	}
+
+	gv_nodes_t header = {0};
+	bool const reuse = (size_t) st.st_size >= sizeof header && pread(state->node_segment_fd, &header, sizeof header, 0) == sizeof header && header.magic == GV_NODES_MAGIC && header.vers == GV_NODES_VERS;
+
+	if (!reuse && ftruncate(state->node_segment_fd, 0) < 0) {
+		LOG_E(state->elp_cls, "ftruncate: %s", strerror(errno));
+		goto err;
+	}
+
+	size_t const size = reuse ? (size_t) st.st_size : NODE_SEGMENT_SIZE_MIN;
+
+	if (grow_segment(state, size) < 0) {
+		goto err;
+	}
+
+	gv_nodes_t* const seg = state->node_segment;
+
+	if (reuse) {
+		// If the previous instance went down while publishing, the sequence number is still odd; make it even again, as nobody else is going to.
+
+		uint64_t const seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+		atomic_store_explicit(&seg->seq, (seq | 1) + 1, memory_order_release);
+	}
+
+	else {
+		seg->magic = GV_NODES_MAGIC;
+		seg->vers = GV_NODES_VERS;
+		atomic_store_explicit(&seg->seq, 0, memory_order_relaxed);
+		seg->node_count = 0;
+		seg->ents_bytes = 0;
+	}
+
+	node_publish(state);
+	return 0;
+
+err:
+
+	close(state->node_segment_fd);
+	state->node_segment_fd = -1;
+
+	return -1;
+}
+
+void node_publish(state_t* state) {
+	size_t node_count = 0;
+	size_t ents_bytes = 0;
+
+	for (size_t i = 0; i < state->node_count; i++) {
+		node_t const* const node = &state->nodes[i];
+
+		if (node->slot_used && node->ent != NULL) {
+			node_count++;
+			ents_bytes += node->ent_bytes;
+		}
+	}
+
+	size_t const needed = sizeof(gv_nodes_t) + ents_bytes;
+
+	if (needed > state->node_segment_size) {
+		size_t size = state->node_segment_size;
+
+		while (size < needed) {
+			size *= 2;
+		}
+
+		if (grow_segment(state, size) < 0) {
+			LOG_E(state->elp_cls, "Failed to grow nodes segment to %zu bytes; KOSs won't see the latest nodes.", size);
+			return;
+		}
+	}
+
+	gv_nodes_t* const seg = state->node_segment;
+	uint64_t const seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	uint8_t* ent = (uint8_t*) (seg + 1);
+
+	for (size_t i = 0; i < state->node_count; i++) {
+		node_t const* const node = &state->nodes[i];
+
+		if (node->slot_used && node->ent != NULL) {
+			memcpy(ent, node->ent, node->ent_bytes);
+			ent += node->ent_bytes;
+		}
+	}
+
+	seg->node_count = node_count;
+	seg->ents_bytes = ents_bytes;
+
+	atomic_store_explicit(&seg->seq, seq + 2, memory_order_release);
+	LOG_V(state->elp_cls, "Published %zu nodes (%zu bytes).", node_count, ents_bytes);
+}
+
+void node_table_free(state_t* state) {
+	for (size_t i = 0; i < state->node_count; i++) {
+		free(state->nodes[i].ent);
+	}
+
+	free(state->nodes);
+	free(state->node_buckets);
+
+	if (state->node_segment != NULL) {
+		munmap(state->node_segment, state->node_segment_size);
+	}
+
+	if (state->node_segment_fd >= 0) {
+		close(state->node_segment_fd);
+	}
+}
@@ -0,0 +1,145 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Table of the nodes we know about, indexed by host ID, along with a timer wheel to expire those we haven't heard from in a while.
+// Both are intrusive and link nodes by their index in the table rather than by pointer, as the table is reallocated as it grows.
+
+#pragma once
+
+#include <aqua/gv_ipc.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+/**
+ * Index meaning "no node" in the links between nodes.
+ */
+#define NODE_NONE SIZE_MAX
+
+/**
+ * Number of levels of the timer wheel, and number of slots (ticks) in each level.
+ *
+ * Each level covers NODE_WHEEL_SLOTS times as many ticks as the one before it, so two levels cover NODE_WHEEL_SLOTS² ticks, which is way longer than any TTL we'd want.
+ */
+#define NODE_WHEEL_LEVELS 2
+#define NODE_WHEEL_BITS 6
+#define NODE_WHEEL_SLOTS (1 << NODE_WHEEL_BITS)
+
+typedef struct state_t state_t;
+
+typedef struct {
+	bool slot_used;
+	uint64_t unique;
+	uint64_t vdevs_vers;
+	uint64_t host;
+	struct sockaddr_in addr;
+
+	/**
+	 * Tick at which the node is to be considered dead, unless we get an ELP from it before then (see {@link node_touch}).
+	 */
+	uint64_t expires;
+
+	size_t ent_bytes;
+	gv_node_ent_t* ent;
+
+	/**
+	 * Whether this node was loaded from the node cache and hasn't been queried again since.
+	 */
+	bool cached;
+
+	/**
+	 * Next node in the same hash bucket, or in the list of free slots if this one isn't used.
+	 */
+	size_t bucket_next;
+
+	/**
+	 * Neighbouring nodes in the same timer wheel slot, and that slot.
+	 */
+	size_t timer_prev;
+	size_t timer_next;
+	uint8_t timer_level;
+	uint8_t timer_slot;
+} node_t;
+
+/**
+ * Initialize an empty node table.
+ *
+ * @param state The gvd state.
+ */
+void node_table_init(state_t* state);
+
+/**
+ * Find a node by host ID.
+ *
+ * @param state The gvd state.
+ * @param host The host ID.
+ * @return The node, or NULL if we don't know about any node with this host ID.
+ */
+node_t* node_find(state_t* state, uint64_t host);
+
+/**
+ * Add a node to the table.
+ *
+ * The node's TTL is started as if we had just gotten an ELP from it.
+ * This may move other nodes around in memory, so any pointer to them must be looked up again after this.
+ *
+ * @param state The gvd state.
+ * @param host The node's host ID, which mustn't already be in the table.
+ * @return The node, all of whose other fields are for the caller to fill in.
+ */
+node_t* node_add(state_t* state, uint64_t host);
+
+/**
+ * Restart a node's TTL, as we've just gotten an ELP from it.
+ *
+ * @param state The gvd state.
+ * @param node The node.
+ */
+void node_touch(state_t* state, node_t* node);
+
+/**
+ * Remove a node from the table, freeing its entry.
+ *
+ * Subscribers are told its VDEVs are gone (see {@link ctl_vdevs_changed}).
+ *
+ * @param state The gvd state.
+ * @param node The node.
+ */
+void node_remove(state_t* state, node_t* node);
+
+/**
+ * Advance the timer wheel by one tick, removing the nodes whose TTL has run out.
+ *
+ * This is called every ELP_DELAY seconds, and only ever looks at the nodes which are expiring.
+ *
+ * @param state The gvd state.
+ * @return The number of nodes which were removed.
+ */
+size_t node_tick(state_t* state);
+
+/**
+ * Create (or reuse) and map the nodes segment, which is where nodes and their VDEVs are published for KOSs to read (see {@link gv_nodes_t}).
+ *
+ * @param state The gvd state.
+ * @return 0 on success, or a negative value on failure.
+ */
+int node_segment_init(state_t* state);
+
+/**
+ * Publish all nodes and their VDEVs to the nodes segment.
+ *
+ * This updates the segment in place under its seqlock, so KOSs never see a half-written set of nodes.
+ *
+ * @param state The gvd state.
+ */
+void node_publish(state_t* state);
+
+/**
+ * Free the node table and all its nodes, and unmap the nodes segment.
+ *
+ * @param state The gvd state.
+ */
+void node_table_free(state_t* state);
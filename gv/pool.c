@@ -0,0 +1,210 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "pool.h"
+#include "conn.h"
+#include "gv.h"
+
+#include "agent/agent.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+int pool_spawn_agent(state_t* state, char const* spec, pool_agent_t* agent) {
+	agent->uds = -1;
+	agent->ready = false;
+
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		LOG_E(state->pool_cls, "socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	// Neither end may leak into other processes we spawn, or we'd never notice the agent going away.
+	// The agent's end is still passed on as fd 3, as dup2() clears the flag.
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	char* const path = "gv-agent";
+	char* const argv[] = {path, "-p", spec == NULL ? NULL : "-s", (char*) spec, NULL};
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 3);
+
+	extern char** environ;
+	int const rv = posix_spawnp(&agent->pid, path, &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (rv != 0) {
+		LOG_E(state->pool_cls, "posix_spawnp(\"%s\"): %s", path, strerror(rv));
+		close(fds[0]);
+		return -1;
+	}
+
+	LOG_V(state->pool_cls, "Spawned KOS agent (PID %d).", agent->pid);
+	agent->uds = fds[0];
+
+	return 0;
+}
+
+bool pool_agent_alive(pool_agent_t* agent) {
+	// Agents let us know they're ready by sending us a single byte, and don't send us anything else.
+
+	char byte;
+	ssize_t r;
+
+	while ((r = recv(agent->uds, &byte, 1, MSG_DONTWAIT)) == 1) {
+		agent->ready = true;
+	}
+
+	return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+void pool_agent_drop(pool_agent_t* agent) {
+	// Once it exits, the agent is reaped by the event loop (see conn_loop).
+
+	close(agent->uds);
+
+	agent->uds = -1;
+}
+
+int pool_agent_handoff(pool_agent_t const* agent, int sock, char const* spec, uint64_t vdev_id) {
+	gv_agent_handoff_t handoff = {
+		.vdev_id = vdev_id,
+	};
+
+	strncpy(handoff.spec, spec, sizeof handoff.spec - 1);
+	return send_sock(agent->uds, sock, &handoff, sizeof handoff);
+}
+
+static void replace_agent(state_t* state, pool_t* pool, pool_agent_t* agent) {
+	pool_agent_drop(agent);
+	pool_spawn_agent(state, pool->spec, agent);
+}
+
+/**
+ * Check if a pooled agent is ready to be handed a connection.
+ *
+ * Agents which have gone away are replaced.
+ */
+static bool agent_ready(state_t* state, pool_t* pool, pool_agent_t* agent) {
+	if (agent->uds < 0) {
+		// We failed to spawn an agent for this slot before, so try again now.
+
+		pool_spawn_agent(state, pool->spec, agent);
+		return false;
+	}
+
+	if (!pool_agent_alive(agent)) {
+		LOG_W(state->pool_cls, "Pooled KOS agent for %s (PID %d) went away. Replacing it.", pool->spec, agent->pid);
+		replace_agent(state, pool, agent);
+
+		return false;
+	}
+
+	return agent->ready;
+}
+
+void pool_create(state_t* state, char const* spec, size_t size) {
+	state->pools = realloc(state->pools, (state->pool_count + 1) * sizeof *state->pools);
+	assert(state->pools != NULL);
+
+	pool_t* const pool = &state->pools[state->pool_count++];
+
+	pool->spec = spec;
+	pool->agent_count = size;
+	pool->agents = calloc(size, sizeof *pool->agents);
+	assert(size == 0 || pool->agents != NULL);
+
+	LOG_I(state->pool_cls, "Keeping %zu KOS agents ready for %s.", size, spec);
+
+	for (size_t i = 0; i < size; i++) {
+		pool->agents[i].uds = -1;
+		pool_spawn_agent(state, spec, &pool->agents[i]);
+	}
+}
+
+int pool_take(state_t* state, char const* spec, pool_agent_t* agent_ref) {
+	pool_t* pool = NULL;
+
+	for (size_t i = 0; i < state->pool_count; i++) {
+		if (strcmp(state->pools[i].spec, spec) == 0) {
+			pool = &state->pools[i];
+			break;
+		}
+	}
+
+	if (pool == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < pool->agent_count; i++) {
+		pool_agent_t* const agent = &pool->agents[i];
+
+		if (!agent_ready(state, pool, agent)) {
+			continue;
+		}
+
+		LOG_V(state->pool_cls, "Taking pooled KOS agent for %s (PID %d).", spec, agent->pid);
+
+		// Get a new agent ready to take its place.
+
+		*agent_ref = *agent;
+		pool_spawn_agent(state, spec, agent);
+
+		return 0;
+	}
+
+	LOG_W(state->pool_cls, "No pooled KOS agent for %s is ready yet.", spec);
+	return -1;
+}
+
+int pool_handoff(state_t* state, char const* spec, int sock, uint64_t vdev_id) {
+	pool_agent_t agent;
+
+	while (pool_take(state, spec, &agent) == 0) {
+		int const rv = pool_agent_handoff(&agent, sock, spec, vdev_id);
+
+		// The agent is on its own from now on, just like one we'd have spawned for this connection.
+		// If it went away in the meantime, just try the next one.
+
+		pool_agent_drop(&agent);
+
+		if (rv == 0) {
+			return 0;
+		}
+
+		LOG_W(state->pool_cls, "Failed to hand connection off to pooled KOS agent for %s (PID %d).", spec, agent.pid);
+	}
+
+	return -1;
+}
+
+void pool_free(state_t* state) {
+	for (size_t i = 0; i < state->pool_count; i++) {
+		pool_t* const pool = &state->pools[i];
+
+		for (size_t j = 0; j < pool->agent_count; j++) {
+			if (pool->agents[j].uds >= 0) {
+				close(pool->agents[j].uds);
+			}
+		}
+
+		free(pool->agents);
+	}
+
+	free(state->pools);
+}
@@ -0,0 +1,123 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+typedef struct state_t state_t;
+
+/**
+ * A KOS agent we hand connections to over a UDS, either sitting in a pool or serving a session (see session.h).
+ */
+typedef struct {
+	pid_t pid;
+
+	/**
+	 * Our end of the UDS connected to the agent, or -1 if the slot is empty.
+	 */
+	int uds;
+
+	/**
+	 * Whether the agent has told us it's done getting ready.
+	 */
+	bool ready;
+} pool_agent_t;
+
+/**
+ * Pool of KOS agents for a given spec.
+ *
+ * Spawning a KOS agent means connecting to the KOS, finding the VDEVs of the spec, and loading its VDRIVER, which takes long enough to noticeably slow down connecting to a VDEV.
+ * Pooled agents do all this before any connection comes in, and are then handed connections over a UDS.
+ */
+typedef struct {
+	char const* spec;
+
+	size_t agent_count;
+	pool_agent_t* agents;
+} pool_t;
+
+/**
+ * Spawn a KOS agent which is to be handed connections over a UDS.
+ *
+ * @param state The gvd state.
+ * @param spec Spec the agent should get ready for ahead of time, or NULL.
+ * @param agent Where to put the agent.
+ * @return 0 on success, or a negative value on failure (in which case the agent's UDS is -1).
+ */
+int pool_spawn_agent(state_t* state, char const* spec, pool_agent_t* agent);
+
+/**
+ * Check whether an agent is still around, and update whether it's ready.
+ *
+ * @param agent The agent.
+ * @return Whether the agent is still around.
+ */
+bool pool_agent_alive(pool_agent_t* agent);
+
+/**
+ * Stop handing connections to an agent.
+ *
+ * The agent exits once it's done with the connections it's already been handed.
+ *
+ * @param agent The agent.
+ */
+void pool_agent_drop(pool_agent_t* agent);
+
+/**
+ * Hand a connection to an agent.
+ *
+ * @param agent The agent.
+ * @param sock The connection's socket.
+ * @param spec The spec of the VDEV the connection is for.
+ * @param vdev_id The VDEV ID the connection is for.
+ * @return 0 on success, or -1 if the agent is gone or is no longer taking on connections (with `errno` set).
+ */
+int pool_agent_handoff(pool_agent_t const* agent, int sock, char const* spec, uint64_t vdev_id);
+
+/**
+ * Create a pool of KOS agents for a spec and start spawning its agents.
+ *
+ * @param state The gvd state.
+ * @param spec The spec to pool agents for.
+ * @param size Number of agents to keep in the pool.
+ */
+void pool_create(state_t* state, char const* spec, size_t size);
+
+/**
+ * Take a ready agent out of a pool.
+ *
+ * The agent is replaced by a new one in the background.
+ *
+ * @param state The gvd state.
+ * @param spec The spec to take an agent for.
+ * @param agent_ref Where to put the agent, which the caller is now responsible for.
+ * @return 0 on success, or a negative value if there is no pool for this spec or no agent in it is ready yet.
+ */
+int pool_take(state_t* state, char const* spec, pool_agent_t* agent_ref);
+
+/**
+ * Hand a connection off to a pooled KOS agent, if one is ready.
+ *
+ * The agent won't be handed any other connection, and is replaced by a new one in the background.
+ *
+ * @param state The gvd state.
+ * @param spec The spec of the VDEV the connection is for.
+ * @param sock The connection's socket.
+ * @param vdev_id The VDEV ID the connection is for.
+ * @return 0 if the connection was handed off, or a negative value if there is no pool for this spec or no agent in it is ready yet.
+ */
+int pool_handoff(state_t* state, char const* spec, int sock, uint64_t vdev_id);
+
+/**
+ * Free all pools.
+ *
+ * Idle agents exit on their own once they notice we're gone.
+ *
+ * @param state The gvd state.
+ */
+void pool_free(state_t* state);
@@ -0,0 +1,434 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Measure how fast KOS call packets are serialized and deserialized, for argument mixes modelled on real VDEVs.
+// Every remote call goes through this, so this is what to run before and after touching the GrapeVine protocol.
+// Each round trip is also checked against the original arguments, so this doubles as a quick sanity check.
+
+#define _POSIX_C_SOURCE 200809L // For clock_gettime().
+
+#include "proto.h"
+
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * How often we check the time while benchmarking, in calls.
+ */
+#define CLOCK_INTERVAL 64
+
+typedef struct {
+	char const* name;
+	char const* descr;
+	kos_fn_t fn;
+
+	/**
+	 * Fill in the arguments for the `i`th call.
+	 *
+	 * Integer arguments vary from call to call as they would in practice, as this affects how large they are once varint-encoded.
+	 */
+	void (*gen)(kos_val_t* args, uint64_t i);
+} mix_t;
+
+typedef struct {
+	char const* name;
+
+	/**
+	 * Do one call's worth of work.
+	 *
+	 * @return Number of bytes the call takes up on the wire.
+	 */
+	size_t (*run)(mix_t const* mix, gv_fn_layout_t const* layout, kos_val_t const* args, void* buf);
+} op_t;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t xorshift(uint32_t* state) {
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+// wgpu: a stream of indexed draws, as issued for every mesh in every frame.
+
+static void gen_wgpu_draw(kos_val_t* args, uint64_t i) {
+	args[0].opaque_ptr = (kos_opaque_ptr_t) {.host_id = 0x1234567890AB, .ptr = 0x7F0000001000};
+	args[1].u32 = 36 + (i * 37) % 6000;
+	args[2].u32 = 1 + (i % 16 == 0 ? i % 64 : 0);
+	args[3].u32 = (i * 3) % 65536;
+	args[4].i32 = (int32_t) (i % 7) - 3;
+	args[5].u32 = 0;
+}
+
+// audio: 1024 frames of 16-bit stereo PCM per write.
+
+#define AUDIO_FRAMES 1024
+
+static int16_t pcm[AUDIO_FRAMES * 2];
+
+static void gen_audio_write(kos_val_t* args, uint64_t i) {
+	uint32_t noise = i + 1;
+
+	// A slowly varying tone with a bit of noise, which is about as compressible as real audio.
+
+	for (size_t f = 0; f < AUDIO_FRAMES; f++) {
+		int16_t const sample = ((int32_t) ((i * AUDIO_FRAMES + f) * 440 % 48000) - 24000) + (int32_t) (xorshift(&noise) % 512) - 256;
+
+		pcm[f * 2 + 0] = sample;
+		pcm[f * 2 + 1] = sample;
+	}
+
+	args[0].opaque_ptr = (kos_opaque_ptr_t) {.host_id = 0x1234567890AB, .ptr = 0x7F0000002000};
+	args[1].buf.size = sizeof pcm;
+	args[1].buf.ptr = pcm;
+}
+
+// vr: a 1080p window split into 32x32 tiles, with a tenth of them updated each frame.
+
+#define VR_X_RES 1920
+#define VR_Y_RES 1080
+#define VR_TILE 32
+#define VR_TILES_X ((VR_X_RES + VR_TILE - 1) / VR_TILE)
+#define VR_TILES_Y ((VR_Y_RES + VR_TILE - 1) / VR_TILE)
+#define VR_TILES (VR_TILES_X * VR_TILES_Y)
+
+static uint8_t tile_bitmap[(VR_TILES + 7) / 8];
+static uint8_t tile_data[VR_TILES * VR_TILE * VR_TILE * 4];
+
+static void gen_vr_send_win(kos_val_t* args, uint64_t i) {
+	uint32_t noise = i + 1;
+	size_t dirty = 0;
+
+	memset(tile_bitmap, 0, sizeof tile_bitmap);
+
+	for (size_t t = 0; t < VR_TILES; t++) {
+		if (xorshift(&noise) % 10 != 0) {
+			continue;
+		}
+
+		tile_bitmap[t / 8] |= 1 << (t % 8);
+
+		// Mostly flat colour with gradients, like most UI.
+
+		uint8_t* const tile = tile_data + dirty++ * VR_TILE * VR_TILE * 4;
+
+		for (size_t p = 0; p < VR_TILE * VR_TILE; p++) {
+			tile[p * 4 + 0] = t * 7;
+			tile[p * 4 + 1] = p / VR_TILE * 4;
+			tile[p * 4 + 2] = i;
+			tile[p * 4 + 3] = 0xFF;
+		}
+	}
+
+	args[0].u32 = 1;
+	args[1].u32 = VR_X_RES;
+	args[2].u32 = VR_Y_RES;
+	args[3].u32 = VR_TILES_X;
+	args[4].u32 = VR_TILES_Y;
+	args[5].buf.size = sizeof tile_bitmap;
+	args[5].buf.ptr = tile_bitmap;
+	args[6].buf.size = dirty * VR_TILE * VR_TILE * 4;
+	args[6].buf.ptr = tile_data;
+}
+
+static mix_t const MIXES[] = {
+	{
+		.name = "wgpu",
+		.descr = "wgpuRenderPassEncoderDrawIndexed",
+		.fn = {
+			.name = "wgpuRenderPassEncoderDrawIndexed",
+			.ret_type = KOS_TYPE_VOID,
+			.param_count = 6,
+			.params = (kos_param_t[]) {
+				{KOS_TYPE_OPAQUE_PTR, "renderPassEncoder"},
+				{KOS_TYPE_U32, "indexCount"},
+				{KOS_TYPE_U32, "instanceCount"},
+				{KOS_TYPE_U32, "firstIndex"},
+				{KOS_TYPE_I32, "baseVertex"},
+				{KOS_TYPE_U32, "firstInstance"},
+			},
+		},
+		.gen = gen_wgpu_draw,
+	},
+	{
+		.name = "audio",
+		.descr = "write, 4 KiB PCM",
+		.fn = {
+			.name = "write",
+			.ret_type = KOS_TYPE_VOID,
+			.param_count = 2,
+			.params = (kos_param_t[]) {
+				{KOS_TYPE_OPAQUE_PTR, "stream"},
+				{KOS_TYPE_BUF, "buf"},
+			},
+		},
+		.gen = gen_audio_write,
+	},
+	{
+		.name = "vr",
+		.descr = "send_win, 10% of 1080p tiles",
+		.fn = {
+			.name = "send_win",
+			.ret_type = KOS_TYPE_VOID,
+			.param_count = 7,
+			.params = (kos_param_t[]) {
+				{KOS_TYPE_U32, "id"},
+				{KOS_TYPE_U32, "x_res"},
+				{KOS_TYPE_U32, "y_res"},
+				{KOS_TYPE_U32, "tiles_x"},
+				{KOS_TYPE_U32, "tiles_y"},
+				{KOS_TYPE_BUF, "tile_update_bitmap"},
+				{KOS_TYPE_BUF, "tile_data"},
+			},
+		},
+		.gen = gen_vr_send_win,
+	},
+};
+
+#define MIX_COUNT (sizeof MIXES / sizeof *MIXES)
+
+/**
+ * Check that deserialized arguments are the same as the ones which were serialized.
+ */
+static void check(mix_t const* mix, char const* op, kos_val_t const* args, kos_val_t const* got) {
+	for (size_t i = 0; i < mix->fn.param_count; i++) {
+		kos_type_t const t = mix->fn.params[i].type;
+		bool same;
+
+		switch (t) {
+		case KOS_TYPE_BUF:
+			same = args[i].buf.size == got[i].buf.size && memcmp(args[i].buf.ptr, got[i].buf.ptr, args[i].buf.size) == 0;
+			break;
+		case KOS_TYPE_OPAQUE_PTR:
+		case KOS_TYPE_PTR:
+			same = memcmp(&args[i].opaque_ptr, &got[i].opaque_ptr, sizeof args[i].opaque_ptr) == 0;
+			break;
+		default:
+			same = memcmp(&args[i], &got[i], gv_serialize_val_size(t, &args[i])) == 0;
+			break;
+		}
+
+		if (!same) {
+			fprintf(stderr, "%s/%s: Argument %zu (%s) didn't survive the round trip.\n", mix->name, op, i, mix->fn.params[i].name);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Per-value serialization, as used for return values.
+
+static size_t run_val(mix_t const* mix, gv_fn_layout_t const* layout, kos_val_t const* args, void* buf) {
+	(void) layout;
+
+	size_t size = 0;
+
+	for (size_t i = 0; i < mix->fn.param_count; i++) {
+		size += gv_serialize_val(buf + size, mix->fn.params[i].type, &args[i]);
+	}
+
+	kos_val_t got[mix->fn.param_count];
+	size_t consumed = 0;
+
+	for (size_t i = 0; i < mix->fn.param_count; i++) {
+		memset(&got[i], 0, sizeof got[i]);
+		consumed += gv_deserialize_val(buf + consumed, mix->fn.params[i].type, &got[i]);
+	}
+
+	assert(consumed == size);
+	check(mix, "val", args, got);
+
+	for (size_t i = 0; i < mix->fn.param_count; i++) {
+		if (mix->fn.params[i].type == KOS_TYPE_BUF) {
+			free((void*) got[i].buf.ptr);
+		}
+	}
+
+	return size;
+}
+
+// Full KOS call packets with the function's preferred argument encoding, framing included, as sent by the KOS and received by the KOS agent.
+
+static size_t run_call(mix_t const* mix, gv_fn_layout_t const* layout, kos_val_t const* args, void* buf) {
+	gv_packet_t* const packet = buf;
+	size_t const proto_packet_size = sizeof packet->header + sizeof packet->kos_call;
+	size_t const arg_size = gv_serialize_args(buf + proto_packet_size, layout, layout->encoding, args);
+
+	packet->header = (gv_packet_header_t) {
+		.vers = GV_PROTO_VERS,
+		.type = GV_PACKET_TYPE_KOS_CALL,
+		.len = sizeof packet->kos_call + arg_size,
+	};
+
+	packet->kos_call = (gv_kos_call_t) {
+		.req_id = 1,
+		.compression = GV_COMPRESSION_NONE,
+		.encoding = layout->encoding,
+		.size = arg_size,
+	};
+
+	// Receive side.
+
+	if (!gv_packet_header_valid(&packet->header) || packet->header.len != sizeof packet->kos_call + packet->kos_call.size) {
+		fprintf(stderr, "%s/call: Bad packet header.\n", mix->name);
+		exit(EXIT_FAILURE);
+	}
+
+	kos_val_t got[mix->fn.param_count];
+
+	if (gv_deserialize_args(buf + proto_packet_size, packet->kos_call.size, layout, packet->kos_call.encoding, true, got) != (ssize_t) arg_size) {
+		fprintf(stderr, "%s/call: Failed to deserialize arguments.\n", mix->name);
+		exit(EXIT_FAILURE);
+	}
+
+	check(mix, "call", args, got);
+	return proto_packet_size + arg_size;
+}
+
+// Scatter-gather serialization, as used for uncompressed calls (the receive side being the same as above).
+// Buffer contents aren't copied here at all, so the throughput this reports for buffer-heavy mixes is only how much data it lets through.
+
+static size_t run_iov(mix_t const* mix, gv_fn_layout_t const* layout, kos_val_t const* args, void* buf) {
+	(void) mix;
+
+	struct iovec iov[GV_ARGS_IOV_MAX(layout)];
+	size_t iov_count;
+
+	return gv_serialize_args_iov(buf, iov, &iov_count, layout, layout->encoding, args);
+}
+
+static op_t const OPS[] = {
+	{"val", run_val},
+	{"call", run_call},
+	{"iov", run_iov},
+};
+
+static void bench(mix_t const* mix, double secs) {
+	gv_fn_layout_t layout;
+	gv_fn_layout_init(&layout, &mix->fn);
+
+	kos_val_t args[mix->fn.param_count];
+	memset(args, 0, sizeof args);
+	mix->gen(args, 0);
+
+	// Size the buffer for the largest call the mix can generate, which is the one with every VR tile updated at worst.
+
+	size_t const buf_size = sizeof(gv_packet_t) + gv_serialize_args_bound(&layout, GV_ENCODING_VARINT, args) + sizeof tile_data + sizeof tile_bitmap;
+	void* const buf = malloc(buf_size);
+	assert(buf != NULL);
+
+	for (size_t o = 0; o < sizeof OPS / sizeof *OPS; o++) {
+		op_t const* const op = &OPS[o];
+
+		uint64_t const budget = secs * 1e9;
+		uint64_t elapsed = 0;
+		uint64_t calls = 0;
+		uint64_t bytes = 0;
+
+		// Generating arguments isn't part of what we're measuring.
+
+		while (elapsed < budget) {
+			mix->gen(args, calls);
+			uint64_t const start = now();
+
+			for (size_t i = 0; i < CLOCK_INTERVAL; i++) {
+				bytes += op->run(mix, &layout, args, buf);
+			}
+
+			elapsed += now() - start;
+			calls += CLOCK_INTERVAL;
+		}
+
+		double const elapsed_secs = elapsed / 1e9;
+
+		printf(
+			"%-8s%-6s%14.0f%12.1f%12.1f\n",
+			mix->name,
+			op->name,
+			calls / elapsed_secs,
+			bytes / elapsed_secs / 1e6,
+			(double) bytes / calls
+		);
+	}
+
+	free(buf);
+	gv_fn_layout_destroy(&layout);
+}
+
+static void usage(char const* progname) {
+	fprintf(stderr, "usage: %s [-t seconds] [mix ...]\n", progname);
+	fprintf(stderr, "\nMixes:\n");
+
+	for (size_t i = 0; i < MIX_COUNT; i++) {
+		fprintf(stderr, "  %-8s%s\n", MIXES[i].name, MIXES[i].descr);
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	char const* const progname = argv[0];
+	double secs = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			secs = strtod(optarg, NULL);
+
+			if (secs <= 0) {
+				usage(progname);
+			}
+
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	for (int i = 0; i < argc; i++) {
+		size_t m;
+
+		for (m = 0; m < MIX_COUNT; m++) {
+			if (strcmp(argv[i], MIXES[m].name) == 0) {
+				break;
+			}
+		}
+
+		if (m == MIX_COUNT) {
+			fprintf(stderr, "Unknown mix '%s'.\n", argv[i]);
+			usage(progname);
+		}
+	}
+
+	printf("%-8s%-6s%14s%12s%12s\n", "MIX", "OP", "CALLS/S", "MB/S", "BYTES/CALL");
+
+	for (size_t m = 0; m < MIX_COUNT; m++) {
+		bool selected = argc == 0;
+
+		for (int i = 0; i < argc; i++) {
+			selected |= strcmp(argv[i], MIXES[m].name) == 0;
+		}
+
+		if (selected) {
+			bench(&MIXES[m], secs);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "proto.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int gv_dict_path(char* buf, size_t size, char const* spec) {
+	char const* dir = getenv(GV_DICT_DIR_ENVVAR);
+
+	if (dir == NULL || *dir == '\0') {
+		dir = GV_DEFAULT_DICT_DIR;
+	}
+
+	// Specs come from the network, so don't let them walk out of the dictionary directory.
+
+	if (*spec == '\0' || strchr(spec, '/') != NULL) {
+		return -1;
+	}
+
+	int const len = snprintf(buf, size, "%s/%s.zdict", dir, spec);
+
+	if (len < 0 || (size_t) len >= size) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void* gv_dict_load(char const* spec, size_t* size_out) {
+	char path[1024];
+
+	if (gv_dict_path(path, sizeof path, spec) < 0) {
+		return NULL;
+	}
+
+	FILE* const f = fopen(path, "rb");
+
+	if (f == NULL) {
+		return NULL;
+	}
+
+	void* dict = NULL;
+
+	if (fseek(f, 0, SEEK_END) < 0) {
+		goto done;
+	}
+
+	long const size = ftell(f);
+
+	if (size <= 0 || size > GV_DICT_MAX_SIZE || fseek(f, 0, SEEK_SET) < 0) {
+		goto done;
+	}
+
+	dict = malloc(size);
+
+	if (dict == NULL) {
+		goto done;
+	}
+
+	if (fread(dict, 1, size, f) != (size_t) size) {
+		free(dict);
+		dict = NULL;
+		goto done;
+	}
+
+	*size_out = size;
+
+done:
+
+	fclose(f);
+	return dict;
+}
@@ -0,0 +1,41 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "proto.h"
+
+#include <math.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of bytes we look at when estimating entropy.
+ */
+#define ENTROPY_SAMPLE 4096
+
+double gv_entropy_estimate(void const* buf, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+
+	// Sample evenly across the whole buffer rather than just looking at the start, as e.g. framebuffers often start with a uniform region.
+
+	size_t const stride = size > ENTROPY_SAMPLE ? size / ENTROPY_SAMPLE : 1;
+	size_t hist[256] = {0};
+	size_t n = 0;
+
+	for (size_t i = 0; i < size && n < ENTROPY_SAMPLE; i += stride, n++) {
+		hist[((uint8_t const*) buf)[i]]++;
+	}
+
+	double entropy = 0;
+
+	for (size_t i = 0; i < sizeof hist / sizeof *hist; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+
+		double const p = (double) hist[i] / n;
+		entropy -= p * log2(p);
+	}
+
+	return entropy;
+}
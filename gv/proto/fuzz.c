@@ -0,0 +1,201 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// libFuzzer/AFL harness for the parts of the GrapeVine protocol which parse what comes off the wire: KOS_CALL packet headers, arguments, and return values.
+// Each input is laid out as follows:
+//
+// - A packet header and KOS call header, as they would be received by the KOS agent.
+// - One byte for the function's return type, one for its parameter count, and one per parameter for its type.
+// - The serialized arguments (the KOS call header's `size` bytes of what's left).
+// - Whatever remains is deserialized as a return value.
+//
+// This is only built with `GV_FUZZ=1` set, as it needs a compiler with libFuzzer (see README.md).
+
+#include "proto.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Most parameters we let a fuzzed function take.
+ */
+#define MAX_PARAMS 16
+
+/**
+ * Check that a value of a given type fits in a buffer, which callers of {@link gv_deserialize_val} must ensure.
+ *
+ * @param buf Buffer containing the serialized value.
+ * @param len Size of the buffer.
+ * @param t Type of the value.
+ * @return Whether the whole value is in the buffer.
+ */
+static bool val_fits(uint8_t const* buf, size_t len, kos_type_t t) {
+	kos_val_t v;
+
+	switch (t) {
+	case KOS_TYPE_VOID:
+		return true;
+	case KOS_TYPE_BOOL:
+	case KOS_TYPE_U8:
+	case KOS_TYPE_I8:
+		return len >= 1;
+	case KOS_TYPE_U16:
+	case KOS_TYPE_I16:
+		return len >= 2;
+	case KOS_TYPE_U32:
+	case KOS_TYPE_I32:
+	case KOS_TYPE_F32:
+		return len >= 4;
+	case KOS_TYPE_U64:
+	case KOS_TYPE_I64:
+	case KOS_TYPE_F64:
+		return len >= 8;
+	case KOS_TYPE_BUF:
+		if (len < sizeof v.buf.size) {
+			return false;
+		}
+
+		memcpy(&v.buf.size, buf, sizeof v.buf.size);
+		return len - sizeof v.buf.size >= v.buf.size;
+	case KOS_TYPE_OPAQUE_PTR:
+		return len >= sizeof v.opaque_ptr;
+	case KOS_TYPE_PTR:
+		return len >= sizeof v.ptr;
+	}
+
+	return false;
+}
+
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size);
+
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+	// Packet and KOS call headers.
+	// Copy them out, as the input isn't aligned and the agent reads them into their own structs too.
+
+	gv_packet_t packet;
+	size_t const header_size = sizeof packet.header + sizeof packet.kos_call;
+
+	if (size < header_size) {
+		return 0;
+	}
+
+	memcpy(&packet, data, header_size);
+	data += header_size;
+	size -= header_size;
+
+	if (!gv_packet_header_valid(&packet.header) || packet.header.type != GV_PACKET_TYPE_KOS_CALL) {
+		return 0;
+	}
+
+	if (packet.header.len < sizeof packet.kos_call) {
+		return 0;
+	}
+
+	gv_kos_call_t const* const call = &packet.kos_call;
+
+	if (call->encoding != GV_ENCODING_FIXED && call->encoding != GV_ENCODING_VARINT) {
+		return 0;
+	}
+
+	// Function signature.
+
+	if (size < 2) {
+		return 0;
+	}
+
+	kos_param_t params[MAX_PARAMS] = {0};
+
+	kos_fn_t fn = {
+		.ret_type = data[0] % KOS_TYPE_COUNT,
+		.param_count = data[1] % (MAX_PARAMS + 1),
+		.params = params,
+	};
+
+	data += 2;
+	size -= 2;
+
+	if (size < fn.param_count) {
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < fn.param_count; i++) {
+		params[i].type = data[i] % KOS_TYPE_COUNT;
+
+		// Void parameters make no sense and are never advertised by a VDEV.
+
+		if (params[i].type == KOS_TYPE_VOID) {
+			params[i].type = KOS_TYPE_U8;
+		}
+	}
+
+	data += fn.param_count;
+	size -= fn.param_count;
+
+	// Arguments.
+	// These are copied into a buffer of exactly the announced size, like the agent does, so the sanitizers catch any read past it.
+
+	size_t const arg_size = call->size < size ? call->size : size;
+	uint8_t* const arg_buf = malloc(arg_size);
+
+	if (arg_buf == NULL && arg_size > 0) {
+		return 0;
+	}
+
+	if (arg_size > 0) {
+		memcpy(arg_buf, data, arg_size);
+	}
+
+	data += arg_size;
+	size -= arg_size;
+
+	gv_fn_layout_t layout;
+	gv_fn_layout_init(&layout, &fn);
+
+	kos_val_t args[MAX_PARAMS];
+
+	// Borrowing leaves buffer arguments pointing into the argument buffer, and copying allocates them.
+	// Exercise both.
+
+	if (gv_deserialize_args(arg_buf, arg_size, &layout, call->encoding, true, args) >= 0) {
+		for (uint32_t i = 0; i < fn.param_count; i++) {
+			if (params[i].type == KOS_TYPE_BUF && args[i].buf.size > 0) {
+				// Touch both ends of borrowed buffers so an out-of-bounds one is caught.
+
+				volatile uint8_t const* const ptr = args[i].buf.ptr;
+				(void) ptr[0];
+				(void) ptr[args[i].buf.size - 1];
+			}
+		}
+	}
+
+	if (gv_deserialize_args(arg_buf, arg_size, &layout, call->encoding, false, args) >= 0) {
+		for (uint32_t i = 0; i < fn.param_count; i++) {
+			kos_val_free(params[i].type, &args[i]);
+		}
+	}
+
+	gv_fn_layout_destroy(&layout);
+	free(arg_buf);
+
+	// Return value.
+
+	if (val_fits(data, size, fn.ret_type)) {
+		uint8_t* const val_buf = malloc(size);
+
+		if (val_buf == NULL && size > 0) {
+			return 0;
+		}
+
+		if (size > 0) {
+			memcpy(val_buf, data, size);
+		}
+
+		kos_val_t ret;
+		gv_deserialize_val(val_buf, fn.ret_type, &ret);
+		kos_val_free(fn.ret_type, &ret);
+
+		free(val_buf);
+	}
+
+	return 0;
+}
@@ -0,0 +1,344 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "proto.h"
+
+#include <assert.h>
+#include <string.h>
+
+/**
+ * Maximum size of an LEB128-encoded 64-bit integer.
+ */
+#define VARINT_MAX 10
+
+static uint8_t fixed_size(kos_type_t t) {
+	kos_val_t v;
+
+	switch (t) {
+	case KOS_TYPE_VOID:
+		return 0;
+	case KOS_TYPE_BOOL:
+	case KOS_TYPE_U8:
+	case KOS_TYPE_I8:
+		return sizeof v.u8;
+	case KOS_TYPE_U16:
+	case KOS_TYPE_I16:
+		return sizeof v.u16;
+	case KOS_TYPE_U32:
+	case KOS_TYPE_I32:
+	case KOS_TYPE_F32:
+		return sizeof v.u32;
+	case KOS_TYPE_U64:
+	case KOS_TYPE_I64:
+	case KOS_TYPE_F64:
+		return sizeof v.u64;
+	case KOS_TYPE_BUF:
+		return sizeof v.buf.size;
+	case KOS_TYPE_OPAQUE_PTR:
+		return sizeof v.opaque_ptr;
+	case KOS_TYPE_PTR:
+		return sizeof v.ptr;
+	}
+
+	assert(false);
+	return 0;
+}
+
+void gv_fn_layout_init(gv_fn_layout_t* layout, kos_fn_t const* fn) {
+	layout->param_count = fn->param_count;
+	layout->fixed_size = 0;
+	layout->buf_count = 0;
+	layout->slots = NULL;
+
+	if (fn->param_count > 0) {
+		layout->slots = malloc(fn->param_count * sizeof *layout->slots);
+		assert(layout->slots != NULL);
+	}
+
+	size_t int_count = 0;
+
+	for (size_t i = 0; i < fn->param_count; i++) {
+		kos_type_t const t = fn->params[i].type;
+		gv_layout_slot_t* const slot = &layout->slots[i];
+
+		slot->size = fixed_size(t);
+		slot->kind = GV_LAYOUT_SLOT_FIXED;
+
+		switch (t) {
+		case KOS_TYPE_U16:
+		case KOS_TYPE_U32:
+		case KOS_TYPE_U64:
+			slot->kind = GV_LAYOUT_SLOT_UVARINT;
+			int_count++;
+			break;
+		case KOS_TYPE_I16:
+		case KOS_TYPE_I32:
+		case KOS_TYPE_I64:
+			slot->kind = GV_LAYOUT_SLOT_SVARINT;
+			int_count++;
+			break;
+		case KOS_TYPE_BUF:
+			slot->kind = GV_LAYOUT_SLOT_BUF;
+			layout->buf_count++;
+			break;
+		default:
+			break;
+		}
+
+		layout->fixed_size += slot->size;
+	}
+
+	// Only bother varint-packing argument lists which are mostly integers.
+	// Small integers are by far the most common, and this is where the savings are, but it's not worth giving up straight memcpys over for just one or two.
+
+	layout->encoding = int_count > 0 && int_count * 2 >= fn->param_count ? GV_ENCODING_VARINT : GV_ENCODING_FIXED;
+}
+
+void gv_fn_layout_destroy(gv_fn_layout_t* layout) {
+	free(layout->slots);
+	layout->slots = NULL;
+}
+
+size_t gv_serialize_args_bound(gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args) {
+	size_t size = encoding == GV_ENCODING_VARINT ? layout->param_count * VARINT_MAX : layout->fixed_size;
+
+	for (size_t i = 0; layout->buf_count > 0 && i < layout->param_count; i++) {
+		if (layout->slots[i].kind == GV_LAYOUT_SLOT_BUF) {
+			size += args[i].buf.size;
+		}
+	}
+
+	return size;
+}
+
+static size_t put_uvarint(uint8_t* buf, uint64_t x) {
+	size_t size = 0;
+
+	while (x >= 0x80) {
+		buf[size++] = (x & 0x7F) | 0x80;
+		x >>= 7;
+	}
+
+	buf[size++] = x;
+	return size;
+}
+
+static size_t get_uvarint(uint8_t const* buf, size_t len, uint64_t* x) {
+	*x = 0;
+
+	for (size_t i = 0; i < len && i < VARINT_MAX; i++) {
+		*x |= (uint64_t) (buf[i] & 0x7F) << (7 * i);
+
+		if (!(buf[i] & 0x80)) {
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read an integer of a given size out of a value.
+ *
+ * All members of {@link kos_val_t} start at the same address, so we only need to know the size of the integer.
+ */
+static uint64_t val_to_u64(kos_val_t const* v, uint8_t size, bool sign) {
+	switch (size) {
+	case sizeof v->u16:
+		return sign ? (uint64_t) (int64_t) v->i16 : v->u16;
+	case sizeof v->u32:
+		return sign ? (uint64_t) (int64_t) v->i32 : v->u32;
+	default:
+		return v->u64;
+	}
+}
+
+static void u64_to_val(kos_val_t* v, uint8_t size, uint64_t x) {
+	switch (size) {
+	case sizeof v->u16:
+		v->u16 = x;
+		break;
+	case sizeof v->u32:
+		v->u32 = x;
+		break;
+	default:
+		v->u64 = x;
+		break;
+	}
+}
+
+size_t gv_serialize_args(void* buf, gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args) {
+	size_t size = 0;
+
+	// Fast path: everything is fixed-size, so we can just lay out each argument one after the other without looking at its type.
+
+	if (encoding == GV_ENCODING_FIXED && layout->buf_count == 0) {
+		for (size_t i = 0; i < layout->param_count; i++) {
+			memcpy(buf + size, &args[i], layout->slots[i].size);
+			size += layout->slots[i].size;
+		}
+
+		return size;
+	}
+
+	for (size_t i = 0; i < layout->param_count; i++) {
+		gv_layout_slot_t const* const slot = &layout->slots[i];
+		kos_val_t const* const v = &args[i];
+
+		switch (encoding == GV_ENCODING_FIXED && slot->kind != GV_LAYOUT_SLOT_BUF ? GV_LAYOUT_SLOT_FIXED : slot->kind) {
+		case GV_LAYOUT_SLOT_FIXED:
+			memcpy(buf + size, v, slot->size);
+			size += slot->size;
+			break;
+		case GV_LAYOUT_SLOT_UVARINT:
+			size += put_uvarint(buf + size, val_to_u64(v, slot->size, false));
+			break;
+		case GV_LAYOUT_SLOT_SVARINT:;
+			int64_t const x = val_to_u64(v, slot->size, true);
+			size += put_uvarint(buf + size, ((uint64_t) x << 1) ^ (uint64_t) (x >> 63)); // Zigzag encoding.
+			break;
+		case GV_LAYOUT_SLOT_BUF:
+			memcpy(buf + size, &v->buf.size, sizeof v->buf.size);
+			size += sizeof v->buf.size;
+			memcpy(buf + size, v->buf.ptr, v->buf.size);
+			size += v->buf.size;
+			break;
+		}
+	}
+
+	return size;
+}
+
+size_t gv_serialize_args_scratch_size(gv_fn_layout_t const* layout, gv_encoding_t encoding) {
+	return encoding == GV_ENCODING_VARINT ? layout->param_count * VARINT_MAX : layout->fixed_size;
+}
+
+size_t gv_serialize_args_iov(void* scratch, struct iovec* iov, size_t* iov_count, gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args) {
+	size_t count = 0;
+	size_t total = 0;
+
+	// Everything but buffer contents goes in the scratch buffer, which is split up only where buffer contents need to go in between.
+
+	void* seg = scratch;
+	size_t seg_size = 0;
+
+	for (size_t i = 0; i < layout->param_count; i++) {
+		gv_layout_slot_t const* const slot = &layout->slots[i];
+		kos_val_t const* const v = &args[i];
+
+		if (slot->kind != GV_LAYOUT_SLOT_BUF) {
+			gv_fn_layout_t const single = {
+				.param_count = 1,
+				.slots = (gv_layout_slot_t*) slot,
+			};
+
+			seg_size += gv_serialize_args(seg + seg_size, &single, encoding, v);
+			continue;
+		}
+
+		memcpy(seg + seg_size, &v->buf.size, sizeof v->buf.size);
+		seg_size += sizeof v->buf.size;
+
+		if (v->buf.size == 0) {
+			continue;
+		}
+
+		iov[count++] = (struct iovec) {seg, seg_size};
+		iov[count++] = (struct iovec) {(void*) v->buf.ptr, v->buf.size};
+		total += seg_size + v->buf.size;
+
+		seg += seg_size;
+		seg_size = 0;
+	}
+
+	if (seg_size > 0) {
+		iov[count++] = (struct iovec) {seg, seg_size};
+		total += seg_size;
+	}
+
+	*iov_count = count;
+	return total;
+}
+
+ssize_t gv_deserialize_args(void const* buf, size_t len, gv_fn_layout_t const* layout, gv_encoding_t encoding, bool borrow, kos_val_t* args) {
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; i < layout->param_count; i++) {
+		gv_layout_slot_t const* const slot = &layout->slots[i];
+		kos_val_t* const v = &args[i];
+		uint64_t x;
+		size_t consumed;
+
+		switch (encoding == GV_ENCODING_FIXED && slot->kind != GV_LAYOUT_SLOT_BUF ? GV_LAYOUT_SLOT_FIXED : slot->kind) {
+		case GV_LAYOUT_SLOT_FIXED:
+			if (len - size < slot->size) {
+				goto fail;
+			}
+
+			memset(v, 0, sizeof *v);
+			memcpy(v, buf + size, slot->size);
+			size += slot->size;
+
+			break;
+		case GV_LAYOUT_SLOT_UVARINT:
+			if ((consumed = get_uvarint(buf + size, len - size, &x)) == 0) {
+				goto fail;
+			}
+
+			u64_to_val(v, slot->size, x);
+			size += consumed;
+
+			break;
+		case GV_LAYOUT_SLOT_SVARINT:
+			if ((consumed = get_uvarint(buf + size, len - size, &x)) == 0) {
+				goto fail;
+			}
+
+			u64_to_val(v, slot->size, (x >> 1) ^ -(x & 1));
+			size += consumed;
+
+			break;
+		case GV_LAYOUT_SLOT_BUF:
+			if (len - size < sizeof v->buf.size) {
+				goto fail;
+			}
+
+			memcpy(&v->buf.size, buf + size, sizeof v->buf.size);
+			size += sizeof v->buf.size;
+
+			if (len - size < v->buf.size) {
+				goto fail;
+			}
+
+			if (borrow) {
+				v->buf.ptr = buf + size;
+			}
+
+			else {
+				v->buf.ptr = malloc(v->buf.size);
+				assert(v->buf.size == 0 || v->buf.ptr != NULL);
+
+				memcpy((void*) v->buf.ptr, buf + size, v->buf.size);
+			}
+
+			size += v->buf.size;
+
+			break;
+		}
+	}
+
+	return size;
+
+fail:
+
+	// Free the buffers we've already deserialized.
+
+	while (!borrow && i-- > 0) {
+		if (layout->slots[i].kind == GV_LAYOUT_SLOT_BUF) {
+			free((void*) args[i].buf.ptr);
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,679 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#define _POSIX_C_SOURCE 200809L // For clock_gettime(), nanosleep(), strtok_r(), and dup().
+#define _DEFAULT_SOURCE // For SO_ZEROCOPY and MSG_ERRQUEUE on Linux.
+
+#include "proto.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define NOSIGNAL MSG_NOSIGNAL
+#else
+#define NOSIGNAL 0
+#endif
+
+static bool enabled = false;
+
+static uint64_t latency = 0; // In nanoseconds.
+static uint64_t jitter = 0; // In nanoseconds.
+static double rate = 0; // In megabits per second, 0 meaning uncapped.
+static double reorder = 0; // In percent.
+static uint64_t reorder_delay = 0; // In nanoseconds.
+
+// Times at which each direction of the emulated link becomes free again.
+// This models a single link per process, which is what we want for benchmarks.
+
+static _Atomic uint64_t tx_free = 0;
+static _Atomic uint64_t rx_free = 0;
+
+static _Thread_local uint64_t rng_state = 0;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t until) {
+	uint64_t const cur = now();
+
+	if (until <= cur) {
+		return;
+	}
+
+	struct timespec const ts = {
+		.tv_sec = (until - cur) / 1000000000,
+		.tv_nsec = (until - cur) % 1000000000,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * Check whether an operation on a socket is non-blocking, i.e. whether the caller is an event loop which mustn't be made to sleep.
+ */
+static bool nonblocking(int sock, int flags) {
+	if (flags & MSG_DONTWAIT) {
+		return true;
+	}
+
+	int const fl = fcntl(sock, F_GETFL);
+	return fl >= 0 && (fl & O_NONBLOCK);
+}
+
+/**
+ * Get a random number in [0, 1).
+ */
+static double rng(void) {
+	if (rng_state == 0) {
+		rng_state = now() | 1;
+	}
+
+	// xorshift64*.
+
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (double) ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) / (double) (1ULL << 53);
+}
+
+/**
+ * Data sent on a socket which the emulated link hasn't delivered yet.
+ */
+typedef struct pkt_t {
+	struct pkt_t* next;
+
+	uint64_t until; // When the data is to be delivered.
+	size_t len;
+	size_t off; // How much of it has already been handed to the kernel.
+	uint8_t data[];
+} pkt_t;
+
+/**
+ * Delay queue of a socket.
+ *
+ * Sockets are identified by their inode and not just by their descriptor, which may be closed and reused for another socket while data is still queued.
+ * We hold a duplicate of the descriptor until the queue drains, so that closing a socket right after sending on it still delivers everything first, like the kernel would.
+ */
+typedef struct queue_t {
+	struct queue_t* next;
+
+	int sock;
+	dev_t dev;
+	ino_t ino;
+
+	int dup_sock;
+	int err; // Error delivering queued data, reported on the next send.
+
+	uint64_t last_until;
+	pkt_t* head;
+	pkt_t* tail;
+} queue_t;
+
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queues_cond = PTHREAD_COND_INITIALIZER;
+static queue_t* queues = NULL;
+static bool deliverer_running = false;
+
+static void queue_free(queue_t* q) {
+	while (q->head != NULL) {
+		pkt_t* const pkt = q->head;
+		q->head = pkt->next;
+		free(pkt);
+	}
+
+	if (q->dup_sock >= 0) {
+		close(q->dup_sock);
+	}
+
+	free(q);
+}
+
+/**
+ * Wait on the queues' condition variable until some time on the monotonic clock.
+ *
+ * Condition variables wait on the realtime clock by default, and not every platform lets us change that, so we convert.
+ */
+static void wait_until(uint64_t until) {
+	uint64_t const cur = now();
+	uint64_t const rel = until > cur ? until - cur : 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint64_t const abs = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec + rel;
+
+	ts.tv_sec = abs / 1000000000;
+	ts.tv_nsec = abs % 1000000000;
+
+	pthread_cond_timedwait(&queues_cond, &queues_lock, &ts);
+}
+
+static void atfork_prepare(void) {
+	pthread_mutex_lock(&queues_lock);
+}
+
+static void atfork_parent(void) {
+	pthread_mutex_unlock(&queues_lock);
+}
+
+/**
+ * The deliverer isn't carried over to children, so they start off with nothing queued and the parent delivers what it had queued.
+ * The condition variable may still think the parent's deliverer is waiting on it, so it's started over too.
+ */
+static void atfork_child(void) {
+	pthread_cond_init(&queues_cond, NULL);
+
+	while (queues != NULL) {
+		queue_t* const q = queues;
+		queues = q->next;
+		queue_free(q);
+	}
+
+	deliverer_running = false;
+	pthread_mutex_unlock(&queues_lock);
+}
+
+static __attribute__((constructor)) void init(void) {
+	char const* const env = getenv(GV_NETEM_ENVVAR);
+
+	if (env == NULL || *env == '\0') {
+		return;
+	}
+
+	char* const conf = strdup(env);
+
+	if (conf == NULL) {
+		return;
+	}
+
+	char* save = NULL;
+
+	for (char* tok = strtok_r(conf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		char* const eq = strchr(tok, '=');
+
+		if (eq == NULL) {
+			fprintf(stderr, "%s: Ignoring malformed option '%s'.\n", GV_NETEM_ENVVAR, tok);
+			continue;
+		}
+
+		*eq = '\0';
+		double const val = strtod(eq + 1, NULL);
+
+		if (val < 0) {
+			fprintf(stderr, "%s: Ignoring negative value for '%s'.\n", GV_NETEM_ENVVAR, tok);
+			continue;
+		}
+
+		if (strcmp(tok, "latency") == 0) {
+			latency = val * 1000000;
+		}
+
+		else if (strcmp(tok, "jitter") == 0) {
+			jitter = val * 1000000;
+		}
+
+		else if (strcmp(tok, "rate") == 0) {
+			rate = val;
+		}
+
+		else if (strcmp(tok, "reorder") == 0) {
+			reorder = val;
+		}
+
+		else if (strcmp(tok, "reorder_delay") == 0) {
+			reorder_delay = val * 1000000;
+		}
+
+		else {
+			fprintf(stderr, "%s: Ignoring unknown option '%s'.\n", GV_NETEM_ENVVAR, tok);
+		}
+	}
+
+	free(conf);
+	enabled = true;
+
+	pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+/**
+ * Reserve one direction of the link for transmitting some data.
+ *
+ * @param link_free When this direction of the link becomes free.
+ * @param len Size of the data to transmit.
+ * @return When the data will have finished being transmitted.
+ */
+static uint64_t reserve(_Atomic uint64_t* link_free, size_t len) {
+	uint64_t const cur = now();
+
+	if (rate == 0) {
+		return cur;
+	}
+
+	uint64_t const tx_time = len * 8 * 1000 / rate;
+	uint64_t prev = atomic_load(link_free);
+	uint64_t done;
+
+	do {
+		done = (prev > cur ? prev : cur) + tx_time;
+	} while (!atomic_compare_exchange_weak(link_free, &prev, done));
+
+	return done;
+}
+
+/**
+ * Hand queued data to the kernel as it becomes due.
+ *
+ * This never blocks on a socket while holding the queues' lock, so a peer which stops reading only holds back its own queue.
+ */
+static void* deliverer(void* arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&queues_lock);
+
+	for (;;) {
+		uint64_t const cur = now();
+		uint64_t next = UINT64_MAX;
+
+		for (queue_t** qp = &queues; *qp != NULL;) {
+			queue_t* const q = *qp;
+
+			while (q->head != NULL && q->head->until <= cur) {
+				pkt_t* const pkt = q->head;
+				ssize_t const r = send(q->dup_sock, pkt->data + pkt->off, pkt->len - pkt->off, MSG_DONTWAIT | NOSIGNAL);
+
+				if (r < 0 && errno == EINTR) {
+					continue;
+				}
+
+				if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					// The socket buffer is full, so try again a little later.
+
+					next = cur + 1000000 < next ? cur + 1000000 : next;
+					break;
+				}
+
+				if (r < 0) {
+					// Nothing more is going to make it through; drop what's left and tell the sender.
+
+					q->err = errno;
+
+					while (q->head != NULL) {
+						pkt_t* const dropped = q->head;
+						q->head = dropped->next;
+						free(dropped);
+					}
+
+					break;
+				}
+
+				pkt->off += r;
+
+				if (pkt->off == pkt->len) {
+					q->head = pkt->next;
+					free(pkt);
+				}
+			}
+
+			if (q->head == NULL) {
+				q->tail = NULL;
+			}
+
+			// Drained queues are forgotten, unless they have an error to report to a socket which is still around.
+
+			if (q->head == NULL && (q->err == 0 || q->sock < 0)) {
+				*qp = q->next;
+				queue_free(q);
+				continue;
+			}
+
+			if (q->head == NULL && q->dup_sock >= 0) {
+				close(q->dup_sock);
+				q->dup_sock = -1;
+			}
+
+			if (q->head != NULL && q->head->until < next) {
+				next = q->head->until;
+			}
+
+			qp = &q->next;
+		}
+
+		pthread_cond_broadcast(&queues_cond);
+
+		if (next == UINT64_MAX) {
+			pthread_cond_wait(&queues_cond, &queues_lock);
+		}
+
+		else {
+			wait_until(next);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue data for the emulated link to deliver once its latency has passed.
+ *
+ * Latency is modelled as a delivery time rather than by blocking the sender, so that back-to-back sends overlap on the link like they would on a real one, and so that event loops sending on non-blocking sockets never sleep.
+ * Only blocking senders are held back, and only for as long as the rate cap says it takes to put the data on the link.
+ *
+ * @param sock Socket to send on.
+ * @param iov Scatter-gather list of the data to send.
+ * @param iov_count Number of entries in the list.
+ * @param flags Flags passed on to `send(2)`.
+ * @return Number of bytes queued, or -1 on error.
+ */
+static ssize_t delay_send(int sock, struct iovec const* iov, size_t iov_count, int flags) {
+	struct stat st;
+
+	if (fstat(sock, &st) < 0) {
+		return -1;
+	}
+
+	size_t len = 0;
+
+	for (size_t i = 0; i < iov_count; i++) {
+		len += iov[i].iov_len;
+	}
+
+	pkt_t* const pkt = malloc(sizeof *pkt + len);
+
+	if (pkt == NULL) {
+		return -1;
+	}
+
+	pkt->next = NULL;
+	pkt->len = len;
+	pkt->off = 0;
+
+	for (size_t i = 0, off = 0; i < iov_count; off += iov[i++].iov_len) {
+		memcpy(pkt->data + off, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	// Work out when the data is delivered.
+
+	uint64_t const on_link = reserve(&tx_free, len);
+	uint64_t until = on_link + latency;
+
+	if (jitter > 0) {
+		int64_t const dev = (rng() * 2 - 1) * jitter;
+		until = (int64_t) until + dev;
+	}
+
+	if (reorder > 0 && rng() * 100 < reorder) {
+		until += reorder_delay;
+	}
+
+	// Find the socket's queue, replacing any left over from a closed socket which had the same descriptor.
+
+	pthread_mutex_lock(&queues_lock);
+
+	queue_t* q = NULL;
+
+	for (queue_t** qp = &queues; *qp != NULL; qp = &(*qp)->next) {
+		if ((*qp)->sock != sock) {
+			continue;
+		}
+
+		if ((*qp)->dev == st.st_dev && (*qp)->ino == st.st_ino) {
+			q = *qp;
+			break;
+		}
+
+		if ((*qp)->head == NULL) {
+			queue_t* const stale = *qp;
+			*qp = stale->next;
+			queue_free(stale);
+			break;
+		}
+
+		// Data for the old socket is still in flight, so leave its queue to the deliverer and disown it.
+
+		(*qp)->sock = -1;
+	}
+
+	if (q != NULL && q->err != 0) {
+		int const err = q->err;
+		pthread_mutex_unlock(&queues_lock);
+
+		free(pkt);
+		errno = err;
+
+		return -1;
+	}
+
+	if (q == NULL) {
+		q = calloc(1, sizeof *q);
+
+		if (q == NULL || (q->dup_sock = dup(sock)) < 0) {
+			pthread_mutex_unlock(&queues_lock);
+
+			free(q);
+			free(pkt);
+
+			return -1;
+		}
+
+		q->sock = sock;
+		q->dev = st.st_dev;
+		q->ino = st.st_ino;
+
+		q->next = queues;
+		queues = q;
+	}
+
+	// TCP delivers in order, so data held back holds back everything after it too.
+
+	if (until < q->last_until) {
+		until = q->last_until;
+	}
+
+	pkt->until = q->last_until = until;
+
+	if (q->tail != NULL) {
+		q->tail->next = pkt;
+	}
+
+	else {
+		q->head = pkt;
+	}
+
+	q->tail = pkt;
+
+	if (!deliverer_running) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, deliverer, NULL) == 0) {
+			pthread_detach(thread);
+			deliverer_running = true;
+		}
+	}
+
+	pthread_cond_broadcast(&queues_cond);
+	pthread_mutex_unlock(&queues_lock);
+
+	if (!nonblocking(sock, flags)) {
+		sleep_until(on_link);
+	}
+
+	return len;
+}
+
+/**
+ * Deliver whatever is still queued before exiting, as the kernel would for data already sent.
+ */
+static __attribute__((destructor)) void fini(void) {
+	if (!enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&queues_lock);
+
+	for (;;) {
+		uint64_t last = 0;
+
+		for (queue_t* q = queues; q != NULL; q = q->next) {
+			if (q->head != NULL && q->last_until > last) {
+				last = q->last_until;
+			}
+		}
+
+		// Don't hang around forever for a peer which stopped reading.
+
+		if (last == 0 || now() > last + 1000000000) {
+			break;
+		}
+
+		wait_until(now() + 10000000);
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+}
+
+ssize_t gv_send(int sock, void const* buf, size_t len, int flags) {
+	if (enabled) {
+		struct iovec const iov = {
+			.iov_base = (void*) buf,
+			.iov_len = len,
+		};
+
+		return delay_send(sock, &iov, 1, flags);
+	}
+
+	return send(sock, buf, len, flags);
+}
+
+ssize_t gv_sendv(int sock, struct iovec const* iov, size_t iov_count, int flags) {
+	// Queued data is copied, so there's nothing for zero-copy sends to save and no completions to wait for.
+
+	if (enabled) {
+		return delay_send(sock, iov, iov_count, flags);
+	}
+
+	// sendmsg(2) may only send part of the data, in which case we finish sending the entry it stopped in the middle of on its own, and then carry on from the next one.
+
+	size_t sent = 0;
+	size_t i = 0;
+	size_t off = 0;
+
+	while (i < iov_count) {
+		ssize_t r;
+
+		if (off > 0) {
+			r = send(sock, (char*) iov[i].iov_base + off, iov[i].iov_len - off, flags);
+		}
+
+		else {
+			struct msghdr msg = {
+				.msg_iov = (struct iovec*) &iov[i],
+				.msg_iovlen = iov_count - i < IOV_MAX ? iov_count - i : IOV_MAX,
+			};
+
+			r = sendmsg(sock, &msg, flags);
+		}
+
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		sent += r;
+		off += r;
+
+		while (i < iov_count && off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			i++;
+		}
+	}
+
+	return sent;
+}
+
+int gv_zerocopy_enable(int sock) {
+#if defined(SO_ZEROCOPY)
+	return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &(int) {1}, sizeof(int));
+#else
+	(void) sock;
+	return -1;
+#endif
+}
+
+void gv_zerocopy_drain(int sock) {
+#if defined(SO_ZEROCOPY)
+	// We don't need to look at the completions themselves, as by the time we call this the data has already been received on the other end.
+	// They still need to be read so they don't pile up on the socket's error queue.
+
+	char control[128];
+
+	for (;;) {
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof control,
+		};
+
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			break;
+		}
+	}
+#else
+	(void) sock;
+#endif
+}
+
+ssize_t gv_recv(int sock, void* buf, size_t len, int flags) {
+	ssize_t const r = recv(sock, buf, len, flags);
+
+	// Latency is all applied on the sending side, so all that's left to do here is cap the rate.
+	// Event loops reading non-blocking sockets are never made to sleep though.
+
+	if (enabled && r > 0) {
+		uint64_t const until = reserve(&rx_free, r);
+
+		if (!nonblocking(sock, flags)) {
+			sleep_until(until);
+		}
+	}
+
+	return r;
+}
+
+int gv_recv_discard(int sock, size_t len) {
+	char buf[4096];
+
+	while (len > 0) {
+		size_t const chunk = len < sizeof buf ? len : sizeof buf;
+		ssize_t const r = gv_recv(sock, buf, chunk, MSG_WAITALL);
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		len -= r;
+	}
+
+	return 0;
+}
@@ -13,6 +13,9 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * The port used for GrapeVine connections (TCP).
@@ -24,6 +27,15 @@
  */
 #define GV_ELP_PORT GV_PORT
 
+/**
+ * TCP keepalive parameters for GrapeVine connections.
+ *
+ * These determine how quickly we notice a node which vanished without closing its connections: after `GV_KEEPALIVE_IDLE` seconds of silence, a probe is sent every `GV_KEEPALIVE_INTVL` seconds, and the connection is dropped after `GV_KEEPALIVE_CNT` unanswered probes.
+ */
+#define GV_KEEPALIVE_IDLE 1
+#define GV_KEEPALIVE_INTVL 1
+#define GV_KEEPALIVE_CNT 3
+
 /**
  * The type of a GrapeVine packet.
  *
@@ -57,8 +69,60 @@ typedef enum : uint8_t {
 typedef enum : uint8_t {
 	GV_COMPRESSION_NONE = 0,
 	GV_COMPRESSION_ZSTD = 1,
+	GV_COMPRESSION_ZSTD_CHUNKED = 2,
 } gv_compression_t;
 
+/**
+ * Payloads at least this large are sent as {@link GV_COMPRESSION_ZSTD_CHUNKED} when they are to be compressed.
+ */
+#define GV_CHUNK_THRESHOLD (1 << 20)
+
+/**
+ * Maximum size of a chunk of a {@link GV_COMPRESSION_ZSTD_CHUNKED} payload.
+ *
+ * This bounds how much memory each end needs for compressed data, however large the payload.
+ */
+#define GV_CHUNK_SIZE (256 << 10)
+
+/**
+ * Header of a chunk of a {@link GV_COMPRESSION_ZSTD_CHUNKED} payload.
+ *
+ * The payload is a single ZSTD stream split up into chunks, each prefixed by this header, and terminated by an empty chunk.
+ * This lets both ends compress, send, receive, and decompress it piece by piece rather than having to hold it all in memory at once.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * Size of the chunk's data following this header, at most {@link GV_CHUNK_SIZE}.
+	 */
+	uint32_t size;
+} gv_chunk_t;
+
+/**
+ * Payloads smaller than this many bytes are never compressed.
+ *
+ * ZSTD's frame overhead eats most of the savings on these, and calls this small are latency-bound anyway.
+ */
+#define GV_COMPRESSION_THRESHOLD 512
+
+/**
+ * Same as {@link GV_COMPRESSION_THRESHOLD}, but when a dictionary is available.
+ *
+ * Dictionaries are what make compressing small payloads worthwhile, so this is much lower.
+ */
+#define GV_DICT_COMPRESSION_THRESHOLD 32
+
+/**
+ * How the arguments in a KOS call packet are encoded.
+ *
+ * With `GV_ENCODING_FIXED`, each argument is laid out at its natural size one after the other.
+ * With `GV_ENCODING_VARINT`, 16-, 32-, and 64-bit integer arguments are instead LEB128-encoded (zigzagged first if signed), which is much more compact for the small integers most calls pass.
+ * See {@link gv_fn_layout_t}.
+ */
+typedef enum : uint8_t {
+	GV_ENCODING_FIXED = 0,
+	GV_ENCODING_VARINT = 1,
+} gv_encoding_t;
+
 static char const* const gv_packet_type_strs[] = {
 	"ELP",
 	"QUERY",
@@ -73,10 +137,29 @@ static char const* const gv_packet_type_strs[] = {
 
 _Static_assert(sizeof gv_packet_type_strs / sizeof *gv_packet_type_strs == GV_PACKET_TYPE_LEN, "Bad number of gv_packet_type_t strings.");
 
+/**
+ * Get the name of a packet type, for logging.
+ *
+ * Unlike indexing {@link gv_packet_type_strs} directly, this is safe to call on packet types received from the network.
+ *
+ * @param type The packet type.
+ * @return The name of the packet type.
+ */
+static inline char const* gv_packet_type_str(gv_packet_type_t type) {
+	return type < GV_PACKET_TYPE_LEN ? gv_packet_type_strs[type] : "UNKNOWN";
+}
+
+/**
+ * The GrapeVine protocol version.
+ *
+ * This is carried in the header of every packet (see {@link gv_packet_header_t}), and packets with any other version are rejected.
+ */
+#define GV_PROTO_VERS 3
+
 /**
  * The ELP packet version.
  */
-#define GV_ELP_VERS 0
+#define GV_ELP_VERS 1
 
 /**
  * Maximum size of our UDP packets.
@@ -100,6 +183,7 @@ typedef struct __attribute__((packed)) {
 	 * A unique value.
 	 *
 	 * If this value changes, it means we want all other hosts to send us a QUERY packet again because something has changed (e.g. new VDEVs are available).
+	 * This is picked again whenever the GrapeVine daemon restarts.
 	 */
 	uint64_t unique : 56;
 
@@ -114,10 +198,34 @@ typedef struct __attribute__((packed)) {
 	 * A friendly name for the host.
 	 */
 	uint8_t name[64];
+
+	/**
+	 * Version of the set of VDEVs this node exposes, which is incremented whenever it changes.
+	 *
+	 * This only means anything along with `unique`, and starts over from 1 when `unique` changes.
+	 * If this changes, other hosts send us a QUERY packet again with the version they already know about, so that we only have to send them what changed since (see {@link gv_query_t}).
+	 */
+	uint64_t vdevs_vers;
 } gv_elp_t;
 
 _Static_assert(sizeof(gv_elp_t) < GV_UDP_BUDGET, "ELP packet is too large for our UDP budget.");
 
+/**
+ * QUERY packet.
+ *
+ * This asks a node for the VDEVs it exposes.
+ * It can also be sent empty (i.e. with a length of 0), in which case all of them are always sent back.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * The `unique` and VDEV set version of the node ({@link gv_elp_t}) we already know the VDEVs of, or 0 if we don't know about any yet.
+	 *
+	 * If these are still current, or the node knows what changed since, only what changed is sent back.
+	 */
+	uint64_t unique;
+	uint64_t vdevs_vers;
+} gv_query_t;
+
 /**
  * QUERY response packet.
  *
@@ -125,10 +233,29 @@ _Static_assert(sizeof(gv_elp_t) < GV_UDP_BUDGET, "ELP packet is too large for ou
  */
 typedef struct __attribute__((packed)) {
 	/**
-	 * Number of VDEVs this node supports.
+	 * The `unique` and VDEV set version of the node this is for, which are to be sent in the next QUERY packet.
+	 */
+	uint64_t unique;
+	uint64_t vdevs_vers;
+
+	/**
+	 * Whether this is only what changed since the `unique` and VDEV set version in the QUERY packet.
+	 *
+	 * If set, `vdevs` only contains the VDEVs which were added or changed since, and is followed by `removed_count` VDEV IDs (`uint64_t`) of those which were removed since.
+	 * Otherwise, `vdevs` contains all the VDEVs the node supports and `removed_count` is 0.
+	 */
+	uint8_t delta;
+
+	/**
+	 * Number of VDEVs in `vdevs`.
 	 */
 	uint32_t vdev_count;
 
+	/**
+	 * Number of VDEV IDs of removed VDEVs following `vdevs`.
+	 */
+	uint32_t removed_count;
+
 	/**
 	 * Serialized VDEV descriptors of VDEVs we support.
 	 */
@@ -143,6 +270,14 @@ typedef struct __attribute__((packed)) {
 	 * The ID of the VDEV we want to connect to.
 	 */
 	uint64_t vdev_id;
+
+	/**
+	 * The ID of the KOS session making the connection, or 0 if it isn't to be shared.
+	 *
+	 * All connections made from the same session to the same host are served by a single KOS agent, which saves on processes and lets them share VDRIVER instances.
+	 * Session IDs only have to be unique on the host making the connection.
+	 */
+	uint64_t session_id;
 } gv_conn_vdev_t;
 
 /**
@@ -170,12 +305,28 @@ typedef struct __attribute__((packed)) {
 	 * Number of functions this VDEV supports.
 	 */
 	uint32_t fn_count;
+
+	/**
+	 * ID of the ZSTD dictionary the KOS agent can decompress call arguments with, or 0 if it has none.
+	 *
+	 * See {@link gv_dict_load}.
+	 */
+	uint32_t dict_id;
 } gv_conn_vdev_res_t;
 
 /**
  * KOS call packet.
+ *
+ * Calls on a connection are executed in the order they are sent, but the KOS may send several before waiting for any of them to return, and their returns may come back in any order.
  */
 typedef struct __attribute__((packed)) {
+	/**
+	 * Request ID.
+	 *
+	 * This is chosen by the KOS, must be unique among the calls in flight on a connection, and is echoed back in the {@link gv_kos_call_ret_t} or {@link gv_kos_call_fail_t} for this call.
+	 */
+	uint64_t req_id;
+
 	/**
 	 * Connection ID.
 	 */
@@ -186,10 +337,21 @@ typedef struct __attribute__((packed)) {
 	 */
 	gv_compression_t compression;
 
+	/**
+	 * Encoding used for arguments, before compression.
+	 */
+	gv_encoding_t encoding;
+
+	/**
+	 * ID of the ZSTD dictionary arguments were compressed with, or 0 if none was used.
+	 */
+	uint32_t dict_id;
+
 	/**
 	 * Size of this struct plus arguments.
 	 *
 	 * If compression is applicable, this means the compressed size of the arguments.
+	 * For {@link GV_COMPRESSION_ZSTD_CHUNKED}, this is the uncompressed size of the arguments instead, as the compressed size isn't known until everything has been sent.
 	 */
 	uint32_t size;
 
@@ -197,40 +359,111 @@ typedef struct __attribute__((packed)) {
 	 * ID of function to call.
 	 */
 	uint32_t fn_id;
+
+	/**
+	 * Compression the KOS agent may use for the return value.
+	 *
+	 * The KOS is the one which knows how fast the link is, so it decides this for both directions.
+	 * The KOS agent can still choose not to compress a return value which is too small or doesn't look compressible (see {@link gv_entropy_estimate}).
+	 */
+	gv_compression_t ret_compression;
+
+	/**
+	 * ZSTD compression level the KOS agent should use for the return value, if `ret_compression` is {@link GV_COMPRESSION_ZSTD}.
+	 */
+	int8_t ret_level;
 } gv_kos_call_t;
 
+/**
+ * KOS call failure packet.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * Request ID of the call which failed.
+	 */
+	uint64_t req_id;
+} gv_kos_call_fail_t;
+
 /**
  * KOS call return packet.
  */
 typedef struct __attribute__((packed)) {
+	/**
+	 * Request ID of the call this is the return value of.
+	 */
+	uint64_t req_id;
+
+	/**
+	 * Compression method used for the return value.
+	 */
+	gv_compression_t compression;
+
 	/**
 	 * Size of return value.
 	 *
 	 * Necessary because otherwise it would be annoying to read buffer values.
+	 * If compression is applicable, this means the compressed size of the return value.
 	 */
 	uint32_t size;
 } gv_kos_call_ret_t;
 
 // TODO All the others: writing pointer back, vitrification, writing chunks of memory (for when vitrification is happening and all of the syncing for that), and interrupts.
 
+/**
+ * GrapeVine packet header.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * The protocol version.
+	 *
+	 * Should be set to {@link GV_PROTO_VERS}.
+	 */
+	uint8_t vers;
+
+	/**
+	 * The type of the packet.
+	 */
+	gv_packet_type_t type;
+
+	/**
+	 * Size of the packet following this header.
+	 *
+	 * This lets the receiver skip over packets it doesn't expect without losing track of where the next one starts.
+	 * {@link GV_COMPRESSION_ZSTD_CHUNKED} payloads aren't counted, as they follow the packet and are framed by their own chunk headers (see {@link gv_chunk_t}).
+	 */
+	uint32_t len;
+} gv_packet_header_t;
+
 /**
  * GrapeVine packet description.
  */
 typedef struct __attribute__((packed)) {
-	struct {
-		gv_packet_type_t type;
-	} header;
+	gv_packet_header_t header;
 
 	union {
 		gv_elp_t elp;
+		gv_query_t query;
 		gv_query_res_t query_res;
 		gv_conn_vdev_t conn_vdev;
 		gv_conn_vdev_res_t conn_vdev_res;
 		gv_kos_call_t kos_call;
+		gv_kos_call_fail_t kos_call_fail;
 		gv_kos_call_ret_t kos_call_ret;
 	};
 } gv_packet_t;
 
+/**
+ * Check that a received packet header is one we can make sense of.
+ *
+ * If it isn't, nothing else received on the stream can be trusted either.
+ *
+ * @param header The packet header.
+ * @return Whether the header is of a version we support and of a known packet type.
+ */
+static inline bool gv_packet_header_valid(gv_packet_header_t const* header) {
+	return header->vers == GV_PROTO_VERS && header->type < GV_PACKET_TYPE_LEN;
+}
+
 /**
  * Free a packet.
  *
@@ -350,3 +583,304 @@ size_t gv_deserialize_param(void const* buf, kos_param_t* p);
  * @return Number of bytes consumed from the buffer.
  */
 size_t gv_deserialize_fn(void const* buf, kos_fn_t* fn);
+
+// Argument layout functions.
+
+/**
+ * How a single argument is laid out in a KOS call packet.
+ */
+typedef enum : uint8_t {
+	GV_LAYOUT_SLOT_FIXED,
+	GV_LAYOUT_SLOT_UVARINT,
+	GV_LAYOUT_SLOT_SVARINT,
+	GV_LAYOUT_SLOT_BUF,
+} gv_layout_slot_kind_t;
+
+typedef struct {
+	/**
+	 * How this argument is laid out when varint encoding is used.
+	 *
+	 * With fixed encoding, everything but buffers is just copied as-is.
+	 */
+	gv_layout_slot_kind_t kind;
+
+	/**
+	 * Size of the argument when fixed-encoded, or of the buffer's size prefix for buffers.
+	 */
+	uint8_t size;
+} gv_layout_slot_t;
+
+/**
+ * Precomputed layout of a function's arguments in KOS call packets.
+ *
+ * This is computed once per function when connecting, so that serializing and deserializing arguments on every call doesn't have to look at each argument's type.
+ */
+typedef struct {
+	/**
+	 * Number of parameters the function takes.
+	 */
+	uint32_t param_count;
+
+	/**
+	 * Layout of each parameter.
+	 */
+	gv_layout_slot_t* slots;
+
+	/**
+	 * Size of all fixed-encoded arguments, not counting the contents of buffers.
+	 */
+	size_t fixed_size;
+
+	/**
+	 * Number of buffer parameters.
+	 */
+	uint32_t buf_count;
+
+	/**
+	 * Encoding to use when sending calls to this function.
+	 *
+	 * Argument lists which are mostly integers are varint-encoded.
+	 */
+	gv_encoding_t encoding;
+} gv_fn_layout_t;
+
+/**
+ * Compute the argument layout of a function.
+ *
+ * @param layout Layout to initialize. Must be destroyed with {@link gv_fn_layout_destroy}.
+ * @param fn Function to compute the layout for.
+ */
+void gv_fn_layout_init(gv_fn_layout_t* layout, kos_fn_t const* fn);
+
+/**
+ * Destroy an argument layout.
+ *
+ * @param layout Layout to destroy.
+ */
+void gv_fn_layout_destroy(gv_fn_layout_t* layout);
+
+/**
+ * Get an upper bound on the size of serialized arguments.
+ *
+ * @param layout Layout of the function's arguments.
+ * @param encoding Encoding to serialize the arguments with.
+ * @param args Arguments to serialize.
+ * @return Maximum size of the serialized arguments in bytes.
+ */
+size_t gv_serialize_args_bound(gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args);
+
+/**
+ * Serialize arguments.
+ *
+ * @param buf Buffer to serialize the arguments into. Expected to be at least as large as {@link gv_serialize_args_bound}.
+ * @param layout Layout of the function's arguments.
+ * @param encoding Encoding to serialize the arguments with (usually the layout's preferred encoding).
+ * @param args Arguments to serialize.
+ * @return Size of serialized arguments in bytes.
+ */
+size_t gv_serialize_args(void* buf, gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args);
+
+/**
+ * Get the size of the scratch buffer needed by {@link gv_serialize_args_iov}.
+ *
+ * @param layout Layout of the function's arguments.
+ * @param encoding Encoding to serialize the arguments with.
+ * @return Size of the scratch buffer in bytes.
+ */
+size_t gv_serialize_args_scratch_size(gv_fn_layout_t const* layout, gv_encoding_t encoding);
+
+/**
+ * Serialize arguments as a scatter-gather list, without copying the contents of buffer arguments.
+ *
+ * Everything but the contents of buffer arguments is written to a small scratch buffer, and the returned list points into either it or the buffer arguments themselves.
+ * The list is thus only valid for as long as the scratch buffer and the arguments are.
+ *
+ * @param scratch Scratch buffer, of at least {@link gv_serialize_args_scratch_size} bytes.
+ * @param iov Scatter-gather list to fill in, with room for at least {@link GV_ARGS_IOV_MAX} entries.
+ * @param iov_count Reference to where the number of entries used should be written.
+ * @param layout Layout of the function's arguments.
+ * @param encoding Encoding to serialize the arguments with.
+ * @param args Arguments to serialize.
+ * @return Total size of the serialized arguments in bytes.
+ */
+size_t gv_serialize_args_iov(void* scratch, struct iovec* iov, size_t* iov_count, gv_fn_layout_t const* layout, gv_encoding_t encoding, kos_val_t const* args);
+
+/**
+ * Maximum number of scatter-gather list entries {@link gv_serialize_args_iov} can use for a function.
+ */
+#define GV_ARGS_IOV_MAX(layout) (2 * (layout)->buf_count + 1)
+
+/**
+ * Deserialize arguments.
+ *
+ * @param buf Buffer containing the serialized arguments.
+ * @param len Size of the buffer.
+ * @param layout Layout of the function's arguments.
+ * @param encoding Encoding the arguments were serialized with.
+ * @param borrow Whether buffer arguments should point straight into `buf` rather than be copied. Otherwise, they are allocated and must be freed by the caller (see {@link kos_val_free}).
+ * @param args Output location for the deserialized arguments.
+ * @return Number of bytes consumed from the buffer, or -1 if the buffer is malformed (in which case nothing is left allocated).
+ */
+ssize_t gv_deserialize_args(void const* buf, size_t len, gv_fn_layout_t const* layout, gv_encoding_t encoding, bool borrow, kos_val_t* args);
+
+/**
+ * Payloads whose estimated entropy is above this many bits per byte are considered incompressible (e.g. already compressed images).
+ */
+#define GV_ENTROPY_THRESHOLD 7.5
+
+/**
+ * Quickly estimate how compressible a payload is.
+ *
+ * This computes the Shannon entropy of the byte distribution of (a sample of) the payload.
+ *
+ * @param buf Payload.
+ * @param size Size of the payload.
+ * @return Estimated entropy in bits per byte, between 0 and 8.
+ */
+double gv_entropy_estimate(void const* buf, size_t size);
+
+// Dictionary functions.
+
+/**
+ * The GV_DICT_DIR environment variable name.
+ *
+ * This is the directory ZSTD dictionaries are looked for in, one per VDEV spec, named `<spec>.zdict`.
+ * These are trained from KOS recordings with `aqua-dict-train`, and must be the same on both ends of a connection for them to be used.
+ */
+#define GV_DICT_DIR_ENVVAR "GV_DICT_DIR"
+
+/**
+ * Default directory ZSTD dictionaries are looked for in, if {@link GV_DICT_DIR_ENVVAR} isn't set.
+ */
+#define GV_DEFAULT_DICT_DIR "/tmp/gv-dicts"
+
+/**
+ * Maximum size of a ZSTD dictionary we're willing to load.
+ */
+#define GV_DICT_MAX_SIZE (1 << 20)
+
+/**
+ * Get the path of the ZSTD dictionary for a VDEV spec.
+ *
+ * @param buf Buffer to write the path to.
+ * @param size Size of the buffer.
+ * @param spec The VDEV spec.
+ * @return 0 on success, or a negative value if the spec is invalid or the path doesn't fit.
+ */
+int gv_dict_path(char* buf, size_t size, char const* spec);
+
+/**
+ * Load the ZSTD dictionary for a VDEV spec.
+ *
+ * @param spec The VDEV spec.
+ * @param size_out Reference to where the size of the dictionary should be written.
+ * @return The dictionary, which must be freed by the caller, or `NULL` if there is none.
+ */
+void* gv_dict_load(char const* spec, size_t* size_out);
+
+// Transport functions.
+
+/**
+ * The GV_NETEM environment variable name.
+ *
+ * When set, {@link gv_send} and {@link gv_recv} emulate the network conditions it describes, so that benchmarks over loopback can model real links.
+ * It is a comma-separated list of `key=value` pairs, with the following keys:
+ *
+ * - `latency`: Latency in milliseconds added to each packet sent, i.e. the time between it being sent and it being delivered to the other end.
+ * - `jitter`: Maximum random deviation in milliseconds added to or removed from that latency.
+ * - `rate`: Bandwidth cap in megabits per second, applied separately to each direction.
+ * - `reorder`: Percentage of packets which are held back, as if they had been reordered on the link and TCP had to wait for them.
+ * - `reorder_delay`: How long in milliseconds those packets are held back for.
+ *
+ * E.g., `GV_NETEM=latency=20,jitter=2,rate=50` roughly models a 20 ms RTT, 50 Mbit/s link when set on the client.
+ * As both directions are rate-capped and latency only needs to be added once per round trip, this only needs to be set on one end of the connection.
+ */
+#define GV_NETEM_ENVVAR "GV_NETEM"
+
+/**
+ * Send data on a GrapeVine stream.
+ *
+ * This is a drop-in replacement for `send(2)` which applies network emulation if enabled (see {@link GV_NETEM_ENVVAR}).
+ * When it does, the data is queued and only handed to the kernel once its latency has passed, so the sender is only ever held back by the rate cap, and not at all on non-blocking sockets.
+ * Errors delivering queued data are reported by the next send on the socket.
+ *
+ * @param sock Socket to send on.
+ * @param buf Data to send.
+ * @param len Size of the data to send.
+ * @param flags Flags passed on to `send(2)`.
+ * @return Whatever `send(2)` returns.
+ */
+ssize_t gv_send(int sock, void const* buf, size_t len, int flags);
+
+/**
+ * Send a scatter-gather list of data on a GrapeVine stream.
+ *
+ * This is like {@link gv_send}, but sends the data from wherever it is, without it having to be copied into a single buffer first.
+ * Unlike `sendmsg(2)`, this keeps going until everything has been sent.
+ *
+ * @param sock Socket to send on.
+ * @param iov Scatter-gather list of the data to send.
+ * @param iov_count Number of entries in the list.
+ * @param flags Flags passed on to `sendmsg(2)`, such as {@link GV_MSG_ZEROCOPY}.
+ * @return Total number of bytes sent, or -1 on error.
+ */
+ssize_t gv_sendv(int sock, struct iovec const* iov, size_t iov_count, int flags);
+
+/**
+ * Payloads at least this large are sent with {@link GV_MSG_ZEROCOPY}.
+ *
+ * Below this, the cost of pinning pages and handling completions outweighs that of copying the data into the kernel.
+ */
+#define GV_ZEROCOPY_THRESHOLD (64 << 10)
+
+/**
+ * Flag to pass to {@link gv_sendv} to have the kernel send data straight from userspace memory, where supported (Linux' `MSG_ZEROCOPY`).
+ *
+ * The socket must have had {@link gv_zerocopy_enable} called on it for this to have any effect, and the data must not be modified until the other end has received it.
+ * Completions must then be cleared with {@link gv_zerocopy_drain}.
+ */
+#if defined(MSG_ZEROCOPY)
+#define GV_MSG_ZEROCOPY MSG_ZEROCOPY
+#else
+#define GV_MSG_ZEROCOPY 0
+#endif
+
+/**
+ * Enable zero-copy sends on a socket, where supported.
+ *
+ * @param sock Socket.
+ * @return 0 on success, or a negative value if zero-copy sends aren't supported.
+ */
+int gv_zerocopy_enable(int sock);
+
+/**
+ * Clear the zero-copy completion notifications queued on a socket.
+ *
+ * @param sock Socket.
+ */
+void gv_zerocopy_drain(int sock);
+
+/**
+ * Receive and throw away data from a GrapeVine stream.
+ *
+ * This is used to skip over the rest of packets we don't expect, using the length in their header.
+ *
+ * @param sock Socket to receive from.
+ * @param len Number of bytes to throw away.
+ * @return 0 on success, or -1 if the connection was closed or broke first.
+ */
+int gv_recv_discard(int sock, size_t len);
+
+/**
+ * Receive data from a GrapeVine stream.
+ *
+ * This is a drop-in replacement for `recv(2)` which applies network emulation if enabled (see {@link GV_NETEM_ENVVAR}).
+ * Only the rate cap applies in this direction, and only to blocking receives.
+ *
+ * @param sock Socket to receive from.
+ * @param buf Buffer to receive the data into.
+ * @param len Maximum size of the data to receive.
+ * @param flags Flags passed on to `recv(2)`.
+ * @return Whatever `recv(2)` returns.
+ */
+ssize_t gv_recv(int sock, void* buf, size_t len, int flags);
@@ -1,23 +1,65 @@
 // This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
 // Copyright (c) 2024 Aymeric Wibo
 
+#include "conn.h"
+#include "elp.h"
 #include "gv.h"
+#include "query.h"
 
 #include <aqua/gv_proto.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/time.h>
+
+/**
+ * Number of nodes which can be queried at once.
+ */
+#define QUERY_WORKERS 8
+
+/**
+ * Maximum number of nodes waiting to be queried.
+ *
+ * Nodes beyond this are dropped, and queued again the next time we get an ELP from them.
+ */
+#define QUERY_JOBS_MAX 256
+
+/**
+ * How long to wait on an unresponsive node before giving up on a query, in seconds.
+ */
+#define QUERY_TIMEOUT 2
+
+/**
+ * Maximum time to wait between two attempts at querying a node, in seconds.
+ */
+#define QUERY_BACKOFF_MAX 16
+
 static void close_sock(int const* sock) {
 	if (*sock >= 0) {
 		close(*sock);
 	}
 }
 
-int query(state_t* s, in_addr_t in_addr, size_t* vdev_count_ref, kos_vdev_descr_t** vdevs_ref) {
+/**
+ * Receive exactly `len` bytes, if there are any to receive at all.
+ *
+ * Deltas are often empty, and a zero-length blocking receive would wait for data which isn't coming until we time out.
+ */
+static int recv_all(int sock, void* buf, size_t len) {
+	if (len == 0) {
+		return 0;
+	}
+
+	return gv_recv(sock, buf, len, MSG_WAITALL) == (ssize_t) len ? 0 : -1;
+}
+
+int query(state_t* s, in_addr_t in_addr, uint64_t since_unique, uint64_t since_vers, queried_t* queried) {
 	LOG_V(s->query_cls, "Create a new socket for sending to this node.");
 
 	int const __attribute__((cleanup(close_sock))) sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -27,6 +69,15 @@ int query(state_t* s, in_addr_t in_addr, size_t* vdev_count_ref, kos_vdev_descr_
 		return -1;
 	}
 
+	// Don't let an unresponsive node hold up the worker querying it forever.
+
+	struct timeval const timeout = {
+		.tv_sec = QUERY_TIMEOUT,
+	};
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
 	LOG_V(s->query_cls, "Connect to the node.");
 
 	struct sockaddr_in addr = {
@@ -42,12 +93,20 @@ int query(state_t* s, in_addr_t in_addr, size_t* vdev_count_ref, kos_vdev_descr_
 
 	LOG_V(s->query_cls, "Send QUERY packet.");
 
+	// Let the node know which of its VDEVs we already know about, so that it only has to send what changed since.
+
 	gv_packet_t packet = {
-		.header.type = GV_PACKET_TYPE_QUERY,
+		.header = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_QUERY,
+			.len = sizeof packet.query,
+		},
+		.query.unique = since_unique,
+		.query.vdevs_vers = since_vers,
 	};
 
-	if (sendto(sock, &packet, sizeof packet.header, 0, (struct sockaddr*) &addr, sizeof addr) < 0) {
-		LOG_E(s->query_cls, "sendto: %s", strerror(errno));
+	if (gv_send(sock, &packet, sizeof packet.header + sizeof packet.query, 0) < 0) {
+		LOG_E(s->query_cls, "send: %s", strerror(errno));
 		return -1;
 	}
 
@@ -55,59 +114,331 @@ int query(state_t* s, in_addr_t in_addr, size_t* vdev_count_ref, kos_vdev_descr_
 
 	size_t const query_res_size = sizeof packet.header + sizeof packet.query_res;
 
-	if (recv(sock, &packet, query_res_size, MSG_WAITALL) != (ssize_t) query_res_size) {
+	if (gv_recv(sock, &packet, query_res_size, MSG_WAITALL) != (ssize_t) query_res_size) {
 		LOG_E(s->query_cls, "recv failed.");
 		return -1;
 	}
 
+	if (!gv_packet_header_valid(&packet.header)) {
+		LOG_E(s->query_cls, "Unsupported protocol version for QUERY response: %d", packet.header.vers);
+		return -1;
+	}
+
 	if (packet.header.type != GV_PACKET_TYPE_QUERY_RES) {
 		LOG_E(s->query_cls, "Unexpected packet type for QUERY response: %d", packet.header.type);
 		return -1;
 	}
 
-	LOG_V(s->query_cls, "Receive VDEV descriptors themselves.");
+	LOG_V(s->query_cls, "Receive VDEV descriptors themselves, and the VDEV IDs of removed VDEVs if this is a delta.");
 
 	size_t const vdev_count = packet.query_res.vdev_count;
+	size_t const removed_count = packet.query_res.removed_count;
 	size_t const vdev_bytes = vdev_count * sizeof(kos_vdev_descr_t);
+	size_t const removed_bytes = removed_count * sizeof(uint64_t);
+
+	if (packet.header.len != sizeof packet.query_res + vdev_bytes + removed_bytes || (!packet.query_res.delta && removed_count != 0)) {
+		LOG_E(s->query_cls, "QUERY response length (%" PRIu32 ") doesn't match its VDEV count (%zu) and removed VDEV count (%zu).", packet.header.len, vdev_count, removed_count);
+		return -1;
+	}
 
 	kos_vdev_descr_t* const vdevs = malloc(vdev_bytes);
-	assert(vdevs != NULL);
+	uint64_t* const removed = malloc(removed_bytes);
+	assert(vdev_count == 0 || vdevs != NULL);
+	assert(removed_count == 0 || removed != NULL);
 
-	if (recv(sock, vdevs, vdev_bytes, MSG_WAITALL) != (ssize_t) vdev_bytes) {
+	if (recv_all(sock, vdevs, vdev_bytes) < 0 || recv_all(sock, removed, removed_bytes) < 0) {
 		LOG_E(s->query_cls, "recv failed.");
 		free(vdevs);
+		free(removed);
 		return -1;
 	}
 
 	LOG_V(s->query_cls, "Queried.");
 
-	*vdev_count_ref = vdev_count;
-	*vdevs_ref = vdevs;
+	*queried = (queried_t) {
+		.unique = packet.query_res.unique,
+		.vdevs_vers = packet.query_res.vdevs_vers,
+		.delta = packet.query_res.delta,
+		.since_unique = since_unique,
+		.since_vers = since_vers,
+		.vdev_count = vdev_count,
+		.vdevs = vdevs,
+		.removed_count = removed_count,
+		.removed = removed,
+	};
 
 	return 0;
 }
 
+static query_job_t* find_job(state_t* state, uint64_t host) {
+	for (size_t i = 0; i < state->query_job_count; i++) {
+		if (state->query_jobs[i].host == host) {
+			return &state->query_jobs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void remove_job(state_t* state, query_job_t* job) {
+	*job = state->query_jobs[--state->query_job_count];
+}
+
+/**
+ * Pick the next job which is due, forgetting about nodes we haven't heard from in a while along the way.
+ *
+ * @return The job, or NULL if none is due yet (in which case `next_ref` is set to when the earliest one will be, or 0 if there are none waiting).
+ */
+static query_job_t* next_job(state_t* state, time_t now, time_t* next_ref) {
+	*next_ref = 0;
+
+	for (size_t i = 0; i < state->query_job_count;) {
+		query_job_t* const job = &state->query_jobs[i];
+
+		if (job->running) {
+			i++;
+			continue;
+		}
+
+		if (now - job->last_seen > NODE_TTL) {
+			LOG_V(state->query_cls, "Node with host ID 0x%" PRIx64 " went away before we could query it.", job->host);
+			remove_job(state, job);
+			continue;
+		}
+
+		if (job->next_attempt <= now) {
+			return job;
+		}
+
+		if (*next_ref == 0 || job->next_attempt < *next_ref) {
+			*next_ref = job->next_attempt;
+		}
+
+		i++;
+	}
+
+	return NULL;
+}
+
+static void* query_worker(void* arg) {
+	state_t* const state = arg;
+
+	pthread_mutex_lock(&state->query_mutex);
+
+	while (!state->query_stop) {
+		time_t const now = time(NULL);
+		time_t next;
+		query_job_t* const job = next_job(state, now, &next);
+
+		if (job == NULL && next == 0) {
+			pthread_cond_wait(&state->query_cond, &state->query_mutex);
+			continue;
+		}
+
+		if (job == NULL) {
+			struct timespec const until = {
+				.tv_sec = next,
+			};
+
+			pthread_cond_timedwait(&state->query_cond, &state->query_mutex, &until);
+			continue;
+		}
+
+		// Query the node without holding the lock, so that other workers and the ELP listener can get on with it in the meantime.
+		// The job may be moved around while we do, so we'll have to look it up again by host ID afterwards.
+
+		job->running = true;
+		query_job_t const snapshot = *job;
+
+		pthread_mutex_unlock(&state->query_mutex);
+
+		// If we already know some version of the node's VDEVs (even from the node cache), the node only has to send us what changed since.
+
+		uint64_t since_unique = 0;
+		uint64_t since_vers = 0;
+
+		pthread_mutex_lock(&state->nodes_mutex);
+		node_t const* const node = node_find(state, snapshot.host);
+
+		if (node != NULL) {
+			since_unique = node->unique;
+			since_vers = node->vdevs_vers;
+		}
+
+		pthread_mutex_unlock(&state->nodes_mutex);
+
+		queried_t queried;
+		int rv = query(state, snapshot.addr.sin_addr.s_addr, since_unique, since_vers, &queried);
+
+		if (rv == 0) {
+			rv = elp_queried(state, snapshot.host, &snapshot.addr, &queried);
+		}
+
+		pthread_mutex_lock(&state->query_mutex);
+		query_job_t* const done = find_job(state, snapshot.host);
+		assert(done != NULL);
+
+		done->running = false;
+
+		// If the node's unique or VDEV set version changed while we were querying it, what we got might already be out of date, so query it again straight away.
+
+		if (done->unique != snapshot.unique || done->vdevs_vers != snapshot.vdevs_vers) {
+			done->attempts = 0;
+			done->next_attempt = time(NULL);
+		}
+
+		else if (rv == 0) {
+			remove_job(state, done);
+		}
+
+		else {
+			unsigned const backoff = done->attempts < 4 ? 1u << done->attempts : QUERY_BACKOFF_MAX;
+			done->attempts++;
+			done->next_attempt = time(NULL) + backoff;
+
+			LOG_W(state->query_cls, "Failed to query node with host ID 0x%" PRIx64 " (attempt %u). Retrying in %u seconds.", done->host, done->attempts, backoff);
+		}
+	}
+
+	pthread_mutex_unlock(&state->query_mutex);
+	return NULL;
+}
+
+int query_start(state_t* state) {
+	state->query_stop = false;
+	state->query_job_count = 0;
+	state->query_jobs = malloc(QUERY_JOBS_MAX * sizeof *state->query_jobs);
+	assert(state->query_jobs != NULL);
+
+	pthread_mutex_init(&state->query_mutex, NULL);
+	pthread_cond_init(&state->query_cond, NULL);
+
+	state->query_worker_count = 0;
+	state->query_workers = malloc(QUERY_WORKERS * sizeof *state->query_workers);
+	assert(state->query_workers != NULL);
+
+	for (size_t i = 0; i < QUERY_WORKERS; i++) {
+		int const rv = pthread_create(&state->query_workers[i], NULL, query_worker, state);
+
+		if (rv != 0) {
+			LOG_E(state->query_cls, "pthread_create: %s", strerror(rv));
+			break;
+		}
+
+		state->query_worker_count++;
+	}
+
+	if (state->query_worker_count == 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void query_enqueue(state_t* state, uint64_t host, uint64_t unique, uint64_t vdevs_vers, struct sockaddr_in const* addr) {
+	time_t const now = time(NULL);
+
+	pthread_mutex_lock(&state->query_mutex);
+	query_job_t* job = find_job(state, host);
+
+	// If the node is already waiting to be queried, just keep it from being given up on.
+	// If its unique or VDEV set version changed in the meantime, don't make it wait out its backoff; it's likely to respond now.
+
+	if (job != NULL) {
+		job->last_seen = now;
+
+		if (job->unique != unique || job->vdevs_vers != vdevs_vers) {
+			job->unique = unique;
+			job->vdevs_vers = vdevs_vers;
+			job->addr = *addr;
+
+			if (!job->running) {
+				job->attempts = 0;
+				job->next_attempt = now;
+				pthread_cond_signal(&state->query_cond);
+			}
+		}
+
+		goto done;
+	}
+
+	if (state->query_job_count == QUERY_JOBS_MAX) {
+		LOG_W(state->query_cls, "Too many nodes waiting to be queried; node with host ID 0x%" PRIx64 " will have to wait for its next ELP.", host);
+		goto done;
+	}
+
+	job = &state->query_jobs[state->query_job_count++];
+
+	job->host = host;
+	job->unique = unique;
+	job->vdevs_vers = vdevs_vers;
+	job->addr = *addr;
+	job->last_seen = now;
+	job->next_attempt = now;
+	job->attempts = 0;
+	job->running = false;
+
+	pthread_cond_signal(&state->query_cond);
+
+done:
+
+	pthread_mutex_unlock(&state->query_mutex);
+}
+
+void query_free(state_t* state) {
+	pthread_mutex_lock(&state->query_mutex);
+	state->query_stop = true;
+	pthread_cond_broadcast(&state->query_cond);
+	pthread_mutex_unlock(&state->query_mutex);
+
+	for (size_t i = 0; i < state->query_worker_count; i++) {
+		pthread_join(state->query_workers[i], NULL);
+	}
+
+	free(state->query_workers);
+	free(state->query_jobs);
+
+	pthread_cond_destroy(&state->query_cond);
+	pthread_mutex_destroy(&state->query_mutex);
+}
+
 int query_res(conn_t* conn) {
 	state_t* const state = conn->state;
-	gv_packet_t* __attribute__((cleanup(gv_packet_free))) packet = NULL;
+	gv_packet_t* packet;
 
-	size_t const vdevs_size = state->vdev_count * sizeof *packet->query_res.vdevs;
+	// We only ever take inventory of our VDEVs once, when we start, and we pick a new unique then too.
+	// So if the querier already knows our current unique and VDEV set version, nothing has changed since, and we can send it an empty delta.
+	// Otherwise (including if it sent an empty QUERY), send it all our VDEVs.
+
+	gv_query_t const* const q = &conn->rx.query;
+	bool const up_to_date = conn->rx.header.len == sizeof *q && q->unique == state->unique && q->vdevs_vers == state->vdevs_vers;
+	size_t const vdev_count = up_to_date ? 0 : state->vdev_count;
+
+	size_t const vdevs_size = vdev_count * sizeof *packet->query_res.vdevs;
 	size_t const packet_size = sizeof packet->header + sizeof packet->query_res + vdevs_size;
 
 	packet = malloc(packet_size);
 	assert(packet != NULL);
 
+	packet->header.vers = GV_PROTO_VERS;
 	packet->header.type = GV_PACKET_TYPE_QUERY_RES;
-	packet->query_res.vdev_count = state->vdev_count;
+	packet->header.len = packet_size - sizeof packet->header;
+	packet->query_res.unique = state->unique;
+	packet->query_res.vdevs_vers = state->vdevs_vers;
+	packet->query_res.delta = up_to_date;
+	packet->query_res.vdev_count = vdev_count;
+	packet->query_res.removed_count = 0;
 	memcpy(packet->query_res.vdevs, state->vdevs, vdevs_size);
 
-	LOG_V(state->query_cls, "Sending QUERY_RES packet.");
+	LOG_V(state->query_cls, "Sending QUERY_RES packet (%s).", up_to_date ? "nothing changed" : "all VDEVs");
+
+	// The connection takes ownership of the packet, and sends whatever it can't send right away once the socket becomes writable.
 
-	if (send(conn->sock, packet, packet_size, 0) != (ssize_t) packet_size) {
-		LOG_E(state->query_cls, "sendto: %s", strerror(errno));
+	if (conn_send(conn, packet, packet_size) < 0) {
+		LOG_E(state->query_cls, "Failed to send QUERY_RES packet.");
 		return -1;
 	}
 
-	LOG_V(state->query_cls, "QUERY_RES packet sent.");
+	LOG_V(state->query_cls, "QUERY_RES packet queued.");
 	return 0;
 }
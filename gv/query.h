@@ -5,5 +5,76 @@
 
 #include "gv.h"
 
-int query(state_t* state, in_addr_t in_addr, size_t* vdev_count_ref, kos_vdev_descr_t** vdevs_ref);
+/**
+ * What we got from querying a node.
+ */
+typedef struct {
+	/**
+	 * The node's `unique` and VDEV set version these VDEVs are for.
+	 */
+	uint64_t unique;
+	uint64_t vdevs_vers;
+
+	/**
+	 * Whether this is only what changed since the `unique` and VDEV set version we already knew about (`since_unique` and `since_vers`), rather than all the node's VDEVs.
+	 */
+	bool delta;
+	uint64_t since_unique;
+	uint64_t since_vers;
+
+	/**
+	 * The node's VDEVs (or those which were added or changed, if this is a delta).
+	 */
+	size_t vdev_count;
+	kos_vdev_descr_t* vdevs;
+
+	/**
+	 * VDEV IDs of the node's VDEVs which were removed, if this is a delta.
+	 */
+	size_t removed_count;
+	uint64_t* removed;
+} queried_t;
+
+/**
+ * Query a node for its VDEVs.
+ *
+ * @param state The gvd state.
+ * @param in_addr The node's address.
+ * @param since_unique The node's `unique` we already know its VDEVs for, or 0 if we don't know any.
+ * @param since_vers The node's VDEV set version we already know its VDEVs for, or 0 if we don't know any.
+ * @param queried What we got, whose VDEVs and removed VDEV IDs are for the caller to free.
+ * @return 0 on success, or a negative value on failure.
+ */
+int query(state_t* state, in_addr_t in_addr, uint64_t since_unique, uint64_t since_vers, queried_t* queried);
 int query_res(conn_t* conn);
+
+/**
+ * Start the workers which query nodes in the background.
+ *
+ * Querying a node means a round trip over a new TCP connection, so many nodes appearing at once (e.g. when they all boot together) would otherwise hold up the ELP listener for a long time.
+ *
+ * @param state The gvd state.
+ * @return 0 on success, or a negative value if no worker could be started.
+ */
+int query_start(state_t* state);
+
+/**
+ * Queue a node to be queried by a worker.
+ *
+ * Its VDEVs are passed on to {@link elp_queried} once it's been queried.
+ * If this fails, it's retried with exponential backoff for as long as we keep getting ELPs from the node.
+ *
+ * @param state The gvd state.
+ * @param host The node's host ID.
+ * @param unique The `unique` of the node's latest ELP.
+ * @param vdevs_vers The VDEV set version of the node's latest ELP.
+ * @param addr The node's address.
+ */
+void query_enqueue(state_t* state, uint64_t host, uint64_t unique, uint64_t vdevs_vers, struct sockaddr_in const* addr);
+
+/**
+ * Stop the query workers, waiting for any query in progress.
+ *
+ * @param state The gvd state.
+ */
+void query_free(state_t* state);
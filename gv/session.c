@@ -0,0 +1,97 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "session.h"
+#include "gv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+static void remove_session(state_t* state, size_t i) {
+	pool_agent_drop(&state->sessions[i].agent);
+	state->sessions[i] = state->sessions[--state->session_count];
+}
+
+/**
+ * Find a session, forgetting about any whose KOS agent has gone away along the way.
+ *
+ * KOS agents exit once they're done serving all the connections of their session, so this is how sessions end.
+ */
+static session_t* find_session(state_t* state, in_addr_t host, uint64_t session_id) {
+	for (size_t i = 0; i < state->session_count;) {
+		session_t* const session = &state->sessions[i];
+
+		if (pool_agent_alive(&session->agent)) {
+			i++;
+			continue;
+		}
+
+		LOG_V(state->session_cls, "Session %" PRIx64 " from %s ended.", session->id, inet_ntoa((struct in_addr) {session->host}));
+		remove_session(state, i);
+	}
+
+	for (size_t i = 0; i < state->session_count; i++) {
+		session_t* const session = &state->sessions[i];
+
+		if (session->host == host && session->id == session_id) {
+			return session;
+		}
+	}
+
+	return NULL;
+}
+
+int session_handoff(state_t* state, in_addr_t host, uint64_t session_id, char const* spec, int sock, uint64_t vdev_id) {
+	assert(session_id != 0);
+
+	session_t* session = find_session(state, host, session_id);
+
+	// If the session's KOS agent has just stopped taking on new connections, start a new one.
+	// There's no point in trying more than once; if a fresh agent can't take it, nothing can.
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (session == NULL) {
+			pool_agent_t agent;
+
+			if (pool_take(state, spec, &agent) < 0 && pool_spawn_agent(state, NULL, &agent) < 0) {
+				return -1;
+			}
+
+			state->sessions = realloc(state->sessions, (state->session_count + 1) * sizeof *state->sessions);
+			assert(state->sessions != NULL);
+
+			session = &state->sessions[state->session_count++];
+
+			session->host = host;
+			session->id = session_id;
+			session->agent = agent;
+
+			LOG_V(state->session_cls, "Session %" PRIx64 " from %s started (KOS agent PID %d).", session_id, inet_ntoa((struct in_addr) {host}), agent.pid);
+		}
+
+		if (pool_agent_handoff(&session->agent, sock, spec, vdev_id) == 0) {
+			LOG_V(state->session_cls, "Handed connection to VID %" PRIu64 " off to session %" PRIx64 ".", vdev_id, session_id);
+			return 0;
+		}
+
+		LOG_V(state->session_cls, "KOS agent of session %" PRIx64 " is no longer taking connections: %s", session_id, strerror(errno));
+
+		remove_session(state, session - state->sessions);
+		session = NULL;
+	}
+
+	return -1;
+}
+
+void session_free(state_t* state) {
+	while (state->session_count > 0) {
+		remove_session(state, 0);
+	}
+
+	free(state->sessions);
+}
@@ -0,0 +1,47 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#pragma once
+
+#include "pool.h"
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+typedef struct state_t state_t;
+
+/**
+ * A KOS session on a remote host, all of whose connections are served by a single KOS agent.
+ *
+ * Without this, an application using several VDEVs on the same host would need a KOS agent process (and its own KOS and VDRIVER instances) for each one of them.
+ */
+typedef struct {
+	in_addr_t host;
+	uint64_t id;
+	pool_agent_t agent;
+} session_t;
+
+/**
+ * Hand a connection off to the KOS agent serving its session.
+ *
+ * If the session doesn't have one yet (or it has gone away), one is taken from the pool for the spec if there is one, or spawned otherwise.
+ *
+ * @param state The gvd state.
+ * @param host The address of the host making the connection.
+ * @param session_id The ID of the session making the connection, which mustn't be 0.
+ * @param spec The spec of the VDEV the connection is for.
+ * @param sock The connection's socket.
+ * @param vdev_id The VDEV ID the connection is for.
+ * @return 0 if the connection was handed off, or a negative value if no KOS agent could be found or started for it.
+ */
+int session_handoff(state_t* state, in_addr_t host, uint64_t session_id, char const* spec, int sock, uint64_t vdev_id);
+
+/**
+ * Free all sessions.
+ *
+ * Their KOS agents keep serving their connections, but won't be handed any new ones.
+ *
+ * @param state The gvd state.
+ */
+void session_free(state_t* state);
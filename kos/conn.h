@@ -5,6 +5,10 @@
 
 #include "lib/vdriver.h"
 
+#include <aqua/gv_proto.h>
+
+#include <zstd.h>
+
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -14,6 +18,64 @@ typedef enum {
 	CONN_TYPE_GV,
 } conn_type_t;
 
+/**
+ * A call sent on a GrapeVine connection whose return we haven't received yet.
+ *
+ * Everything needed to send the call again is kept around until then, in case the connection fails over.
+ */
+typedef struct {
+	kos_cookie_t cookie;
+	uint64_t req_id;
+
+	/**
+	 * The packet header and KOS call packet, followed by the compressed arguments unless they're sent uncompressed or in chunks.
+	 */
+	void* packet;
+
+	/**
+	 * Size of {@link packet}.
+	 */
+	size_t packet_size;
+
+	/**
+	 * Scatter-gather list of the uncompressed arguments, with an extra entry at the start for the packet, followed by the scratch buffer they're laid out in (see {@link gv_serialize_args_iov}).
+	 */
+	struct iovec* packet_iov;
+
+	/**
+	 * Number of entries in {@link packet_iov}, not counting the one for the packet.
+	 */
+	size_t iov_count;
+
+	/**
+	 * Uncompressed size of the arguments.
+	 */
+	size_t arg_buf_size;
+
+	/**
+	 * ZSTD compression level, for arguments sent in chunks or compressed again after a failover.
+	 */
+	int level;
+
+	/**
+	 * Whether the arguments are sent with {@link GV_MSG_ZEROCOPY}.
+	 */
+	bool zerocopy;
+
+	/**
+	 * Whether no other calls were in flight when this one was sent.
+	 *
+	 * Only the latency of these is meaningful to the cost model, as the others were queued behind other calls.
+	 */
+	bool alone;
+
+	/**
+	 * When the call was sent and how many bytes that took, for the cost model.
+	 */
+	uint64_t start;
+	size_t sent;
+} pending_call_t;
+
 /**
  * A connection to a VDEV.
  *
@@ -48,6 +110,74 @@ typedef struct {
 			 * For GrapeVine VDEVs, the connection ID on the remote KOS agent the GrapeVine daemon spawned for us.
 			 */
 			uint64_t remote_cid;
+
+			/**
+			 * For GrapeVine VDEVs, the host ID of the node we're currently connected to.
+			 *
+			 * This can change if the connection fails over to another node.
+			 */
+			uint64_t host_id;
+
+			/**
+			 * For GrapeVine VDEVs, the spec of the VDEV.
+			 *
+			 * This is what is used to find a replacement VDEV when failing over.
+			 */
+			uint8_t spec[64];
+
+			/**
+			 * For GrapeVine VDEVs, the version of {@link spec}, which a replacement VDEV must also have when failing over.
+			 */
+			uint32_t vers;
+
+			/**
+			 * For GrapeVine VDEVs, whether the connection may fail over to another VDEV with the same spec if the node goes away.
+			 *
+			 * See {@link kos_vdev_set_failover}.
+			 */
+			bool failover;
+
+			/**
+			 * For GrapeVine VDEVs, the precomputed argument layouts of each function, used for serializing calls.
+			 */
+			gv_fn_layout_t* layouts;
+
+			/**
+			 * For GrapeVine VDEVs, the ZSTD compression context, kept around between calls as creating one is expensive.
+			 *
+			 * This is created on the first call which needs compressing.
+			 */
+			ZSTD_CCtx* cctx;
+
+			/**
+			 * For GrapeVine VDEVs, the ZSTD decompression context for return values, also created on first use.
+			 */
+			ZSTD_DCtx* dctx;
+
+			/**
+			 * For GrapeVine VDEVs, the ZSTD dictionary call arguments are compressed with, or `NULL` if there is none.
+			 *
+			 * This is only set if the KOS agent on the other end advertised the same dictionary as the one we have for the VDEV's spec.
+			 */
+			ZSTD_CDict* cdict;
+
+			/**
+			 * For GrapeVine VDEVs, the ID of {@link cdict}.
+			 */
+			uint32_t dict_id;
+
+			/**
+			 * For GrapeVine VDEVs, the calls in flight, in the order they were sent.
+			 *
+			 * Their returns may come back in any order, and are matched to them by request ID.
+			 */
+			pending_call_t* pending;
+			size_t pending_count;
+
+			/**
+			 * For GrapeVine VDEVs, the request ID to give the next call.
+			 */
+			uint64_t next_req_id;
 		};
 	};
 
@@ -65,6 +195,16 @@ typedef struct {
 	 * The functions the VDEV this connection is for supports.
 	 */
 	kos_fn_t const* fns;
+
+	/**
+	 * The number of constants the VDEV this connection is for has.
+	 */
+	size_t const_count;
+
+	/**
+	 * The constants the VDEV this connection is for has.
+	 */
+	kos_const_t const* consts;
 } conn_t;
 
 static conn_t* conns = NULL;
@@ -107,16 +247,28 @@ static uint64_t conn_new_local(vid_t vid, vdriver_t* vdriver) {
  * Create new GrapeVine connection.
  *
  * @param VDEV ID of the VDEV we will connect to.
+ * @param host_id Host ID of the node the VDEV is on.
  * @param sock Socket the connection is happening over.
  * @param sock Remote connection ID.
  * @returns Connection ID of new connection.
  */
-static uint64_t conn_new_gv(vid_t vid, int sock, uint64_t remote_cid) {
+static uint64_t conn_new_gv(vid_t vid, uint64_t host_id, int sock, uint64_t remote_cid) {
 	uint64_t const cid = conn_new(vid);
 
 	conns[cid].type = CONN_TYPE_GV;
 	conns[cid].remote_cid = remote_cid;
 	conns[cid].sock = sock;
+	conns[cid].host_id = host_id;
+	conns[cid].spec[0] = '\0';
+	conns[cid].failover = false;
+	conns[cid].layouts = NULL;
+	conns[cid].cctx = NULL;
+	conns[cid].dctx = NULL;
+	conns[cid].cdict = NULL;
+	conns[cid].dict_id = 0;
+	conns[cid].pending = NULL;
+	conns[cid].pending_count = 0;
+	conns[cid].next_req_id = 0;
 
 	return cid;
 }
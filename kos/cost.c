@@ -0,0 +1,117 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "cost.h"
+
+#include <umber.h>
+
+#include <inttypes.h>
+
+/**
+ * Fixed per-call overhead of each kind of VDEV, in nanoseconds.
+ *
+ * For GrapeVine VDEVs, this accounts for (de)serialization and compression on top of the default RTT, and is only used until we have measured the host's actual RTT (which includes all that).
+ */
+#define LOCAL_OVERHEAD 1000
+#define UDS_OVERHEAD 20000
+#define GV_OVERHEAD 200000
+
+/**
+ * Throughput of each kind of VDEV, in bytes per second.
+ *
+ * For GrapeVine VDEVs, this is only used until we have measured the host's actual throughput.
+ */
+#define LOCAL_THROUGHPUT 10000000000.
+#define UDS_THROUGHPUT 1000000000.
+#define GV_DEFAULT_THROUGHPUT 12500000. // 100 Mbit/s.
+
+/**
+ * RTT assumed for GrapeVine hosts we haven't made any calls to yet, in nanoseconds.
+ */
+#define GV_DEFAULT_RTT 1000000
+
+/**
+ * Weight given to new samples in the moving averages (same as for TCP's smoothed RTT).
+ */
+#define EWMA_ALPHA (1. / 8)
+
+typedef struct {
+	uint64_t host_id;
+	bool has_rtt;
+	double rtt;
+	bool has_throughput;
+	double throughput;
+} host_t;
+
+static umber_class_t const* cls = NULL;
+
+static size_t host_count = 0;
+static host_t hosts[256];
+
+static __attribute__((constructor)) void init(void) {
+	cls = umber_class_new("aqua.kos.cost", UMBER_LVL_WARN, "KOS call cost estimation.");
+}
+
+static host_t* find_host(uint64_t host_id, bool create) {
+	for (size_t i = 0; i < host_count; i++) {
+		if (hosts[i].host_id == host_id) {
+			return &hosts[i];
+		}
+	}
+
+	if (!create || host_count >= sizeof hosts / sizeof *hosts) {
+		return NULL;
+	}
+
+	host_t* const host = &hosts[host_count++];
+
+	host->host_id = host_id;
+	host->has_rtt = false;
+	host->has_throughput = false;
+
+	return host;
+}
+
+static void ewma(bool* has, double* avg, double sample) {
+	*avg = *has ? *avg + EWMA_ALPHA * (sample - *avg) : sample;
+	*has = true;
+}
+
+void cost_sample_call(uint64_t host_id, size_t bytes, uint64_t ns) {
+	host_t* const host = find_host(host_id, true);
+
+	if (host == NULL) {
+		return;
+	}
+
+	if (bytes <= COST_SMALL_CALL) {
+		ewma(&host->has_rtt, &host->rtt, ns);
+		LOG_V(cls, "Host 0x%" PRIx64 ": RTT sample %" PRIu64 " ns (smoothed %.0f ns).", host_id, ns, host->rtt);
+	}
+
+	else if (bytes >= COST_LARGE_CALL && host->has_rtt && ns > host->rtt) {
+		ewma(&host->has_throughput, &host->throughput, bytes * 1e9 / (ns - host->rtt));
+		LOG_V(cls, "Host 0x%" PRIx64 ": throughput sample for %zu bytes in %" PRIu64 " ns (smoothed %.0f B/s).", host_id, bytes, ns, host->throughput);
+	}
+}
+
+double cost_throughput(uint64_t host_id) {
+	host_t const* const host = find_host(host_id, false);
+	return host != NULL && host->has_throughput ? host->throughput : GV_DEFAULT_THROUGHPUT;
+}
+
+uint64_t cost_estimate(kos_vdev_kind_t kind, uint64_t host_id, size_t bytes) {
+	switch (kind) {
+	case KOS_VDEV_KIND_LOCAL:
+		return LOCAL_OVERHEAD + bytes * 1e9 / LOCAL_THROUGHPUT;
+	case KOS_VDEV_KIND_UDS:
+		return UDS_OVERHEAD + bytes * 1e9 / UDS_THROUGHPUT;
+	case KOS_VDEV_KIND_GV:;
+		host_t const* const host = find_host(host_id, false);
+
+		double const rtt = host != NULL && host->has_rtt ? host->rtt : GV_OVERHEAD + GV_DEFAULT_RTT;
+		return rtt + bytes * 1e9 / cost_throughput(host_id);
+	}
+
+	return UINT64_MAX;
+}
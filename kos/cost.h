@@ -0,0 +1,56 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+/**
+ * Live estimates of how expensive calls to VDEVs are, used for picking between equivalent VDEVs.
+ *
+ * For GrapeVine hosts, RTT and throughput are estimated from the calls made to them, using exponentially-weighted moving averages.
+ * Small calls are taken to measure RTT, and large calls to measure throughput once the RTT is subtracted.
+ */
+
+#pragma once
+
+#include <aqua/kos.h>
+
+/**
+ * Calls with at most this many bytes on the wire are used as RTT samples.
+ */
+#define COST_SMALL_CALL 4096
+
+/**
+ * Calls with at least this many bytes on the wire are used as throughput samples.
+ */
+#define COST_LARGE_CALL 65536
+
+/**
+ * Number of bytes on the wire assumed for a call of each {@link kos_workload_t}.
+ */
+#define COST_LATENCY_WORKLOAD_BYTES 64
+#define COST_BANDWIDTH_WORKLOAD_BYTES (1 << 20)
+
+/**
+ * Record a call made to a GrapeVine host.
+ *
+ * @param host_id The host the call was made to.
+ * @param bytes Total number of bytes sent and received for the call.
+ * @param ns How long the call took, from sending it to receiving its return, in nanoseconds.
+ */
+void cost_sample_call(uint64_t host_id, size_t bytes, uint64_t ns);
+
+/**
+ * Estimate the cost of a call.
+ *
+ * @param kind The kind of VDEV the call is made to.
+ * @param host_id The host the VDEV is on (only relevant for GrapeVine VDEVs).
+ * @param bytes Number of bytes the call moves.
+ * @return Expected duration of the call, in nanoseconds.
+ */
+uint64_t cost_estimate(kos_vdev_kind_t kind, uint64_t host_id, size_t bytes);
+
+/**
+ * Get the estimated throughput to a GrapeVine host.
+ *
+ * @param host_id The host.
+ * @return Measured throughput to the host if we have any samples, or a default otherwise, in bytes per second.
+ */
+double cost_throughput(uint64_t host_id);
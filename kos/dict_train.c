@@ -0,0 +1,261 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Train ZSTD dictionaries from the call arguments in recordings made with KOS_RECORD, one per VDEV spec.
+// The dictionaries are written where the KOS and KOS agents look for them (see GV_DICT_DIR_ENVVAR), and need to be installed on both ends of a connection to be used.
+
+#include "record.h"
+
+#include <aqua/gv_proto.h>
+
+#include <zdict.h>
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Default maximum dictionary size, which is what the ZSTD CLI uses too.
+ */
+#define DEFAULT_DICT_SIZE (110 << 10)
+
+/**
+ * Minimum number of samples we need for a spec before trying to train a dictionary for it.
+ */
+#define MIN_SAMPLES 16
+
+typedef struct {
+	char spec[64];
+
+	size_t sample_count;
+	size_t* sample_sizes;
+	size_t samples_size;
+	void* samples;
+} spec_t;
+
+typedef struct {
+	uint64_t conn_id;
+	size_t spec;
+} conn_map_t;
+
+static size_t spec_count = 0;
+static spec_t* specs = NULL;
+
+static size_t find_spec(char const* name) {
+	for (size_t i = 0; i < spec_count; i++) {
+		if (strcmp(specs[i].spec, name) == 0) {
+			return i;
+		}
+	}
+
+	specs = realloc(specs, (spec_count + 1) * sizeof *specs);
+	assert(specs != NULL);
+
+	spec_t* const spec = &specs[spec_count];
+	memset(spec, 0, sizeof *spec);
+	strncpy(spec->spec, name, sizeof spec->spec - 1);
+
+	return spec_count++;
+}
+
+static void add_sample(spec_t* spec, void const* payload, size_t size) {
+	spec->sample_sizes = realloc(spec->sample_sizes, (spec->sample_count + 1) * sizeof *spec->sample_sizes);
+	assert(spec->sample_sizes != NULL);
+
+	spec->samples = realloc(spec->samples, spec->samples_size + size);
+	assert(spec->samples != NULL);
+
+	memcpy(spec->samples + spec->samples_size, payload, size);
+	spec->sample_sizes[spec->sample_count++] = size;
+	spec->samples_size += size;
+}
+
+static int read_recording(char const* path) {
+	FILE* const f = fopen(path, "r");
+
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return -1;
+	}
+
+	int rv = -1;
+	record_file_hdr_t hdr;
+
+	size_t conn_map_count = 0;
+	conn_map_t* conn_map = NULL;
+	void* payload = NULL;
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, RECORD_MAGIC, sizeof RECORD_MAGIC) != 0) {
+		fprintf(stderr, "%s is not a KOS recording.\n", path);
+		goto done;
+	}
+
+	if (hdr.vers != RECORD_VERS) {
+		fprintf(stderr, "%s has unsupported recording version %u.\n", path, hdr.vers);
+		goto done;
+	}
+
+	record_t record;
+
+	while (fread(&record, sizeof record, 1, f) == 1) {
+		payload = realloc(payload, record.size);
+		assert(record.size == 0 || payload != NULL);
+
+		if (record.size > 0 && fread(payload, record.size, 1, f) != 1) {
+			fprintf(stderr, "%s is truncated.\n", path);
+			break;
+		}
+
+		// Connection IDs are only meaningful within a single recording, so we keep a separate map for each one.
+
+		if (record.kind == RECORD_KIND_CONN) {
+			char name[64] = {0};
+			memcpy(name, payload, record.size < sizeof name ? record.size : sizeof name - 1);
+
+			conn_map = realloc(conn_map, (conn_map_count + 1) * sizeof *conn_map);
+			assert(conn_map != NULL);
+
+			conn_map[conn_map_count].conn_id = record.conn_id;
+			conn_map[conn_map_count++].spec = find_spec(name);
+
+			continue;
+		}
+
+		if (record.kind != RECORD_KIND_CALL || record.size == 0) {
+			continue;
+		}
+
+		for (size_t i = conn_map_count; i-- > 0;) {
+			if (conn_map[i].conn_id == record.conn_id) {
+				add_sample(&specs[conn_map[i].spec], payload, record.size);
+				break;
+			}
+		}
+	}
+
+	rv = 0;
+
+done:
+
+	free(payload);
+	free(conn_map);
+	fclose(f);
+
+	return rv;
+}
+
+static int train(spec_t const* spec, size_t dict_size) {
+	if (spec->sample_count < MIN_SAMPLES) {
+		fprintf(stderr, "%s: Only %zu samples, need at least %d.\n", spec->spec, spec->sample_count, MIN_SAMPLES);
+		return -1;
+	}
+
+	char path[1024];
+
+	if (gv_dict_path(path, sizeof path, spec->spec) < 0) {
+		fprintf(stderr, "%s: Can't make a dictionary path for this spec.\n", spec->spec);
+		return -1;
+	}
+
+	void* const dict = malloc(dict_size);
+	assert(dict != NULL);
+
+	int rv = -1;
+	size_t const size = ZDICT_trainFromBuffer(dict, dict_size, spec->samples, spec->sample_sizes, spec->sample_count);
+
+	if (ZDICT_isError(size)) {
+		fprintf(stderr, "%s: Failed to train dictionary: %s\n", spec->spec, ZDICT_getErrorName(size));
+		goto done;
+	}
+
+	FILE* const f = fopen(path, "wb");
+
+	if (f == NULL) {
+		fprintf(stderr, "%s: Failed to open %s for writing.\n", spec->spec, path);
+		goto done;
+	}
+
+	if (fwrite(dict, size, 1, f) != 1) {
+		fprintf(stderr, "%s: Failed to write %s.\n", spec->spec, path);
+		fclose(f);
+		goto done;
+	}
+
+	fclose(f);
+
+	printf(
+		"%s: %zu byte dictionary (id=%u) from %zu samples (%zu bytes) written to %s.\n",
+		spec->spec,
+		size,
+		ZDICT_getDictID(dict, size),
+		spec->sample_count,
+		spec->samples_size,
+		path
+	);
+
+	rv = 0;
+
+done:
+
+	free(dict);
+	return rv;
+}
+
+static void usage(char const* progname) {
+	fprintf(stderr, "usage: %s [-o dir] [-s max_dict_size] recording ...\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	char const* const progname = argv[0];
+	size_t dict_size = DEFAULT_DICT_SIZE;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:s:")) != -1) {
+		switch (c) {
+		case 'o':
+			setenv(GV_DICT_DIR_ENVVAR, optarg, 1);
+			break;
+		case 's':
+			dict_size = strtoul(optarg, NULL, 0);
+
+			if (dict_size == 0 || dict_size > GV_DICT_MAX_SIZE) {
+				fprintf(stderr, "Dictionary size must be between 1 and %d bytes.\n", GV_DICT_MAX_SIZE);
+				return EXIT_FAILURE;
+			}
+
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		usage(progname);
+	}
+
+	for (int i = 0; i < argc; i++) {
+		if (read_recording(argv[i]) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	int rv = EXIT_SUCCESS;
+
+	for (size_t i = 0; i < spec_count; i++) {
+		if (train(&specs[i], dict_size) < 0) {
+			rv = EXIT_FAILURE;
+		}
+
+		free(specs[i].sample_sizes);
+		free(specs[i].samples);
+	}
+
+	free(specs);
+	return rv;
+}
@@ -2,7 +2,7 @@
 // Copyright (c) 2024-2025 Aymeric Wibo
 
 #if defined(__linux__)
-# define _POSIX_C_SOURCE 200809L // For fileno().
+# define _POSIX_C_SOURCE 200809L // For fileno() and sched_yield().
 #endif
 
 #include "lib/gv_ipc.h"
@@ -13,24 +13,109 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * Maximum number of times to try reading the nodes segment while gvd is publishing to it, before giving up.
+ */
+#define SEGMENT_ATTEMPTS_MAX 10000
 
 static umber_class_t const* cls = NULL;
 
 static bool gvd_running = false;
+
+/**
+ * Our mapping of the GrapeVine nodes segment, or NULL if we haven't mapped it yet.
+ *
+ * This is mapped once and then read from directly; it's only mapped again if gvd grows it past the end of our mapping.
+ */
+static gv_nodes_t* segment = NULL;
+static size_t segment_size = 0;
+
+/**
+ * Address of a node in the nodes segment.
+ */
+typedef struct {
+	bool used;
+	uint64_t host_id;
+	in_addr_t ipv4;
+} node_slot_t;
+
+/**
+ * Addresses of the nodes in the nodes segment as of the last time it was read, indexed by host ID.
+ *
+ * This is an open-addressed hash table whose size is a power of two, and which is kept at most half full.
+ */
 static size_t node_count = 0;
-static gv_node_ent_t nodes[256];
+static unsigned node_slot_bits = 0;
+static node_slot_t* node_slots = NULL;
+
+/**
+ * Our connection to the GrapeVine daemon's control socket, over which we're subscribed to specs, or -1 if we haven't connected yet (or it broke).
+ *
+ * Control messages are all the same size, so this is the one we're in the middle of receiving and how much of it we've received so far.
+ */
+static int ctl = -1;
+static gv_ctl_t ctl_rx;
+static size_t ctl_rx_got = 0;
 
 static __attribute__((constructor)) void init(void) {
 	cls = umber_class_new("aqua.kos.gv", UMBER_LVL_INFO, "KOS GrapeVine interaction.");
 }
 
+static node_slot_t* find_node_slot(uint64_t host_id) {
+	size_t const mask = ((size_t) 1 << node_slot_bits) - 1;
+	size_t i = gv_host_id_hash(host_id) >> (64 - node_slot_bits);
+
+	while (node_slots[i].used && node_slots[i].host_id != host_id) {
+		i = (i + 1) & mask;
+	}
+
+	return &node_slots[i];
+}
+
+static void add_node(gv_node_ent_t const* ent) {
+	if ((node_count + 1) * 2 > ((size_t) 1 << node_slot_bits)) {
+		size_t const prev_slot_count = node_slots == NULL ? 0 : (size_t) 1 << node_slot_bits;
+		node_slot_t* const prev_slots = node_slots;
+
+		node_slot_bits = node_slots == NULL ? 6 : node_slot_bits + 1;
+		node_slots = calloc((size_t) 1 << node_slot_bits, sizeof *node_slots);
+		assert(node_slots != NULL);
+
+		for (size_t i = 0; i < prev_slot_count; i++) {
+			if (prev_slots[i].used) {
+				*find_node_slot(prev_slots[i].host_id) = prev_slots[i];
+			}
+		}
+
+		free(prev_slots);
+	}
+
+	node_slot_t* const slot = find_node_slot(ent->host_id);
+
+	if (!slot->used) {
+		slot->used = true;
+		slot->host_id = ent->host_id;
+		node_count++;
+	}
+
+	slot->ipv4 = ent->ip.v4;
+}
+
 static void unlock(FILE* f) {
 	flock(fileno(f), LOCK_UN);
 	fclose(f);
@@ -102,6 +187,105 @@ int get_gv_host_id(uint64_t* host_id_out) {
 	return 0;
 }
 
+static int map_segment(void) {
+	char const* const path = gv_get_nodes_path();
+
+	if (segment != NULL) {
+		munmap(segment, segment_size);
+		segment = NULL;
+	}
+
+	int const fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		LOG_W(cls, "Couldn't open GrapeVine nodes segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof *segment) {
+		LOG_W(cls, "GrapeVine nodes segment %s is too small.", path);
+		close(fd);
+		return -1;
+	}
+
+	void* const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		LOG_W(cls, "Couldn't map GrapeVine nodes segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	gv_nodes_t* const seg = map;
+
+	if (seg->magic != GV_NODES_MAGIC || seg->vers != GV_NODES_VERS) {
+		LOG_W(cls, "GrapeVine nodes segment %s was written by an incompatible version of the GrapeVine daemon.", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	segment = seg;
+	segment_size = st.st_size;
+
+	return 0;
+}
+
+/**
+ * Copy a consistent snapshot of the node entries out of the nodes segment.
+ *
+ * This doesn't involve any syscalls, unless gvd is publishing at the same time or has grown the segment.
+ */
+static int read_segment(uint8_t** ents_ref, size_t* ents_bytes_ref) {
+	if (segment == NULL && map_segment() < 0) {
+		return -1;
+	}
+
+	uint8_t* ents = NULL;
+
+	for (size_t attempt = 0; attempt < SEGMENT_ATTEMPTS_MAX; attempt++) {
+		uint64_t const seq = atomic_load_explicit(&segment->seq, memory_order_acquire);
+
+		if (seq & 1) {
+			sched_yield(); // gvd is publishing.
+			continue;
+		}
+
+		size_t const ents_bytes = segment->ents_bytes;
+
+		if (sizeof *segment + ents_bytes > segment_size) {
+			// Either gvd grew the segment since we mapped it, or it changed ents_bytes while we were reading it.
+
+			if (atomic_load_explicit(&segment->size, memory_order_acquire) > segment_size && map_segment() < 0) {
+				break;
+			}
+
+			continue;
+		}
+
+		ents = realloc(ents, ents_bytes + 1);
+		assert(ents != NULL);
+		memcpy(ents, segment + 1, ents_bytes);
+
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&segment->seq, memory_order_relaxed) != seq) {
+			continue;
+		}
+
+		*ents_ref = ents;
+		*ents_bytes_ref = ents_bytes;
+
+		return 0;
+	}
+
+	LOG_W(cls, "Couldn't get a consistent read of the GrapeVine nodes segment.");
+	free(ents);
+
+	return -1;
+}
+
 ssize_t query_gv_vdevs(kos_vdev_descr_t** vdevs_out) {
 	LOG_V(cls, "Querying all VDEVs on GrapeVine network.");
 
@@ -116,10 +300,10 @@ ssize_t query_gv_vdevs(kos_vdev_descr_t** vdevs_out) {
 
 	// Actually read.
 
-	FILE* const f = fopen(gv_get_nodes_path(), "r");
+	uint8_t* ents;
+	size_t ents_bytes;
 
-	if (f == NULL) {
-		LOG_W(cls, "Couldn't load GrapeVine nodes file %s: %s", gv_get_nodes_path(), strerror(errno));
+	if (read_segment(&ents, &ents_bytes) < 0) {
 		return 0;
 	}
 
@@ -128,38 +312,41 @@ ssize_t query_gv_vdevs(kos_vdev_descr_t** vdevs_out) {
 
 	node_count = 0;
 
-	int fread_rv;
-	gv_node_ent_t header;
+	if (node_slots != NULL) {
+		memset(node_slots, 0, ((size_t) 1 << node_slot_bits) * sizeof *node_slots);
+	}
 
-	while ((fread_rv = fread(&header, 1, sizeof header, f)) > 0) {
-		nodes[node_count++] = header;
+	size_t off = 0;
+	gv_node_ent_t header;
 
-		if (node_count >= sizeof nodes / sizeof *nodes) {
-			LOG_E(cls, "Too many nodes in GrapeVine nodes file.");
-			goto done;
+	while (off < ents_bytes) {
+		if (ents_bytes - off < sizeof header) {
+			LOG_W(cls, "Failed to read GrapeVine node header.");
+			break;
 		}
 
+		memcpy(&header, ents + off, sizeof header);
+		off += sizeof header;
+
+		add_node(&header);
+
 		LOG_I(cls, "Reading VDEVs of node with host ID 0x%" PRIx64 " (%u VDEVs).", header.host_id, header.vdev_count);
 
 		size_t const vdevs_bytes = header.vdev_count * sizeof *vdevs;
-		size_t const ent_size = sizeof header + vdevs_bytes;
 
-		gv_node_ent_t* const ent = malloc(ent_size);
-		assert(ent != NULL);
-		memcpy(ent, &header, sizeof header);
-
-		if (fread((void*) ent + sizeof header, 1, vdevs_bytes, f) != vdevs_bytes) {
+		if (ents_bytes - off < vdevs_bytes) {
 			LOG_E(cls, "Failed to read VDEVs of node.");
 
-			free(ent);
-			fclose(f);
+			free(vdevs);
+			free(ents);
 
 			return -1;
 		}
 
 		vdevs = realloc(vdevs, (vdev_count + header.vdev_count) * sizeof *vdevs);
-		assert(vdevs != NULL);
-		memcpy(vdevs + vdev_count, (void*) ent + sizeof header, vdevs_bytes);
+		assert(vdevs != NULL || vdev_count + header.vdev_count == 0);
+		memcpy(vdevs + vdev_count, ents + off, vdevs_bytes);
+		off += vdevs_bytes;
 
 		LOG_V(cls, "Check the VDEVs reported. %zu", (vdev_count + header.vdev_count) * sizeof *vdevs);
 
@@ -192,36 +379,211 @@ ssize_t query_gv_vdevs(kos_vdev_descr_t** vdevs_out) {
 		}
 
 		vdev_count += header.vdev_count;
-		free(ent);
 	}
 
 	if (node_count == 0) {
-		LOG_I(cls, "No GrapeVine nodes found on network.", gv_get_nodes_path());
+		LOG_I(cls, "No GrapeVine nodes found on network.");
 	}
 
-done:
-
-	if (fread_rv < 0) {
-		LOG_W(cls, "Failed to read GrapeVine node header.");
-	}
-
-	fclose(f);
+	free(ents);
 	*vdevs_out = vdevs;
 
 	return vdev_count;
 }
 
 int gv_get_ip_by_host_id(uint64_t host_id, in_addr_t* ipv4) {
-	for (size_t i = 0; i < node_count; i++) {
-		gv_node_ent_t* const node = &nodes[i];
+	node_slot_t const* slot = node_count == 0 ? NULL : find_node_slot(host_id);
 
-		if (node->host_id != host_id) {
+	// We may have learned about the node from a subscription since we last read the nodes segment.
+
+	if (slot == NULL || !slot->used) {
+		kos_vdev_descr_t* vdevs;
+
+		if (query_gv_vdevs(&vdevs) > 0) {
+			free(vdevs);
+		}
+
+		slot = node_count == 0 ? NULL : find_node_slot(host_id);
+	}
+
+	if (slot == NULL || !slot->used) {
+		return -1;
+	}
+
+	*ipv4 = slot->ipv4;
+	return 0;
+}
+
+int gv_get_vdev(uint64_t host_id, uint64_t vdev_id, kos_vdev_descr_t* vdev_out) {
+	kos_vdev_descr_t* vdevs;
+	ssize_t const vdev_count = query_gv_vdevs(&vdevs);
+
+	int rv = -1;
+
+	for (ssize_t i = 0; i < vdev_count; i++) {
+		if (vdevs[i].host_id == host_id && vdevs[i].vdev_id == vdev_id) {
+			*vdev_out = vdevs[i];
+			rv = 0;
+			break;
+		}
+	}
+
+	free(vdevs);
+	return rv;
+}
+
+static int ctl_connect(void) {
+	if (ctl >= 0) {
+		return 0;
+	}
+
+	if (!gvd_running) {
+		return -1;
+	}
+
+	char const* const path = gv_get_ctl_path();
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		LOG_W(cls, "GrapeVine daemon control socket path %s is too long.", path);
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+	int const sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock < 0) {
+		LOG_W(cls, "socket(AF_UNIX): %s", strerror(errno));
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr*) &addr, sizeof addr) < 0) {
+		LOG_W(cls, "Couldn't connect to GrapeVine daemon control socket %s: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	ctl = sock;
+	ctl_rx_got = 0;
+
+	return 0;
+}
+
+static void ctl_close(void) {
+	close(ctl);
+	ctl = -1;
+}
+
+/**
+ * Receive the rest of a control message.
+ *
+ * @param block Whether to wait for the message if it isn't all there yet.
+ * @return 1 if a whole message was received, 0 if we're not blocking and it isn't all there yet, or -1 if the control socket broke (in which case it's closed).
+ */
+static int ctl_recv(bool block) {
+	while (ctl_rx_got < sizeof ctl_rx) {
+		ssize_t const r = recv(ctl, (uint8_t*) &ctl_rx + ctl_rx_got, sizeof ctl_rx - ctl_rx_got, block ? 0 : MSG_DONTWAIT);
+
+		if (r < 0 && errno == EINTR) {
 			continue;
 		}
 
-		memcpy(ipv4, &node->ip, sizeof *ipv4);
+		if (r < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+
+		if (r <= 0) {
+			LOG_W(cls, "GrapeVine daemon control socket broke: %s", r == 0 ? "closed" : strerror(errno));
+			ctl_close();
+			return -1;
+		}
+
+		ctl_rx_got += r;
+	}
+
+	ctl_rx_got = 0;
+	return 1;
+}
+
+/**
+ * Pass an ATTACH or DETACH control message on to a callback as the corresponding notification.
+ */
+static void ctl_notify(gv_ctl_t const* msg, kos_notif_cb_t cb, void* data) {
+	kos_notif_t notif = {0};
+
+	switch (msg->type) {
+	case GV_CTL_TYPE_ATTACH:
+		notif.kind = KOS_NOTIF_ATTACH;
+		notif.attach.vdev = msg->attach.vdev;
+
+		LOG_V(cls, "VDEV (%s, vid=0x%" PRIx64 ") of node with host ID 0x%" PRIx64 " attached.", notif.attach.vdev.human, notif.attach.vdev.vdev_id, notif.attach.vdev.host_id);
+		break;
+	case GV_CTL_TYPE_DETACH:
+		notif.kind = KOS_NOTIF_DETACH;
+		notif.detach.host_id = msg->detach.host_id;
+		notif.detach.vdev_id = msg->detach.vdev_id;
+
+		LOG_V(cls, "VDEV (vid=0x%" PRIx64 ") of node with host ID 0x%" PRIx64 " detached.", notif.detach.vdev_id, notif.detach.host_id);
+		break;
+	default:
+		LOG_W(cls, "Got unexpected control message type %d from GrapeVine daemon.", msg->type);
+		return;
+	}
+
+	cb(&notif, data);
+}
+
+int gv_sub(char const* spec, kos_notif_cb_t cb, void* data) {
+	if (ctl_connect() < 0) {
+		return -1;
+	}
+
+	gv_ctl_t msg = {
+		.type = GV_CTL_TYPE_SUBSCRIBE,
+	};
+
+	if (strlen(spec) >= sizeof msg.sub.spec) {
+		LOG_W(cls, "Spec '%s' is too long to subscribe to.", spec);
+		return -1;
+	}
+
+	strcpy(msg.sub.spec, spec);
+
+	if (send(ctl, &msg, sizeof msg, 0) != sizeof msg) {
+		LOG_W(cls, "Couldn't subscribe to '%s' VDEVs: %s", spec, strerror(errno));
+		ctl_close();
+		return -1;
+	}
+
+	// The GrapeVine daemon replies with the VDEVs of the spec it knows about followed by RES.
+	// There may also still be ATTACH and DETACH messages for previous subscriptions before all that, which we just pass on too.
+
+	for (;;) {
+		if (ctl_recv(true) < 0) {
+			return -1;
+		}
+
+		if (ctl_rx.type != GV_CTL_TYPE_RES) {
+			ctl_notify(&ctl_rx, cb, data);
+			continue;
+		}
+
+		if (ctl_rx.res.err != 0) {
+			LOG_W(cls, "GrapeVine daemon refused subscription to '%s' VDEVs: %s", spec, strerror(ctl_rx.res.err));
+			return -1;
+		}
+
 		return 0;
 	}
+}
 
-	return -1;
+void gv_poll_subs(kos_notif_cb_t cb, void* data) {
+	while (ctl >= 0 && ctl_recv(false) > 0) {
+		ctl_notify(&ctl_rx, cb, data);
+	}
 }
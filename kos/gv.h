@@ -20,6 +20,28 @@
  */
 ssize_t query_gv_vdevs(kos_vdev_descr_t** vdevs_out);
 
+/**
+ * Subscribe to the VDEVs of a spec on the GrapeVine over the GrapeVine daemon's control socket.
+ *
+ * The VDEVs of the spec the GrapeVine daemon currently knows about are passed to the callback as attach notifications before this returns.
+ * So are any attach and detach notifications for specs previously subscribed to which came in in the meantime.
+ * Subsequent ones are passed to the callback by {@link gv_poll_subs}.
+ *
+ * @param spec The spec to subscribe to.
+ * @param cb The callback to pass notifications to.
+ * @param data User data to pass to the callback.
+ * @return 0 on success, or a negative value if the control socket can't be used (e.g. because the GrapeVine daemon isn't running or is too old), in which case {@link query_gv_vdevs} must be used instead.
+ */
+int gv_sub(char const* spec, kos_notif_cb_t cb, void* data);
+
+/**
+ * Pass attach and detach notifications for the specs subscribed to which have come in since last time to a callback, without blocking.
+ *
+ * @param cb The callback to pass notifications to.
+ * @param data User data to pass to the callback.
+ */
+void gv_poll_subs(kos_notif_cb_t cb, void* data);
+
 /**
  * Get the host ID of the current machine.
  *
@@ -38,3 +60,13 @@ int get_gv_host_id(uint64_t* host_id_out);
  * @return 0 on success, or a negative value if node couldn't be found.
  */
 int gv_get_ip_by_host_id(uint64_t host_id, in_addr_t* ipv4);
+
+/**
+ * Get the descriptor of a VDEV on the GrapeVine by its host ID and VDEV ID.
+ *
+ * @param host_id The host ID of the node the VDEV is on.
+ * @param vdev_id The VDEV ID of the VDEV.
+ * @param vdev_out Reference to the VDEV descriptor the VDEV's descriptor should be written to.
+ * @return 0 on success, or a negative value if the VDEV couldn't be found.
+ */
+int gv_get_vdev(uint64_t host_id, uint64_t vdev_id, kos_vdev_descr_t* vdev_out);
@@ -390,6 +390,22 @@ typedef enum : uint8_t {
 	KOS_VDEV_KIND_LOCAL,
 } kos_vdev_kind_t;
 
+/**
+ * Profile of the calls a client expects to make to a VDEV.
+ *
+ * This is used by {@link kos_vdev_cost} to estimate how expensive calls to a given VDEV would be.
+ */
+typedef enum : uint8_t {
+	/**
+	 * Calls are small and their cost is dominated by round-trip latency (e.g. font layout queries).
+	 */
+	KOS_WORKLOAD_LATENCY,
+	/**
+	 * Calls carry large amounts of data and their cost is dominated by bandwidth (e.g. texture uploads).
+	 */
+	KOS_WORKLOAD_BANDWIDTH,
+} kos_workload_t;
+
 /**
  * A VDEV descriptor.
  */
@@ -664,6 +680,7 @@ void kos_flush(bool sync);
 
 // Request a VDEV's following the given spec to be loaded.
 // This function is guaranteed to immediately call the callback for all `VDEV_KIND_LOCAL` and `VDEV_KIND_UDS` VDEVs, so the client can exit if it doesn't immediately find the VDEV it needs.
+// GrapeVine VDEVs following the spec which come and go after this are then notified about (`KOS_NOTIF_ATTACH` and `KOS_NOTIF_DETACH`) from `kos_flush`, as long as the GrapeVine daemon is running.
 
 void kos_req_vdev(char const* spec);
 
@@ -672,6 +689,18 @@ void kos_req_vdev(char const* spec);
 kos_cookie_t kos_vdev_conn(uint64_t host_id, uint64_t vdev_id);
 void kos_vdev_disconn(uint64_t conn_id);
 
+// Allow a connection to transparently fail over to another VDEV with the same spec and functions if the one it's connected to goes away.
+// The connection ID stays the same, and the call in flight at the time is replayed on the new VDEV, so only enable this for connections to stateless VDEVs whose calls are idempotent.
+// This has no effect on local connections.
+
+void kos_vdev_set_failover(uint64_t conn_id, bool failover);
+
+// Get the expected cost of a call to a VDEV, in nanoseconds, for a given workload profile.
+// This takes into account the kind of the VDEV and, for GrapeVine VDEVs, the RTT and throughput measured on previous calls to its host.
+// Lower is better; this is meant for comparing VDEVs, not as an accurate prediction.
+
+uint64_t kos_vdev_cost(kos_vdev_descr_t const* vdev, kos_workload_t workload);
+
 // Call a function on a VDEV.
 
 kos_cookie_t kos_vdev_call(uint64_t conn_id, uint32_t fn_id, void const* args);
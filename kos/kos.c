@@ -3,8 +3,11 @@
 
 #include "action.h"
 #include "conn.h"
+#include "cost.h"
 #include "gv.h"
+#include "record.h"
 
+#include "lib/trace.h"
 #include "lib/vdriver.h"
 #include "lib/vdriver_loader.h"
 
@@ -21,10 +24,12 @@
 #include <ifaddrs.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 static umber_class_t const* init_cls = NULL;
@@ -35,12 +40,40 @@ static umber_class_t const* call_cls = NULL;
 
 static bool has_init = false;
 static uint64_t local_host_id;
+
+/**
+ * ID of this KOS session, sent along with our GrapeVine connections so that remote gvds can serve all of them from a single KOS agent.
+ */
+static uint64_t session_id;
 static kos_notif_cb_t client_notif_cb = NULL;
 static void* client_notif_data = NULL;
 
+/**
+ * Maximum number of times a connection may fail over to another VDEV in a row before we give up on the calls in flight on it.
+ */
+#define GV_MAX_FAILOVERS 3
+
+/**
+ * Maximum number of calls which may be in flight on a GrapeVine connection at once.
+ */
+#define GV_PIPELINE_DEPTH 64
+
+/**
+ * ZSTD compression level dictionaries are created with.
+ *
+ * Calls compressed with a dictionary are small, so the level matters much less than for other calls.
+ */
+#define ZSTD_DICT_LEVEL 3
+
 static kos_cookie_t cookies = 0;
 static kos_ino_t inos = 0;
 
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void __attribute__((constructor)) kos_init(void) {
 	has_init = true;
 
@@ -71,6 +104,11 @@ kos_api_vers_t kos_hello(kos_api_vers_t min, kos_api_vers_t max, kos_descr_v4_t*
 		local_host_id = 0;
 	}
 
+	// Session IDs only have to be unique on this host, so our PID and when we started are plenty.
+	// This can't be 0, which means the session isn't to be shared.
+
+	session_id = ((uint64_t) getpid() << 32 ^ now()) | 1;
+
 	descr->api_vers = KOS_API_V4;
 	descr->best_api_vers = KOS_API_V4;
 	strcpy((char*) descr->name, "Generic Unix-like system's KOS");
@@ -80,6 +118,30 @@ kos_api_vers_t kos_hello(kos_api_vers_t min, kos_api_vers_t max, kos_descr_v4_t*
 	return descr->api_vers;
 }
 
+static void record_notif(kos_notif_t const* notif) {
+	if (!record_enabled) {
+		return;
+	}
+
+	switch (notif->kind) {
+	case KOS_NOTIF_CONN:;
+		conn_t const* const conn = &conns[notif->conn_id];
+		record_conn(notif->cookie, notif->conn_id, conn->type == CONN_TYPE_LOCAL ? conn->vdriver->spec : (char const*) conn->spec);
+		break;
+	case KOS_NOTIF_CALL_RET:
+	case KOS_NOTIF_CALL_FAIL:
+		record_ret(notif);
+		break;
+	default:
+		break;
+	}
+}
+
+static void notify_client(kos_notif_t const* notif) {
+	record_notif(notif);
+	client_notif_cb(notif, client_notif_data);
+}
+
 static void notif_cb(kos_notif_t const* notif, void* data) {
 	if (notif->kind >= KOS_NOTIF_KIND_COUNT) {
 		LOG_E(notif_cls, "Received notification of unknown kind %d.", notif->kind);
@@ -100,6 +162,8 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 		conn->alive = true;
 		conn->fn_count = notif->conn.fn_count;
 		conn->fns = notif->conn.fns;
+		conn->const_count = notif->conn.const_count;
+		conn->consts = notif->conn.consts;
 
 		break;
 	default:
@@ -107,6 +171,7 @@ static void notif_cb(kos_notif_t const* notif, void* data) {
 	}
 
 	LOG_V(notif_cls, "Forwarding notification to client.");
+	record_notif(notif);
 	client_notif_cb(notif, data);
 }
 
@@ -140,6 +205,14 @@ void kos_req_vdev(char const* spec) {
 
 	LOG_V(init_cls, "Trying to find VDEV on the GrapeVine for spec '%s'.", spec);
 
+	// Subscribing to the spec gets us its VDEVs straight away, and then tells us (in kos_flush) as soon as any come or go.
+	// If we can't, fall back to reading them from the nodes segment.
+
+	if (gv_sub(spec, notif_cb, client_notif_data) == 0) {
+		LOG_V(init_cls, "Done looking for VDEVs.");
+		return;
+	}
+
 	kos_vdev_descr_t* gv_vdevs;
 	ssize_t const gv_vdev_count = query_gv_vdevs(&gv_vdevs);
 
@@ -184,7 +257,7 @@ static void conn_local(kos_cookie_t cookie, action_t* action, bool sync) {
 			.cookie = cookie,
 		};
 
-		client_notif_cb(&notif, client_notif_data);
+		notify_client(&notif);
 		return;
 	}
 
@@ -194,29 +267,67 @@ static void conn_local(kos_cookie_t cookie, action_t* action, bool sync) {
 	vdriver->conn(cookie, action->conn.vdev_id, cid);
 }
 
-static void conn_gv(kos_cookie_t cookie, action_t* action, bool sync) {
-	LOG_V(
-		conn_cls,
-		"Trying to connect to VDEV (%" PRIu64 ":%" PRIu64 ") on the GrapeVine (cookie=0x%" PRIx64 ").",
-		action->conn.host_id,
-		action->conn.vdev_id,
-		cookie
-	);
+static void free_conn_schema(kos_notif_t* notif) {
+	for (size_t i = 0; i < notif->conn.const_count; i++) {
+		kos_const_t* const c = (kos_const_t*) &notif->conn.consts[i];
+		kos_val_free(c->type, &c->val);
+	}
+
+	for (size_t i = 0; i < notif->conn.fn_count; i++) {
+		free((void*) notif->conn.fns[i].params);
+	}
+
+	free((void*) notif->conn.consts);
+	free((void*) notif->conn.fns);
+}
 
+/**
+ * Establish a connection to a VDEV on the GrapeVine.
+ *
+ * This connects to the node's gvd, sends it a CONN_VDEV packet, and deserializes the constants and functions of the CONN_VDEV_RES it gets back into the connection notification.
+ *
+ * @param host_id The host ID of the node the VDEV is on.
+ * @param vdev_id The VDEV ID of the VDEV.
+ * @param sync Whether the connection request is synchronous.
+ * @param sock_out Reference to where the connected socket should be written.
+ * @param remote_cid_out Reference to where the remote connection ID should be written.
+ * @param dict_id_out Reference to where the ID of the dictionary the remote KOS agent advertised should be written.
+ * @param notif Connection notification whose `conn` member is to be filled in.
+ * @return 0 on success, or a negative value on failure.
+ */
+static int gv_conn_vdev(uint64_t host_id, vid_t vdev_id, bool sync, int* sock_out, uint64_t* remote_cid_out, uint32_t* dict_id_out, kos_notif_t* notif) {
 	in_addr_t ipv4;
 
-	if (gv_get_ip_by_host_id(action->conn.host_id, &ipv4) < 0) {
-		LOG_E(conn_cls, "Failed to find IP address of host ID %" PRIu64 ".", action->conn.host_id);
-		goto fail;
+	if (gv_get_ip_by_host_id(host_id, &ipv4) < 0) {
+		LOG_E(conn_cls, "Failed to find IP address of host ID %" PRIu64 ".", host_id);
+		return -1;
 	}
 
 	int const sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
 	if (sock < 0) {
 		LOG_E(conn_cls, "Failed to create socket: %s", strerror(errno));
-		goto fail;
+		return -1;
 	}
 
+	// If the node vanishes without closing the connection, we'd otherwise be stuck in a blocking recv until the kernel gives up on it, which can take many minutes.
+	// Keepalives let us notice a dead peer within a few seconds so we can fail over.
+
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &(int) {1}, sizeof(int));
+
+#if defined(TCP_KEEPIDLE)
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &(int) {GV_KEEPALIVE_IDLE}, sizeof(int));
+#elif defined(TCP_KEEPALIVE) // macOS.
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPALIVE, &(int) {GV_KEEPALIVE_IDLE}, sizeof(int));
+#endif
+
+#if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &(int) {GV_KEEPALIVE_INTVL}, sizeof(int));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &(int) {GV_KEEPALIVE_CNT}, sizeof(int));
+#endif
+
+	gv_zerocopy_enable(sock); // Not a problem if this isn't supported.
+
 	struct sockaddr_in addr = {
 		.sin_family = AF_INET,
 		.sin_port = htons(GV_PORT),
@@ -225,21 +336,26 @@ static void conn_gv(kos_cookie_t cookie, action_t* action, bool sync) {
 
 	if (connect(sock, (struct sockaddr*) &addr, sizeof addr) < 0) {
 		LOG_E(conn_cls, "Failed to connect: %s", strerror(errno));
-		close(sock);
-		goto fail;
+		goto err;
 	}
 
 	gv_packet_t const conn_packet = {
-		.header.type = GV_PACKET_TYPE_CONN_VDEV,
-		.conn_vdev.vdev_id = action->conn.vdev_id,
+		.header = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_CONN_VDEV,
+			.len = sizeof(gv_conn_vdev_t),
+		},
+		.conn_vdev = {
+			.vdev_id = vdev_id,
+			.session_id = session_id,
+		},
 	};
 
 	size_t const conn_size = sizeof conn_packet.header + sizeof conn_packet.conn_vdev;
 
-	if (send(sock, &conn_packet, conn_size, 0) != (ssize_t) conn_size) {
+	if (gv_send(sock, &conn_packet, conn_size, 0) != (ssize_t) conn_size) {
 		LOG_E(conn_cls, "Failed to send VDEV connection packet: %s", strerror(errno));
-		close(sock);
-		goto fail;
+		goto err;
 	}
 
 	if (!sync) { // TODO
@@ -250,28 +366,34 @@ static void conn_gv(kos_cookie_t cookie, action_t* action, bool sync) {
 
 	gv_packet_t conn_res_packet;
 
-	if (recv(sock, &conn_res_packet, sizeof conn_res_packet.header, MSG_WAITALL) != sizeof conn_res_packet.header) {
+	if (gv_recv(sock, &conn_res_packet, sizeof conn_res_packet.header, MSG_WAITALL) != sizeof conn_res_packet.header) {
 		LOG_E(conn_cls, "Failed to get response header.");
-		close(sock);
-		goto fail;
+		goto err;
+	}
+
+	if (!gv_packet_header_valid(&conn_res_packet.header)) {
+		LOG_E(conn_cls, "Got a response with an unsupported protocol version (%d).", conn_res_packet.header.vers);
+		goto err;
 	}
 
 	if (conn_res_packet.header.type == GV_PACKET_TYPE_CONN_VDEV_FAIL) {
 		LOG_E(conn_cls, "Got a VDEV connection failure response.");
-		close(sock);
-		goto fail;
+		goto err;
 	}
 
 	if (conn_res_packet.header.type != GV_PACKET_TYPE_CONN_VDEV_RES) {
 		LOG_E(conn_cls, "Got a unexpected response to VDEV connection request: %s.", gv_packet_type_strs[conn_res_packet.header.type]);
-		close(sock);
-		goto fail;
+		goto err;
 	}
 
-	if (recv(sock, &conn_res_packet.conn_vdev_res, sizeof conn_res_packet.conn_vdev_res, MSG_WAITALL) != sizeof conn_res_packet.conn_vdev_res) {
+	if (gv_recv(sock, &conn_res_packet.conn_vdev_res, sizeof conn_res_packet.conn_vdev_res, MSG_WAITALL) != sizeof conn_res_packet.conn_vdev_res) {
 		LOG_E(conn_cls, "Failed to get response payload.");
-		close(sock);
-		goto fail;
+		goto err;
+	}
+
+	if (conn_res_packet.conn_vdev_res.size != conn_res_packet.header.len || conn_res_packet.conn_vdev_res.size < sizeof conn_res_packet.conn_vdev_res) {
+		LOG_E(conn_cls, "VDEV connection response has an inconsistent size.");
+		goto err;
 	}
 
 	gv_conn_vdev_res_t* const conn_vdev_res = malloc(conn_res_packet.conn_vdev_res.size);
@@ -279,70 +401,297 @@ static void conn_gv(kos_cookie_t cookie, action_t* action, bool sync) {
 	memcpy(conn_vdev_res, &conn_res_packet.conn_vdev_res, sizeof conn_res_packet.conn_vdev_res);
 	size_t const remaining = (ssize_t) conn_vdev_res->size - sizeof *conn_vdev_res;
 
-	if (recv(sock, (void*) conn_vdev_res + sizeof conn_res_packet.conn_vdev_res, remaining, MSG_WAITALL) != (ssize_t) remaining) {
+	if (gv_recv(sock, (void*) conn_vdev_res + sizeof conn_res_packet.conn_vdev_res, remaining, MSG_WAITALL) != (ssize_t) remaining) {
 		LOG_E(conn_cls, "Failed to get response payload.");
 		free(conn_vdev_res);
-		close(sock);
-		goto fail;
+		goto err;
 	}
 
 	LOG_V(conn_cls, "Managed to connect to VDEV (const_count=%zu, fn_count=%zu)!", conn_vdev_res->const_count, conn_vdev_res->fn_count);
 
-	kos_notif_t notif = {
-		.kind = KOS_NOTIF_CONN,
-		.cookie = cookie,
-		.conn = {
-			.const_count = conn_vdev_res->const_count,
-			.fn_count = conn_vdev_res->fn_count,
-		},
-	};
-
+	// Deserialize the rest of the CONN_VDEV_RES packet.
 	// TODO Where the hell do we free all of this?
 
-	// Deserialize the rest of the CONN_VDEV_RES packet.
+	notif->conn.const_count = conn_vdev_res->const_count;
+	notif->conn.fn_count = conn_vdev_res->fn_count;
 
-	notif.conn.consts = malloc(conn_vdev_res->const_count * sizeof *notif.conn.consts);
-	assert(notif.conn.consts != NULL);
+	notif->conn.consts = malloc(conn_vdev_res->const_count * sizeof *notif->conn.consts);
+	assert(notif->conn.consts != NULL);
 
-	notif.conn.fns = malloc(conn_vdev_res->fn_count * sizeof *notif.conn.fns);
-	assert(notif.conn.fns != NULL);
+	notif->conn.fns = malloc(conn_vdev_res->fn_count * sizeof *notif->conn.fns);
+	assert(notif->conn.fns != NULL);
 
 	void* buf = (void*) conn_vdev_res + sizeof *conn_vdev_res;
 
 	for (size_t i = 0; i < conn_vdev_res->const_count; i++) {
-		buf += gv_deserialize_const(buf, (kos_const_t*) &notif.conn.consts[i]);
+		buf += gv_deserialize_const(buf, (kos_const_t*) &notif->conn.consts[i]);
 	}
 
 	for (size_t i = 0; i < conn_vdev_res->fn_count; i++) {
-		buf += gv_deserialize_fn(buf, (kos_fn_t*) &notif.conn.fns[i]);
+		buf += gv_deserialize_fn(buf, (kos_fn_t*) &notif->conn.fns[i]);
+	}
+
+	*sock_out = sock;
+	*remote_cid_out = conn_vdev_res->conn_id;
+	*dict_id_out = conn_vdev_res->dict_id;
+
+	free(conn_vdev_res);
+	return 0;
+
+err:
+
+	close(sock);
+	return -1;
+}
+
+/**
+ * Set up the dictionary call arguments on a GrapeVine connection are compressed with.
+ *
+ * We can only use a dictionary if we have the exact one the KOS agent advertised for the VDEV's spec; otherwise, we fall back to compressing without one.
+ *
+ * @param conn The connection, whose spec must already be set.
+ * @param dict_id The ID of the dictionary the KOS agent advertised, or 0 if it has none.
+ */
+static void conn_use_dict(conn_t* conn, uint32_t dict_id) {
+	if (conn->dict_id == dict_id) {
+		return;
+	}
+
+	ZSTD_freeCDict(conn->cdict);
+	conn->cdict = NULL;
+	conn->dict_id = 0;
+
+	if (dict_id == 0 || conn->spec[0] == '\0') {
+		return;
+	}
+
+	size_t dict_size;
+	void* const dict = gv_dict_load((char*) conn->spec, &dict_size);
+
+	if (dict == NULL) {
+		LOG_V(conn_cls, "KOS agent has a dictionary for '%s' (id=%" PRIu32 "), but we don't.", conn->spec, dict_id);
+		return;
+	}
+
+	if (ZSTD_getDictID_fromDict(dict, dict_size) != dict_id) {
+		LOG_W(conn_cls, "Our dictionary for '%s' doesn't match the KOS agent's (id=%" PRIu32 "), not using it.", conn->spec, dict_id);
+		free(dict);
+		return;
+	}
+
+	conn->cdict = ZSTD_createCDict(dict, dict_size, ZSTD_DICT_LEVEL);
+	free(dict);
+
+	if (conn->cdict == NULL) {
+		LOG_W(conn_cls, "Failed to create ZSTD dictionary for '%s'.", conn->spec);
+		return;
+	}
+
+	conn->dict_id = dict_id;
+	LOG_V(conn_cls, "Using dictionary for '%s' (id=%" PRIu32 ").", conn->spec, dict_id);
+}
+
+static void conn_gv(kos_cookie_t cookie, action_t* action, bool sync) {
+	LOG_V(
+		conn_cls,
+		"Trying to connect to VDEV (%" PRIu64 ":%" PRIu64 ") on the GrapeVine (cookie=0x%" PRIx64 ").",
+		action->conn.host_id,
+		action->conn.vdev_id,
+		cookie
+	);
+
+	kos_notif_t notif = {
+		.kind = KOS_NOTIF_CONN,
+		.cookie = cookie,
+	};
+
+	int sock;
+	uint64_t remote_cid;
+	uint32_t dict_id;
+
+	if (gv_conn_vdev(action->conn.host_id, action->conn.vdev_id, sync, &sock, &remote_cid, &dict_id, &notif) < 0) {
+		kos_notif_t const fail_notif = {
+			.kind = KOS_NOTIF_CONN_FAIL,
+			.cookie = cookie,
+		};
+
+		notify_client(&fail_notif);
+		return;
 	}
 
 	// Create connection.
 
-	notif.conn_id = conn_new_gv(action->conn.vdev_id, sock, conn_vdev_res->conn_id);
+	notif.conn_id = conn_new_gv(action->conn.vdev_id, action->conn.host_id, sock, remote_cid);
 	conn_t* const conn = &conns[notif.conn_id];
 
 	conn->alive = true;
 	conn->fn_count = notif.conn.fn_count;
 	conn->fns = notif.conn.fns;
+	conn->const_count = notif.conn.const_count;
+	conn->consts = notif.conn.consts;
+
+	// Request IDs only have to be unique per connection, but starting each connection's off somewhere different makes them unique across traces too.
+	// That way, the KOS agent's trace events for a call can be tied back to ours by request ID alone (see TRACE_FLOW).
 
-	LOG_V(conn_cls, "Created connection (cid=%" PRIu64 ", remote_cid=%" PRIu64 ").", notif.conn_id, conn_vdev_res->conn_id);
+	conn->next_req_id = session_id ^ (notif.conn_id << 48);
+
+	conn->layouts = malloc(conn->fn_count * sizeof *conn->layouts);
+	assert(conn->fn_count == 0 || conn->layouts != NULL);
+
+	for (size_t i = 0; i < conn->fn_count; i++) {
+		gv_fn_layout_init(&conn->layouts[i], &conn->fns[i]);
+	}
+
+	// Remember the spec and its version so we know what to look for if we ever need to fail over.
+
+	kos_vdev_descr_t vdev;
+
+	if (gv_get_vdev(action->conn.host_id, action->conn.vdev_id, &vdev) == 0) {
+		memcpy(conn->spec, vdev.spec, sizeof conn->spec);
+		conn->vers = vdev.vers;
+	}
+
+	conn_use_dict(conn, dict_id);
+
+	LOG_V(conn_cls, "Created connection (cid=%" PRIu64 ", remote_cid=%" PRIu64 ").", notif.conn_id, remote_cid);
 
 	// Finally, send notification.
 
-	free(conn_vdev_res);
-	client_notif_cb(&notif, client_notif_data);
+	notify_client(&notif);
+}
 
-	return;
+/**
+ * Check that the functions of a replacement VDEV match the ones we've cached for a connection.
+ *
+ * Clients have already resolved function IDs and parameter schemas from the original connection, so the replacement must match exactly for calls to be transparently replayable.
+ */
+static bool same_fns(conn_t const* conn, kos_notif_t const* notif) {
+	if (notif->conn.fn_count != conn->fn_count) {
+		return false;
+	}
 
-fail:;
+	for (size_t i = 0; i < conn->fn_count; i++) {
+		kos_fn_t const* const a = &conn->fns[i];
+		kos_fn_t const* const b = &notif->conn.fns[i];
 
-	kos_notif_t fail_notif = {
-		.kind = KOS_NOTIF_CONN_FAIL,
-		.cookie = cookie,
-	};
+		if (strcmp((char*) a->name, (char*) b->name) != 0 || a->ret_type != b->ret_type || a->param_count != b->param_count) {
+			return false;
+		}
+
+		for (size_t j = 0; j < a->param_count; j++) {
+			if (a->params[j].type != b->params[j].type) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Check that the constants of a replacement VDEV match the ones of a connection.
+ *
+ * Clients read constants once when connecting and pass them back as arguments (e.g. the test component's SIXTY_NINE), so these must be the same too.
+ */
+static bool same_consts(conn_t const* conn, kos_notif_t const* notif) {
+	if (notif->conn.const_count != conn->const_count) {
+		return false;
+	}
+
+	for (size_t i = 0; i < conn->const_count; i++) {
+		kos_const_t const* const a = &conn->consts[i];
+		kos_const_t const* const b = &notif->conn.consts[i];
+
+		if (strcmp((char*) a->name, (char*) b->name) != 0 || a->type != b->type) {
+			return false;
+		}
+
+		bool same;
+
+		switch (a->type) {
+		case KOS_TYPE_BUF:
+			same = a->val.buf.size == b->val.buf.size && memcmp(a->val.buf.ptr, b->val.buf.ptr, a->val.buf.size) == 0;
+			break;
+		case KOS_TYPE_OPAQUE_PTR:
+		case KOS_TYPE_PTR:
+			same = memcmp(&a->val.opaque_ptr, &b->val.opaque_ptr, sizeof a->val.opaque_ptr) == 0;
+			break;
+		default:
+			same = memcmp(&a->val, &b->val, gv_serialize_val_size(a->type, &a->val)) == 0;
+			break;
+		}
+
+		if (!same) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Fail a GrapeVine connection over to another VDEV with the same spec.
+ *
+ * The replacement must have the same spec version, functions, and constants.
+ * The connection keeps its connection ID and cached functions; only the socket, remote connection ID, and node change.
+ *
+ * @param conn The connection whose node went away.
+ * @return 0 if the connection was moved to another VDEV, or a negative value if no suitable one could be found.
+ */
+static int gv_failover(conn_t* conn) {
+	if (!conn->failover || conn->spec[0] == '\0') {
+		return -1;
+	}
+
+	LOG_W(conn_cls, "Node 0x%" PRIx64 " went away, trying to fail over to another '%s' VDEV.", conn->host_id, conn->spec);
+
+	kos_vdev_descr_t* vdevs;
+	ssize_t const vdev_count = query_gv_vdevs(&vdevs);
+
+	int rv = -1;
+
+	for (ssize_t i = 0; i < vdev_count; i++) {
+		kos_vdev_descr_t const* const vdev = &vdevs[i];
+
+		if (vdev->host_id == conn->host_id || strcmp((char*) vdev->spec, (char*) conn->spec) != 0 || vdev->vers != conn->vers) {
+			continue;
+		}
+
+		kos_notif_t notif = {0};
+		int sock;
+		uint64_t remote_cid;
+		uint32_t dict_id;
+
+		if (gv_conn_vdev(vdev->host_id, vdev->vdev_id, true, &sock, &remote_cid, &dict_id, &notif) < 0) {
+			continue;
+		}
+
+		bool const compatible = same_fns(conn, &notif) && same_consts(conn, &notif);
+		free_conn_schema(&notif);
+
+		if (!compatible) {
+			LOG_W(conn_cls, "VDEV %" PRIx64 ":%" PRIu64 " has different functions or constants, not failing over to it.", vdev->host_id, vdev->vdev_id);
+			close(sock);
+			continue;
+		}
+
+		close(conn->sock);
+
+		conn->sock = sock;
+		conn->remote_cid = remote_cid;
+		conn->host_id = vdev->host_id;
+		conn->vdev_id = vdev->vdev_id;
 
-	client_notif_cb(&fail_notif, client_notif_data);
+		conn_use_dict(conn, dict_id);
+
+		LOG_I(conn_cls, "Failed over to VDEV %" PRIx64 ":%" PRIu64 " (%s).", vdev->host_id, vdev->vdev_id, vdev->human);
+
+		rv = 0;
+		break;
+	}
+
+	free(vdevs);
+	return rv;
 }
 
 kos_cookie_t kos_vdev_conn(uint64_t host_id, uint64_t vdev_id) {
@@ -384,139 +733,722 @@ static void call_local(kos_cookie_t cookie, action_t* action, bool sync) {
 	// TODO It seems the VDEV ID is just 0, either here or in call_gv.
 	// Maybe the testing device should expose 2 VDEVs so we can test this correctly?
 
+	TRACE(TRACE_VDRIVER_CALL_BEGIN, cookie, action->call.fn_id, 0);
 	vdriver->call(cookie, conn->vdev_id, action->call.conn_id, action->call.fn_id, action->call.args);
+	TRACE(TRACE_VDRIVER_CALL_END, cookie, 0, 0);
 }
 
-static void call_gv(kos_cookie_t cookie, action_t* action, bool sync) {
-	LOG_V(call_cls, "Passing call on to GrapeVine connection (cookie=0x%" PRIx64 ").", cookie);
-	conn_t* const conn = &conns[action->call.conn_id];
+/**
+ * ZSTD compression levels we pick from, along with their rough single-core compression speeds in bytes per second.
+ *
+ * Negative levels are ZSTD's fast modes, which are in the same ballpark as LZ4.
+ */
+static struct {
+	int level;
+	double speed;
+} const zstd_levels[] = {
+	{19, 3e6},
+	{15, 20e6},
+	{9, 60e6},
+	{6, 100e6},
+	{3, 300e6},
+	{1, 500e6},
+	{-5, 1000e6},
+};
+
+/**
+ * How much faster than the link the compressor must be for it to be worth using.
+ */
+#define ZSTD_SPEED_MARGIN 2
+
+/**
+ * Pick the compression to use on a GrapeVine connection.
+ *
+ * The point of compression is to spend less time on the link, so we pick the strongest level that can still keep up with the link's measured throughput.
+ * If even the fastest level can't keep up (e.g. over loopback or fast LANs), we don't compress at all.
+ *
+ * @param conn The connection.
+ * @param level_out Reference to where the ZSTD compression level should be written.
+ * @return The compression to use.
+ */
+static gv_compression_t pick_link_compression(conn_t const* conn, int* level_out) {
+	double const throughput = cost_throughput(conn->host_id);
+
+	for (size_t i = 0; i < sizeof zstd_levels / sizeof *zstd_levels; i++) {
+		if (zstd_levels[i].speed >= throughput * ZSTD_SPEED_MARGIN) {
+			*level_out = zstd_levels[i].level;
+			return GV_COMPRESSION_ZSTD;
+		}
+	}
 
-	// Serialize call.
+	return GV_COMPRESSION_NONE;
+}
 
-	kos_fn_t const* const fn = &conn->fns[action->call.fn_id];
+/**
+ * Pick the compression to use for the arguments of a GrapeVine call.
+ *
+ * This is the same as {@link pick_link_compression}, except small payloads are never compressed.
+ *
+ * @param conn The connection the call is made on.
+ * @param size Size of the uncompressed payload.
+ * @param level_out Reference to where the ZSTD compression level should be written.
+ * @return The compression to use.
+ */
+static gv_compression_t pick_compression(conn_t const* conn, size_t size, int* level_out) {
+	if (size < (conn->cdict != NULL ? GV_DICT_COMPRESSION_THRESHOLD : GV_COMPRESSION_THRESHOLD)) {
+		return GV_COMPRESSION_NONE;
+	}
 
-	gv_packet_t proto_packet = {
-		.header.type = GV_PACKET_TYPE_KOS_CALL,
-		.kos_call = {
-			.conn_id = conn->remote_cid,
-			.fn_id = action->call.fn_id,
-		},
-	};
+	return pick_link_compression(conn, level_out);
+}
 
-	size_t const proto_packet_size = sizeof proto_packet.header + sizeof proto_packet.kos_call;
-	size_t arg_buf_size = 0;
+/**
+ * Set up a connection's compression context for a new ZSTD frame.
+ *
+ * @param conn The connection.
+ * @param level Compression level to use, unless a dictionary is used.
+ * @param size Size of the data which is going to be compressed.
+ * @param workers Number of worker threads ZSTD may use.
+ * @param cdict Dictionary to use, or `NULL` for none.
+ */
+static void setup_cctx(conn_t* conn, int level, size_t size, int workers, ZSTD_CDict const* cdict) {
+	if (conn->cctx == NULL) {
+		conn->cctx = ZSTD_createCCtx();
+		assert(conn->cctx != NULL);
+	}
+
+	ZSTD_CCtx_reset(conn->cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setPledgedSrcSize(conn->cctx, size); // So the frame header includes the uncompressed size.
 
-	for (size_t i = 0; i < fn->param_count; i++) {
-		arg_buf_size += gv_serialize_val_size(fn->params[i].type, &action->call.args[i]);
+	if (cdict != NULL) {
+		ZSTD_CCtx_refCDict(conn->cctx, cdict);
 	}
 
-	void* const arg_buf = malloc(arg_buf_size);
-	assert(arg_buf != NULL);
+	else {
+		ZSTD_CCtx_setParameter(conn->cctx, ZSTD_c_compressionLevel, level);
+	}
+
+	// This fails if ZSTD was built without multithreading support, in which case we just compress on this thread.
+
+	ZSTD_CCtx_setParameter(conn->cctx, ZSTD_c_nbWorkers, workers);
+}
+
+/**
+ * Compress a scatter-gather list into a single ZSTD frame.
+ *
+ * @param conn The connection whose compression context to use.
+ * @param dst Buffer to compress into.
+ * @param dst_size Size of that buffer, which should be at least `ZSTD_compressBound(size)`.
+ * @param iov Scatter-gather list to compress.
+ * @param iov_count Number of entries in the list.
+ * @param size Total size of the data in the list.
+ * @param level Compression level to use, unless the connection has a dictionary.
+ * @return Compressed size, or a ZSTD error code.
+ */
+static size_t compress_iov(conn_t* conn, void* dst, size_t dst_size, struct iovec const* iov, size_t iov_count, size_t size, int level) {
+	setup_cctx(conn, level, size, 0, conn->cdict);
+	ZSTD_outBuffer out = {dst, dst_size, 0};
+
+	for (size_t i = 0; i <= iov_count; i++) {
+		ZSTD_inBuffer in = {NULL, 0, 0};
+		ZSTD_EndDirective const mode = i == iov_count ? ZSTD_e_end : ZSTD_e_continue;
+
+		if (i < iov_count) {
+			in.src = iov[i].iov_base;
+			in.size = iov[i].iov_len;
+		}
+
+		size_t rem;
 
-	void* buf = arg_buf;
+		do {
+			rem = ZSTD_compressStream2(conn->cctx, &out, &in, mode);
 
-	for (size_t i = 0; i < fn->param_count; i++) {
-		buf += gv_serialize_val(buf, fn->params[i].type, &action->call.args[i]);
+			if (ZSTD_isError(rem)) {
+				return rem;
+			}
+		} while (mode == ZSTD_e_end ? rem != 0 : in.pos < in.size);
 	}
 
-	// Compress and build packet.
-	// TODO We should be reusing the ZSTD compression context (see multiple_simple_compression.c).
+	return out.pos;
+}
 
-	size_t const max_compressed_arg_buf_size = ZSTD_compressBound(arg_buf_size);
-	void* const packet = malloc(proto_packet_size + max_compressed_arg_buf_size);
-	assert(packet != NULL);
+/**
+ * Number of worker threads ZSTD may use for compressing chunked payloads.
+ */
+#define ZSTD_CHUNK_WORKERS 2
+
+/**
+ * Compress and send a scatter-gather list as a chunked payload (see {@link GV_COMPRESSION_ZSTD_CHUNKED}).
+ *
+ * Chunks are sent as soon as they're full, so that the KOS agent can receive and decompress them while we're still compressing the next ones, and so that we only ever need to hold one of them.
+ *
+ * @param conn The connection to send the payload on.
+ * @param iov Scatter-gather list to send.
+ * @param iov_count Number of entries in the list.
+ * @param size Total size of the data in the list.
+ * @param level Compression level to use.
+ * @return Total compressed size, or a negative value if something went wrong, in which case the connection is left in an unusable state.
+ */
+static ssize_t send_chunked(conn_t* conn, struct iovec const* iov, size_t iov_count, size_t size, int level) {
+	setup_cctx(conn, level, size, ZSTD_CHUNK_WORKERS, NULL); // Dictionaries don't help with payloads this large.
+
+	gv_chunk_t* const chunk = malloc(sizeof *chunk + GV_CHUNK_SIZE);
+	assert(chunk != NULL);
+
+	ssize_t total = -1;
+	size_t sent = 0;
+	ZSTD_outBuffer out = {(void*) chunk + sizeof *chunk, GV_CHUNK_SIZE, 0};
+
+	for (size_t i = 0; i <= iov_count; i++) {
+		ZSTD_inBuffer in = {NULL, 0, 0};
+		ZSTD_EndDirective const mode = i == iov_count ? ZSTD_e_end : ZSTD_e_continue;
+
+		if (i < iov_count) {
+			in.src = iov[i].iov_base;
+			in.size = iov[i].iov_len;
+		}
+
+		for (;;) {
+			size_t const rem = ZSTD_compressStream2(conn->cctx, &out, &in, mode);
+
+			if (ZSTD_isError(rem)) {
+				LOG_E(call_cls, "Something went wrong during ZSTD compression: %s", ZSTD_getErrorName(rem));
+				goto done;
+			}
 
-	size_t const compressed_size = ZSTD_compress(packet + proto_packet_size, max_compressed_arg_buf_size, arg_buf, arg_buf_size, ZSTD_btultra2);
-	free(arg_buf);
+			bool const finished = mode == ZSTD_e_end ? rem == 0 : in.pos == in.size;
 
-	if (ZSTD_isError(compressed_size)) {
-		LOG_W(conn_cls, "Something went wrong during ZSTD compression!");
-		// TODO how do we fail??
+			if (out.pos == out.size || (finished && mode == ZSTD_e_end && out.pos > 0)) {
+				chunk->size = out.pos;
+				size_t const chunk_size = sizeof *chunk + out.pos;
+
+				if (gv_send(conn->sock, chunk, chunk_size, 0) != (ssize_t) chunk_size) {
+					LOG_E(call_cls, "Failed to send argument chunk: %s", strerror(errno));
+					goto done;
+				}
+
+				sent += out.pos;
+				out.pos = 0;
+			}
+
+			if (finished) {
+				break;
+			}
+		}
 	}
 
-	LOG_V(conn_cls, "Compressed %zu bytes to %zu (%.2f:1).", arg_buf_size, compressed_size, (float) arg_buf_size / compressed_size);
+	// Terminate the payload with an empty chunk.
 
-	proto_packet.kos_call.compression = GV_COMPRESSION_ZSTD;
-	proto_packet.kos_call.size = compressed_size;
-	memcpy(packet, &proto_packet, proto_packet_size);
+	chunk->size = 0;
 
-	size_t const size = proto_packet_size + compressed_size;
+	if (gv_send(conn->sock, chunk, sizeof *chunk, 0) != sizeof *chunk) {
+		LOG_E(call_cls, "Failed to send final argument chunk: %s", strerror(errno));
+		goto done;
+	}
 
-	// Send packet.
+	total = sent;
 
-	if (send(conn->sock, packet, size, 0) != (ssize_t) size) {
-		LOG_E(call_cls, "Failed to send KOS call packet: %s", strerror(errno));
-		free(packet);
-		goto fail;
+done:
+
+	free(chunk);
+	return total;
+}
+
+/**
+ * Send a call on a GrapeVine connection, or send it again after a failover.
+ *
+ * @param conn The connection.
+ * @param call The call, which must already be in the connection's calls in flight.
+ * @return 0 on success, or a negative value if the connection broke.
+ */
+static int gv_send_call(conn_t* conn, pending_call_t* call) {
+	gv_packet_t* const packet = call->packet;
+	size_t const proto_packet_size = sizeof packet->header + sizeof packet->kos_call;
+
+	// The remote connection ID changes if we failed over, so (re)write it every time.
+
+	packet->kos_call.conn_id = conn->remote_cid;
+	call->start = now();
+
+	if (packet->kos_call.compression == GV_COMPRESSION_NONE) {
+		// Uncompressed arguments are sent straight from where they are, along with the packet.
+		// Large ones are sent without even being copied into the kernel; the client can't touch them until the call returns anyway, by which point they've been received.
+
+		call->packet_iov[0] = (struct iovec) {packet, call->packet_size};
+		call->sent = call->packet_size + call->arg_buf_size;
+
+		if (gv_sendv(conn->sock, call->packet_iov, call->iov_count + 1, call->zerocopy ? GV_MSG_ZEROCOPY : 0) != (ssize_t) call->sent) {
+			LOG_E(call_cls, "Failed to send KOS call packet: %s", strerror(errno));
+			return -1;
+		}
 	}
 
-	if (!sync) { // TODO
-		LOG_W(call_cls, "Currently, all GrapeVine VDEV connection requests are considered to be sync.");
+	else {
+		call->sent = call->packet_size;
+
+		if (gv_send(conn->sock, packet, call->packet_size, 0) != (ssize_t) call->packet_size) {
+			LOG_E(call_cls, "Failed to send KOS call packet: %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	if (packet->kos_call.compression == GV_COMPRESSION_ZSTD_CHUNKED) {
+		ssize_t const sent = send_chunked(conn, call->packet_iov + 1, call->iov_count, call->arg_buf_size, call->level);
+
+		if (sent < 0) {
+			return -1;
+		}
+
+		call->sent += sent;
+		LOG_V(conn_cls, "Streamed %zu bytes compressed to %zd at level %d (%.2f:1).", call->arg_buf_size, sent, call->level, (float) call->arg_buf_size / sent);
+	}
+
+	TRACE_FLOW(TRACE_GV_SEND, call->cookie, call->req_id, call->arg_buf_size, call->sent - proto_packet_size);
+	return 0;
+}
+
+/**
+ * Compress the arguments of calls in flight again if they were compressed with a dictionary the connection no longer has.
+ *
+ * After a failover, the new VDEV's KOS agent may have a different dictionary (or none), and would reject calls compressed with the old one.
+ * If compressing fails, the arguments are sent uncompressed instead.
+ *
+ * @param conn The connection, which must have just failed over.
+ */
+static void gv_recompress_pending(conn_t* conn) {
+	for (size_t i = 0; i < conn->pending_count; i++) {
+		pending_call_t* const call = &conn->pending[i];
+		gv_packet_t* packet = call->packet;
+
+		if (packet->kos_call.compression != GV_COMPRESSION_ZSTD || packet->kos_call.dict_id == conn->dict_id) {
+			continue;
+		}
+
+		size_t const proto_packet_size = sizeof packet->header + sizeof packet->kos_call;
+		size_t const max_compressed_arg_buf_size = ZSTD_compressBound(call->arg_buf_size);
+
+		packet = realloc(packet, proto_packet_size + max_compressed_arg_buf_size);
+		assert(packet != NULL);
+		call->packet = packet;
+
+		size_t const compressed_size = compress_iov(conn, (void*) packet + proto_packet_size, max_compressed_arg_buf_size, call->packet_iov + 1, call->iov_count, call->arg_buf_size, call->level);
+
+		if (ZSTD_isError(compressed_size)) {
+			LOG_W(conn_cls, "Something went wrong during ZSTD recompression, sending arguments uncompressed: %s", ZSTD_getErrorName(compressed_size));
+
+			packet->kos_call.compression = GV_COMPRESSION_NONE;
+			packet->kos_call.dict_id = 0;
+			packet->kos_call.size = call->arg_buf_size;
+			packet->header.len = sizeof packet->kos_call + call->arg_buf_size;
+
+			call->packet_size = proto_packet_size;
+			continue;
+		}
+
+		LOG_V(conn_cls, "Recompressed call arguments for the new VDEV's dictionary (id=%" PRIu32 " -> %" PRIu32 ").", packet->kos_call.dict_id, conn->dict_id);
+
+		packet->kos_call.dict_id = conn->dict_id;
+		packet->kos_call.size = compressed_size;
+		packet->header.len = sizeof packet->kos_call + compressed_size;
+
+		call->packet_size = proto_packet_size + compressed_size;
 	}
+}
+
+static void gv_remove_pending(conn_t* conn, size_t i) {
+	free(conn->pending[i].packet_iov);
+	free(conn->pending[i].packet);
 
-	LOG_V(call_cls, "Wait for KOS call return.");
+	conn->pending_count--;
+	memmove(&conn->pending[i], &conn->pending[i + 1], (conn->pending_count - i) * sizeof *conn->pending);
+}
+
+/**
+ * Fail all the calls in flight on a GrapeVine connection.
+ *
+ * @param cid The connection ID.
+ */
+static void gv_fail_pending(uint64_t cid) {
+	conn_t* const conn = &conns[cid];
+
+	while (conn->pending_count > 0) {
+		kos_notif_t const notif = {
+			.kind = KOS_NOTIF_CALL_FAIL,
+			.cookie = conn->pending[0].cookie,
+			.conn_id = cid,
+		};
+
+		gv_remove_pending(conn, 0);
+		notify_client(&notif);
+	}
+}
+
+/**
+ * Handle a GrapeVine connection breaking, which most likely means the node went away.
+ *
+ * If the client told us this connection is to a stateless VDEV, we can move it over to another one and replay all the calls in flight there, in the order they were originally sent.
+ * Otherwise, they all fail.
+ *
+ * @param cid The connection ID.
+ * @return 0 if the connection failed over, or a negative value if the calls in flight were failed.
+ */
+static int gv_conn_broke(uint64_t cid) {
+	conn_t* const conn = &conns[cid];
+
+	for (size_t failovers = 0; failovers < GV_MAX_FAILOVERS && gv_failover(conn) == 0; failovers++) {
+		gv_recompress_pending(conn);
+
+		size_t i;
+
+		for (i = 0; i < conn->pending_count; i++) {
+			if (gv_send_call(conn, &conn->pending[i]) < 0) {
+				break;
+			}
+		}
+
+		if (i == conn->pending_count) {
+			return 0;
+		}
+	}
+
+	gv_fail_pending(cid);
+	return -1;
+}
+
+/**
+ * Receive the next return on a GrapeVine connection, and notify the client of it.
+ *
+ * Returns may come back in any order, so they're matched to the call they're for by request ID.
+ *
+ * @param cid The connection ID, which must have calls in flight.
+ */
+static void gv_recv_ret(uint64_t cid) {
+	conn_t* const conn = &conns[cid];
 	gv_packet_t res_packet;
 
-	if (recv(conn->sock, &res_packet, sizeof res_packet.header, MSG_WAITALL) != sizeof res_packet.header) {
+	LOG_V(call_cls, "Wait for KOS call return (%zu calls in flight).", conn->pending_count);
+
+	if (gv_recv(conn->sock, &res_packet.header, sizeof res_packet.header, MSG_WAITALL) != sizeof res_packet.header) {
 		LOG_E(call_cls, "Failed to get response header.");
-		goto fail;
+		goto transport_fail;
 	}
 
-	if (res_packet.header.type == GV_PACKET_TYPE_KOS_CALL_FAIL) {
-		LOG_E(call_cls, "Got a KOS call failure response.");
-		goto fail;
+	if (!gv_packet_header_valid(&res_packet.header)) {
+		LOG_E(call_cls, "Got a response with an unsupported protocol version (%d).", res_packet.header.vers);
+		goto transport_fail;
 	}
 
-	if (res_packet.header.type != GV_PACKET_TYPE_KOS_CALL_RET) {
+	size_t body_size;
+
+	switch (res_packet.header.type) {
+	case GV_PACKET_TYPE_KOS_CALL_FAIL:
+		body_size = sizeof res_packet.kos_call_fail;
+		break;
+	case GV_PACKET_TYPE_KOS_CALL_RET:
+		body_size = sizeof res_packet.kos_call_ret;
+		break;
+	default:
 		LOG_E(call_cls, "Got a unexpected response to KOS call: %s.", gv_packet_type_strs[res_packet.header.type]);
-		goto fail;
-	}
 
-	gv_kos_call_ret_t ret;
+		if (gv_recv_discard(conn->sock, res_packet.header.len) < 0) {
+			goto transport_fail;
+		}
 
-	if (recv(conn->sock, &ret, sizeof ret, MSG_WAITALL) != (ssize_t) sizeof ret) {
+		return;
+	}
+
+	if (res_packet.header.len < body_size || gv_recv(conn->sock, &res_packet.kos_call_ret, body_size, MSG_WAITALL) != (ssize_t) body_size) {
 		LOG_E(call_cls, "Failed to get response payload (part 1).");
-		free(packet);
-		goto fail;
+		goto transport_fail;
+	}
+
+	// Both the KOS call failure and return packets start with the request ID.
+
+	uint64_t const req_id = res_packet.kos_call_ret.req_id;
+	size_t i;
+
+	for (i = 0; i < conn->pending_count; i++) {
+		if (conn->pending[i].req_id == req_id) {
+			break;
+		}
+	}
+
+	if (i == conn->pending_count) {
+		LOG_E(call_cls, "Got a response to a call which isn't in flight (req_id=%" PRIu64 ").", req_id);
+
+		if (gv_recv_discard(conn->sock, res_packet.header.len - body_size) < 0) {
+			goto transport_fail;
+		}
+
+		return;
+	}
+
+	pending_call_t* const call = &conn->pending[i];
+	kos_cookie_t const cookie = call->cookie;
+
+	kos_notif_t notif = {
+		.kind = KOS_NOTIF_CALL_FAIL,
+		.cookie = cookie,
+		.conn_id = cid,
+	};
+
+	if (res_packet.header.type == GV_PACKET_TYPE_KOS_CALL_FAIL) {
+		LOG_E(call_cls, "Got a KOS call failure response.");
+		gv_remove_pending(conn, i);
+		notify_client(&notif);
+
+		return;
+	}
+
+	gv_kos_call_ret_t const ret = res_packet.kos_call_ret;
+
+	if (res_packet.header.len != body_size + ret.size) {
+		LOG_E(call_cls, "KOS call return length (%" PRIu32 ") doesn't match its payload size (%" PRIu32 ").", res_packet.header.len, ret.size);
+		goto transport_fail;
 	}
 
 	void* const ret_buf = malloc(ret.size);
 	assert(ret_buf != NULL);
 
-	if (recv(conn->sock, ret_buf, ret.size, MSG_WAITALL) != (ssize_t) ret.size) {
+	if (gv_recv(conn->sock, ret_buf, ret.size, MSG_WAITALL) != (ssize_t) ret.size) {
 		LOG_E(call_cls, "Failed to get response payload (part 2).");
-		free(packet);
+		free(ret_buf);
+		goto transport_fail;
+	}
+
+	if (call->zerocopy) {
+		gv_zerocopy_drain(conn->sock);
+	}
+
+	TRACE_FLOW(TRACE_GV_RECV, cookie, req_id, ret.size, 0);
+
+	// Chunked arguments are compressed while they're being sent, and compressed return values while the KOS agent sends them.
+	// Timing those would count compression time as link time, which makes the link look slower and has us pick even slower compression levels, so leave them out.
+
+	bool const compressed_in_flight = ((gv_packet_t*) call->packet)->kos_call.compression == GV_COMPRESSION_ZSTD_CHUNKED || ret.compression != GV_COMPRESSION_NONE;
+
+	if (call->alone && conn->pending_count == 1 && !compressed_in_flight) {
+		cost_sample_call(conn->host_id, call->sent + sizeof res_packet.header + body_size + ret.size, now() - call->start);
+	}
+
+	kos_fn_t const* const fn = &conn->fns[((gv_packet_t*) call->packet)->kos_call.fn_id];
+	gv_remove_pending(conn, i);
+
+	// Decompress return value.
+
+	void* val_buf = ret_buf;
+	size_t val_size = ret.size;
+
+	if (ret.compression == GV_COMPRESSION_ZSTD) {
+		unsigned long long const content_size = ZSTD_getFrameContentSize(ret_buf, ret.size);
+
+		if (content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+			LOG_E(call_cls, "Return value was not compressed by ZSTD or its uncompressed size is unknown.");
+			free(ret_buf);
+			goto fail;
+		}
+
+		if (conn->dctx == NULL) {
+			conn->dctx = ZSTD_createDCtx();
+			assert(conn->dctx != NULL);
+		}
+
+		val_size = content_size;
+		val_buf = malloc(val_size);
+		assert(val_size == 0 || val_buf != NULL);
+
+		size_t const zstd_size = ZSTD_decompressDCtx(conn->dctx, val_buf, val_size, ret_buf, ret.size);
+		free(ret_buf);
+
+		if (ZSTD_isError(zstd_size) || zstd_size != val_size) {
+			LOG_E(call_cls, "Something went wrong during ZSTD decompression of return value!");
+			free(val_buf);
+			goto fail;
+		}
+
+		LOG_V(call_cls, "Decompressed return value from %" PRIu32 " bytes to %zu.", ret.size, val_size);
+	}
+
+	else if (ret.compression != GV_COMPRESSION_NONE) {
+		LOG_E(call_cls, "Unknown return value compression method %d.", ret.compression);
+		free(ret_buf);
 		goto fail;
 	}
 
-	kos_type_t const ret_type = fn->ret_type;
 	kos_val_t ret_val;
 
-	size_t const deserialized_size = gv_deserialize_val(ret_buf, ret_type, &ret_val);
+	size_t const deserialized_size = gv_deserialize_val(val_buf, fn->ret_type, &ret_val);
+	free(val_buf);
 
-	if (deserialized_size != ret.size) {
-		LOG_E(call_cls, "Deserialized size (%zu) not expected size (%zu).", deserialized_size, ret.size);
-		free(packet);
+	if (deserialized_size != val_size) {
+		LOG_E(call_cls, "Deserialized size (%zu) not expected size (%zu).", deserialized_size, val_size);
 		goto fail;
 	}
 
-	free(packet);
-
 	LOG_V(call_cls, "Got return response, notifying the client.");
 
-	kos_notif_t const notif = {
-		.kind = KOS_NOTIF_CALL_RET,
+	notif.kind = KOS_NOTIF_CALL_RET;
+	notif.call_ret.ret = ret_val;
+
+fail:
+
+	notify_client(&notif);
+	return;
+
+transport_fail:
+
+	gv_conn_broke(cid);
+}
+
+/**
+ * Wait for the returns of all calls in flight on all GrapeVine connections.
+ */
+static void gv_drain(void) {
+	for (uint64_t cid = 0; cid < conn_count; cid++) {
+		while (conns[cid].type == CONN_TYPE_GV && conns[cid].pending_count > 0) {
+			gv_recv_ret(cid);
+		}
+	}
+}
+
+static void call_gv(kos_cookie_t cookie, action_t* action, bool sync) {
+	(void) sync; // The return is always waited for by the end of the flush (see kos_flush).
+
+	LOG_V(call_cls, "Passing call on to GrapeVine connection (cookie=0x%" PRIx64 ").", cookie);
+
+	uint64_t const cid = action->call.conn_id;
+	conn_t* const conn = &conns[cid];
+
+	// Don't let the pipeline get any deeper than this.
+
+	while (conn->pending_count >= GV_PIPELINE_DEPTH) {
+		gv_recv_ret(cid);
+	}
+
+	// Serialize call.
+
+	kos_fn_t const* const fn = &conn->fns[action->call.fn_id];
+	gv_fn_layout_t const* const layout = &conn->layouts[action->call.fn_id];
+
+	// Dictionaries are trained on fixed-encoded arguments (see record.h), so stick to that when we have one.
+
+	gv_encoding_t const encoding = conn->cdict != NULL ? GV_ENCODING_FIXED : layout->encoding;
+
+	gv_packet_t proto_packet = {
+		.header = {
+			.vers = GV_PROTO_VERS,
+			.type = GV_PACKET_TYPE_KOS_CALL,
+		},
+		.kos_call = {
+			.req_id = conn->next_req_id++,
+			.encoding = encoding,
+			.fn_id = action->call.fn_id,
+		},
+	};
+
+	size_t const proto_packet_size = sizeof proto_packet.header + sizeof proto_packet.kos_call;
+
+	// Lay out the arguments without copying buffer arguments, which may be very large.
+	// The scratch buffer and scatter-gather list share an allocation, and the list has an extra entry at the start for the packet header.
+
+	size_t const scratch_size = gv_serialize_args_scratch_size(layout, encoding);
+	size_t const iov_max = GV_ARGS_IOV_MAX(layout) + 1;
+
+	struct iovec* const packet_iov = malloc(iov_max * sizeof *packet_iov + scratch_size);
+	assert(packet_iov != NULL);
+
+	struct iovec* const iov = packet_iov + 1;
+	size_t iov_count;
+	size_t const arg_buf_size = gv_serialize_args_iov(packet_iov + iov_max, iov, &iov_count, layout, encoding, action->call.args);
+
+	// Compress and build packet.
+	// Very large arguments are compressed and sent in chunks as we go instead, so that we never hold a compressed copy of all of them at once.
+
+	int level = 0;
+	gv_compression_t compression = pick_compression(conn, arg_buf_size, &level);
+	bool const chunked = compression == GV_COMPRESSION_ZSTD && arg_buf_size >= GV_CHUNK_THRESHOLD;
+
+	size_t const max_compressed_arg_buf_size = compression == GV_COMPRESSION_ZSTD && !chunked ? ZSTD_compressBound(arg_buf_size) : 0;
+	void* const packet = malloc(proto_packet_size + max_compressed_arg_buf_size);
+	assert(packet != NULL);
+
+	size_t compressed_size = arg_buf_size;
+
+	if (chunked) {
+		compression = GV_COMPRESSION_ZSTD_CHUNKED;
+		compressed_size = 0; // Only known once everything has been sent.
+	}
+
+	else if (compression == GV_COMPRESSION_ZSTD) {
+		if (conn->cdict != NULL) {
+			proto_packet.kos_call.dict_id = conn->dict_id;
+		}
+
+		compressed_size = compress_iov(conn, packet + proto_packet_size, max_compressed_arg_buf_size, iov, iov_count, arg_buf_size, level);
+
+		if (ZSTD_isError(compressed_size)) {
+			LOG_W(conn_cls, "Something went wrong during ZSTD compression: %s", ZSTD_getErrorName(compressed_size));
+			free(packet_iov);
+			free(packet);
+
+			kos_notif_t const notif = {
+				.kind = KOS_NOTIF_CALL_FAIL,
+				.cookie = cookie,
+				.conn_id = cid,
+			};
+
+			notify_client(&notif);
+			return;
+		}
+
+		LOG_V(conn_cls, "Compressed %zu bytes to %zu at level %d (%.2f:1).", arg_buf_size, compressed_size, level, (float) arg_buf_size / compressed_size);
+	}
+
+	proto_packet.header.len = sizeof proto_packet.kos_call + (chunked ? 0 : compressed_size);
+	proto_packet.kos_call.compression = compression;
+	proto_packet.kos_call.size = chunked ? arg_buf_size : compressed_size;
+
+	// Let the KOS agent know how it may compress the return value.
+
+	int ret_level = 0;
+	proto_packet.kos_call.ret_compression = pick_link_compression(conn, &ret_level);
+	proto_packet.kos_call.ret_level = ret_level;
+
+	memcpy(packet, &proto_packet, proto_packet_size);
+
+	// Add the call to those in flight and send it.
+	// We don't wait for its return here, so that the client can have many calls in flight at once; gv_drain does that at the end of the flush.
+
+	bool const alone = conn->pending_count == 0;
+
+	conn->pending = realloc(conn->pending, (conn->pending_count + 1) * sizeof *conn->pending);
+	assert(conn->pending != NULL);
+
+	conn->pending[conn->pending_count++] = (pending_call_t) {
 		.cookie = cookie,
-		.conn_id = action->call.conn_id,
-		.call_ret.ret = ret_val,
+		.req_id = proto_packet.kos_call.req_id,
+		.packet = packet,
+		.packet_size = proto_packet_size + (compression == GV_COMPRESSION_ZSTD ? compressed_size : 0),
+		.packet_iov = packet_iov,
+		.iov_count = iov_count,
+		.arg_buf_size = arg_buf_size,
+		.level = level,
+		.zerocopy = compression == GV_COMPRESSION_NONE && arg_buf_size >= GV_ZEROCOPY_THRESHOLD,
+		.alone = alone,
 	};
 
-	client_notif_cb(&notif, client_notif_data);
-	return;
+	if (gv_send_call(conn, &conn->pending[conn->pending_count - 1]) < 0 && gv_conn_broke(cid) < 0) {
+		return;
+	}
 
-fail:
+	// Return values which are buffers may be large enough that the KOS agent would block sending them back while we're blocked sending it more calls.
+	// So don't send anything else on the connection until they've come back.
 
-	; // TODO Send CALL_FAIL notification.
+	if (fn->ret_type == KOS_TYPE_BUF) {
+		while (conn->pending_count > 0) {
+			gv_recv_ret(cid);
+		}
+	}
 }
 
 static void call_fail(kos_cookie_t cookie, action_t* action, bool sync) {
@@ -530,7 +1462,7 @@ static void call_fail(kos_cookie_t cookie, action_t* action, bool sync) {
 		.cookie = cookie,
 	};
 
-	client_notif_cb(&notif, client_notif_data);
+	notify_client(&notif);
 }
 
 kos_cookie_t kos_vdev_call(uint64_t conn_id, uint32_t fn_id, void const* args) {
@@ -576,6 +1508,11 @@ fail:;
 
 	// Actually add action to queue.
 
+	if (record_enabled && action.cb != call_fail) {
+		record_call(cookie, conn_id, fn_id, &conns[conn_id].fns[fn_id], args);
+	}
+
+	TRACE(TRACE_CALL_ENQUEUE, cookie, conn_id, fn_id);
 	PUSH_QUEUE(action);
 
 	if (action_queue_tail - action_queue_head > ACTION_QUEUE_SIZE) {
@@ -589,11 +1526,26 @@ fail:;
 void kos_flush(bool sync) {
 	LOG_V(action_cls, "Flushing KOS action queue (sync=%d).", sync);
 
-	while (action_queue_head != action_queue_tail) {
-		action_t action;
-		POP_QUEUE(action);
-		action.cb(action.cookie, &action, sync);
-	}
+	TRACE(TRACE_FLUSH_BEGIN, 0, action_queue_tail - action_queue_head, 0);
+
+	// GrapeVine calls are only sent when dispatched, so wait for their returns once everything has been.
+	// The client may queue more actions from its notification callback as those come in, so keep going until there are none left.
+
+	do {
+		while (action_queue_head != action_queue_tail) {
+			action_t action;
+			POP_QUEUE(action);
+
+			TRACE(TRACE_DISPATCH_BEGIN, action.cookie, 0, 0);
+			action.cb(action.cookie, &action, sync);
+			TRACE(TRACE_DISPATCH_END, action.cookie, 0, 0);
+		}
+
+		gv_drain();
+		gv_poll_subs(notif_cb, client_notif_data);
+	} while (action_queue_head != action_queue_tail);
+
+	TRACE(TRACE_FLUSH_END, 0, 0, 0);
 }
 
 void kos_vdev_disconn(uint64_t conn_id) {
@@ -605,12 +1557,46 @@ void kos_vdev_disconn(uint64_t conn_id) {
 	}
 
 	if (conns[conn_id].type == CONN_TYPE_GV) {
+		gv_fail_pending(conn_id);
+		free(conns[conn_id].pending);
+		conns[conn_id].pending = NULL;
+
 		close(conns[conn_id].sock);
+
+		ZSTD_freeCCtx(conns[conn_id].cctx);
+		conns[conn_id].cctx = NULL;
+
+		ZSTD_freeDCtx(conns[conn_id].dctx);
+		conns[conn_id].dctx = NULL;
+
+		ZSTD_freeCDict(conns[conn_id].cdict);
+		conns[conn_id].cdict = NULL;
+		conns[conn_id].dict_id = 0;
 	}
 
 	conns[conn_id].alive = false;
 }
 
+void kos_vdev_set_failover(uint64_t conn_id, bool failover) {
+	LOG_V(conn_cls, "Setting failover on connection ID %" PRIu64 " to %d.", conn_id, failover);
+
+	if (conn_id >= conn_count) {
+		LOG_E(conn_cls, "Connection ID %" PRIu64 " invalid.", conn_id);
+		return;
+	}
+
+	conn_t* const conn = &conns[conn_id];
+
+	if (conn->type == CONN_TYPE_GV) {
+		conn->failover = failover;
+	}
+}
+
+uint64_t kos_vdev_cost(kos_vdev_descr_t const* vdev, kos_workload_t workload) {
+	size_t const bytes = workload == KOS_WORKLOAD_BANDWIDTH ? COST_BANDWIDTH_WORKLOAD_BYTES : COST_LATENCY_WORKLOAD_BYTES;
+	return cost_estimate(vdev->kind, vdev->host_id, bytes);
+}
+
 kos_ino_t kos_gen_ino(void) {
 	return inos++;
 }
@@ -12,13 +12,14 @@
 #include <aqua/kos.h>
 
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 _Static_assert(sizeof(in_addr_t) == sizeof(uint32_t), "in_addr_t is not 32 bits long.");
 _Static_assert(sizeof(struct in6_addr) == sizeof(uint8_t) * 16, "in6_addr_t is not 128 bits long.");
 
 /**
- * Node entry in the GrapeVine nodes file.
+ * Node entry in the GrapeVine nodes segment.
  *
  * One entry represents a node's host information and its VDEVs.
  */
@@ -55,6 +56,56 @@ typedef struct __attribute__((packed)) {
 	kos_vdev_descr_t vdevs[];
 } gv_node_ent_t;
 
+/**
+ * Magic number at the start of the GrapeVine nodes segment ("GVNODES" in little-endian).
+ */
+#define GV_NODES_MAGIC 0x005345444F4E5647ull
+
+/**
+ * Version of the layout of the GrapeVine nodes segment, which must change whenever it or {@link gv_node_ent_t} or `kos_vdev_descr_t` does.
+ */
+#define GV_NODES_VERS 1
+
+/**
+ * Header of the GrapeVine nodes segment.
+ *
+ * The nodes segment is a file at the nodes path which the GrapeVine daemon keeps mapped and updates in place, and which KOSs map once and read from directly.
+ * It is followed by `ents_bytes` worth of node entries ({@link gv_node_ent_t}, each followed by its VDEVs), one after the other.
+ *
+ * Everything following `seq` is protected by a seqlock:
+ * the GrapeVine daemon makes `seq` odd before changing anything and even again once it's done, so readers must retry if it was odd or changed while they were reading.
+ * The segment is never shrunk and the GrapeVine daemon reuses it when it restarts, so a mapping of it always stays valid.
+ */
+typedef struct {
+	uint64_t magic;
+	uint32_t vers;
+	uint32_t _pad;
+
+	_Atomic(uint64_t) seq;
+
+	/**
+	 * Size of the whole segment, which only ever grows.
+	 *
+	 * If entries extend past the end of a reader's mapping, it must map the segment again to read them.
+	 */
+	_Atomic(uint64_t) size;
+
+	uint64_t node_count;
+	uint64_t ents_bytes;
+} gv_nodes_t;
+
+/**
+ * Hash a host ID, for looking nodes up by host ID in hash tables.
+ *
+ * Host IDs are derived from MAC addresses and all end in the same 16 bits (see gvd), so they need mixing before their low bits can be used to pick a bucket.
+ *
+ * @param host_id The host ID.
+ * @return The hash. Its high bits are the best mixed, so prefer shifting it over masking it.
+ */
+static inline uint64_t gv_host_id_hash(uint64_t host_id) {
+	return host_id * 0x9E3779B97F4A7C15; // Fibonacci hashing.
+}
+
 /**
  * Get the host ID of the current machine.
  *
@@ -73,9 +124,9 @@ static inline char const* gv_get_host_id_path(void) {
 }
 
 /**
- * Get the path to the discovered GrapeVine nodes file.
+ * Get the path to the discovered GrapeVine nodes segment.
  *
- * This is the file where the discovered nodes and their VDEVs are stored.
+ * This is the file where the discovered nodes and their VDEVs are published (see {@link gv_nodes_t}).
  * This value can be set with the GV_NODES_PATH environment variable.
  *
  * @return Nodes file path. This is either allocated in the environment or is a constant, so don't free this.
@@ -108,3 +159,125 @@ static inline char const* gv_get_lock_path(void) {
 
 	return env;
 }
+
+/**
+ * Get the path to the GrapeVine daemon's control socket.
+ *
+ * This is a UDS over which long-running processes can talk to the GrapeVine daemon (see {@link gv_ctl_t}).
+ * This value can be set with the GV_CTL_PATH environment variable.
+ *
+ * @return Control socket path. This is either allocated in the environment or is a constant, so don't free this.
+ */
+static inline char const* gv_get_ctl_path(void) {
+	char const* const env = getenv("GV_CTL_PATH");
+
+	if (env == NULL) {
+		return "/tmp/gv.ctl";
+	}
+
+	return env;
+}
+
+/**
+ * Maximum length of a spec in control messages, including the null terminator.
+ */
+#define GV_CTL_SPEC_MAX 64
+
+/**
+ * Control message types.
+ */
+typedef enum : uint8_t {
+	/**
+	 * Sent to the GrapeVine daemon to claim a spec.
+	 *
+	 * Connections to VDEVs of this spec are then handed to us (see {@link GV_CTL_TYPE_CONN}) rather than to a KOS agent, for as long as the control socket stays open.
+	 * The GrapeVine daemon replies with {@link GV_CTL_TYPE_RES}.
+	 */
+	GV_CTL_TYPE_REGISTER,
+	/**
+	 * Sent by the GrapeVine daemon in reply to a request.
+	 */
+	GV_CTL_TYPE_RES,
+	/**
+	 * Sent by the GrapeVine daemon to hand us a connection to a VDEV of a spec we claimed.
+	 *
+	 * The connection's socket is sent along with this message as `SCM_RIGHTS`.
+	 * It has already received its CONN_VDEV packet, and expects a CONN_VDEV_RES (or CONN_VDEV_FAIL) packet back.
+	 */
+	GV_CTL_TYPE_CONN,
+	/**
+	 * Sent to the GrapeVine daemon to subscribe to changes to the VDEVs of a spec (or of all specs, if the spec is empty) on the GrapeVine.
+	 *
+	 * The GrapeVine daemon first replies with {@link GV_CTL_TYPE_ATTACH} for each VDEV of the spec it currently knows about, followed by {@link GV_CTL_TYPE_RES}.
+	 * From then on, it sends {@link GV_CTL_TYPE_ATTACH} and {@link GV_CTL_TYPE_DETACH} as VDEVs of the spec come and go, for as long as the control socket stays open.
+	 * Subscribing to a spec again just gets its VDEVs sent again.
+	 */
+	GV_CTL_TYPE_SUBSCRIBE,
+	/**
+	 * Sent by the GrapeVine daemon when a VDEV of a spec we subscribed to appears on the GrapeVine (or has changed).
+	 */
+	GV_CTL_TYPE_ATTACH,
+	/**
+	 * Sent by the GrapeVine daemon when a VDEV of a spec we subscribed to goes away.
+	 */
+	GV_CTL_TYPE_DETACH,
+	GV_CTL_TYPE_LEN,
+} gv_ctl_type_t;
+
+/**
+ * Control message, sent either way over the GrapeVine daemon's control socket.
+ *
+ * These are all the same size (that of the largest one, {@link GV_CTL_TYPE_ATTACH}), so they can just be read one after the other.
+ */
+typedef struct __attribute__((packed)) {
+	gv_ctl_type_t type;
+
+	union {
+		struct __attribute__((packed)) {
+			/**
+			 * The spec to claim, null-terminated.
+			 */
+			char spec[GV_CTL_SPEC_MAX];
+		} reg;
+
+		struct __attribute__((packed)) {
+			/**
+			 * 0 on success, or an `errno` value describing why the request failed (e.g. `EEXIST` if another process already claimed the spec).
+			 */
+			int32_t err;
+		} res;
+
+		struct __attribute__((packed)) {
+			/**
+			 * The VDEV ID the connection is for.
+			 */
+			uint64_t vdev_id;
+
+			/**
+			 * The spec of the VDEV the connection is for, null-terminated.
+			 */
+			char spec[GV_CTL_SPEC_MAX];
+		} conn;
+
+		struct __attribute__((packed)) {
+			/**
+			 * The spec to subscribe to, null-terminated, or empty to subscribe to all specs.
+			 */
+			char spec[GV_CTL_SPEC_MAX];
+		} sub;
+
+		struct __attribute__((packed)) {
+			kos_vdev_descr_t vdev;
+		} attach;
+
+		struct __attribute__((packed)) {
+			uint64_t host_id;
+			uint64_t vdev_id;
+
+			/**
+			 * The spec of the VDEV, null-terminated, so that it can be told which subscription this is for.
+			 */
+			char spec[GV_CTL_SPEC_MAX];
+		} detach;
+	};
+} gv_ctl_t;
@@ -0,0 +1,182 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "trace.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+_Static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "TRACE_RING_SIZE must be a power of two.");
+
+typedef struct trace_ring_t trace_ring_t;
+
+struct trace_ring_t {
+	/**
+	 * Total number of events ever written to this ring.
+	 *
+	 * Only the owning thread writes to this, so it only has to be atomic for the dumper to see a consistent value.
+	 */
+	_Atomic uint64_t head;
+	uint32_t tid;
+	trace_ring_t* next;
+
+	/**
+	 * Whether the thread which owned this ring has exited, so that the ring can be taken over by a new thread.
+	 *
+	 * Rings are never freed, as the dumper may be walking them at any time, and we want to keep their events around for it anyway.
+	 */
+	_Atomic bool retired;
+
+	trace_ev_t evs[TRACE_RING_SIZE];
+};
+
+bool trace_enabled = false;
+
+static char const* trace_dir = NULL;
+static _Atomic uint32_t tids = 0;
+static _Atomic(trace_ring_t*) rings = NULL;
+static _Thread_local trace_ring_t* ring = NULL;
+static pthread_key_t ring_key; // Only used for its destructor, which retires the ring of an exiting thread.
+
+static char const* get_proc_name(void) {
+#if defined(__linux__)
+	extern char* program_invocation_short_name;
+	return program_invocation_short_name;
+#else
+	return getprogname();
+#endif
+}
+
+void trace_dump(void) {
+	if (!trace_enabled) {
+		return;
+	}
+
+	// Write to a temporary file first, so that a dump which is being read while we write the next one is never seen half-written.
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, "%s/%s.%d.trace", trace_dir, get_proc_name(), getpid());
+
+	char tmp_path[PATH_MAX + 4];
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+
+	FILE* const f = fopen(tmp_path, "w");
+
+	if (f == NULL) {
+		return;
+	}
+
+	trace_file_hdr_t hdr = {
+		.magic = TRACE_MAGIC,
+		.vers = TRACE_VERS,
+		.pid = getpid(),
+	};
+
+	strncpy(hdr.name, get_proc_name(), sizeof hdr.name - 1);
+	fwrite(&hdr, sizeof hdr, 1, f);
+
+	// Write out each ring in order, oldest event first.
+	// Threads may still be running while we dump, in which case the oldest events of their rings may be overwritten under us; this is fine as it's best-effort anyway.
+
+	for (trace_ring_t* r = atomic_load(&rings); r != NULL; r = r->next) {
+		uint64_t const head = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t const tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (uint64_t i = tail; i < head; i++) {
+			fwrite(&r->evs[i & (TRACE_RING_SIZE - 1)], sizeof *r->evs, 1, f);
+		}
+	}
+
+	fclose(f);
+	rename(tmp_path, path);
+}
+
+static void retire_ring(void* r) {
+	atomic_store(&((trace_ring_t*) r)->retired, true);
+}
+
+static __attribute__((constructor)) void init(void) {
+	trace_dir = getenv(TRACE_ENVVAR);
+
+	if (trace_dir == NULL || *trace_dir == '\0') {
+		return;
+	}
+
+	if (pthread_key_create(&ring_key, retire_ring) != 0) {
+		return;
+	}
+
+	trace_enabled = true;
+	atexit(trace_dump);
+}
+
+static trace_ring_t* claim_ring(void) {
+	// Take over the ring of a thread which has exited, if there is one.
+	// Its events are kept, and only overwritten as usual as the ring wraps around, which keeps the number of rings down to the most threads ever alive at once rather than growing with every thread ever spawned (e.g. one per connection in the KOS agent).
+
+	for (trace_ring_t* r = atomic_load(&rings); r != NULL; r = r->next) {
+		bool expected = true;
+
+		if (atomic_compare_exchange_strong(&r->retired, &expected, false)) {
+			return r;
+		}
+	}
+
+	trace_ring_t* const r = calloc(1, sizeof *r);
+
+	if (r == NULL) {
+		return NULL;
+	}
+
+	// Lock-free push onto the list of rings the dumper walks.
+
+	r->next = atomic_load(&rings);
+
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+	}
+
+	return r;
+}
+
+static trace_ring_t* new_ring(void) {
+	trace_ring_t* const r = claim_ring();
+
+	if (r == NULL) {
+		return NULL;
+	}
+
+	// Events carry the ID of the thread which emitted them, so a reused ring can still be given a new one without mixing up its older events.
+
+	r->tid = atomic_fetch_add(&tids, 1);
+	pthread_setspecific(ring_key, r);
+
+	return r;
+}
+
+void trace_emit(trace_kind_t kind, uint64_t id, uint64_t flow, uint64_t a, uint64_t b) {
+	if (ring == NULL && (ring = new_ring()) == NULL) {
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint64_t const head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	trace_ev_t* const ev = &ring->evs[head & (TRACE_RING_SIZE - 1)];
+
+	ev->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	ev->id = id;
+	ev->flow = flow;
+	ev->a = a;
+	ev->b = b;
+	ev->tid = ring->tid;
+	ev->kind = kind;
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,244 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+/**
+ * Low-overhead binary event tracing.
+ *
+ * This is used by the KOS, gvd, and KOS agents to record the timeline of calls as they go through each of them.
+ * Each thread records events into its own lock-free ring buffer, which is dumped to a file when the process exits (or whenever {@link trace_dump} is called, for daemons which don't exit).
+ * These files can then be converted to the Chrome/Perfetto JSON trace format with `aqua-trace-dump`.
+ *
+ * Tracing is enabled by setting the AQUA_TRACE environment variable to the directory the trace files should be written to.
+ * When it isn't set, {@link TRACE} costs a single predictable branch.
+ * Define `AQUA_TRACE_DISABLE` at compile time to get rid of even that.
+ * Define `AQUA_TRACE_USDT` at compile time to additionally fire an `aqua:event` USDT probe for each event (regardless of AQUA_TRACE).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(AQUA_TRACE_USDT)
+# include <sys/sdt.h>
+#endif
+
+/**
+ * The AQUA_TRACE environment variable name.
+ */
+#define TRACE_ENVVAR "AQUA_TRACE"
+
+/**
+ * Number of events in each thread's ring buffer.
+ *
+ * Must be a power of two.
+ * Once full, the oldest events are overwritten.
+ */
+#define TRACE_RING_SIZE (1 << 16)
+
+/**
+ * Magic bytes at the start of each trace file.
+ */
+#define TRACE_MAGIC "AQUATRC"
+
+/**
+ * Trace file format version.
+ */
+#define TRACE_VERS 1
+
+/**
+ * The kind of a trace event.
+ *
+ * Kinds ending in `_BEGIN` and `_END` delimit spans, and the others are instants.
+ */
+typedef enum : uint16_t {
+	/**
+	 * A call was added to the KOS' action queue (id=cookie, a=connection ID, b=function ID).
+	 */
+	TRACE_CALL_ENQUEUE,
+	/**
+	 * The KOS started flushing its action queue.
+	 */
+	TRACE_FLUSH_BEGIN,
+	/**
+	 * The KOS finished flushing its action queue.
+	 */
+	TRACE_FLUSH_END,
+	/**
+	 * An action was popped off the KOS' action queue and dispatched (id=cookie).
+	 */
+	TRACE_DISPATCH_BEGIN,
+	/**
+	 * A dispatched action completed (id=cookie).
+	 */
+	TRACE_DISPATCH_END,
+	/**
+	 * A call was sent over the GrapeVine (id=cookie, flow=request ID, a=uncompressed argument size, b=sent argument size).
+	 */
+	TRACE_GV_SEND,
+	/**
+	 * A call return was received from the GrapeVine (id=cookie, flow=request ID, a=received return value size).
+	 */
+	TRACE_GV_RECV,
+	/**
+	 * A call was passed on to a local VDRIVER (id=cookie, a=function ID).
+	 */
+	TRACE_VDRIVER_CALL_BEGIN,
+	/**
+	 * A local VDRIVER returned from a call (id=cookie).
+	 */
+	TRACE_VDRIVER_CALL_END,
+	/**
+	 * A KOS agent received a call (id=flow=request ID, a=function ID, b=received argument size).
+	 */
+	TRACE_AGENT_CALL_BEGIN,
+	/**
+	 * A KOS agent finished handling a call (id=flow=request ID).
+	 */
+	TRACE_AGENT_CALL_END,
+	/**
+	 * A KOS agent sent a call return (id=flow=request ID, a=uncompressed return value size, b=sent return value size).
+	 */
+	TRACE_AGENT_RET,
+	/**
+	 * gvd accepted a connection (id=host ID of the peer).
+	 */
+	TRACE_GVD_ACCEPT,
+	/**
+	 * gvd handed a VDEV connection off (id=session ID of the KOS, a=VDEV ID).
+	 */
+	TRACE_GVD_CONN_VDEV,
+
+#define TRACE_KIND_COUNT (TRACE_GVD_CONN_VDEV + 1)
+} trace_kind_t;
+
+/**
+ * Mappings from the `trace_kind_t` enum to strings.
+ */
+static char const* const trace_kind_strs[TRACE_KIND_COUNT] = {
+	"CALL_ENQUEUE",
+	"FLUSH_BEGIN",
+	"FLUSH_END",
+	"DISPATCH_BEGIN",
+	"DISPATCH_END",
+	"GV_SEND",
+	"GV_RECV",
+	"VDRIVER_CALL_BEGIN",
+	"VDRIVER_CALL_END",
+	"AGENT_CALL_BEGIN",
+	"AGENT_CALL_END",
+	"AGENT_RET",
+	"GVD_ACCEPT",
+	"GVD_CONN_VDEV",
+};
+
+/**
+ * A trace event, as recorded in a ring and written out to trace files.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * Timestamp in nanoseconds.
+	 *
+	 * This is wall-clock time so that events from processes on different hosts can roughly be lined up.
+	 */
+	uint64_t ts;
+	/**
+	 * Identifier used to correlate events, usually the cookie of the call.
+	 */
+	uint64_t id;
+	/**
+	 * Request ID of the GrapeVine call this event is part of, or 0.
+	 *
+	 * Unlike cookies, request IDs are known to both the KOS and the KOS agent, so this is what ties their events together across processes (and hosts).
+	 */
+	uint64_t flow;
+	/**
+	 * Kind-specific argument.
+	 */
+	uint64_t a;
+	/**
+	 * Kind-specific argument.
+	 */
+	uint64_t b;
+	/**
+	 * ID of the thread which recorded this event.
+	 */
+	uint32_t tid;
+	/**
+	 * The kind of the event.
+	 */
+	trace_kind_t kind;
+} trace_ev_t;
+
+/**
+ * Header at the start of each trace file.
+ *
+ * It is followed by a sequence of {@link trace_ev_t} until the end of the file.
+ */
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t vers;
+	uint32_t pid;
+	char name[64];
+} trace_file_hdr_t;
+
+/**
+ * Whether tracing is enabled.
+ *
+ * Don't touch this directly, use {@link TRACE}.
+ */
+extern bool trace_enabled;
+
+/**
+ * Record an event into the calling thread's ring.
+ *
+ * Don't call this directly, use {@link TRACE}.
+ */
+void trace_emit(trace_kind_t kind, uint64_t id, uint64_t flow, uint64_t a, uint64_t b);
+
+/**
+ * Write the rings out to this process' trace file now.
+ *
+ * This is done automatically when the process exits, but daemons such as gvd may never exit normally, so they call this on demand instead.
+ * Each dump overwrites the previous one with everything still in the rings.
+ * Does nothing if tracing isn't enabled.
+ */
+void trace_dump(void);
+
+#if defined(AQUA_TRACE_USDT)
+# define __TRACE_USDT(kind, id, flow, a, b) DTRACE_PROBE5(aqua, event, (kind), (id), (flow), (a), (b))
+#else
+# define __TRACE_USDT(kind, id, flow, a, b) ((void) 0)
+#endif
+
+/**
+ * Record a trace event which is part of a GrapeVine call.
+ *
+ * @param kind The {@link trace_kind_t} of the event.
+ * @param id Identifier used to correlate events.
+ * @param flow Request ID of the call.
+ * @param a Kind-specific argument.
+ * @param b Kind-specific argument.
+ */
+#if defined(AQUA_TRACE_DISABLE)
+# define TRACE_FLOW(kind, id, flow, a, b) ((void) sizeof((kind) + (id) + (flow) + (a) + (b))) // Still "use" the arguments, so that variables only traced aren't unused.
+#else
+# define TRACE_FLOW(kind, id, flow, a, b)               \
+	do {                                                \
+		__TRACE_USDT(kind, id, flow, a, b);             \
+                                                        \
+		if (__builtin_expect(trace_enabled, 0)) {       \
+			trace_emit((kind), (id), (flow), (a), (b)); \
+		}                                               \
+	} while (0)
+#endif
+
+/**
+ * Record a trace event.
+ *
+ * @param kind The {@link trace_kind_t} of the event.
+ * @param id Identifier used to correlate events.
+ * @param a Kind-specific argument.
+ * @param b Kind-specific argument.
+ */
+#define TRACE(kind, id, a, b) TRACE_FLOW(kind, id, 0, a, b)
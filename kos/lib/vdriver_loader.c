@@ -8,21 +8,117 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/file.h>
+#include <sys/stat.h>
+
 #include <dlfcn.h>
 
+/**
+ * Magic bytes at the start of the manifest.
+ */
+#define MANIFEST_MAGIC "AQUAVDM"
+
+/**
+ * Manifest format version.
+ */
+#define MANIFEST_VERS 0
+
+/**
+ * Maximum number of VID slices we accept from the manifest.
+ *
+ * This is just a sanity check so that a corrupt manifest can't make us allocate huge amounts of memory.
+ */
+#define MAX_SLICES (1 << 16)
+
+/**
+ * Maximum number of threads used to load and probe VDRIVERs concurrently.
+ */
+#define PROBE_THREADS_MAX 8
+
+/**
+ * Header at the start of the manifest.
+ *
+ * It is followed by `entry_count` {@link manifest_ent_t}, each immediately followed by its `vdev_count` VDEV descriptors.
+ */
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t vers;
+	uint32_t entry_count;
+} manifest_hdr_t;
+
+typedef struct __attribute__((packed)) {
+	char path[1024];
+	char spec[64];
+
+	// What we use to tell if the VDRIVER changed since it was probed.
+
+	int64_t mtime;
+	uint64_t size;
+	uint64_t ino;
+
+	uint32_t slice;
+	uint8_t cached;
+	uint32_t vdev_count;
+} manifest_ent_t;
+
+/**
+ * A VID slice and the VDRIVER it was allocated to.
+ *
+ * The VDRIVER is only actually loaded when needed, and until then, its VDEVs are served from the manifest.
+ */
+typedef struct {
+	bool used;
+
+	char path[1024];
+	char spec[64];
+
+	int64_t mtime;
+	uint64_t size;
+	uint64_t ino;
+
+	/**
+	 * Whether the VDEV descriptors are known (i.e. the VDRIVER was probed at some point).
+	 */
+	bool cached;
+	size_t vdev_count;
+	kos_vdev_descr_t* vdevs;
+
+	/**
+	 * The loaded VDRIVER, or NULL if it hasn't been loaded yet.
+	 */
+	vdriver_t* vdriver;
+
+	// What the VDRIVER should be loaded with once it is.
+
+	bool requested;
+	uint64_t host_id;
+	kos_notif_cb_t notif_cb;
+	void* notif_data;
+	vdriver_write_ptr_t write_ptr;
+} slot_t;
+
 static umber_class_t const* cls = NULL;
 
 static char* vdriver_path = NULL;
-static uint64_t cur_vid_slice = 0;
-static size_t vdriver_count = 0;
-static vdriver_t** vdrivers = NULL;
+static char const* manifest_path = NULL;
+static bool manifest_read = false;
+
+/**
+ * All the VID slices we know of, indexed by slice number.
+ */
+static size_t slot_count = 0;
+static slot_t* slots = NULL;
 
 static void strfree(char** str) {
 	if (str != NULL) {
@@ -34,9 +130,8 @@ void vdriver_loader_init(void) {
 	assert(cls == NULL);
 	cls = umber_class_new("aqua.kos.vdriver_loader", UMBER_LVL_INFO, "VDRIVER loader.");
 
-	assert(vdrivers == NULL);
-	assert(vdriver_count == 0);
-	assert(cur_vid_slice == 0);
+	assert(slots == NULL);
+	assert(slot_count == 0);
 
 	LOG_V(cls, "VDRIVER loader init.");
 }
@@ -50,6 +145,12 @@ static void update_vdriver_path(void) {
 		return;
 	}
 
+	manifest_path = getenv(VDRIVER_MANIFEST_ENVVAR);
+
+	if (manifest_path == NULL) {
+		manifest_path = DEFAULT_VDRIVER_MANIFEST;
+	}
+
 	vdriver_path = getenv(VDRIVER_PATH_ENVVAR);
 
 	if (vdriver_path != NULL) {
@@ -77,13 +178,290 @@ static void update_vdriver_path(void) {
 	}
 }
 
-static vdriver_t* load_from_path(
-	char const* path,
-	uint64_t host_id,
-	kos_notif_cb_t notif_cb,
-	void* notif_data,
-	vdriver_write_ptr_t write_ptr
-) {
+static slot_t* get_slot(uint32_t slice) {
+	if (slice >= slot_count) {
+		slots = realloc(slots, (slice + 1) * sizeof *slots);
+		assert(slots != NULL);
+
+		memset(&slots[slot_count], 0, (slice + 1 - slot_count) * sizeof *slots);
+		slot_count = slice + 1;
+	}
+
+	return &slots[slice];
+}
+
+static slot_t* find_slot_by_path(char const* path) {
+	for (size_t i = 0; i < slot_count; i++) {
+		if (slots[i].used && strcmp(slots[i].path, path) == 0) {
+			return &slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool is_fresh(slot_t const* slot, struct stat const* st) {
+	return slot->mtime == st->st_mtime && slot->size == (uint64_t) st->st_size && slot->ino == st->st_ino;
+}
+
+// Manifest handling.
+// All reads and writes happen with the lock file held, so that processes don't allocate the same VID slice to different VDRIVERs.
+// Writes go through a temporary file which is then renamed, so that the manifest is never seen half-written.
+
+static int lock_manifest(void) {
+	char* __attribute__((cleanup(strfree))) lock_path = NULL;
+	asprintf(&lock_path, "%s.lock", manifest_path);
+	assert(lock_path != NULL);
+
+	int const fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+
+	if (fd < 0) {
+		LOG_W(cls, "open(\"%s\"): %s", lock_path, strerror(errno));
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX) < 0) {
+		LOG_W(cls, "flock(\"%s\"): %s", lock_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void unlock_manifest(int fd) {
+	if (fd >= 0) {
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+}
+
+/**
+ * Read the manifest and merge its entries into our slots.
+ *
+ * Entries for slices we don't know of yet are taken as-is.
+ * Entries for slices we do know of only fill in VDEV descriptors we don't have yet.
+ */
+static void read_manifest(void) {
+	FILE* const f = fopen(manifest_path, "r");
+
+	if (f == NULL) {
+		if (errno != ENOENT) {
+			LOG_W(cls, "fopen(\"%s\"): %s", manifest_path, strerror(errno));
+		}
+
+		return;
+	}
+
+	manifest_hdr_t hdr;
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, MANIFEST_MAGIC, sizeof MANIFEST_MAGIC) != 0 || hdr.vers != MANIFEST_VERS) {
+		LOG_W(cls, "Manifest %s is invalid or of a different version, ignoring it.", manifest_path);
+		goto done;
+	}
+
+	for (size_t i = 0; i < hdr.entry_count; i++) {
+		manifest_ent_t ent;
+
+		if (fread(&ent, sizeof ent, 1, f) != 1) {
+			LOG_W(cls, "Manifest %s is truncated.", manifest_path);
+			goto done;
+		}
+
+		ent.path[sizeof ent.path - 1] = '\0';
+		ent.spec[sizeof ent.spec - 1] = '\0';
+
+		kos_vdev_descr_t* const vdevs = malloc(ent.vdev_count * sizeof *vdevs);
+		assert(ent.vdev_count == 0 || vdevs != NULL);
+
+		if (ent.vdev_count > 0 && fread(vdevs, sizeof *vdevs, ent.vdev_count, f) != ent.vdev_count) {
+			LOG_W(cls, "Manifest %s is truncated.", manifest_path);
+			free(vdevs);
+			goto done;
+		}
+
+		if (ent.slice >= MAX_SLICES) {
+			free(vdevs);
+			continue;
+		}
+
+		slot_t* const slot = get_slot(ent.slice);
+		bool const take = !slot->used || (strcmp(slot->path, ent.path) == 0 && !slot->cached && slot->vdriver == NULL);
+
+		if (!take) {
+			free(vdevs);
+			continue;
+		}
+
+		slot->used = true;
+		strcpy(slot->path, ent.path);
+		strcpy(slot->spec, ent.spec);
+
+		slot->mtime = ent.mtime;
+		slot->size = ent.size;
+		slot->ino = ent.ino;
+
+		free(slot->vdevs);
+
+		slot->cached = ent.cached;
+		slot->vdev_count = ent.vdev_count;
+		slot->vdevs = vdevs;
+	}
+
+done:
+
+	fclose(f);
+}
+
+static void write_manifest(void) {
+	char* __attribute__((cleanup(strfree))) tmp_path = NULL;
+	asprintf(&tmp_path, "%s.%d.tmp", manifest_path, getpid());
+	assert(tmp_path != NULL);
+
+	FILE* const f = fopen(tmp_path, "w");
+
+	if (f == NULL) {
+		LOG_W(cls, "fopen(\"%s\"): %s", tmp_path, strerror(errno));
+		return;
+	}
+
+	manifest_hdr_t hdr = {
+		.magic = MANIFEST_MAGIC,
+		.vers = MANIFEST_VERS,
+		.entry_count = 0,
+	};
+
+	for (size_t i = 0; i < slot_count; i++) {
+		hdr.entry_count += slots[i].used;
+	}
+
+	bool ok = fwrite(&hdr, sizeof hdr, 1, f) == 1;
+
+	for (size_t i = 0; ok && i < slot_count; i++) {
+		slot_t const* const slot = &slots[i];
+
+		if (!slot->used) {
+			continue;
+		}
+
+		manifest_ent_t ent = {
+			.mtime = slot->mtime,
+			.size = slot->size,
+			.ino = slot->ino,
+			.slice = i,
+			.cached = slot->cached,
+			.vdev_count = slot->vdev_count,
+		};
+
+		strncpy(ent.path, slot->path, sizeof ent.path - 1);
+		strncpy(ent.spec, slot->spec, sizeof ent.spec - 1);
+
+		ok = fwrite(&ent, sizeof ent, 1, f) == 1;
+		ok = ok && (slot->vdev_count == 0 || fwrite(slot->vdevs, sizeof *slot->vdevs, slot->vdev_count, f) == slot->vdev_count);
+	}
+
+	if (fclose(f) != 0 || !ok) {
+		LOG_W(cls, "Failed to write manifest to %s.", tmp_path);
+		unlink(tmp_path);
+		return;
+	}
+
+	if (rename(tmp_path, manifest_path) < 0) {
+		LOG_W(cls, "rename(\"%s\", \"%s\"): %s", tmp_path, manifest_path, strerror(errno));
+		unlink(tmp_path);
+	}
+}
+
+static void ensure_manifest_read(void) {
+	if (manifest_read) {
+		return;
+	}
+
+	int const fd = lock_manifest();
+	read_manifest();
+	unlock_manifest(fd);
+
+	manifest_read = true;
+}
+
+/**
+ * Get the slot for a VDRIVER, allocating it a new VID slice if it doesn't have one yet.
+ */
+static slot_t* alloc_slot(char const* path) {
+	slot_t* slot = find_slot_by_path(path);
+
+	if (slot != NULL) {
+		return slot;
+	}
+
+	// Re-read the manifest with the lock held, in case another process allocated a slice in the meantime.
+
+	int const fd = lock_manifest();
+	read_manifest();
+
+	slot = find_slot_by_path(path);
+
+	if (slot == NULL) {
+		assert(slot_count < MAX_SLICES);
+		slot = get_slot(slot_count);
+
+		slot->used = true;
+		strncpy(slot->path, path, sizeof slot->path - 1);
+
+		write_manifest();
+	}
+
+	unlock_manifest(fd);
+	return slot;
+}
+
+static void save_slot(void) {
+	int const fd = lock_manifest();
+	read_manifest();
+	write_manifest();
+	unlock_manifest(fd);
+}
+
+// VDRIVER loading.
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void capture_notif_cb(kos_notif_t const* notif, void* data) {
+	slot_t* const slot = data;
+
+	if (notif->kind == KOS_NOTIF_ATTACH) {
+		slot->vdevs = realloc(slot->vdevs, (slot->vdev_count + 1) * sizeof *slot->vdevs);
+		assert(slot->vdevs != NULL);
+		slot->vdevs[slot->vdev_count++] = notif->attach.vdev;
+
+		return;
+	}
+
+	if (slot->notif_cb != NULL) {
+		slot->notif_cb(notif, slot->notif_data);
+	}
+}
+
+/**
+ * Load and probe the VDRIVER of a slot.
+ *
+ * The {@link KOS_NOTIF_ATTACH} notifications sent while probing aren't forwarded, but replace the slot's cached VDEV descriptors.
+ * This may be called for different slots concurrently, as long as the slot array isn't grown in the meantime.
+ *
+ * @param slot The slot of the VDRIVER to load.
+ * @return The loaded VDRIVER, or NULL if it failed to load.
+ */
+static vdriver_t* load_slot(slot_t* slot) {
+	assert(slot->vdriver == NULL);
+
+	char const* const path = slot->path;
+	uint64_t const slice = slot - slots;
+	uint64_t const load_start = now();
+
 	LOG_V(cls, "Trying to load VDRIVER from path: %s", path);
 	void* const lib = dlopen(path, RTLD_LAZY);
 
@@ -103,24 +481,17 @@ static vdriver_t* load_from_path(
 		return NULL;
 	}
 
-	LOG_V(cls, "Allocating VID slice for VDRIVER.", path);
-
-	assert(cur_vid_slice < UINT32_MAX);
-
-	vdriver->vdev_id_lo = cur_vid_slice << 32;
-	vdriver->vdev_id_hi = ((cur_vid_slice + 1) << 32) - 1;
-
-	cur_vid_slice++;
+	vdriver->vdev_id_lo = slice << 32;
+	vdriver->vdev_id_hi = ((slice + 1) << 32) - 1;
 
 	// Set other values on VDRIVER.
 
-	vdriver->host_id = host_id;
-	vdriver->notif_cb = notif_cb;
-	vdriver->notif_data = notif_data;
+	vdriver->host_id = slot->host_id;
 	vdriver->lib = lib;
-	vdriver->write_ptr = write_ptr;
+	vdriver->write_ptr = slot->write_ptr;
 
 	LOG_V(cls, "Call init function on VDRIVER, if it exists.", path);
+	uint64_t const init_start = now();
 
 	if (vdriver->init != NULL) {
 		vdriver->init();
@@ -128,15 +499,236 @@ static vdriver_t* load_from_path(
 
 	LOG_I(cls, "VDRIVER loaded from '%s' (VID slice [0x%" PRIx64 ", 0x%" PRIx64 "]).", path, vdriver->vdev_id_lo, vdriver->vdev_id_hi);
 
-	// Store the VDRIVER in the global array.
+	strncpy(slot->spec, vdriver->spec, sizeof slot->spec - 1);
+	slot->vdriver = vdriver;
+
+	// Probe for VDEVs on that driver, catching the VDEVs it reports.
+
+	free(slot->vdevs);
+
+	slot->vdevs = NULL;
+	slot->vdev_count = 0;
+	slot->cached = true;
+
+	uint64_t const probe_start = now();
+
+	if (vdriver->probe == NULL) {
+		LOG_E(cls, "VDRIVER '%s' doesn't implement a probe function.", vdriver->spec);
+	}
+
+	else {
+		LOG_V(cls, "Probing VDRIVER for '%s' VDEVs.", vdriver->spec);
+
+		vdriver->notif_cb = capture_notif_cb;
+		vdriver->notif_data = slot;
+
+		vdriver->probe();
+	}
+
+	vdriver->notif_cb = slot->notif_cb;
+	vdriver->notif_data = slot->notif_data;
 
-	vdrivers = realloc(vdrivers, (vdriver_count + 1) * sizeof *vdrivers);
-	assert(vdrivers != NULL);
-	vdrivers[vdriver_count++] = vdriver;
+	uint64_t const probe_end = now();
+
+	LOG_I(
+		cls,
+		"VDRIVER '%s' took %.3f ms to load (dlopen %.3f ms, init %.3f ms, probe %.3f ms, %zu VDEV(s)).",
+		vdriver->spec,
+		(probe_end - load_start) / 1e6,
+		(init_start - load_start) / 1e6,
+		(probe_start - init_start) / 1e6,
+		(probe_end - probe_start) / 1e6,
+		slot->vdev_count
+	);
 
 	return vdriver;
 }
 
+typedef struct {
+	size_t* slices;
+	size_t count;
+	_Atomic size_t next;
+} load_job_t;
+
+static void* load_worker(void* arg) {
+	load_job_t* const job = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+		load_slot(&slots[job->slices[i]]);
+	}
+
+	return NULL;
+}
+
+/**
+ * Load and probe a set of VDRIVERs concurrently on a bounded pool of threads.
+ *
+ * @param slices The VID slices of the VDRIVERs to load.
+ * @param count The number of VDRIVERs to load.
+ */
+static void load_slots(size_t* slices, size_t count) {
+	long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_count = cpus > 0 ? (size_t) cpus : 1;
+
+	if (thread_count > PROBE_THREADS_MAX) {
+		thread_count = PROBE_THREADS_MAX;
+	}
+
+	if (thread_count > count) {
+		thread_count = count;
+	}
+
+	load_job_t job = {
+		.slices = slices,
+		.count = count,
+		.next = 0,
+	};
+
+	// No need to spin up threads for a single VDRIVER.
+
+	if (thread_count <= 1) {
+		load_worker(&job);
+		return;
+	}
+
+	LOG_V(cls, "Loading %zu VDRIVERs on %zu threads.", count, thread_count);
+	uint64_t const start = now();
+
+	pthread_t threads[PROBE_THREADS_MAX];
+	size_t spawned = 0;
+
+	for (; spawned < thread_count; spawned++) {
+		if (pthread_create(&threads[spawned], NULL, load_worker, &job) != 0) {
+			LOG_W(cls, "pthread_create: %s", strerror(errno));
+			break;
+		}
+	}
+
+	load_worker(&job); // Help out (and make sure all jobs are done even if no thread could be created).
+
+	for (size_t i = 0; i < spawned; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	LOG_I(cls, "Loaded %zu VDRIVERs in %.3f ms.", count, (now() - start) / 1e6);
+}
+
+/**
+ * A VDRIVER file to request the VDEVs of.
+ */
+typedef struct {
+	char* path;
+	struct stat st;
+} req_t;
+
+/**
+ * Request the VDEVs of the VDRIVERs at a set of paths.
+ *
+ * VDEVs are sent from the cache if possible.
+ * Otherwise, the VDRIVERs are loaded and probed concurrently, and their VDEVs are sent once all of them are done, in the order of the paths.
+ * This frees the paths.
+ */
+static void req_paths(
+	req_t* reqs,
+	size_t req_count,
+	uint64_t host_id,
+	kos_notif_cb_t notif_cb,
+	void* notif_data,
+	vdriver_write_ptr_t write_ptr
+) {
+	ensure_manifest_read();
+
+	// Find which VDRIVERs need to be (re)loaded.
+	// We can only keep slice numbers and not slot pointers at this point, as allocating slots may grow the slot array.
+
+	size_t* const slices = malloc(req_count * sizeof *slices);
+	size_t* const load_slices = malloc(req_count * sizeof *load_slices);
+	size_t load_count = 0;
+
+	assert(req_count == 0 || (slices != NULL && load_slices != NULL));
+
+	for (size_t i = 0; i < req_count; i++) {
+		req_t const* const req = &reqs[i];
+		slot_t* slot = find_slot_by_path(req->path);
+
+		if (slot == NULL || slot->vdriver == NULL) {
+			slot = alloc_slot(req->path);
+
+			slot->requested = true;
+			slot->host_id = host_id;
+			slot->notif_cb = notif_cb;
+			slot->notif_data = notif_data;
+			slot->write_ptr = write_ptr;
+		}
+
+		slices[i] = slot - slots;
+
+		if (slot->vdriver != NULL || (slot->cached && is_fresh(slot, &req->st))) {
+			continue;
+		}
+
+		// VDRIVER is new or changed since it was last probed, so we have to actually load it.
+
+		slot->mtime = req->st.st_mtime;
+		slot->size = req->st.st_size;
+		slot->ino = req->st.st_ino;
+
+		load_slices[load_count++] = slices[i];
+	}
+
+	if (load_count > 0) {
+		load_slots(load_slices, load_count);
+		save_slot();
+	}
+
+	// Send all the VDEVs from the cache.
+
+	for (size_t i = 0; i < req_count; i++) {
+		slot_t const* const slot = &slots[slices[i]];
+
+		if (!slot->cached) {
+			continue; // Failed to load.
+		}
+
+		LOG_V(cls, "Sending %zu VDEV(s) for VDRIVER '%s' (loaded=%d).", slot->vdev_count, slot->path, slot->vdriver != NULL);
+
+		for (size_t j = 0; j < slot->vdev_count; j++) {
+			kos_notif_t notif = {
+				.kind = KOS_NOTIF_ATTACH,
+				.attach.vdev = slot->vdevs[j],
+			};
+
+			notif.attach.vdev.host_id = host_id;
+			notif_cb(&notif, notif_data);
+		}
+	}
+
+	for (size_t i = 0; i < req_count; i++) {
+		free(reqs[i].path);
+	}
+
+	free(slices);
+	free(load_slices);
+}
+
+static void add_req(req_t** reqs, size_t* req_count, char const* path) {
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		return;
+	}
+
+	*reqs = realloc(*reqs, (*req_count + 1) * sizeof **reqs);
+	assert(*reqs != NULL);
+
+	req_t* const req = &(*reqs)[(*req_count)++];
+
+	req->path = strdup(path);
+	assert(req->path != NULL);
+	req->st = st;
+}
+
 void vdriver_loader_req_local_vdev(
 	char const* spec,
 	uint64_t host_id,
@@ -150,6 +742,9 @@ void vdriver_loader_req_local_vdev(
 	char** done_paths = NULL;
 	size_t done_path_count = 0;
 
+	req_t* reqs = NULL;
+	size_t req_count = 0;
+
 	char* __attribute__((cleanup(strfree))) path_copy_orig = strdup(vdriver_path);
 	assert(path_copy_orig != NULL);
 
@@ -174,29 +769,9 @@ void vdriver_loader_req_local_vdev(
 		assert(done_paths != NULL);
 		done_paths[done_path_count - 1] = candidate;
 
-		// Check if driver file exists.
+		// If driver file exists, we'll want its VDEVs.
 
-		if (access(candidate, F_OK) != 0) {
-			continue;
-		}
-
-		// Driver file exists, we should be able to load it.
-
-		vdriver_t* const vdriver = load_from_path(candidate, host_id, notif_cb, notif_data, write_ptr);
-
-		if (vdriver == NULL) {
-			continue;
-		}
-
-		// Probe for VDEVs on that driver.
-
-		if (vdriver->probe == NULL) {
-			LOG_E(cls, "VDRIVER '%s' doesn't implement a probe function.", spec);
-			continue;
-		}
-
-		LOG_V(cls, "Probing VDRIVER for '%s' VDEVs.", spec);
-		vdriver->probe();
+		add_req(&reqs, &req_count, candidate);
 
 next:;
 	}
@@ -206,6 +781,9 @@ next:;
 	}
 
 	free(done_paths);
+
+	req_paths(reqs, req_count, host_id, notif_cb, notif_data, write_ptr);
+	free(reqs);
 }
 
 void vdriver_loader_vdev_local_inventory(
@@ -219,6 +797,9 @@ void vdriver_loader_vdev_local_inventory(
 	char** done_paths = NULL;
 	size_t done_path_count = 0;
 
+	req_t* reqs = NULL;
+	size_t req_count = 0;
+
 	char* __attribute__((cleanup(strfree))) path_copy_orig = strdup(vdriver_path);
 	assert(path_copy_orig != NULL);
 
@@ -230,7 +811,6 @@ void vdriver_loader_vdev_local_inventory(
 
 		for (size_t i = 0; i < done_path_count; i++) {
 			if (strcmp(tok, done_paths[i]) == 0) {
-				free(tok);
 				goto next;
 			}
 		}
@@ -263,21 +843,7 @@ void vdriver_loader_vdev_local_inventory(
 			asprintf(&candidate, "%s/%s", tok, ent->d_name);
 			assert(candidate != NULL);
 
-			vdriver_t* const vdriver = load_from_path(candidate, host_id, notif_cb, notif_data, NULL);
-
-			if (vdriver == NULL) {
-				continue;
-			}
-
-			// Probe for VDEVs on that driver.
-
-			if (vdriver->probe == NULL) {
-				LOG_E(cls, "VDRIVER '%s' doesn't implement a probe function.", vdriver->spec);
-				continue;
-			}
-
-			LOG_V(cls, "Probing VDRIVER for '%s' VDEVs.", vdriver->spec);
-			vdriver->probe();
+			add_req(&reqs, &req_count, candidate);
 		}
 
 		closedir(dir);
@@ -286,20 +852,43 @@ next:;
 	}
 
 	free(done_paths);
+
+	// Load everything which needs to be at once, so that VDRIVERs can be probed concurrently.
+
+	req_paths(reqs, req_count, host_id, notif_cb, notif_data, NULL);
+	free(reqs);
 }
 
 vdriver_t* vdriver_loader_find_loaded_by_vid(vid_t vid) {
 	LOG_V(cls, "Trying to find VDRIVER associated with VDEV ID %" PRIu64 ".", vid);
 
-	for (size_t i = 0; i < vdriver_count; i++) {
-		vdriver_t* const vdriver = vdrivers[i];
+	uint64_t const slice = vid >> 32;
+
+	if (slice >= slot_count || !slots[slice].used || !slots[slice].requested) {
+		LOG_V(cls, "Could not find VDRIVER for VDEV ID %" PRIu64 ".", vid);
+		return NULL;
+	}
+
+	slot_t* const slot = &slots[slice];
+
+	if (slot->vdriver == NULL) {
+		LOG_V(cls, "VDRIVER '%s' for VDEV ID %" PRIu64 " not loaded yet, loading it now.", slot->path, vid);
 
-		if (vid >= vdriver->vdev_id_lo && vid <= vdriver->vdev_id_hi) {
-			LOG_V(cls, "Found VDRIVER '%s' for VDEV ID %" PRIu64 ".", vdriver->spec, vid);
-			return vdriver;
+		if (load_slot(slot) == NULL) {
+			return NULL;
 		}
 	}
 
-	LOG_V(cls, "Could not find VDRIVER for VDEV ID %" PRIu64 ".", vid);
-	return NULL;
+	LOG_V(cls, "Found VDRIVER '%s' for VDEV ID %" PRIu64 ".", slot->vdriver->spec, vid);
+	return slot->vdriver;
+}
+
+char const* vdriver_loader_get_spec_by_vid(vid_t vid) {
+	uint64_t const slice = vid >> 32;
+
+	if (slice >= slot_count || !slots[slice].used || !slots[slice].cached) {
+		return NULL;
+	}
+
+	return slots[slice].spec;
 }
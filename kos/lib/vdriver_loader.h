@@ -36,6 +36,22 @@
  */
 #define VDRIVER_EXT ".vdriver"
 
+/**
+ * The VDRIVER_MANIFEST environment variable name.
+ *
+ * This is the path to the VDRIVER manifest, which caches which VDRIVERs exist, the VID slice each of them was allocated, and the VDEVs they expose.
+ * This is what lets the loader hand out VDEVs without having to load the VDRIVERs behind them until something actually connects to one.
+ * The manifest is shared between all processes using the loader, so that VDEV IDs are consistent across them.
+ */
+#define VDRIVER_MANIFEST_ENVVAR "VDRIVER_MANIFEST"
+
+/**
+ * The default VDRIVER manifest path.
+ *
+ * It is used if the VDRIVER_MANIFEST environment variable is not set.
+ */
+#define DEFAULT_VDRIVER_MANIFEST "/tmp/vdriver.manifest"
+
 /**
  * Initialize VDRIVER loader global state.
  *
@@ -46,7 +62,9 @@ void vdriver_loader_init(void);
 /**
  * Request all the VDEVs of a specific spec.
  *
- * This will look for and load the VDRIVER implementing this spec if it exists, 
+ * This will look for the VDRIVER implementing this spec and send {@link KOS_NOTIF_ATTACH} notifications for all its VDEVs.
+ * If the VDRIVER is in the manifest and hasn't changed since, these are sent from the manifest and the VDRIVER is only loaded once something connects to one of its VDEVs (see {@link vdriver_loader_find_loaded_by_vid}).
+ * Requesting the same spec multiple times is fine; the VDRIVER is only ever loaded once.
  *
  * @param spec The specification of the VDEV to request.
  * @param host_id The host ID to pass to the VDRIVER when loading it.
@@ -65,7 +83,9 @@ void vdriver_loader_req_local_vdev(
 /**
  * Take inventory of all VDEVs available on the system.
  *
- * This will load all VDRIVERs found and probe for all their VDEVs.
+ * This will find all VDRIVERs and send {@link KOS_NOTIF_ATTACH} notifications for all their VDEVs.
+ * Like with {@link vdriver_loader_req_local_vdev}, VDRIVERs are only loaded and probed if they aren't in the manifest or changed since.
+ * Those that are are probed concurrently, but notifications are still sent in a deterministic order, once all of them are done.
  *
  * @param host_id The host ID to pass to the VDRIVERs when loading them.
  * @param notif_cb The callback to call for {@link KOS_NOTIF_ATTACH} notifications.
@@ -78,11 +98,22 @@ void vdriver_loader_vdev_local_inventory(
 );
 
 /**
- * Find an already loaded VDRIVER by a VDEV ID.
+ * Find the VDRIVER of a previously requested VDEV by its VDEV ID.
  *
- * Concretely, this just looks for the VDRIVER which has the given VDEV ID in its allocated VID slice.
+ * Concretely, this just looks up the VDRIVER which was allocated the VID slice the VDEV ID is in.
+ * If the VDRIVER hasn't actually been loaded yet, it is loaded (and probed, without sending any notifications) now.
  *
  * @param vid The VDEV ID to look for.
- * @return The VDRIVER associated with the given VDEV ID, or NULL if not found.
+ * @return The VDRIVER associated with the given VDEV ID, or NULL if not found or if it failed to load.
  */
 vdriver_t* vdriver_loader_find_loaded_by_vid(vid_t vid);
+
+/**
+ * Get the spec of the VDRIVER of a previously requested VDEV by its VDEV ID.
+ *
+ * Unlike {@link vdriver_loader_find_loaded_by_vid}, this never loads the VDRIVER.
+ *
+ * @param vid The VDEV ID to look for.
+ * @return The spec of the VDRIVER associated with the given VDEV ID, or NULL if not found.
+ */
+char const* vdriver_loader_get_spec_by_vid(vid_t vid);
@@ -0,0 +1,162 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+#include "record.h"
+
+#include <aqua/gv_proto.h>
+
+#include <umber.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Number of calls we remember the return type of while waiting for them to return.
+ */
+#define PENDING_SIZE 256
+
+typedef struct {
+	bool used;
+	kos_cookie_t cookie;
+	kos_type_t ret_type;
+} pending_t;
+
+static umber_class_t const* cls = NULL;
+
+bool record_enabled = false;
+
+static FILE* f = NULL;
+static uint64_t start;
+static pending_t pending[PENDING_SIZE];
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fini(void) {
+	fclose(f);
+}
+
+static __attribute__((constructor)) void init(void) {
+	cls = umber_class_new("aqua.kos.record", UMBER_LVL_INFO, "KOS call stream recording.");
+
+	char const* const path = getenv(RECORD_ENVVAR);
+
+	if (path == NULL || *path == '\0') {
+		return;
+	}
+
+	f = fopen(path, "w");
+
+	if (f == NULL) {
+		LOG_E(cls, "Failed to open %s for recording.", path);
+		return;
+	}
+
+	record_file_hdr_t const hdr = {
+		.magic = RECORD_MAGIC,
+		.vers = RECORD_VERS,
+	};
+
+	if (fwrite(&hdr, sizeof hdr, 1, f) != 1) {
+		LOG_E(cls, "Failed to write recording header to %s.", path);
+		fclose(f);
+		return;
+	}
+
+	LOG_I(cls, "Recording KOS call stream to %s.", path);
+
+	start = now();
+	record_enabled = true;
+	atexit(fini);
+}
+
+static void write_record(record_kind_t kind, kos_cookie_t cookie, uint64_t conn_id, uint32_t fn_id, void const* payload, uint32_t size) {
+	record_t const record = {
+		.ts = now() - start,
+		.cookie = cookie,
+		.conn_id = conn_id,
+		.fn_id = fn_id,
+		.size = size,
+		.kind = kind,
+	};
+
+	if (fwrite(&record, sizeof record, 1, f) != 1 || (size > 0 && fwrite(payload, size, 1, f) != 1)) {
+		LOG_E(cls, "Failed to write record, stopping recording.");
+		record_enabled = false;
+	}
+}
+
+void record_conn(kos_cookie_t cookie, uint64_t conn_id, char const* spec) {
+	uint8_t payload[64] = {0};
+	strncpy((char*) payload, spec, sizeof payload - 1);
+
+	write_record(RECORD_KIND_CONN, cookie, conn_id, 0, payload, sizeof payload);
+}
+
+void record_call(kos_cookie_t cookie, uint64_t conn_id, uint32_t fn_id, kos_fn_t const* fn, kos_val_t const* args) {
+	// Remember the return type for when the call returns, as return notifications don't carry the function ID.
+
+	pending_t* const p = &pending[cookie % PENDING_SIZE];
+
+	p->used = true;
+	p->cookie = cookie;
+	p->ret_type = fn->ret_type;
+
+	// Serialize arguments.
+
+	size_t size = 0;
+
+	for (size_t i = 0; i < fn->param_count; i++) {
+		size += gv_serialize_val_size(fn->params[i].type, &args[i]);
+	}
+
+	void* const payload = malloc(size);
+	assert(size == 0 || payload != NULL);
+
+	void* buf = payload;
+
+	for (size_t i = 0; i < fn->param_count; i++) {
+		buf += gv_serialize_val(buf, fn->params[i].type, &args[i]);
+	}
+
+	write_record(RECORD_KIND_CALL, cookie, conn_id, fn_id, payload, size);
+	free(payload);
+}
+
+void record_ret(kos_notif_t const* notif) {
+	pending_t* const p = &pending[notif->cookie % PENDING_SIZE];
+
+	// Calls which failed before even being queued were never recorded.
+
+	if (!p->used || p->cookie != notif->cookie) {
+		if (notif->kind == KOS_NOTIF_CALL_RET) {
+			LOG_W(cls, "Return for cookie 0x%" PRIx64 " doesn't match any recorded call.", notif->cookie);
+		}
+
+		return;
+	}
+
+	p->used = false;
+
+	if (notif->kind == KOS_NOTIF_CALL_FAIL) {
+		write_record(RECORD_KIND_FAIL, notif->cookie, notif->conn_id, 0, NULL, 0);
+		return;
+	}
+
+	kos_val_t const* const ret = &notif->call_ret.ret;
+	size_t const size = gv_serialize_val_size(p->ret_type, ret);
+
+	void* const payload = malloc(size);
+	assert(size == 0 || payload != NULL);
+
+	gv_serialize_val(payload, p->ret_type, ret);
+	write_record(RECORD_KIND_RET, notif->cookie, notif->conn_id, 0, payload, size);
+	free(payload);
+}
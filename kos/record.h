@@ -0,0 +1,133 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+/**
+ * Recording of the stream of connections and calls an application makes to its VDEVs.
+ *
+ * Recording is enabled by setting the KOS_RECORD environment variable to the path of the file to record to.
+ * The recording can then be reissued against a local or GrapeVine VDEV with `aqua-replay`.
+ *
+ * A recording file starts with a {@link record_file_hdr_t} and is followed by a sequence of {@link record_t}, each immediately followed by its payload.
+ * Values in payloads are serialized the same way they would be on the GrapeVine.
+ */
+
+#pragma once
+
+#include <aqua/kos.h>
+
+/**
+ * The KOS_RECORD environment variable name.
+ */
+#define RECORD_ENVVAR "KOS_RECORD"
+
+/**
+ * Magic bytes at the start of each recording file.
+ */
+#define RECORD_MAGIC "AQUAREC"
+
+/**
+ * Recording file format version.
+ */
+#define RECORD_VERS 0
+
+/**
+ * The kind of a record.
+ */
+typedef enum : uint8_t {
+	/**
+	 * A connection to a VDEV was established.
+	 *
+	 * The payload is the spec of the VDEV (64 bytes, NUL-padded).
+	 */
+	RECORD_KIND_CONN,
+	/**
+	 * A call was issued.
+	 *
+	 * The payload is the serialized arguments of the call.
+	 */
+	RECORD_KIND_CALL,
+	/**
+	 * A call returned.
+	 *
+	 * The payload is the serialized return value of the call.
+	 */
+	RECORD_KIND_RET,
+	/**
+	 * A call failed.
+	 *
+	 * There is no payload.
+	 */
+	RECORD_KIND_FAIL,
+} record_kind_t;
+
+/**
+ * Header at the start of each recording file.
+ */
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t vers;
+} record_file_hdr_t;
+
+/**
+ * A record.
+ */
+typedef struct __attribute__((packed)) {
+	/**
+	 * Timestamp in nanoseconds, relative to the start of the recording.
+	 */
+	uint64_t ts;
+	/**
+	 * Cookie of the call or connection.
+	 */
+	kos_cookie_t cookie;
+	/**
+	 * Connection ID, as seen by the recorded application.
+	 */
+	uint64_t conn_id;
+	/**
+	 * Function ID, for {@link RECORD_KIND_CALL} records.
+	 */
+	uint32_t fn_id;
+	/**
+	 * Size of the payload following this record.
+	 */
+	uint32_t size;
+	/**
+	 * The kind of the record.
+	 */
+	record_kind_t kind;
+} record_t;
+
+/**
+ * Whether recording is enabled.
+ *
+ * Check this before calling any of the other functions.
+ */
+extern bool record_enabled;
+
+/**
+ * Record a connection to a VDEV being established.
+ *
+ * @param cookie The cookie of the connection request.
+ * @param conn_id The connection ID.
+ * @param spec The spec of the VDEV connected to.
+ */
+void record_conn(kos_cookie_t cookie, uint64_t conn_id, char const* spec);
+
+/**
+ * Record a call being issued.
+ *
+ * @param cookie The cookie of the call.
+ * @param conn_id The connection ID the call is made on.
+ * @param fn_id The ID of the function being called.
+ * @param fn The function being called.
+ * @param args The arguments of the call.
+ */
+void record_call(kos_cookie_t cookie, uint64_t conn_id, uint32_t fn_id, kos_fn_t const* fn, kos_val_t const* args);
+
+/**
+ * Record a call returning or failing.
+ *
+ * @param notif The {@link KOS_NOTIF_CALL_RET} or {@link KOS_NOTIF_CALL_FAIL} notification.
+ */
+void record_ret(kos_notif_t const* notif);
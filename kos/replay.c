@@ -0,0 +1,484 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Reissue a call stream recorded with KOS_RECORD against whichever matching VDEVs are available, locally or on the GrapeVine.
+// Calls are replayed either at the rate they were originally made or as fast as possible, and latency statistics are printed at the end.
+
+#include "record.h"
+
+#include <aqua/gv_proto.h>
+#include <aqua/kos.h>
+
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+	record_t record;
+	void* payload;
+} ent_t;
+
+typedef struct {
+	bool alive;
+	uint64_t conn_id;
+	uint32_t fn_count;
+	kos_fn_t const* fns;
+} conn_map_t;
+
+typedef struct {
+	kos_opaque_ptr_t recorded;
+	kos_opaque_ptr_t live;
+} opaque_map_t;
+
+typedef struct {
+	char spec[64];
+	bool found;
+	kos_vdev_descr_t vdev;
+} spec_t;
+
+static bool max_rate = false;
+static int kind_filter = -1;
+
+static size_t spec_count = 0;
+static spec_t* specs = NULL;
+
+static size_t conn_map_count = 0;
+static conn_map_t* conn_map = NULL;
+
+static size_t opaque_map_count = 0;
+static opaque_map_t* opaque_map = NULL;
+
+// State of the call or connection currently in flight.
+
+static kos_notif_kind_t last_kind;
+static uint64_t last_conn_id;
+static uint32_t last_fn_count;
+static kos_fn_t const* last_fns;
+static kos_type_t last_ret_type;
+static kos_val_t last_ret;
+static size_t last_ret_size;
+static void* last_ret_buf = NULL;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void notif_cb(kos_notif_t const* notif, void* data) {
+	(void) data;
+
+	switch (notif->kind) {
+	case KOS_NOTIF_ATTACH:;
+		kos_vdev_descr_t const* const vdev = &notif->attach.vdev;
+
+		if (kind_filter >= 0 && (int) vdev->kind != kind_filter) {
+			break;
+		}
+
+		for (size_t i = 0; i < spec_count; i++) {
+			spec_t* const spec = &specs[i];
+
+			if (strcmp(spec->spec, (char const*) vdev->spec) != 0) {
+				continue;
+			}
+
+			if (!spec->found || vdev->pref > spec->vdev.pref) {
+				spec->found = true;
+				spec->vdev = *vdev;
+			}
+		}
+
+		break;
+	case KOS_NOTIF_CONN:
+		last_kind = notif->kind;
+		last_conn_id = notif->conn_id;
+		last_fn_count = notif->conn.fn_count;
+		last_fns = notif->conn.fns;
+		break;
+	case KOS_NOTIF_CALL_RET:
+		last_kind = notif->kind;
+		last_ret = notif->call_ret.ret;
+
+		free(last_ret_buf);
+		last_ret_size = gv_serialize_val_size(last_ret_type, &last_ret);
+		last_ret_buf = malloc(last_ret_size);
+		assert(last_ret_size == 0 || last_ret_buf != NULL);
+		gv_serialize_val(last_ret_buf, last_ret_type, &last_ret);
+
+		break;
+	case KOS_NOTIF_CONN_FAIL:
+	case KOS_NOTIF_CALL_FAIL:
+		last_kind = notif->kind;
+		break;
+	default:
+		break;
+	}
+}
+
+static ent_t* read_recording(char const* path, size_t* count_out) {
+	FILE* const f = fopen(path, "r");
+
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return NULL;
+	}
+
+	record_file_hdr_t hdr;
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, RECORD_MAGIC, sizeof RECORD_MAGIC) != 0) {
+		fprintf(stderr, "%s is not a KOS recording.\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	if (hdr.vers != RECORD_VERS) {
+		fprintf(stderr, "%s has unsupported recording version %u.\n", path, hdr.vers);
+		fclose(f);
+		return NULL;
+	}
+
+	size_t count = 0;
+	ent_t* ents = NULL;
+	record_t record;
+
+	while (fread(&record, sizeof record, 1, f) == 1) {
+		ents = realloc(ents, (count + 1) * sizeof *ents);
+		assert(ents != NULL);
+
+		ent_t* const ent = &ents[count++];
+
+		ent->record = record;
+		ent->payload = malloc(record.size);
+		assert(record.size == 0 || ent->payload != NULL);
+
+		if (record.size > 0 && fread(ent->payload, record.size, 1, f) != 1) {
+			fprintf(stderr, "%s is truncated.\n", path);
+			count--;
+			free(ent->payload);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	*count_out = count;
+	return ents;
+}
+
+static void add_spec(char const* name) {
+	for (size_t i = 0; i < spec_count; i++) {
+		if (strcmp(specs[i].spec, name) == 0) {
+			return;
+		}
+	}
+
+	specs = realloc(specs, (spec_count + 1) * sizeof *specs);
+	assert(specs != NULL);
+
+	spec_t* const spec = &specs[spec_count++];
+	memset(spec, 0, sizeof *spec);
+	strncpy(spec->spec, name, sizeof spec->spec - 1);
+}
+
+static spec_t* find_spec(char const* name) {
+	for (size_t i = 0; i < spec_count; i++) {
+		if (strcmp(specs[i].spec, name) == 0) {
+			return &specs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static conn_map_t* get_conn_map(uint64_t recorded_conn_id) {
+	if (recorded_conn_id >= conn_map_count) {
+		conn_map = realloc(conn_map, (recorded_conn_id + 1) * sizeof *conn_map);
+		assert(conn_map != NULL);
+
+		memset(&conn_map[conn_map_count], 0, (recorded_conn_id + 1 - conn_map_count) * sizeof *conn_map);
+		conn_map_count = recorded_conn_id + 1;
+	}
+
+	return &conn_map[recorded_conn_id];
+}
+
+static void map_opaque_ptr(kos_opaque_ptr_t* ptr) {
+	for (size_t i = 0; i < opaque_map_count; i++) {
+		opaque_map_t* const map = &opaque_map[i];
+
+		if (map->recorded.host_id == ptr->host_id && map->recorded.ptr == ptr->ptr) {
+			*ptr = map->live;
+			return;
+		}
+	}
+}
+
+static int cmp_u64(void const* a, void const* b) {
+	uint64_t const x = *(uint64_t const*) a;
+	uint64_t const y = *(uint64_t const*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(char const* progname) {
+	fprintf(stderr, "usage: %s [-m] [-g | -l] recording\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	char const* const progname = argv[0];
+	int c;
+
+	while ((c = getopt(argc, argv, "mgl")) != -1) {
+		switch (c) {
+		case 'm':
+			max_rate = true;
+			break;
+		case 'g':
+			kind_filter = KOS_VDEV_KIND_GV;
+			break;
+		case 'l':
+			kind_filter = KOS_VDEV_KIND_LOCAL;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage(progname);
+	}
+
+	// Read recording.
+
+	size_t ent_count;
+	ent_t* const ents = read_recording(argv[0], &ent_count);
+
+	if (ents == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	// Find VDEVs for all the specs the recording connects to.
+
+	kos_descr_v4_t descr;
+
+	if (kos_hello(KOS_API_V4, KOS_API_V4, &descr) == KOS_API_VERS_NONE) {
+		fprintf(stderr, "Failed to say hello to the KOS.\n");
+		return EXIT_FAILURE;
+	}
+
+	kos_sub_to_notif(notif_cb, NULL);
+
+	for (size_t i = 0; i < ent_count; i++) {
+		if (ents[i].record.kind == RECORD_KIND_CONN) {
+			add_spec(ents[i].payload);
+		}
+	}
+
+	for (size_t i = 0; i < spec_count; i++) {
+		kos_req_vdev(specs[i].spec);
+	}
+
+	kos_flush(true);
+
+	for (size_t i = 0; i < spec_count; i++) {
+		if (!specs[i].found) {
+			fprintf(stderr, "No VDEV found for spec '%s'.\n", specs[i].spec);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Replay.
+
+	size_t call_count = 0;
+	size_t fail_count = 0;
+	size_t mismatch_count = 0;
+	size_t skip_count = 0;
+	uint64_t* const lats = malloc(ent_count * sizeof *lats);
+	assert(lats != NULL);
+
+	uint64_t const start = now();
+	uint64_t const orig_duration = ent_count > 0 ? ents[ent_count - 1].record.ts : 0;
+
+	for (size_t i = 0; i < ent_count; i++) {
+		ent_t* const ent = &ents[i];
+		record_t const* const record = &ent->record;
+
+		if (record->kind != RECORD_KIND_CONN && record->kind != RECORD_KIND_CALL) {
+			continue;
+		}
+
+		// Wait until the time this was originally done at.
+
+		if (!max_rate) {
+			uint64_t const target = start + record->ts;
+			uint64_t const cur = now();
+
+			if (target > cur) {
+				struct timespec const ts = {
+					.tv_sec = (target - cur) / 1000000000,
+					.tv_nsec = (target - cur) % 1000000000,
+				};
+
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		conn_map_t* const map = get_conn_map(record->conn_id);
+
+		if (record->kind == RECORD_KIND_CONN) {
+			spec_t const* const spec = find_spec(ent->payload);
+			assert(spec != NULL);
+
+			last_kind = KOS_NOTIF_CONN_FAIL;
+			kos_vdev_conn(spec->vdev.host_id, spec->vdev.vdev_id);
+			kos_flush(true);
+
+			if (last_kind != KOS_NOTIF_CONN) {
+				fprintf(stderr, "Failed to connect to VDEV for spec '%s'.\n", spec->spec);
+				return EXIT_FAILURE;
+			}
+
+			map->alive = true;
+			map->conn_id = last_conn_id;
+			map->fn_count = last_fn_count;
+			map->fns = last_fns;
+
+			continue;
+		}
+
+		// Deserialize call arguments.
+
+		if (!map->alive || record->fn_id >= map->fn_count) {
+			skip_count++;
+			continue;
+		}
+
+		kos_fn_t const* const fn = &map->fns[record->fn_id];
+		kos_val_t* const args = malloc(fn->param_count * sizeof *args);
+		assert(fn->param_count == 0 || args != NULL);
+
+		size_t size = 0;
+		bool replayable = true;
+
+		for (size_t j = 0; j < fn->param_count; j++) {
+			kos_type_t const type = fn->params[j].type;
+			size += gv_deserialize_val(ent->payload + size, type, &args[j]);
+
+			// Pointers are into the recorded application's memory, so there's no way we can replay these.
+			// Opaque pointers are handles previously returned by the VDEV, so map them to the ones it returned to us.
+
+			if (type == KOS_TYPE_PTR) {
+				replayable = false;
+			}
+
+			if (type == KOS_TYPE_OPAQUE_PTR) {
+				map_opaque_ptr(&args[j].opaque_ptr);
+			}
+		}
+
+		if (size != record->size || !replayable) {
+			for (size_t j = 0; j < fn->param_count; j++) {
+				kos_val_free(fn->params[j].type, &args[j]);
+			}
+
+			free(args);
+			skip_count++;
+			continue;
+		}
+
+		// Actually call.
+
+		last_kind = KOS_NOTIF_CALL_FAIL;
+		last_ret_type = fn->ret_type;
+
+		uint64_t const call_start = now();
+		kos_vdev_call(map->conn_id, record->fn_id, args);
+		kos_flush(true);
+		lats[call_count++] = now() - call_start;
+
+		for (size_t j = 0; j < fn->param_count; j++) {
+			kos_val_free(fn->params[j].type, &args[j]);
+		}
+
+		free(args);
+
+		if (last_kind != KOS_NOTIF_CALL_RET) {
+			fail_count++;
+			continue;
+		}
+
+		// Compare with the recorded return, if there is one.
+
+		for (size_t j = i + 1; j < ent_count; j++) {
+			record_t const* const ret_record = &ents[j].record;
+
+			if (ret_record->cookie != record->cookie || (ret_record->kind != RECORD_KIND_RET && ret_record->kind != RECORD_KIND_FAIL)) {
+				continue;
+			}
+
+			if (ret_record->kind == RECORD_KIND_FAIL) {
+				mismatch_count++;
+				break;
+			}
+
+			if (fn->ret_type == KOS_TYPE_OPAQUE_PTR) {
+				kos_val_t recorded;
+				gv_deserialize_val(ents[j].payload, fn->ret_type, &recorded);
+
+				opaque_map = realloc(opaque_map, (opaque_map_count + 1) * sizeof *opaque_map);
+				assert(opaque_map != NULL);
+
+				opaque_map[opaque_map_count++] = (opaque_map_t) {
+					.recorded = recorded.opaque_ptr,
+					.live = last_ret.opaque_ptr,
+				};
+
+				break;
+			}
+
+			if (ret_record->size != last_ret_size || memcmp(ents[j].payload, last_ret_buf, last_ret_size) != 0) {
+				mismatch_count++;
+			}
+
+			break;
+		}
+	}
+
+	uint64_t const duration = now() - start;
+
+	// Print statistics.
+
+	qsort(lats, call_count, sizeof *lats, cmp_u64);
+
+	uint64_t total_lat = 0;
+
+	for (size_t i = 0; i < call_count; i++) {
+		total_lat += lats[i];
+	}
+
+	printf("Replayed %zu calls in %.3f ms (originally %.3f ms, %s rate).\n", call_count, duration / 1e6, orig_duration / 1e6, max_rate ? "max" : "original");
+	printf("Throughput: %.1f calls/s\n", call_count ? call_count / (duration / 1e9) : 0.);
+
+	if (call_count > 0) {
+		printf(
+			"Latency: mean %.3f us, p50 %.3f us, p99 %.3f us, max %.3f us\n",
+			total_lat / 1e3 / call_count,
+			lats[call_count / 2] / 1e3,
+			lats[call_count * 99 / 100] / 1e3,
+			lats[call_count - 1] / 1e3
+		);
+	}
+
+	printf("Failed: %zu, return mismatches: %zu, skipped: %zu\n", fail_count, mismatch_count, skip_count);
+
+	return fail_count || mismatch_count ? EXIT_FAILURE : EXIT_SUCCESS;
+}
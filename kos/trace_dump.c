@@ -0,0 +1,172 @@
+// This Source Form is subject to the terms of the AQUA Software License, v. 1.0.
+// Copyright (c) 2025 Aymeric Wibo
+
+// Convert trace files written by processes run with AQUA_TRACE set to the Chrome/Perfetto JSON trace format.
+// Pass all the trace files from the client, gvd, and KOS agents at once to see them all on the same timeline, with each GrapeVine call linked to where the KOS agent handled it by flow arrows.
+
+#include "lib/trace.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool first = true;
+
+/**
+ * Where each kind of event sits in the flows drawn between the KOS and KOS agent for a call.
+ *
+ * Each call gets two flows keyed on its request ID: one for the call going out to the KOS agent, and one for its return coming back.
+ */
+static struct {
+	char const* name;
+	char ph;
+} const flows[TRACE_KIND_COUNT] = {
+	[TRACE_GV_SEND] = {"call", 's'},
+	[TRACE_AGENT_CALL_BEGIN] = {"call", 'f'},
+	[TRACE_AGENT_RET] = {"return", 's'},
+	[TRACE_GV_RECV] = {"return", 'f'},
+};
+
+/**
+ * Emit the flow event tying an event to its counterpart in another process, if it has one.
+ */
+static void emit_flow(trace_file_hdr_t const* hdr, trace_ev_t const* ev) {
+	char const* const name = flows[ev->kind].name;
+
+	if (ev->flow == 0 || name == NULL) {
+		return;
+	}
+
+	// Request IDs don't fit in a double, so pass them as strings.
+	// Flow ends bind to the slice they're in rather than the next one, as the KOS agent's call span starts at the same time.
+
+	printf(
+		",\n\t\t{\"name\": \"%s\", \"cat\": \"gv\", \"ph\": \"%c\", \"id\": \"0x%" PRIx64 "\", \"ts\": %" PRIu64 ".%03" PRIu64 ", \"pid\": %u, \"tid\": %u%s}",
+		name,
+		flows[ev->kind].ph,
+		ev->flow,
+		ev->ts / 1000,
+		ev->ts % 1000,
+		hdr->pid,
+		ev->tid,
+		flows[ev->kind].ph == 'f' ? ", \"bp\": \"e\"" : ""
+	);
+}
+
+static void emit(trace_file_hdr_t const* hdr, trace_ev_t const* ev) {
+	if (ev->kind >= TRACE_KIND_COUNT) {
+		return;
+	}
+
+	// Spans are named after their kind without the _BEGIN/_END suffix.
+
+	char const* const kind = trace_kind_strs[ev->kind];
+	size_t len = strlen(kind);
+	char ph = 'i';
+
+	if (len > 6 && strcmp(kind + len - 6, "_BEGIN") == 0) {
+		ph = 'B';
+		len -= 6;
+	}
+
+	else if (len > 4 && strcmp(kind + len - 4, "_END") == 0) {
+		ph = 'E';
+		len -= 4;
+	}
+
+	printf(
+		"%s\n\t\t{\"name\": \"%.*s\", \"ph\": \"%c\", \"ts\": %" PRIu64 ".%03" PRIu64 ", \"pid\": %u, \"tid\": %u",
+		first ? "" : ",",
+		(int) len,
+		kind,
+		ph,
+		ev->ts / 1000,
+		ev->ts % 1000,
+		hdr->pid,
+		ev->tid
+	);
+
+	if (ph == 'i') {
+		printf(", \"s\": \"t\"");
+	}
+
+	printf(", \"args\": {\"id\": %" PRIu64 ", \"a\": %" PRIu64 ", \"b\": %" PRIu64, ev->id, ev->a, ev->b);
+
+	if (ev->kind == TRACE_GV_SEND && ev->b != 0) {
+		printf(", \"ratio\": %.2f", (double) ev->a / ev->b);
+	}
+
+	if (ev->flow != 0) {
+		printf(", \"req_id\": \"0x%" PRIx64 "\"", ev->flow);
+	}
+
+	printf("}}");
+	first = false;
+
+	emit_flow(hdr, ev);
+}
+
+static int dump_file(char const* path) {
+	FILE* const f = fopen(path, "r");
+
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return -1;
+	}
+
+	trace_file_hdr_t hdr;
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof TRACE_MAGIC) != 0) {
+		fprintf(stderr, "%s is not a trace file.\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	if (hdr.vers != TRACE_VERS) {
+		fprintf(stderr, "%s has unsupported trace version %u.\n", path, hdr.vers);
+		fclose(f);
+		return -1;
+	}
+
+	hdr.name[sizeof hdr.name - 1] = '\0';
+
+	printf(
+		"%s\n\t\t{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %u, \"args\": {\"name\": \"%s\"}}",
+		first ? "" : ",",
+		hdr.pid,
+		hdr.name
+	);
+
+	first = false;
+	trace_ev_t ev;
+
+	while (fread(&ev, sizeof ev, 1, f) == 1) {
+		emit(&hdr, &ev);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace-file ...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int rv = EXIT_SUCCESS;
+
+	printf("{\n\t\"displayTimeUnit\": \"ns\",\n\t\"traceEvents\": [");
+
+	for (int i = 1; i < argc; i++) {
+		if (dump_file(argv[i]) < 0) {
+			rv = EXIT_FAILURE;
+		}
+	}
+
+	printf("\n\t]\n}\n");
+
+	return rv;
+}
@@ -7,6 +7,7 @@
 #include "component.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -226,18 +227,25 @@ void aqua_vdev_it_next(aqua_vdev_it_t* it) {
 }
 
 kos_vdev_descr_t* aqua_get_best_vdev(aqua_component_t comp) {
+	return aqua_get_best_vdev_for(comp, KOS_WORKLOAD_LATENCY);
+}
+
+kos_vdev_descr_t* aqua_get_best_vdev_for(aqua_component_t comp, kos_workload_t workload) {
 	assert(comp != NULL);
 
 	aqua_vdev_it_t it = aqua_vdev_it(comp);
 	kos_vdev_descr_t* best = NULL;
+	uint64_t best_cost = UINT64_MAX;
 
 	for (; it.vdev != NULL; aqua_vdev_it_next(&it)) {
 		kos_vdev_descr_t* const vdev = it.vdev;
+		uint64_t const cost = kos_vdev_cost(vdev, workload);
 
-		LOG_V(cls, "Looking for best VDEV: %s (spec=%s, pref=%d).", vdev->human, vdev->spec, vdev->pref);
+		LOG_V(cls, "Looking for best VDEV: %s (spec=%s, pref=%d, cost=%" PRIu64 " ns).", vdev->human, vdev->spec, vdev->pref, cost);
 
-		if (best == NULL || vdev->pref > best->pref) {
+		if (best == NULL || vdev->pref > best->pref || (vdev->pref == best->pref && cost < best_cost)) {
 			best = vdev;
+			best_cost = cost;
 		}
 	}
 
@@ -295,3 +303,298 @@ void aqua_add_interrupt(aqua_ctx_t ctx, kos_ino_t ino, component_t* comp, void*
 	ent->comp = comp;
 	ent->data = data;
 }
+
+typedef struct {
+	void* ctx;
+	size_t outstanding;
+} pool_member_t;
+
+typedef struct {
+	bool used;
+	bool tombstone;
+	kos_opaque_ptr_t handle;
+	size_t member;
+} pool_pin_t;
+
+struct aqua_pool_t {
+	aqua_ctx_t ctx;
+	aqua_pool_policy_t policy;
+	aqua_pool_disconn_t disconn;
+
+	size_t member_count;
+	pool_member_t* members;
+	size_t next;
+
+	// Open-addressed (linear probing) table of pinned objects.
+	// The capacity is always a power of two so we can mask instead of mod.
+	// Unpinned slots are left as tombstones until the next rehash.
+
+	size_t pin_count;
+	size_t pin_tombstone_count;
+	size_t pin_cap;
+	pool_pin_t* pins;
+};
+
+aqua_pool_t aqua_pool_conn(aqua_component_t comp, aqua_pool_policy_t policy, aqua_pool_conn_t conn, aqua_pool_disconn_t disconn) {
+	assert(comp != NULL);
+	assert(conn != NULL);
+	assert(disconn != NULL);
+
+	kos_vdev_descr_t const* const best = aqua_get_best_vdev(comp);
+
+	if (best == NULL) {
+		return NULL;
+	}
+
+	aqua_pool_t const pool = calloc(1, sizeof *pool);
+
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->ctx = ((component_t*) comp)->ctx;
+	pool->policy = policy;
+	pool->disconn = disconn;
+
+	for (aqua_vdev_it_t it = aqua_vdev_it(comp); it.vdev != NULL; aqua_vdev_it_next(&it)) {
+		kos_vdev_descr_t const* const vdev = it.vdev;
+
+		if (strcmp((char*) vdev->spec, (char*) best->spec) != 0 || vdev->vers != best->vers) {
+			continue;
+		}
+
+		void* const member = conn(vdev);
+
+		if (member == NULL) {
+			LOG_W(cls, "Failed to connect to pool member %s (host_id=0x%" PRIx64 "), skipping.", vdev->human, vdev->host_id);
+			continue;
+		}
+
+		pool_member_t* const members = realloc(pool->members, (pool->member_count + 1) * sizeof *pool->members);
+
+		if (members == NULL) {
+			disconn(member);
+			break;
+		}
+
+		pool->members = members;
+		pool->members[pool->member_count++] = (pool_member_t) {
+			.ctx = member,
+			.outstanding = 0,
+		};
+	}
+
+	if (pool->member_count == 0) {
+		LOG_E(cls, "Could not connect to any VDEV for pooled connection.");
+		aqua_pool_disconn(pool);
+		return NULL;
+	}
+
+	LOG_V(cls, "Created pooled connection with %zu members (spec=%s).", pool->member_count, best->spec);
+	return pool;
+}
+
+void aqua_pool_disconn(aqua_pool_t pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < pool->member_count; i++) {
+		pool->disconn(pool->members[i].ctx);
+	}
+
+	free(pool->members);
+	free(pool->pins);
+	free(pool);
+}
+
+size_t aqua_pool_member_count(aqua_pool_t pool) {
+	assert(pool != NULL);
+	return pool->member_count;
+}
+
+static size_t pool_pick(aqua_pool_t pool) {
+	size_t const start = pool->next++ % pool->member_count;
+
+	if (pool->policy == AQUA_POOL_POLICY_ROUND_ROBIN) {
+		return start;
+	}
+
+	// Least outstanding requests.
+	// We start scanning from the round-robin cursor so that ties are spread out evenly rather than always going to the first member.
+
+	size_t best = start;
+
+	for (size_t i = 1; i < pool->member_count; i++) {
+		size_t const candidate = (start + i) % pool->member_count;
+
+		if (pool->members[candidate].outstanding < pool->members[best].outstanding) {
+			best = candidate;
+		}
+	}
+
+	return best;
+}
+
+void* aqua_pool_get(aqua_pool_t pool) {
+	assert(pool != NULL);
+
+	pool_member_t* const member = &pool->members[pool_pick(pool)];
+	member->outstanding++;
+
+	return member->ctx;
+}
+
+static size_t pin_hash(kos_opaque_ptr_t handle) {
+	return (handle.host_id ^ handle.ptr) * 0x9E3779B97F4A7C15ull >> 17;
+}
+
+static bool pin_eq(kos_opaque_ptr_t a, kos_opaque_ptr_t b) {
+	return a.host_id == b.host_id && a.ptr == b.ptr;
+}
+
+static pool_pin_t* pin_find(aqua_pool_t pool, kos_opaque_ptr_t handle) {
+	if (pool->pin_cap == 0) {
+		return NULL;
+	}
+
+	size_t const mask = pool->pin_cap - 1;
+
+	for (size_t i = pin_hash(handle) & mask;; i = (i + 1) & mask) {
+		pool_pin_t* const pin = &pool->pins[i];
+
+		if (!pin->used && !pin->tombstone) {
+			return NULL;
+		}
+
+		if (pin->used && pin_eq(pin->handle, handle)) {
+			return pin;
+		}
+	}
+}
+
+static pool_pin_t* pin_insert(pool_pin_t* pins, size_t cap, kos_opaque_ptr_t handle, size_t member) {
+	size_t const mask = cap - 1;
+	size_t i = pin_hash(handle) & mask;
+
+	while (pins[i].used) {
+		i = (i + 1) & mask;
+	}
+
+	pool_pin_t* const pin = &pins[i];
+	pin->used = true;
+	pin->handle = handle;
+	pin->member = member;
+
+	return pin;
+}
+
+void* aqua_pool_get_pinned(aqua_pool_t pool, kos_opaque_ptr_t handle) {
+	assert(pool != NULL);
+
+	pool_pin_t const* const pin = pin_find(pool, handle);
+
+	if (pin == NULL) {
+		return aqua_pool_get(pool);
+	}
+
+	pool_member_t* const member = &pool->members[pin->member];
+	member->outstanding++;
+
+	return member->ctx;
+}
+
+void aqua_pool_put(aqua_pool_t pool, void* ctx) {
+	assert(pool != NULL);
+
+	for (size_t i = 0; i < pool->member_count; i++) {
+		pool_member_t* const member = &pool->members[i];
+
+		if (member->ctx != ctx) {
+			continue;
+		}
+
+		assert(member->outstanding > 0);
+		member->outstanding--;
+
+		return;
+	}
+
+	assert(false);
+}
+
+void aqua_pool_pin(aqua_pool_t pool, kos_opaque_ptr_t handle, void* ctx) {
+	assert(pool != NULL);
+
+	size_t member = pool->member_count;
+
+	for (size_t i = 0; i < pool->member_count; i++) {
+		if (pool->members[i].ctx == ctx) {
+			member = i;
+			break;
+		}
+	}
+
+	assert(member < pool->member_count);
+
+	pool_pin_t* const existing = pin_find(pool, handle);
+
+	if (existing != NULL) {
+		existing->member = member;
+		return;
+	}
+
+	// Rehash when we'd be over half full, which also gets rid of tombstones.
+	// Only grow if it's the live pins and not the tombstones that are filling the table up.
+
+	if ((pool->pin_count + pool->pin_tombstone_count + 1) * 2 > pool->pin_cap) {
+		size_t cap = pool->pin_cap == 0 ? 16 : pool->pin_cap;
+
+		if ((pool->pin_count + 1) * 4 > cap) {
+			cap *= 2;
+		}
+
+		pool_pin_t* const pins = calloc(cap, sizeof *pins);
+
+		if (pins == NULL) {
+			error(pool->ctx, "Failed to allocate memory for pin table");
+			return;
+		}
+
+		for (size_t i = 0; i < pool->pin_cap; i++) {
+			if (pool->pins[i].used) {
+				pin_insert(pins, cap, pool->pins[i].handle, pool->pins[i].member);
+			}
+		}
+
+		free(pool->pins);
+		pool->pins = pins;
+		pool->pin_cap = cap;
+		pool->pin_tombstone_count = 0;
+	}
+
+	pool_pin_t* const pin = pin_insert(pool->pins, pool->pin_cap, handle, member);
+
+	if (pin->tombstone) {
+		pin->tombstone = false;
+		pool->pin_tombstone_count--;
+	}
+
+	pool->pin_count++;
+}
+
+void aqua_pool_unpin(aqua_pool_t pool, kos_opaque_ptr_t handle) {
+	assert(pool != NULL);
+
+	pool_pin_t* const pin = pin_find(pool, handle);
+
+	if (pin == NULL) {
+		return;
+	}
+
+	pin->used = false;
+	pin->tombstone = true;
+
+	pool->pin_count--;
+	pool->pin_tombstone_count++;
+}
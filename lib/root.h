@@ -90,10 +90,139 @@ void aqua_vdev_it_next(aqua_vdev_it_t* it);
 /**
  * Get best VDEV for a component.
  *
- * Note that for now, the only heuristic for what the "best" VDEV is is the first one with the highest "pref" value.
- * TODO Make this more sophisticated, by taking into account proximity for example.
+ * This is the same as calling {@link aqua_get_best_vdev_for} with {@link KOS_WORKLOAD_LATENCY}.
  *
  * @param comp The component to get the best VDEV for.
  * @return The best VDEV for the component or `NULL` if no VDEV was found.
  */
 kos_vdev_descr_t* aqua_get_best_vdev(aqua_component_t comp);
+
+/**
+ * Get best VDEV for a component, given the profile of calls that will be made to it.
+ *
+ * VDEVs with the highest "pref" value are preferred, as this reflects the VDRIVER's own judgement of its implementation (e.g. hardware vs. software rendering).
+ * Between VDEVs with the same "pref" value, the one with the lowest expected call cost for the workload (see {@link kos_vdev_cost}) is picked, so that e.g. a local VDEV wins over an equivalent one on a congested GrapeVine link.
+ *
+ * @param comp The component to get the best VDEV for.
+ * @param workload The profile of calls that will be made to the VDEV.
+ * @return The best VDEV for the component or `NULL` if no VDEV was found.
+ */
+kos_vdev_descr_t* aqua_get_best_vdev_for(aqua_component_t comp, kos_workload_t workload);
+
+/**
+ * Policy a pooled connection uses to pick which of its members a stateless call should go to.
+ */
+typedef enum {
+	/**
+	 * Cycle through the members one after the other.
+	 */
+	AQUA_POOL_POLICY_ROUND_ROBIN,
+	/**
+	 * Pick the member with the fewest calls currently outstanding, falling back to round-robin between ties.
+	 */
+	AQUA_POOL_POLICY_LEAST_OUTSTANDING,
+} aqua_pool_policy_t;
+
+/**
+ * AQUA pooled connection.
+ *
+ * A pooled connection is a connection to every VDEV of a component which is identical to the best one (i.e. which has the same spec and version).
+ * Stateless calls can then be spread across all of these VDEVs, while stateful calls can be pinned to the VDEV which owns the object they are operating on.
+ */
+typedef struct aqua_pool_t* aqua_pool_t;
+
+/**
+ * Component-specific connection function used to connect each member of a pooled connection.
+ *
+ * This would be e.g. {@link test_pool_conn} for the test component.
+ *
+ * @param vdev The descriptor of the VDEV to connect to.
+ * @return The component context for this member, or `NULL` if the connection failed.
+ */
+typedef void* (*aqua_pool_conn_t)(kos_vdev_descr_t const* vdev);
+
+/**
+ * Component-specific disconnection function used to disconnect each member of a pooled connection.
+ *
+ * This would be e.g. {@link test_pool_disconn} for the test component.
+ *
+ * @param member The component context of the member, as returned by the {@link aqua_pool_conn_t} function.
+ */
+typedef void (*aqua_pool_disconn_t)(void* member);
+
+/**
+ * Create a pooled connection.
+ *
+ * This connects to every VDEV of the component which has the same spec and version as the one {@link aqua_get_best_vdev} would return.
+ *
+ * @param comp The component whose VDEVs to connect to.
+ * @param policy The policy used to distribute stateless calls.
+ * @param conn The component's connection function.
+ * @param disconn The component's disconnection function.
+ * @return The pooled connection, or `NULL` if no member could be connected to.
+ */
+aqua_pool_t aqua_pool_conn(aqua_component_t comp, aqua_pool_policy_t policy, aqua_pool_conn_t conn, aqua_pool_disconn_t disconn);
+
+/**
+ * Disconnect from all members of a pooled connection and free it.
+ *
+ * @param pool The pooled connection.
+ */
+void aqua_pool_disconn(aqua_pool_t pool);
+
+/**
+ * Get the number of members in a pooled connection.
+ *
+ * @param pool The pooled connection.
+ * @return The number of members.
+ */
+size_t aqua_pool_member_count(aqua_pool_t pool);
+
+/**
+ * Get a member to issue a stateless call on.
+ *
+ * The member is counted as having one more outstanding call until {@link aqua_pool_put} is called on it.
+ *
+ * @param pool The pooled connection.
+ * @return The component context of the member to use.
+ */
+void* aqua_pool_get(aqua_pool_t pool);
+
+/**
+ * Get the member owning an object to issue a stateful call on.
+ *
+ * If the object hasn't been pinned to a member yet, a member is picked as with {@link aqua_pool_get}.
+ * The member is counted as having one more outstanding call until {@link aqua_pool_put} is called on it.
+ *
+ * @param pool The pooled connection.
+ * @param handle The opaque pointer of the object the call operates on.
+ * @return The component context of the member to use.
+ */
+void* aqua_pool_get_pinned(aqua_pool_t pool, kos_opaque_ptr_t handle);
+
+/**
+ * Release a member after the call issued on it has returned.
+ *
+ * @param pool The pooled connection.
+ * @param member The component context of the member, as returned by {@link aqua_pool_get} or {@link aqua_pool_get_pinned}.
+ */
+void aqua_pool_put(aqua_pool_t pool, void* member);
+
+/**
+ * Pin an object to the member which created it.
+ *
+ * All subsequent calls to {@link aqua_pool_get_pinned} with this handle will return that member.
+ *
+ * @param pool The pooled connection.
+ * @param handle The opaque pointer of the object.
+ * @param member The component context of the member which created the object.
+ */
+void aqua_pool_pin(aqua_pool_t pool, kos_opaque_ptr_t handle, void* member);
+
+/**
+ * Unpin an object, e.g. after it has been destroyed.
+ *
+ * @param pool The pooled connection.
+ * @param handle The opaque pointer of the object.
+ */
+void aqua_pool_unpin(aqua_pool_t pool, kos_opaque_ptr_t handle);
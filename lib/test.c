@@ -89,6 +89,27 @@ void test_disconn(test_ctx_t ctx) {
 	free(ctx);
 }
 
+void* test_pool_conn(kos_vdev_descr_t const* vdev) {
+	test_ctx_t const ctx = test_conn(vdev);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	// test_conn() flushes synchronously, so by now we've been notified of the connection if it was established.
+
+	if (!ctx->is_conn) {
+		test_disconn(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void test_pool_disconn(void* member) {
+	test_disconn(member);
+}
+
 static void notif_conn(kos_notif_t const* notif, void* data) {
 	test_ctx_t const ctx = data;
 
@@ -99,6 +120,10 @@ static void notif_conn(kos_notif_t const* notif, void* data) {
 	ctx->conn_id = notif->conn_id;
 	ctx->is_conn = true;
 
+	// The test VDEV is stateless, so we can let the KOS move us to another one if its node goes away.
+
+	kos_vdev_set_failover(ctx->conn_id, true);
+
 	// Read constants.
 
 	memset(&ctx->consts, 0xFF, sizeof ctx->consts);
@@ -33,6 +33,26 @@ test_ctx_t test_conn(kos_vdev_descr_t const* vdev);
  */
 void test_disconn(test_ctx_t ctx);
 
+/**
+ * Connect to a test VDEV as a member of a pooled connection.
+ *
+ * This is the {@link aqua_pool_conn_t} function of the test component.
+ * Unlike {@link test_conn}, this waits for the connection to be established, and fails if it wasn't, so that {@link aqua_pool_conn} can skip VDEVs it can't connect to.
+ *
+ * @param vdev The descriptor of the test VDEV to connect to.
+ * @return The test library component context (as a `test_ctx_t`) or `NULL` if the connection failed.
+ */
+void* test_pool_conn(kos_vdev_descr_t const* vdev);
+
+/**
+ * Disconnect a member of a pooled connection from its test VDEV.
+ *
+ * This is the {@link aqua_pool_disconn_t} function of the test component.
+ *
+ * @param member The test library component context, as returned by {@link test_pool_conn}.
+ */
+void test_pool_disconn(void* member);
+
 /**
  * Add 69 to a number.
  *
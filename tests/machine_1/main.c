@@ -17,7 +17,8 @@ int main(void) {
 
 	// Get the best test VDEV.
 
-	kos_vdev_descr_t* const test_vdev = aqua_get_best_vdev(test_init(ctx));
+	aqua_component_t const test_comp = test_init(ctx);
+	kos_vdev_descr_t* const test_vdev = aqua_get_best_vdev(test_comp);
 
 	if (test_vdev == NULL) {
 		LOG_F(cls, "No test VDEVs found.");
@@ -42,8 +43,33 @@ int main(void) {
 		return EXIT_FAILURE;
 	}
 
+	test_disconn(test_ctx);
+
+	// Test adding 69 again, this time through a pooled connection to every test VDEV identical to the best one.
+
+	aqua_pool_t const pool = aqua_pool_conn(test_comp, AQUA_POOL_POLICY_LEAST_OUTSTANDING, test_pool_conn, test_pool_disconn);
+
+	if (pool == NULL) {
+		LOG_F(cls, "Failed to create pooled connection to test VDEVs.");
+		return EXIT_FAILURE;
+	}
+
+	LOG_V(cls, "Pooled connection has %zu members.", aqua_pool_member_count(pool));
+
+	for (size_t i = 0; i < aqua_pool_member_count(pool); i++) {
+		test_ctx_t const member = aqua_pool_get(pool);
+		int const pool_res = test_add(member, 420);
+		aqua_pool_put(pool, member);
+
+		if (pool_res != 420 + 69) {
+			LOG_F(cls, "Got unexpected result from calling test_add through pooled connection: %d", pool_res);
+			aqua_pool_disconn(pool);
+			return EXIT_FAILURE;
+		}
+	}
+
 	LOG_I(cls, "Tests passed!");
 
-	test_disconn(test_ctx);
+	aqua_pool_disconn(pool);
 	return EXIT_SUCCESS;
 }